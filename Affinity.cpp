@@ -0,0 +1,63 @@
+// Copyright (C) Mihai Preda.
+
+#include "Affinity.h"
+#include "File.h"
+
+#if defined(__linux__)
+
+#include <sched.h>
+
+namespace {
+
+// A sysfs CPU list such as "0-15,32-47".
+bool parseCpuList(const string& list, cpu_set_t& set) {
+  CPU_ZERO(&set);
+  const char* p = list.c_str();
+  while (*p && *p != '\n') {
+    char* end = nullptr;
+    long a = strtol(p, &end, 10);
+    if (end == p) { return false; }
+    long b = a;
+    p = end;
+    if (*p == '-') {
+      b = strtol(p + 1, &end, 10);
+      if (end == p + 1) { return false; }
+      p = end;
+    }
+    for (long cpu = a; cpu <= b && cpu < CPU_SETSIZE; ++cpu) { CPU_SET(cpu, &set); }
+    if (*p == ',') { ++p; }
+  }
+  return CPU_COUNT(&set) > 0;
+}
+
+}
+
+void pinToDevice(cl_device_id device) {
+  string pci = getPciAddress(device);
+  if (pci.empty()) { return; }
+  fs::path dir = fs::path{"/sys/bus/pci/devices"} / pci;
+
+  File nodeFile = File::openRead(dir / "numa_node");
+  File cpusFile = File::openRead(dir / "local_cpulist");
+  if (!nodeFile || !cpusFile) { return; }
+  int node = atoi(nodeFile.readLine().c_str());
+  cpu_set_t local;
+  if (node < 0 || !parseCpuList(cpusFile.readLine(), local)) { return; }
+
+  cpu_set_t allowed, pinned;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) { return; }
+  CPU_AND(&pinned, &allowed, &local);
+  if (CPU_COUNT(&pinned) == 0 || CPU_EQUAL(&pinned, &allowed)) { return; }
+
+  if (sched_setaffinity(0, sizeof(pinned), &pinned)) {
+    log("could not pin to the CPUs of NUMA node %d of the GPU (%s)\n", node, pci.c_str());
+    return;
+  }
+  log("pinned to the %d CPUs of NUMA node %d of the GPU (%s)\n", CPU_COUNT(&pinned), node, pci.c_str());
+}
+
+#else
+
+void pinToDevice(cl_device_id) {}
+
+#endif
@@ -0,0 +1,12 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "clwrap.h"
+
+// Pins the calling thread, and thus the threads it starts afterwards (compaction, proof writes, savefiles), to the
+// CPUs of the NUMA node of the device, found from its PCI address in sysfs: the host work of a GPU then runs next to
+// the PCIe root of the card, and its host buffers, first touched by these threads, are allocated on that node (the
+// default "local" memory policy). Only within the CPUs already allowed (e.g. by taskset). Linux only; does nothing
+// if the node is not known or covers all the allowed CPUs. Off with -noaffinity.
+void pinToDevice(cl_device_id device);
@@ -3,5 +3,5 @@
 #include "AllocTrac.h"
 #include <limits>
 
-std::atomic<size_t> AllocTrac::totalAlloc = 0;
-size_t AllocTrac::maxAlloc = size_t(3) * 1024 * 1024 * 1024; // 3 GB
+thread_local AllocTrac::Budget AllocTrac::ownBudget;
+thread_local AllocTrac::Budget* AllocTrac::sharedBudget = nullptr;
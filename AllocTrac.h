@@ -22,34 +22,47 @@ public:
 */
 
 class AllocTrac {
-  static std::atomic<size_t> totalAlloc;  
-  static size_t maxAlloc;
-  
+public:
+  // The GPU memory budget of a worker. The Gpus of a worker share it, also when one is built on another thread.
+  struct Budget {
+    std::atomic<size_t> total{};
+    size_t max = size_t(3) * 1024 * 1024 * 1024; // 3 GB
+  };
+
+private:
+  // Per thread, which is per worker with -devices or -workers (a Gpu is used from a single thread).
+  static thread_local Budget ownBudget;
+  static thread_local Budget* sharedBudget;
+
+  static Budget& current() { return sharedBudget ? *sharedBudget : ownBudget; }
+
+  Budget* budget{};
   size_t size{};
   
 public:
   AllocTrac() = default;
   explicit AllocTrac(size_t size) : size(size) {
     if (size) {
-      if (totalAlloc + size >= maxAlloc) {
-        log("Reached GPU maxAlloc limit %.1f GB\n", float(maxAlloc) / (1024 * 1024 * 1024));
+      budget = &current();
+      if (budget->total + size >= budget->max) {
+        log("Reached GPU maxAlloc limit %.1f GB\n", float(budget->max) / (1024 * 1024 * 1024));
         throw bad_alloc();
       }
-      totalAlloc += size;
-      // log("alloc %lu total %lu limit %lu\n", size, size_t(totalAlloc), maxAlloc);
+      budget->total += size;
+      // log("alloc %lu total %lu limit %lu\n", size, size_t(budget->total), budget->max);
     }
   }
   ~AllocTrac() {
     if (size) {
-      totalAlloc -= size;
-      // log("release %lu total %lu limit %lu\n", size, size_t(totalAlloc), maxAlloc);
+      budget->total -= size;
+      // log("release %lu total %lu limit %lu\n", size, size_t(budget->total), budget->max);
     }
   }
 
   AllocTrac(const AllocTrac&) = delete;
   void operator=(const AllocTrac&) = delete;
 
-  AllocTrac(AllocTrac&& rhs) : size(rhs.size) { rhs.size = 0; }
+  AllocTrac(AllocTrac&& rhs) : budget(rhs.budget), size(rhs.size) { rhs.size = 0; }
   AllocTrac& operator=(AllocTrac&& rhs) {
     AllocTrac tmp{std::move(rhs)};
     swap(*this, tmp);
@@ -58,10 +71,16 @@ public:
 
   friend void swap(AllocTrac& a, AllocTrac& b) noexcept {
     using std::swap;
+    swap(a.budget, b.budget);
     swap(a.size, b.size);
   }
 
-  static void setMaxAlloc(size_t m) { maxAlloc = m; }
-  static size_t totalAllocBytes() { return totalAlloc; }
-  static size_t availableBytes() { return maxAlloc - totalAlloc; }
+  // The budget of this thread, to be shared with a thread building a Gpu for this one (see useBudget()).
+  static Budget* threadBudget() { return &current(); }
+  static void useBudget(Budget* budget) { sharedBudget = budget; }
+
+  static void setMaxAlloc(size_t m) { current().max = m; }
+  static size_t getMaxAlloc() { return current().max; }
+  static size_t totalAllocBytes() { return current().total; }
+  static size_t availableBytes() { return current().max - current().total; }
 };
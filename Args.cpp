@@ -4,6 +4,7 @@
 #include "File.h"
 #include "FFTConfig.h"
 #include "clwrap.h"
+#include "Pm1Plan.h"
 
 #include <vector>
 #include <string>
@@ -48,39 +49,76 @@ void Args::printHelp() {
 -pool <dir>        : specify a directory with the shared (pooled) worktodo.txt and results.txt
                      Multiple GpuOwl instances, each in its own directory, can share a pool of assignments and report
                      the results back to the common pool.
+-poolBatch <N>     : take N tasks at once from the pool (default 1), fewer rewrites of the shared worktodo.txt
 -uid <unique_id>   : specifies to use the GPU with the given unique_id (only on ROCm/Linux)
 -user <name>       : specify the user name.
 -cpu  <name>       : specify the hardware name.
 -time              : display kernel profiling information.
+-perf <file>       : write the perf counters (per-kernel times and GB/s, host spans, GPU idle) as JSON to <file> at
+                     every check, see tools/monitor.py. The kernels are sampled, thus it can stay on in production.
+-trace <file>      : write the timeline of the latest kernels and host spans (check, read, save, proof writes, finish
+                     waits) at every check, in the Chrome trace JSON format for ui.perfetto.dev. Profiles every kernel.
 -fft <spec>        : specify FFT e.g.: 1152K, 5M, 5.5M, 256:10:1K
+-fftUp <pErr%%>     : move a PRP to the next larger FFT when its sampled roundoff estimates a probability of error
+                     in the whole test above <pErr%%> (default 2), and again if needed; the larger FFT is kept in the
+                     exponent's directory across restarts. 0 disables. Not with -fft.
 -block <value>     : PRP error-check block size. Must divide 10'000.
+-nttCheck <N>      : on load, cross-check N squarings of the PRP residue against an exact NTT engine on the host (slow)
+-inflight <N>      : keep up to N PRP blocks enqueued ahead of the GPU (default 2); 0 waits at every block.
+-powerCap <watts>  : keep the average GPU power under <watts> in PRP by pausing between the blocks (amdgpu on Linux).
+                     The power and the energy per iteration are logged with the progress when readable.
+-groupFFT          : among the next tasks of worktodo.txt, run first one of the same FFT as the task that ended, which
+                     re-uses its Gpu (program, trig tables and buffers) without the setup.
 -log <step>        : log every <step> iterations. Multiple of 10'000.
 -carry long|short  : force carry type. Short carry may be faster, but requires high bits/word.
--B1                : P-1 B1 bound
+-B1 <B1>|auto      : P-1 B1 bound. With "auto" the bounds (not set by the task) are planned for the most PRP time
+                     saved, from the measured speed of the GPU and the trial-factoring depth of the exponent.
+                     The planned bounds are written into the worktodo line, for a restart.
 -B2                : P-1 B2 bound
 -rB2               : ratio of B2 to B1. Default %u, used only if B2 is not explicitly set
 -prp <exponent>    : run a single PRP test and exit, ignoring worktodo.txt
 -verify <file>     : verify PRP-proof contained in <file>
+-verifyDir <dir>   : verify all the PRP-proofs (*.proof) in <dir>, grouped by FFT size
+-tune <exponent>   : time the FFT variants and the -use flags for the FFT size of <exponent>, and store the fastest
+                     in the tune file. With -fft only the -use flags of the given FFT are tuned.
+-bench <ffts>      : benchmark the kernels and the iteration of the FFT variants, "all" or a comma separated list of
+                     FFT sizes and specs (e.g. -bench 5M,256:10:1K), appending the results to bench.csv
+-crossover <ffts>  : measure the roundoff of the FFT variants ("all" or a list as for -bench) around their exponent
+                     limits, and store the fitted limits in the crossover file, which the FFT choice then prefers.
+-crossoverFile <file> : the crossover file, default '%s'
+-tuneFile <file>   : the tune file, used for choosing the FFT variant and the flags. Default '%s'
 -proof <power>     : By default a proof of power %u is generated, using 3GB of temporary disk space for a 100M exponent.
                      A lower power reduces disk space requirements but increases the verification cost.
                      A proof of power 9 uses 6GB of disk space for a 100M exponent and enables faster verification.
 -autoverify <power> : Self-verify proofs generated with at least this power. Default %u.
 -tmpDir <dir>      : specify a folder with plenty of disk space where temporary proof checkpoints will be stored, default '%s'.
--mprimeDir <dir>   : folder where an instance of Prime95/mprime can be found (for P-1 second-stage)
+-proofDisk <size>  : limit the disk space of the proof checkpoints of an exponent, lowering the proof power to fit.
+                     The size has the suffix M for MB or G for GB, e.g. -proofDisk 2G
+-mprimeDir <dir>   : folder where an instance of Prime95/mprime can be found (for P-1 second-stage,
+                     used only when there is not enough GPU memory for the second stage)
 -results <file>    : name of results file, default '%s'
 -iters <N>         : run next PRP test for <N> iterations and exit. Multiple of 10000.
 -maxAlloc <size>   : limit GPU memory usage to size, which is a value with suffix M for MB and G for GB.
-                     e.g. -maxAlloc 2048M or -maxAlloc 3.5G
+                     e.g. -maxAlloc 2048M or -maxAlloc 3.5G. Without it, the default of 3G is raised (up to 90%%
+                     of the GPU memory) for the large FFTs which need more.
 -save <N>          : specify the number of savefiles to keep (default %u).
 -noclean           : do not delete data after the test is complete.
 -from <iteration>  : start at the given iteration instead of the most recent saved iteration
 -yield             : enable work-around for Nvidia GPUs busy wait. Do not use on AMD GPUs!
 -nospin            : disable progress spinner
+-noselftest        : skip the self-test of an FFT on its first use per device and driver (timing, roundoff and an NTT
+                     cross-check, recorded in selftest.txt; a regression from the previous driver is logged)
+-noaffinity        : do not pin the host threads of a GPU to the CPUs of its NUMA node (Linux)
 -use NEW_FFT8,OLD_FFT5,NEW_FFT10: comma separated list of defines, see the #if tests in gpuowl.cl (used for perf tuning)
 -unsafeMath        : use OpenCL -cl-unsafe-math-optimizations (use at your own risk)
 -binary <file>     : specify a file containing the compiled kernels binary
+-cacheDir <dir>    : folder where the compiled kernels are cached for reuse, default '%s'
+-nocache           : do not use the compiled kernels cache
+-devices <list>    : run one worker per device, on a comma separated list of devices (or "all"), sharing worktodo.txt
+-workers <N>       : run N workers per device, each with its own task; fills a big GPU at small FFT sizes.
+                     The -maxAlloc limit (default 3G) is split between the workers of a device.
 -device <N>        : select a specific device:
-)", B2_B1_ratio, proofPow, proofVerify, tmpDir.c_str(), resultsFile.c_str(), nSavefiles);
+)", B2_B1_ratio, crossoverFile.c_str(), tuneFile.c_str(), proofPow, proofVerify, tmpDir.c_str(), resultsFile.c_str(), nSavefiles, cacheDir.c_str());
 
   // Undocumented:
   // -D <value>         : specify the P2 "D" value, one of: 210, 330, 420, 462, 660, 770, 924, 1540, 2310.
@@ -164,6 +202,12 @@ void Args::parse(const string& line) {
         throw "-keep without proof";
       }
       keepProof = true;
+    } else if (key == "-verifyDir") {
+      if (s.empty()) {
+        log("-verifyDir needs <dir>\n");
+        throw "-verifyDir without dir";
+      }
+      verifyDir = s;
     } else if (key == "-verify") {
       if (s.empty()) {
         log("-verify needs <proof-file> or <exponent>\n");
@@ -178,16 +222,25 @@ void Args::parse(const string& line) {
         throw("-pool <path> requires an absolute path");
       }
     }
+    else if (key == "-poolBatch") { poolBatch = std::max(1, stoi(s)); }
     else if (key == "-results") { resultsFile = s; }
     else if (key == "-maxAlloc" || key == "-maxalloc") {
       assert(!s.empty());
       u32 multiple = (s.back() == 'G') ? (1u << 30) : (1u << 20);
       maxAlloc = size_t(stod(s) * multiple + .5);
     }
+    else if (key == "-proofDisk") {
+      if (s.empty()) {
+        log("-proofDisk expects <size>\n");
+        throw "-proofDisk <size>";
+      }
+      u32 multiple = (s.back() == 'G') ? (1u << 30) : (1u << 20);
+      proofDisk = u64(stod(s) * multiple + .5);
+    }
     else if (key == "-log") { logStep = stoi(s); assert(logStep && (logStep % 10000 == 0)); }
     else if (key == "-iters") { iters = stoi(s); assert(iters && (iters % 10000 == 0)); }
     else if (key == "-prp" || key == "-PRP") { prpExp = stoll(s); }
-    else if (key == "-B1" || key == "-b1") { B1 = stoi(s); }
+    else if (key == "-B1" || key == "-b1") { B1 = (s == "auto") ? 0 : stoi(s); }
     else if (key == "-B2" || key == "-b2") { B2 = stoi(s); }
     else if (key == "-rB2") { B2_B1_ratio = stoi(s); }
     else if (key == "-fft") { fftSpec = s; }
@@ -195,11 +248,49 @@ void Args::parse(const string& line) {
     else if (key == "-user") { user = s; }
     else if (key == "-cpu") { cpu = s; }
     else if (key == "-time") { timeKernels = true; }
+    else if (key == "-perf") {
+      if (s.empty()) {
+        log("-perf expects <file>\n");
+        throw "-perf <file>";
+      }
+      perfFile = s;
+    }
+    else if (key == "-trace") {
+      if (s.empty()) {
+        log("-trace expects <file>\n");
+        throw "-trace <file>";
+      }
+      traceFile = s;
+    }
     else if (key == "-device" || key == "-d") { device = stoi(s); }
+    else if (key == "-devices") {
+      devices.clear();
+      if (s == "all") {
+        for (u32 i = 0, n = getAllDeviceIDs().size(); i < n; ++i) { devices.push_back(i); }
+      } else {
+        string ss = s;
+        std::replace(ss.begin(), ss.end(), ',', ' ');
+        std::istringstream iss{ss};
+        for (u32 d; iss >> d;) { devices.push_back(d); }
+      }
+      if (devices.empty()) {
+        log("-devices expects a list of devices, found '%s'\n", s.c_str());
+        throw "-devices";
+      }
+    }
+    else if (key == "-workers") {
+      workers = stoi(s);
+      if (workers < 1) {
+        log("-workers expects a positive number, found '%s'\n", s.c_str());
+        throw "-workers";
+      }
+    }
     else if (key == "-uid") { device = getSeqId(s); }
     else if (key == "-dir") { dir = s; }
     else if (key == "-yield") { cudaYield = true; }
     else if (key == "-nospin") { noSpin = true; }
+    else if (key == "-noselftest") { selfTest = false; }
+    else if (key == "-noaffinity") { affinity = false; }
     else if (key == "-carry") {
       if (s == "short" || s == "long") {
         carry = s == "short" ? CARRY_SHORT : CARRY_LONG;
@@ -213,6 +304,16 @@ void Args::parse(const string& line) {
         log("BlockSize %u must divide 10'000\n", blockSize);
         throw "invalid block size";
       }
+    } else if (key == "-nttCheck") {
+      nttCheck = stoi(s);
+    } else if (key == "-inflight") {
+      inFlight = stoi(s);
+    } else if (key == "-powerCap") {
+      powerCap = stoi(s);
+    } else if (key == "-groupFFT") {
+      groupFFT = true;
+    } else if (key == "-fftUp") {
+      fftUp = stod(s) / 100;
     } else if (key == "-use") {
       string ss = s;
       std::replace(ss.begin(), ss.end(), ',', ' ');
@@ -222,12 +323,38 @@ void Args::parse(const string& line) {
       safeMath = false;
     } else if (key == "-binary") {
       binaryFile = s;
+    } else if (key == "-tune") {
+      tuneExp = stoi(s);
+    } else if (key == "-bench") {
+      if (s.empty()) {
+        log("-bench expects \"all\" or a list of FFTs\n");
+        throw "-bench <ffts>";
+      }
+      benchSpec = s;
+    } else if (key == "-crossover") {
+      if (s.empty()) {
+        log("-crossover expects \"all\" or a list of FFTs\n");
+        throw "-crossover <ffts>";
+      }
+      crossoverSpec = s;
+    } else if (key == "-crossoverFile") {
+      crossoverFile = s;
+    } else if (key == "-tuneFile") {
+      tuneFile = s;
+    } else if (key == "-cacheDir") {
+      cacheDir = s;
+    } else if (key == "-nocache") {
+      cacheDir.clear();
     } else if (key == "-save") {
       nSavefiles = stoi(s);      
     } else if (key == "-from") {
       startFrom = stoi(s);
     } else if (key == "-D") {
       D = stoi(s);
+      if (find(Pm1Plan::Ds.begin(), Pm1Plan::Ds.end(), D) == Pm1Plan::Ds.end()) {
+        log("-D %u is not one of: 210, 330, 420, 462, 660, 770, 924, 1540, 2310\n", D);
+        throw "invalid -D";
+      }
     } else {
       log("Argument '%s' '%s' not understood\n", key.c_str(), s.c_str());
       throw "args";
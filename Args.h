@@ -28,11 +28,16 @@ public:
   string uid;
   string binaryFile;
   string verifyPath;
+  fs::path verifyDir;
   std::set<std::string> flags;
   
   int device = 0;
+  vector<u32> devices; // with -devices, one worker per device.
+  u32 workers = 1;      // the number of workers per device.
   
   bool timeKernels = false;
+  bool selfTest = true; // see SelfTest, off with -noselftest.
+  bool affinity = true; // see pinToDevice(), off with -noaffinity.
   bool cudaYield = false;
   bool noSpin = false;
   bool safeMath = true;
@@ -43,26 +48,42 @@ public:
 
   fs::path resultsFile = "results.txt";
   fs::path masterDir;
+  u32 poolBatch = 1; // the tasks taken at once from the -pool worktodo.txt
   fs::path tmpDir = ".";
   fs::path proofResultDir = "proof";
   fs::path proofToVerifyDir = "proof-tmp";
   fs::path mprimeDir = ".";
+  fs::path cacheDir = "kernel-cache";
+  fs::path tuneFile = "tune.txt";
+  fs::path crossoverFile = "crossover.txt";
+  fs::path perfFile; // with -perf, the JSON export of the perf counters.
+  fs::path traceFile; // with -trace, the timeline of the kernels and host spans.
 
   bool keepProof = false;
+  bool groupFFT = false; // with -groupFFT, prefer the next task that re-uses the Gpu (of the same FFT).
 
   int carry = CARRY_AUTO;
   u32 blockSize = 400;
+  u32 nttCheck = 0; // with -nttCheck, the squarings of the loaded PRP residue to cross-check on the host.
+  u32 inFlight = 2; // the PRP blocks enqueued ahead of the GPU; 0 waits for each block.
+  u32 powerCap = 0; // with -powerCap, the average GPU power (W) the PRP loop keeps under by pausing.
   u32 logStep   = 0;
   string fftSpec;
+  double fftUp = 0.02; // with -fftUp, the pErr above which a PRP moves to the next larger FFT; 0 disables.
+  string fftUpSpec; // the larger FFT that -fftUp moved the PRP to; unlike -fft, it does not turn -fftUp off.
 
-  u32 B1 = 2'000'000;
+  u32 B1 = 2'000'000; // 0 with -B1 auto, see Pm1Bounds.
   u32 B2 = 0;
   u32 B2_B1_ratio = 20;
   u32 D = 0;
   
   u32 prpExp = 0;
+  u32 tuneExp = 0;
+  string benchSpec; // with -bench, the FFTs to benchmark.
+  string crossoverSpec; // with -crossover, the FFTs to measure the crossover of.
   
   size_t maxAlloc = 0;
+  u64 proofDisk = 0; // the disk budget of the proof residues of one exponent, 0 for no limit.
 
   u32 iters = 0;
   u32 nSavefiles = 20;
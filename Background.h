@@ -0,0 +1,63 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs host jobs in order on a CPU thread, e.g. the P-1 GCDs and the writing of their result, while the GPU goes on
+// with the next task. At most maxSize jobs are queued, run() then waits for the oldest to end.
+class Background {
+  unsigned maxSize;
+  std::deque<std::function<void()>> jobs;
+  bool busy = false;
+  bool stop = false;
+  std::mutex mut;
+  std::condition_variable cond;
+  std::thread thread;
+
+  void loop() {
+    std::unique_lock lock{mut};
+    while (true) {
+      cond.wait(lock, [this]() { return stop || !jobs.empty(); });
+      if (jobs.empty()) { break; }
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      busy = true;
+      lock.unlock();
+      job();
+      lock.lock();
+      busy = false;
+      cond.notify_all();
+    }
+  }
+
+public:
+  explicit Background(unsigned maxSize = 2) : maxSize{maxSize}, thread{[this]() { loop(); }} {}
+
+  ~Background() {
+    {
+      std::unique_lock lock{mut};
+      stop = true;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+  // The job must not throw.
+  void run(std::function<void()> job) {
+    std::unique_lock lock{mut};
+    cond.wait(lock, [this]() { return jobs.size() < maxSize; });
+    jobs.push_back(std::move(job));
+    cond.notify_all();
+  }
+
+  // Waits for the end of all the queued jobs.
+  void wait() {
+    std::unique_lock lock{mut};
+    cond.wait(lock, [this]() { return jobs.empty() && !busy; });
+  }
+};
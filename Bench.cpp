@@ -0,0 +1,99 @@
+// Copyright (C) Mihai Preda.
+
+#include "Bench.h"
+#include "Args.h"
+#include "Gpu.h"
+#include "FFTConfig.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+
+namespace {
+
+constexpr u32 N_SAMPLES = 20;
+constexpr u32 BATCH = 50;
+
+// The squarings of the roundoff measurement (with -use STATS).
+constexpr u32 ROUNDOFF_ITERS = 5000;
+
+double percentile(vector<double> v, double p) {
+  if (v.empty()) { return 0; }
+  std::sort(v.begin(), v.end());
+  return v[u32(p * (v.size() - 1) + 0.5)];
+}
+
+optional<RoundoffStats> roundoff(Args args, u32 E) {
+  args.flags.insert("STATS");
+  try {
+    return Gpu::make(E, args)->timeSquarings(ROUNDOFF_ITERS).second;
+  } catch (const char* mes) {
+    log("%s roundoff : failed \"%s\"\n", args.fftSpec.c_str(), mes);
+  } catch (const std::exception& e) {
+    log("%s roundoff : failed %s\n", args.fftSpec.c_str(), e.what());
+  }
+  return {};
+}
+
+}
+
+void Bench::bench(const Args& argsIn, const string& spec) {
+  vector<FFTConfig> configs = FFTConfig::fromSpecList(spec);
+  if (configs.empty()) {
+    log("-bench '%s' selects no FFT\n", spec.c_str());
+    throw "-bench";
+  }
+  log("Benchmarking %u FFT variants, results in '%s'\n", u32(configs.size()), FILE_NAME);
+
+  if (!fs::exists(FILE_NAME)) {
+    File::append(FILE_NAME, "fftSize,spec,E,flags,name,p10us,p50us,p90us,GBps,roundoffMean,roundoffMax,pErr\n");
+  }
+
+  string flags;
+  for (const string& flag : argsIn.flags) { flags += (flags.empty() ? "" : " ") + flag; }
+
+  for (const FFTConfig& c : configs) {
+    Args args = argsIn;
+    args.fftSpec = c.spec();
+    args.timeKernels = true;
+    u32 E = c.maxExp() | 1;
+
+    vector<BenchTimes> times;
+    try {
+      times = Gpu::make(E, args)->benchKernels(N_SAMPLES, BATCH);
+    } catch (const char* mes) {
+      log("%s : failed \"%s\"\n", c.spec().c_str(), mes);
+      continue;
+    } catch (const std::exception& e) {
+      log("%s : failed %s\n", c.spec().c_str(), e.what());
+      continue;
+    }
+
+    args.timeKernels = false;
+    optional<RoundoffStats> r = roundoff(args, E);
+
+    string rows;
+    for (const BenchTimes& t : times) {
+      double p50 = percentile(t.secs, 0.5);
+      double gbps = p50 > 0 ? t.bytes / p50 * 1e-9 : 0;
+      bool isStep = t.name == "coreStep";
+      log("%s %-16s : %7.1f us (p10 %.1f, p90 %.1f), %6.1f GB/s\n", c.spec().c_str(), t.name.c_str(),
+          p50 * 1e6, percentile(t.secs, 0.1) * 1e6, percentile(t.secs, 0.9) * 1e6, gbps);
+
+      char buf[512];
+      snprintf(buf, sizeof(buf), "%u,%s,%u,%s,%s,%.2f,%.2f,%.2f,%.1f,", c.fftSize(), c.spec().c_str(), E, flags.c_str(), t.name.c_str(),
+               percentile(t.secs, 0.1) * 1e6, p50 * 1e6, percentile(t.secs, 0.9) * 1e6, gbps);
+      rows += buf;
+      if (isStep && r && r->n) {
+        snprintf(buf, sizeof(buf), "%.4f,%.4f,%.6f\n", r->mean, r->max, r->pErr);
+        rows += buf;
+      } else {
+        rows += ",,\n";
+      }
+    }
+    if (r && r->n) { log("%s roundoff : mean %.4f, max %.4f, pErr %f%%\n", c.spec().c_str(), r->mean, r->max, r->pErr * 100); }
+    File::append(FILE_NAME, rows);
+  }
+}
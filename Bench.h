@@ -0,0 +1,19 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+class Args;
+
+// The microbenchmark (-bench): for each selected FFT variant, times the kernels of an iteration in isolation and a whole
+// iteration, with percentiles over the samples, and measures the roundoff at the largest exponent of the variant.
+// The results are appended to a CSV file, for comparing driver versions and -use flags.
+class Bench {
+public:
+  // The CSV file, in the work directory.
+  static constexpr const char* FILE_NAME = "bench.csv";
+
+  // "spec" selects the FFT variants, see FFTConfig::fromSpecList().
+  static void bench(const Args& args, const string& spec);
+};
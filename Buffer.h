@@ -7,10 +7,19 @@
 #include "Context.h"
 #include "Queue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+// A unique id for every buffer allocation, used by Kernel to recognize the arguments already set. Zero is never used.
+inline u64 nextBufferId() {
+  static std::atomic<u64> id = 0;
+  return ++id;
+}
+
 template<typename T>
 class ConstBuffer {
   std::unique_ptr<cl_mem> ptr;
@@ -18,6 +27,7 @@ class ConstBuffer {
 public:
   const size_t size{};
   const std::string name;
+  u64 id = nextBufferId();
 
 private:
   AllocTrac allocTrac;
@@ -29,6 +39,16 @@ protected:
     , name(name)
     , allocTrac(size * sizeof(T))
   {}
+
+  // Over memory owned (and accounted) elsewhere, see BufferPool.
+  ConstBuffer(cl_mem mem, std::string_view name, size_t size)
+    : ptr{mem}
+    , size(size)
+    , name(name)
+  {}
+
+  // Gives up the ownership of the memory.
+  cl_mem detach() { return ptr.release(); }
     
 public:
   using type = T;
@@ -48,6 +68,7 @@ public:
   ConstBuffer& operator=(ConstBuffer&& rhs) {
     assert(size == rhs.size);
     ptr = std::move(rhs.ptr);
+    id = rhs.id;
     return *this;
   }
   
@@ -66,6 +87,11 @@ protected:
     : ConstBuffer<T>{getQueueContext(queue->get()), name, kind, size}
     , queue{queue}
   {}
+
+  Buffer(QueuePtr queue, cl_mem mem, std::string_view name, size_t size)
+    : ConstBuffer<T>{mem, name, size}
+    , queue{queue}
+  {}
     
 public:
   Buffer(QueuePtr queue, std::string_view name, size_t size)
@@ -93,19 +119,49 @@ public:
 
 template<typename T>
 class HostAccessBuffer : public Buffer<T> {
+  // With unified memory (APUs, integrated GPUs) the transfer buffers, see io() and pinned(), are allocated in host memory
+  // and the host reads and writes them through a mapping instead of a copy by the GPU.
+  bool mapped{};
+  void *pendingMap{};
+
+  HostAccessBuffer(QueuePtr queue, std::string_view name, size_t size, unsigned kind, bool mapped)
+    : Buffer<T>(queue, name, size, mapped ? kind | CL_MEM_ALLOC_HOST_PTR : kind)
+    , mapped{mapped} {}
+
+  static bool unified(const QueuePtr& queue) { return hasUnifiedMemory(getQueueDevice(queue->get())); }
+
 public:
   // using Buffer<T>::operator=;
   using Buffer<T>::operator<<;
   
   HostAccessBuffer(QueuePtr queue, std::string_view name, size_t size)
-    : Buffer<T>(queue, name, size, CL_MEM_READ_WRITE) {}
+    : HostAccessBuffer(queue, name, size, CL_MEM_READ_WRITE, false) {}
+
+  // A buffer mostly used for transfers (the residue in and out, the small results), mapped with unified memory.
+  // The working buffers stay in device memory, which may be faster for the GPU even on an APU.
+  static HostAccessBuffer io(QueuePtr queue, std::string_view name, size_t size) {
+    return HostAccessBuffer{queue, name, size, CL_MEM_READ_WRITE, unified(queue)};
+  }
+
+  // Allocated in host memory, to be used as a staging buffer for the transfers to the host.
+  static HostAccessBuffer pinned(QueuePtr queue, std::string_view name, size_t size) {
+    return HostAccessBuffer{queue, name, size, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, unified(queue)};
+  }
+
+  bool isMapped() const { return mapped; }
 
   // sync read
   vector<T> read(size_t sizeOrFull = 0) const {
     auto readSize = sizeOrFull ? sizeOrFull : this->size;
     assert(readSize <= this->size);
     vector<T> ret(readSize);
-    ::read(this->queue->get(), true, this->get(), readSize * sizeof(T), ret.data());
+    if (mapped) {
+      void *p = mapBuf(this->queue->get(), this->get(), false, readSize * sizeof(T));
+      std::copy_n(static_cast<const T*>(p), readSize, ret.begin());
+      unmapBuf(this->queue->get(), this->get(), p);
+    } else {
+      ::read(this->queue->get(), true, this->get(), readSize * sizeof(T), ret.data());
+    }
     return ret;
   }
 
@@ -116,10 +172,39 @@ public:
     ::read(this->queue->get(), false, this->get(), readSize * sizeof(T), out.data(), start * sizeof(T));
   }
 
+  // async read, "out" is filled when the returned event completes and endRead() is called.
+  EventHolder readAsyncEvent(vector<T>& out, size_t sizeOrFull = 0) {
+    auto readSize = sizeOrFull ? sizeOrFull : this->size;
+    assert(readSize <= this->size);
+    out.resize(readSize);
+    if (mapped) {
+      assert(!pendingMap);
+      cl_event event{};
+      pendingMap = mapBuf(this->queue->get(), this->get(), false, readSize * sizeof(T), &event);
+      return EventHolder{event};
+    }
+    return readWithEvent(this->queue->get(), this->get(), readSize * sizeof(T), out.data());
+  }
+
+  // Completes a readAsyncEvent() after its event: copies from the mapping and releases it. Nothing to do for a copy.
+  void endRead(vector<T>& out) {
+    if (pendingMap) {
+      std::copy_n(static_cast<const T*>(pendingMap), out.size(), out.begin());
+      unmapBuf(this->queue->get(), this->get(), pendingMap);
+      pendingMap = nullptr;
+    }
+  }
+
   // sync write
   void write(const vector<T>& vect) {
     assert(this->size >= vect.size());
-    ::write(this->queue->get(), true, this->get(), vect.size() * sizeof(T), vect.data());
+    if (mapped) {
+      void *p = mapBuf(this->queue->get(), this->get(), true, vect.size() * sizeof(T));
+      std::copy(vect.begin(), vect.end(), static_cast<T*>(p));
+      unmapBuf(this->queue->get(), this->get(), p);
+    } else {
+      ::write(this->queue->get(), true, this->get(), vect.size() * sizeof(T), vect.data());
+    }
   }
 
   operator vector<T>() const { return read(); }
@@ -127,3 +212,87 @@ public:
   // async read
   // void operator>>(vector<T>& out) const { readAsync(out); }
 };
+
+template<typename T> class PooledBuffer;
+
+// The device memory of the temporary buffers (of the proof, P-1 second stage, exponentiation, product), kept for reuse
+// between the leases instead of released: a lease of a size takes a free slab of that size, or allocates a new one
+// within the maxAlloc budget (throwing bad_alloc past it). Owned by Gpu, and must outlive the leases.
+// The pool is not bounded otherwise: it only grows, to the most slabs leased at once, until trim() releases the free
+// slabs. The Gpu trims it after P-1 stage 2, ECM and the generation (and verification) of a proof, and before a
+// preemption; the proofs of -verifyDir keep the slabs for the next proof of the same Gpu.
+class BufferPool {
+  template<typename T> friend class PooledBuffer;
+
+  QueuePtr queue;
+
+  struct Slab {
+    std::unique_ptr<cl_mem> mem;
+    AllocTrac allocTrac;
+  };
+
+  std::vector<Slab> slabs;
+  std::map<size_t, std::vector<cl_mem>> freeSlabs; // by the size in bytes
+
+  cl_mem take(size_t bytes) {
+    std::vector<cl_mem>& free = freeSlabs[bytes];
+    if (!free.empty()) {
+      cl_mem mem = free.back();
+      free.pop_back();
+      return mem;
+    }
+    AllocTrac allocTrac{bytes};
+    std::unique_ptr<cl_mem> mem{makeBuf_(getQueueContext(queue->get()), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, bytes)};
+    cl_mem ret = mem.get();
+    slabs.push_back({std::move(mem), std::move(allocTrac)});
+    return ret;
+  }
+
+  void give(size_t bytes, cl_mem mem) { freeSlabs[bytes].push_back(mem); }
+
+public:
+  explicit BufferPool(QueuePtr queue) : queue{std::move(queue)} {}
+
+  BufferPool(const BufferPool&) = delete;
+  void operator=(const BufferPool&) = delete;
+
+  template<typename T> PooledBuffer<T> lease(std::string_view name, size_t size);
+
+  // The number of buffers of "bytes" which can still be leased: the free slabs and the allocations within the budget.
+  u32 available(size_t bytes) const {
+    auto it = freeSlabs.find(bytes);
+    return (it == freeSlabs.end() ? 0 : it->second.size()) + AllocTrac::availableBytes() / bytes;
+  }
+
+  // Releases the free slabs, e.g. after P-1 second stage.
+  void trim() {
+    for (auto& [bytes, free] : freeSlabs) {
+      for (cl_mem mem : free) {
+        auto it = std::find_if(slabs.begin(), slabs.end(), [mem](const Slab& s) { return s.mem.get() == mem; });
+        assert(it != slabs.end());
+        slabs.erase(it);
+      }
+      free.clear();
+    }
+  }
+};
+
+// A buffer leased from a BufferPool, which takes the memory back on destruction.
+template<typename T>
+class PooledBuffer : public Buffer<T> {
+  BufferPool* pool;
+
+public:
+  PooledBuffer(BufferPool& pool, std::string_view name, size_t size)
+    : Buffer<T>{pool.queue, pool.take(size * sizeof(T)), name, size}
+    , pool{&pool}
+  {}
+
+  PooledBuffer(PooledBuffer&& rhs) = default;
+
+  ~PooledBuffer() {
+    if (cl_mem mem = this->detach()) { pool->give(this->size * sizeof(T), mem); }
+  }
+};
+
+template<typename T> PooledBuffer<T> BufferPool::lease(std::string_view name, size_t size) { return {*this, name, size}; }
@@ -0,0 +1,91 @@
+// Copyright (C) Mihai Preda.
+
+#include "CheckPolicy.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+// The prior: one error in PRIOR_ITERS iterations, which gives the historic step of 200'000 for blockSize 400.
+constexpr double PRIOR_ITERS = 50'000'000;
+
+// When the history exceeds this many iterations it is halved.
+constexpr double MAX_HISTORY = 2'000'000'000;
+
+constexpr u32 MIN_STEP = 50'000;
+constexpr u32 MAX_STEP = 1'000'000;
+
+// Above this roundoff pErr the step is the shortest.
+constexpr double MAX_ROUNDOFF_PERR = 0.01;
+
+// The workers of a process share the history file.
+std::mutex fileMutex;
+
+// One line per device: "<errors> <iterations> <device>"
+bool parse(const string& line, double& errors, double& iters, string& device) {
+  std::istringstream iss{rstripNewline(line)};
+  return iss >> errors >> iters && std::getline(iss >> std::ws, device);
+}
+
+}
+
+CheckPolicy::CheckPolicy(const fs::path& dir, const string& device) : file{dir / FILE_NAME}, device{device} {
+  std::unique_lock lock{fileMutex};
+  for (const string& line : File::openRead(file)) {
+    double e = 0, n = 0;
+    string d;
+    if (parse(line, e, n, d) && d == device) {
+      errors = e;
+      iters = n;
+    }
+  }
+  if (iters > 0) { log("Check history: %.0f errors in %.0fM iterations\n", errors, iters * 1e-6); }
+}
+
+void CheckPolicy::ok(u32 n) {
+  iters += n;
+  if (iters > MAX_HISTORY) {
+    iters /= 2;
+    errors /= 2;
+  }
+  save();
+}
+
+void CheckPolicy::error() {
+  errors += 1;
+  save();
+}
+
+u32 CheckPolicy::checkStep(u32 blockSize, u32 nErrors, double roundoffPErr) const {
+  double rate = (errors + 1) / (iters + PRIOR_ITERS);
+  u32 step = std::clamp(u32(sqrt(2 * blockSize / rate)) / 10'000 * 10'000, MIN_STEP, MAX_STEP);
+  if (nErrors) { step = std::min(step, nErrors == 1 ? 100'000u : MIN_STEP); }
+  if (roundoffPErr > MAX_ROUNDOFF_PERR) { step = MIN_STEP; }
+  return step;
+}
+
+void CheckPolicy::save() const {
+  std::unique_lock lock{fileMutex};
+  vector<string> lines;
+  for (const string& line : File::openRead(file)) {
+    double e = 0, n = 0;
+    string d;
+    if (parse(line, e, n, d) && d != device) { lines.push_back(rstripNewline(line)); }
+  }
+
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.2f %.0f ", errors, iters);
+  lines.push_back(buf + device);
+
+  fs::path tmp = file + ".new";
+  {
+    File fo = File::openWrite(tmp);
+    for (const string& line : lines) { fo.printf("%s\n", line.c_str()); }
+  }
+  fs::rename(tmp, file);
+}
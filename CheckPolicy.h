@@ -0,0 +1,39 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// The PRP check step, chosen from the per-device history of the check errors, which is persisted across tasks in
+// FILE_NAME. A check costs blockSize multiplications, and an error found by a check redoes the iterations since the
+// previous check; the step which minimizes the sum is sqrt(2 * blockSize / errorRate). The history is scaled down
+// as it grows, thus the recent errors weigh more.
+class CheckPolicy {
+public:
+  static constexpr const char* FILE_NAME = "check-history.txt";
+
+  CheckPolicy(const fs::path& dir, const string& device);
+
+  // Records "iters" iterations verified by an OK check.
+  void ok(u32 iters);
+
+  // Records a check error.
+  void error();
+
+  // The check step, a multiple of 10'000. nErrors are the errors of the current test, which shorten the step right
+  // away; so does a high probability of a roundoff error (from -use STATS, 0 otherwise).
+  u32 checkStep(u32 blockSize, u32 nErrors, double roundoffPErr) const;
+
+private:
+  fs::path file;
+  string device;
+  double errors = 0;
+  double iters = 0;
+
+  void save() const;
+};
@@ -8,6 +8,8 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <iterator>
+#include <sstream>
 
 using namespace std;
 
@@ -38,7 +40,7 @@ u32 FFTConfig::getMaxCarry32(u32 fftSize, u32 exponent) {
 // FFTConfig.h sets max bits-per-word based on a pErr of 0.5%.  The last entry accounts for increased ULTRA_TRIG accuracy plus
 // some extra bits-per-word to take us to a pErr of about 0.1%.  Note that the 4 digits of precision in the
 // table below is ludicrous.
-static double chain_savings[16][7] = {
+static double chain_savings[17][7] = {
   {0, 0, 0, 0, 0, 0, 0},						// MIDDLE=0
   {0, 0, 0, 0, 0, 0, 0},						// MIDDLE=1
   {0, 0, 0, 0, 0, 0, 0},						// MIDDLE=2
@@ -54,7 +56,8 @@ static double chain_savings[16][7] = {
   {0.1040, 0.2080, 0.0860, 0.0246, 0.0275, 0.0086, 0.0176+0.0209},	// MIDDLE=12
   {0.0890, 0.1779, 0.0814, 0.0286, 0.0303, 0.0068, 0.0176+0.0059},	// MIDDLE=13
   {0.0962, 0.1925, 0.0924, 0.0280, 0.0327, 0.0113, 0.0176+0.0058},	// MIDDLE=14
-  {0.1045, 0.2090, 0.0897, 0.0413, 0.0358, 0.0094, 0.0176+0.0154}};	// MIDDLE=15
+  {0.1045, 0.2090, 0.0897, 0.0413, 0.0358, 0.0094, 0.0176+0.0154},	// MIDDLE=15
+  {0.1045, 0.2090, 0.0897, 0.0413, 0.0358, 0.0094, 0.0176+0.0154}};	// MIDDLE=16, not measured yet: MIDDLE=15 values
 
 tuple<u32,u32,bool> FFTConfig::getChainLengths(u32 fftSize, u32 exponent, u32 middle) {
   i32 i;
@@ -113,7 +116,7 @@ vector<FFTConfig> FFTConfig::genConfigs() {
   vector<FFTConfig> configs;
   for (u32 width : {256, 512, 1024, 4096}) {
     for (u32 height : {256, 512, 1024}) {
-      for (u32 middle : {2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}) {
+      for (u32 middle : {2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}) {
         if (middle > 1 || width * height < 512 * 512) {
           configs.push_back({width, middle, height});
         }
@@ -123,6 +126,8 @@ vector<FFTConfig> FFTConfig::genConfigs() {
   std::sort(configs.begin(), configs.end(),
             [](const FFTConfig &a, const FFTConfig &b) {
               if (a.fftSize() != b.fftSize()) { return (a.fftSize() < b.fftSize()); }
+              // MIDDLE=16 only comes after the other variants of its size, until the tuner finds it faster.
+              if ((a.middle == 16) != (b.middle == 16)) { return b.middle == 16; }
               if (a.width != b.width) {
                 if (a.width == 1024 || b.width == 1024) { return a.width == 1024; }
                 return a.width < b.width;
@@ -132,6 +137,25 @@ vector<FFTConfig> FFTConfig::genConfigs() {
   return configs;
 }
 
+vector<FFTConfig> FFTConfig::fromSpecList(const string& list) {
+  vector<FFTConfig> all = genConfigs();
+  if (list == "all") { return all; }
+
+  string ss = list;
+  std::replace(ss.begin(), ss.end(), ',', ' ');
+  std::istringstream iss{ss};
+  vector<FFTConfig> configs;
+  for (string s; iss >> s;) {
+    if (s.find(':') != string::npos) {
+      configs.push_back(fromSpec(s));
+    } else {
+      u32 size = fromSpec(s).fftSize();
+      std::copy_if(all.begin(), all.end(), std::back_inserter(configs), [size](const FFTConfig& c) { return c.fftSize() == size; });
+    }
+  }
+  return configs;
+}
+
 string numberK(u32 n) {
   u32 K = 1024;
   u32 M = K * K;
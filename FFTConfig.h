@@ -50,7 +50,9 @@ struct FFTConfig {
                 middle == 12 ? fftSize * (18.5185 - 0.279 * log2(fftSize / (6.0 * 1024 * 1024))) :
                 middle == 13 ? fftSize * (18.4795 - 0.279 * log2(fftSize / (6.5 * 1024 * 1024))) :
                 middle == 14 ? fftSize * (18.4451 - 0.279 * log2(fftSize / (7.0 * 1024 * 1024))) :
-			       fftSize * (18.3804 - 0.279 * log2(fftSize / (7.5 * 1024 * 1024))); }
+                middle == 15 ? fftSize * (18.3804 - 0.279 * log2(fftSize / (7.5 * 1024 * 1024))) :
+                // MIDDLE=16 is extrapolated from the smaller middles; -crossover measures the actual limit.
+			       fftSize * (18.3450 - 0.279 * log2(fftSize / (8.0 * 1024 * 1024))); }
   
   static u32 getMaxCarry32(u32 fftSize, u32 exponent);
   static std::vector<FFTConfig> genConfigs();
@@ -59,6 +61,9 @@ struct FFTConfig {
 
   // FFTConfig(u32 w, u32 m, u32 h) : width(w), middle(m), height(h) {}
   static FFTConfig fromSpec(const string& spec);
+
+  // "all", or a comma separated list of FFT sizes (selecting all the variants of the size) and width:middle:height specs.
+  static std::vector<FFTConfig> fromSpecList(const string& list);
   
   u32 width  = 0;
   u32 middle = 0;
@@ -64,6 +64,9 @@ public:
   static File openReadThrow(const fs::path& name) { return File{name, "rb", true}; }
   
   static File openWrite(const fs::path& name) { return File{name, "wb", true}; }
+
+  // For in-place updates of an existing file.
+  static File openReadWrite(const fs::path& name) { return File{name, "r+b", true}; }
   
   static File openAppend(const fs::path &name) { return File{name, "ab", true}; }
   
@@ -121,8 +124,12 @@ public:
     if (!fwrite(data, nBytes, 1, get())) { throw(std::ios_base::failure((name + ": can't write data").c_str())); }
   }
   
-  void seek(long offset, int whence = SEEK_SET) {
-    int ret = fseek(get(), offset, whence);
+  void seek(i64 offset, int whence = SEEK_SET) {
+#if defined(_WIN32) || defined(__WIN32__)
+    int ret = _fseeki64(get(), offset, whence);
+#else
+    int ret = fseeko(get(), offset, whence);
+#endif
     if (ret) {
       throw(std::ios_base::failure(("fseek: "s + to_string(ret)).c_str()));
     }
@@ -0,0 +1,80 @@
+// Copyright (C) Mihai Preda.
+
+#include "FpRate.h"
+#include "Buffer.h"
+#include "Context.h"
+#include "Queue.h"
+#include "kernel.h"
+#include "timeutil.h"
+
+#include <map>
+#include <mutex>
+
+namespace {
+
+// Four independent chains of fma per work-item, thus the throughput (not the latency) is measured.
+const char* FMA_SOURCE = R"(
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+
+#define FMA_LOOP(T) \
+  T a = (T) 0.9999, b = (T) 0.0001; \
+  T x0 = get_global_id(0), x1 = x0 + 1, x2 = x0 + 2, x3 = x0 + 3; \
+  for (uint i = 0; i < n; ++i) { x0 = fma(x0, a, b); x1 = fma(x1, a, b); x2 = fma(x2, a, b); x3 = fma(x3, a, b); } \
+  out[get_global_id(0)] = x0 + x1 + x2 + x3;
+
+kernel void fmaF(global float* out, uint n)  { FMA_LOOP(float) }
+kernel void fmaD(global double* out, uint n) { FMA_LOOP(double) }
+)";
+
+constexpr u32 WORK_SIZE = 1u << 20;
+constexpr u32 N_FMA = 512;
+
+// The best of a few runs, after a warm-up.
+template<typename T>
+double timeFma(Kernel& kernel, Buffer<T>& out, QueuePtr& queue) {
+  kernel(out, N_FMA);
+  queue->finish();
+  double best = 1e9;
+  for (int i = 0; i < 3; ++i) {
+    Timer timer;
+    kernel(out, N_FMA);
+    queue->finish();
+    best = std::min(best, timer.at());
+  }
+  return best;
+}
+
+double measure(cl_device_id device) {
+  Context context{device};
+  Holder<cl_program> program{compile(context.get(), device, FMA_SOURCE, "", {})};
+  if (!program) { return 0; }
+  QueuePtr queue = Queue::make(context, 0, false);
+  Kernel fmaF{program.get(), queue, device, "fmaF", WORK_SIZE};
+  Kernel fmaD{program.get(), queue, device, "fmaD", WORK_SIZE};
+  Buffer<float> outF{queue, "fmaF", WORK_SIZE};
+  Buffer<double> outD{queue, "fmaD", WORK_SIZE};
+  double secsF = timeFma(fmaF, outF, queue);
+  double secsD = timeFma(fmaD, outD, queue);
+  return secsD > 0 ? secsF / secsD : 0;
+}
+
+}
+
+double fp64Ratio(cl_device_id device) {
+  static std::mutex mut;
+  static std::map<cl_device_id, double> ratios;
+
+  std::unique_lock lock{mut};
+  if (auto it = ratios.find(device); it != ratios.end()) { return it->second; }
+  double ratio = 0;
+  try {
+    ratio = measure(device);
+  } catch (const char* mes) {
+    log("FP64 rate: %s\n", mes);
+  } catch (const std::exception& e) {
+    log("FP64 rate: %s\n", e.what());
+  }
+  if (ratio > 0) { log("FP64 rate 1:%.0f of FP32\n", 1 / ratio); }
+  ratios[device] = ratio;
+  return ratio;
+}
@@ -0,0 +1,11 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include "tinycl.h"
+
+// The FP64 : FP32 fma throughput of the device (e.g. 1/2 on compute GPUs, 1/16 to 1/64 on consumer GPUs), measured
+// once per device with chains of fma in a tiny program, when the default TRIG_COMPUTE depends on it. 0 if the
+// measurement failed.
+double fp64Ratio(cl_device_id device);
@@ -16,6 +16,17 @@ mpz_class mpz(const vector<u32>& words) {
   return b;
 }
 
+// The value mod 2^exp - 1 as exp bits, in words.
+vector<u32> toWords(u32 exp, const mpz_class& a) {
+  mpz_class m = (mpz_class{1} << exp) - 1;
+  mpz_class r = a % m;
+  if (r < 0) { r += m; }
+  vector<u32> ret((exp - 1) / 32 + 1);
+  mpz_export(ret.data(), nullptr, -1 /*order: LSWord first*/, sizeof(u32), 0 /*endianess: native*/, 0 /*nails*/,
+             r.get_mpz_t());
+  return ret;
+}
+
 mpz_class primorial(u32 p) {
   mpz_class b{};
   mpz_primorial_ui(b.get_mpz_t(), p);
@@ -95,3 +106,14 @@ int jacobi(u32 exp, const std::vector<u32>& words) {
   mpz_class m = (mpz_class{1} << exp) - 1;
   return mpz_jacobi(w.get_mpz_t(), m.get_mpz_t());
 }
+
+// u = sigma^2 - 5, v = 4 * sigma; x0 = u^3, z0 = v^3; (A + 2) / 4 == (v - u)^3 * (3u + v) / (16 * u^3 * v).
+std::array<vector<u32>, 4> suyamaCurve(u32 exp, u32 sigma) {
+  assert(sigma > 5);
+  mpz_class s{sigma};
+  mpz_class u = s * s - 5;
+  mpz_class v = 4 * s;
+  mpz_class u3 = u * u * u;
+  mpz_class vu = v - u;
+  return {toWords(exp, u3), toWords(exp, v * v * v), toWords(exp, vu * vu * vu * (3 * u + v)), toWords(exp, 16 * u3 * v)};
+}
@@ -5,6 +5,7 @@
 #include "common.h"
 #include <gmpxx.h>
 
+#include <array>
 #include <string>
 #include <vector>
 
@@ -23,6 +24,11 @@ u32 powerSmoothBits(u32 exp, u32 B1);
 // Returns jacobi-symbol(words, 2**exp - 1)
 int jacobi(u32 exp, const std::vector<u32>& words);
 
+// The ECM curve of Suyama's parametrization by sigma, mod 2**exp - 1: the start point (x0 : z0), and the Montgomery
+// constant (A + 2) / 4 as the fraction a24 / c24, which avoids an inversion. See "Speeding the Pollard and Elliptic
+// Curve Methods of Factorization", P. L. Montgomery, and GMP-ECM.
+std::array<vector<u32>, 4> suyamaCurve(u32 exp, u32 sigma);
+
 inline mpz_class mpz64(u64 h) {
   mpz_class ret{u32(h >> 32)};
   ret <<= 32;
@@ -11,7 +11,17 @@
 #include "AllocTrac.h"
 #include "Queue.h"
 #include "Task.h"
-#include "Memlock.h"
+#include "MemLease.h"
+#include "Pm1Bounds.h"
+#include "Pm1Plan.h"
+#include "Tune.h"
+#include "CheckPolicy.h"
+#include "FpRate.h"
+#include "Ntt.h"
+#include "Power.h"
+#include "MD5.h"
+#include "SelfTest.h"
+#include "Trace.h"
 
 #define _USE_MATH_DEFINES
 #include <cmath>
@@ -24,6 +34,11 @@
 #include <limits>
 #include <iomanip>
 #include <array>
+#include <thread>
+#include <functional>
+#include <random>
+#include <map>
+#include <mutex>
 
 #ifndef M_PIl
 #define M_PIl 3.141592653589793238462643383279502884L
@@ -43,12 +58,31 @@ using float3 = tuple<float, float, float>;
 struct Weights {
   vector<double> threadWeightsIF;  
   vector<double> carryWeightsIF;
+  vector<double> stepWeightsIF;
+  vector<double> unitWeightsIF;
   vector<u32> bitsCF;
   vector<u32> bitsC;
 };
 
 namespace {
 
+// The block size of the borrow resolution in the compaction kernels; must match COMPACT_BLOCK in gpuowl.cl.
+constexpr u32 COMPACT_BLOCK = 256;
+
+// The size of the compact E-bit residue on the GPU, padded to an even number of words for sum64().
+u32 compactSize(u32 E) { return roundUp((E - 1) / 32 + 1, 2); }
+
+// The compact buffers fit any exponent of the FFT size (up to 20 bits per word), thus survive a retarget().
+u32 compactCapacity(u32 N) { return compactSize(u32(std::min<u64>(u64(N) * 20, u32(-1)))); }
+
+// With -perf (and without -time) the kernels are profiled in one out of this many windows between finish() calls,
+// which keeps the overhead of the profiling events low enough for production runs.
+constexpr u32 PERF_SAMPLE = 16;
+
+// The Gpus alive per device, as the self-test is not timed beside another Gpu of the process on the same device.
+std::mutex liveMutex;
+std::map<cl_device_id, u32> liveGpus;
+
 // Returns the primitive root of unity of order N, to the power k.
 
 template<typename T>
@@ -114,12 +148,24 @@ ConstBuffer<double2> genMiddleTrig(const Context& context, u32 smallH, u32 middl
   return {context, "middleTrig", tab};
 }
 
+// Runs fn(begin, end) on slices of [0, n), in parallel on the CPU cores.
+template<typename F>
+void parallelFor(u32 n, F fn) {
+  u32 nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+  u32 step = std::max((n - 1) / nThreads + 1, 1024u);
+  vector<std::thread> threads;
+  for (u32 begin = step; begin < n; begin += step) { threads.emplace_back(fn, begin, std::min(n, begin + step)); }
+  fn(0, std::min(n, step));
+  for (auto& t : threads) { t.join(); }
+}
+
 template<typename T>
 vector<pair<T, T>> makeTrig(u32 n) {
   assert(n % 8 == 0);
-  vector<pair<T, T>> tab;
-  tab.reserve(n/8 + 1);
-  for (u32 k = 0; k <= n/8; ++k) { tab.push_back(root1<T>(n, k)); }
+  vector<pair<T, T>> tab(n/8 + 1);
+  parallelFor(n/8 + 1, [&tab, n](u32 begin, u32 end) {
+                         for (u32 k = begin; k < end; ++k) { tab[k] = root1<T>(n, k); }
+                       });
   return tab;
 }
 
@@ -173,43 +219,55 @@ Weights genWeights(u32 E, u32 W, u32 H, u32 nW) {
     carryWeightsIF.push_back(2 * w);
   }
   
-  vector<u32> bits;
-  
-  for (u32 line = 0; line < H; ++line) {
-    for (u32 thread = 0; thread < groupWidth; ) {
-      std::bitset<32> b;
-      for (u32 bitoffset = 0; bitoffset < 32; bitoffset += nW*2, ++thread) {
-        for (u32 block = 0; block < nW; ++block) {
-          for (u32 rep = 0; rep < 2; ++rep) {
-            if (isBigWord(N, E, kAt(H, line, block * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
-          }        
-	}
-      }
-      bits.push_back(b.to_ulong());
-    }
+  // The weight steps between the two words of a pair, and between the lines of a carry group.
+  vector<double> stepWeightsIF{double(invWeight(N, E, H, 0, 0, 1) - 1), double(weight(N, E, H, 0, 0, 1) - 1)};
+  vector<double> unitWeightsIF;
+  for (u32 i = 0; i < CARRY_LEN; ++i) {
+    unitWeightsIF.push_back(invWeight(N, E, H, 0, 0, 2*i) - 1);
+    unitWeightsIF.push_back(weight(N, E, H, 0, 0, 2*i) - 1);
   }
-  assert(bits.size() == N / 32);
-  
-  vector<u32> bitsC;
-  
-  for (u32 gy = 0; gy < H / CARRY_LEN; ++gy) {
-    for (u32 gx = 0; gx < nW; ++gx) {
+
+  // The bit masks take N isBigWord() each, built in parallel by lines: a line has W/16 words of "bits", and a carry
+  // group of lines has W/2 words of "bitsC".
+  vector<u32> bits(N / 32);
+  parallelFor(H, [&](u32 lineBegin, u32 lineEnd) {
+    for (u32 line = lineBegin; line < lineEnd; ++line) {
+      u32* out = bits.data() + line * (W / 16);
       for (u32 thread = 0; thread < groupWidth; ) {
         std::bitset<32> b;
-        for (u32 bitoffset = 0; bitoffset < 32; bitoffset += CARRY_LEN * 2, ++thread) {
-          for (u32 block = 0; block < CARRY_LEN; ++block) {
+        for (u32 bitoffset = 0; bitoffset < 32; bitoffset += nW*2, ++thread) {
+          for (u32 block = 0; block < nW; ++block) {
             for (u32 rep = 0; rep < 2; ++rep) {
-              if (isBigWord(N, E, kAt(H, gy * CARRY_LEN + block, gx * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
+              if (isBigWord(N, E, kAt(H, line, block * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
             }
           }
         }
-        bitsC.push_back(b.to_ulong());
+        *out++ = b.to_ulong();
       }
     }
-  }
-  assert(bitsC.size() == N / 32);
+  });
+  
+  vector<u32> bitsC(N / 32);
+  parallelFor(H / CARRY_LEN, [&](u32 gyBegin, u32 gyEnd) {
+    for (u32 gy = gyBegin; gy < gyEnd; ++gy) {
+      u32* out = bitsC.data() + gy * (W / 2);
+      for (u32 gx = 0; gx < nW; ++gx) {
+        for (u32 thread = 0; thread < groupWidth; ) {
+          std::bitset<32> b;
+          for (u32 bitoffset = 0; bitoffset < 32; bitoffset += CARRY_LEN * 2, ++thread) {
+            for (u32 block = 0; block < CARRY_LEN; ++block) {
+              for (u32 rep = 0; rep < 2; ++rep) {
+                if (isBigWord(N, E, kAt(H, gy * CARRY_LEN + block, gx * groupWidth + thread) + rep)) { b.set(bitoffset + block * 2 + rep); }
+              }
+            }
+          }
+          *out++ = b.to_ulong();
+        }
+      }
+    }
+  });
 
-  return Weights{threadWeightsIF, carryWeightsIF, bits, bitsC};
+  return Weights{threadWeightsIF, carryWeightsIF, stepWeightsIF, unitWeightsIF, bits, bitsC};
 }
 
 string toLiteral(u32 value) { return to_string(value) + 'u'; }
@@ -260,18 +318,74 @@ struct Define {
   operator string() const { return str; }
 };
 
-cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N, u32 E, u32 WIDTH, u32 SMALL_HEIGHT, u32 MIDDLE, u32 nW) {
-  string clArgs = args.dump.empty() ? ""s : (" -save-temps="s + args.dump + "/" + numberK(N));
-  if (!args.safeMath) { clArgs += " -cl-unsafe-math-optimizations"; }
-  
-  vector<Define> defines =
-    {{"EXP", E},
-     {"WIDTH", WIDTH},
-     {"SMALL_HEIGHT", SMALL_HEIGHT},
-     {"MIDDLE", MIDDLE},
-    };
+// Returns the program from the binary cache, or null if not found or not usable.
+cl_program loadCached(cl_context context, cl_device_id id, const fs::path& cacheFile) {
+  if (!fs::exists(cacheFile)) { return nullptr; }
+  try {
+    cl_program program = loadBinary(context, id, cacheFile.string());
+    log("Loaded cached program '%s'\n", cacheFile.string().c_str());
+    return program;
+  } catch (const std::exception& e) {
+    log("Discarding cached program '%s': %s\n", cacheFile.string().c_str(), e.what());
+    std::error_code noThrow;
+    fs::remove(cacheFile, noThrow);
+    return nullptr;
+  }
+}
 
-  if (isAmdGpu(id)) { defines.push_back({"AMDGPU", 1}); }
+// Writing to a temporary followed by rename() makes the cache safe for concurrent instances.
+void saveCached(cl_program program, const fs::path& cacheFile) {
+  try {
+    fs::create_directories(cacheFile.parent_path());
+    // Unique per thread, as several workers may compile the same program at the same time.
+    fs::path tmp = cacheFile;
+    tmp += "."s + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".new";
+    dumpBinary(program, tmp.string());
+    fs::rename(tmp, cacheFile);
+  } catch (const std::exception& e) {
+    log("Can't write cached program '%s': %s\n", cacheFile.string().c_str(), e.what());
+  }
+}
+
+// The value of a "-use KEY=value" flag, if set.
+optional<u32> flagValue(const Args& args, const string& key) {
+  for (const string& flag : args.flags) {
+    if (flag.size() > key.size() && flag.compare(0, key.size() + 1, key + '=') == 0) {
+      return stoi(flag.substr(key.size() + 1));
+    }
+  }
+  return {};
+}
+
+// Below this FP64 : FP32 rate (consumer GPUs) the FP64 compute of the trig costs more than a small table.
+constexpr double LOW_FP64_RATIO = 1.0 / 8;
+
+// The TRIG_COMPUTE variant, when not set with -use (or by the tune file): the full table of TRIG_COMPUTE=0 is N bytes
+// read in every pass, worth it only if it takes a small part of the cache; otherwise the trig is computed, all of it
+// (2), or from the two small tables of 1 on a GPU with a low FP64 rate.
+u32 trigCompute(const Args& args, cl_device_id id, u32 N) {
+  if (auto value = flagValue(args, "TRIG_COMPUTE")) { return *value; }
+  u64 cacheSize = getCacheSize(id);
+  if (cacheSize && N <= cacheSize / 8) { return 0; }
+  double ratio = fp64Ratio(id);
+  return (ratio > 0 && ratio < LOW_FP64_RATIO) ? 1 : 2;
+}
+
+// The GPU memory of the buffers allocated by the constructor: 4 int and 3 double buffers of N words, the carry shuttle,
+// the compacted residue, the roundoff stats and the TRIG_COMPUTE=0 table. The small buffers fit in the 1% margin.
+u64 fixedBytes(u32 N, u32 E, bool fullTrig) {
+  u64 n = N;
+  u64 bytes = 4 * n * sizeof(int) + 3 * n * sizeof(double) + n / 2 * sizeof(i64) + u64(compactCapacity(N)) * sizeof(u32)
+    + (8 + 1024 * 1024) * sizeof(u32) + (fullTrig ? n / 2 * sizeof(double2) : 0);
+  return bytes + bytes / 100;
+}
+
+// The GPU memory shared by the leases (see MemLease) of all the processes on the device.
+u64 leaseBudget(cl_device_id id) { return getTotalMem(id) / 10 * 9; }
+
+// The defines of the program that depend on the exponent. A Gpu is re-targeted only to an exponent with the same ones.
+vector<string> exponentDefines(u32 N, u32 E, u32 MIDDLE) {
+  vector<Define> defines;
 
   // Force carry64 when carry32 might exceed a very conservative 0x6C000000
   if (FFTConfig::getMaxCarry32(N, E) > 0x6C00) { defines.push_back({"CARRY64", 1}); }
@@ -283,18 +397,28 @@ cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N,
   if (mm2_chain) { defines.push_back({"MM2_CHAIN", mm2_chain}); }
   if (ultra_trig) { defines.push_back({"ULTRA_TRIG", 1}); }
 
-  defines.push_back({"WEIGHT_STEP", double(weight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 1) - 1)});
-  defines.push_back({"IWEIGHT_STEP", double(invWeight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 1) - 1)});
+  if (E / N >= 19) { defines.push_back({"LARGE_WORDS", 1}); }
+  return {defines.begin(), defines.end()};
+}
 
-  vector<double> iWeights;
-  vector<double> fWeights;
-  for (u32 i = 0; i < CARRY_LEN; ++i) {
-    iWeights.push_back(invWeight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 2*i) - 1);
-    fWeights.push_back(weight(N, E, SMALL_HEIGHT * MIDDLE, 0, 0, 2*i) - 1);
-  }
-  defines.push_back({"IWEIGHTS", iWeights});
-  defines.push_back({"FWEIGHTS", fWeights});
+cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N, u32 E, u32 WIDTH, u32 SMALL_HEIGHT, u32 MIDDLE, u32 nW) {
+  string clArgs = args.dump.empty() ? ""s : (" -save-temps="s + args.dump + "/" + numberK(N));
+  if (!args.safeMath) { clArgs += " -cl-unsafe-math-optimizations"; }
   
+  // The exponent is not a define, so that the compiled program can be reused (through the cache) for any exponent
+  // of this FFT size; only the code variants that depend on the exponent below are part of the program.
+  vector<Define> defines =
+    {{"WIDTH", WIDTH},
+     {"SMALL_HEIGHT", SMALL_HEIGHT},
+     {"MIDDLE", MIDDLE},
+    };
+
+  if (isAmdGpu(id)) { defines.push_back({"AMDGPU", 1}); }
+
+  for (const string& d : exponentDefines(N, E, MIDDLE)) { defines.push_back(Define{d}); }
+
+  if (!flagValue(args, "TRIG_COMPUTE")) { defines.push_back({"TRIG_COMPUTE", trigCompute(args, id, N)}); }
+
   string clSource = CL_SOURCE;
   for (const string& flag : args.flags) {
     auto pos = flag.find('=');
@@ -314,10 +438,22 @@ cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N,
   strDefines.insert(strDefines.begin(), defines.begin(), defines.end());
 
   cl_program program{};
-  if (args.binaryFile.empty()) {
-    program = compile(context, id, CL_SOURCE, clArgs, strDefines);
-  } else {
+  if (!args.binaryFile.empty()) {
     program = loadBinary(context, id, args.binaryFile);
+  } else {
+    fs::path cacheFile;
+    if (!args.cacheDir.empty()) {
+      string allDefines;
+      for (const string& d : strDefines) { allDefines += d + ' '; }
+      string key = MD5::hash(string(CL_SOURCE), clArgs, allDefines, getLongInfo(id), getDriverVersion(id));
+      cacheFile = args.cacheDir / (numberK(N) + '-' + key + ".bin");
+      program = loadCached(context, id, cacheFile);
+    }
+
+    if (!program) {
+      program = compile(context, id, CL_SOURCE, clArgs, strDefines);
+      if (program && !cacheFile.empty()) { saveCached(program, cacheFile); }
+    }
   }
   if (!program) { throw "OpenCL compilation"; }
   // dumpBinary(program, "dump.bin");
@@ -327,14 +463,77 @@ cl_program compile(const Args& args, cl_context context, cl_device_id id, u32 N,
 }
 
 Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-         cl_device_id device, bool timeKernels, bool useLongCarry)
-  : Gpu{args, E, W, BIG_H, SMALL_H, nW, nH, device, timeKernels, useLongCarry, genWeights(E, W, BIG_H, nW)}
+         cl_device_id device, bool timeKernels, bool useLongCarry, u32 flushStep)
+  : Gpu{args, E, W, BIG_H, SMALL_H, nW, nH, device, timeKernels, useLongCarry, flushStep, genWeights(E, W, BIG_H, nW)}
 {}
 
 using float2 = pair<float, float>;
 
+// The kernel sequences of coreStep() on bufData for every (leadIn, leadOut, mul3), over kernel instances with all the
+// arguments bound once, see Gpu::Gpu(). Queuing an iteration is then only the enqueue of its kernels.
+struct StepPlan {
+  Kernel fftP, tW, tailSquare, tH, fftW, carryA, carryM, carryB, carryFused, carryFusedMul, carryFusedStats,
+    carryFusedMiddle;
+  vector<Kernel*> steps[8];
+  vector<Kernel*> sampled; // the plain step, sampling the roundoff.
+
+  static u32 index(bool leadIn, bool leadOut, bool mul3) { return leadIn * 4 + leadOut * 2 + mul3; }
+
+  // With the fused middle pass (carryFusedMiddle), a plain squaring without mul3 is two kernels instead of four.
+  void build(bool useLongCarry, bool fusedMiddle) {
+    for (bool leadIn : {false, true}) {
+      for (bool leadOut : {false, true}) {
+        for (bool mul3 : {false, true}) {
+          vector<Kernel*>& seq = steps[index(leadIn, leadOut, mul3)];
+          if (leadIn) { seq.insert(seq.end(), {&fftP, &tW}); }
+          if (fusedMiddle && !leadOut && !mul3) {
+            seq.insert(seq.end(), {&tailSquare, &carryFusedMiddle});
+            continue;
+          }
+          seq.insert(seq.end(), {&tailSquare, &tH});
+          if (leadOut) {
+            seq.insert(seq.end(), {&fftW, mul3 ? &carryM : &carryA, &carryB});
+          } else if (!useLongCarry) {
+            seq.insert(seq.end(), {mul3 ? &carryFusedMul : &carryFused, &tW});
+          }
+        }
+      }
+    }
+    if (!useLongCarry) { sampled = {&tailSquare, &tH, &carryFusedStats, &tW}; }
+  }
+
+  void run(bool leadIn, bool leadOut, bool mul3, bool sample) {
+    const vector<Kernel*>& seq = (sample && !sampled.empty()) ? sampled : steps[index(leadIn, leadOut, mul3)];
+    for (Kernel* k : seq) { (*k)(); }
+  }
+};
+
+// A batch of plain iterations on bufData (without lead-in or lead-out), recorded once into a command buffer
+// (cl_khr_command_buffer) if the device supports it, otherwise replayed from a flat launch list of the step plan.
+struct Replay {
+  u32 nIters;
+  vector<Kernel*> launches;
+  CommandBufferHolder commands;
+
+  void run(Queue& queue) {
+    if (commands && !queue.run(commands.get())) {
+      // E.g. a driver without the simultaneous use of a command buffer, when the previous enqueue is still pending.
+      log("Replay of %u iterations goes on from a launch list\n", nIters);
+      commands.reset();
+    }
+    if (!commands) {
+      for (Kernel* k : launches) { (*k)(); }
+    }
+  }
+};
+
+Gpu::~Gpu() {
+  std::unique_lock lock{liveMutex};
+  --liveGpus[device];
+}
+
 Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-         cl_device_id device, bool timeKernels, bool useLongCarry, Weights&& weights) :
+         cl_device_id device, bool timeKernels, bool useLongCarry, u32 flushStep, Weights&& weights) :
   E(E),
   N(W * BIG_H * 2),
   hN(N / 2),
@@ -342,12 +541,16 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   nH(nH),
   bufSize(N * sizeof(double)),
   WIDTH(W),
+  MIDDLE(BIG_H / SMALL_H),
   useLongCarry(useLongCarry),
   timeKernels(timeKernels),
+  flushStep(flushStep),
   device(device),
   context{device},
   program(compile(args, context.get(), device, N, E, W, SMALL_H, BIG_H / SMALL_H, nW)),
-  queue(Queue::make(context, timeKernels, args.cudaYield)),
+  queue(Queue::make(context, (timeKernels || Trace::enabled()) ? 1 : (args.perfFile.empty() ? 0 : PERF_SAMPLE),
+                    args.cudaYield)),
+  pool{queue},
 
   // Specifies size in number of workgroups
 #define LOAD(name, nGroups) name{program.get(), queue, device, nGroups, #name}
@@ -356,6 +559,8 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   
   LOAD(carryFused,    BIG_H + 1),
   LOAD(carryFusedMul, BIG_H + 1),
+  LOAD(carryFusedStats, BIG_H + 1),
+  LOAD(carryFusedMiddle, SMALL_H + 1),
   LOAD(fftP, BIG_H),
   LOAD(fftW,   BIG_H),
   LOAD(fftHin,  hN / SMALL_H),
@@ -365,8 +570,6 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   LOAD_WS(carryA,  hN / CARRY_LEN),
   LOAD_WS(carryM,  hN / CARRY_LEN),
   LOAD_WS(carryB,  hN / CARRY_LEN),
-  LOAD(transposeW,   (W/64) * (BIG_H/64)),
-  LOAD(transposeH,   (W/64) * (BIG_H/64)),
   LOAD(transposeIn,  (W/64) * (BIG_H/64)),
   LOAD(transposeOut, (W/64) * (BIG_H/64)),
   LOAD(kernelMultiply,      hN / SMALL_H),
@@ -378,9 +581,14 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   LOAD(tailSquareLow,     hN / SMALL_H / 2),
   LOAD(tailMulLowLow,     hN / SMALL_H / 2),
   LOAD(readResidue, 1),
-  LOAD(isNotZero, 256),
-  LOAD(isEqual, 256),
+  LOAD(checkReduce, 256),
   LOAD(sum64, 256),
+  LOAD_WS(compactSign, roundUp(N / COMPACT_BLOCK, 64)),
+  LOAD(compactCarry, 1),
+  LOAD_WS(compactWords, roundUp(compactCapacity(N), 64)),
+  LOAD(expandWords, N / 64),
+  LOAD(writeGlobals, 32),
+  LOAD(addSub, hN / 256),
 #undef LOAD_WS
 #undef LOAD
 
@@ -393,32 +601,51 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
   bufAux{queue, "aux", N},
   bufCheck{queue, "check", N},
   bufBase{queue, "base", N},
+  bufCompact{HostAccessBuffer<u32>::io(queue, "compact", compactCapacity(N))},
+  bufCompactSign{queue, "compactSign", N / COMPACT_BLOCK},
+  bufCompactCarry{queue, "compactCarry", N / COMPACT_BLOCK},
   bufCarry{queue, "carry", N / 2},
-  bufReady{queue, "ready", BIG_H},
+  bufReady{queue, "ready", BIG_H + 1},
   bufRoundoff{queue, "roundoff", 8 + 1024 * 1024},
   bufCarryMax{queue, "carryMax", 8},
   bufCarryMulMax{queue, "carryMulMax", 8},
-  bufSmallOut{queue, "smallOut", 256},
+  bufSmallOut{HostAccessBuffer<int>::io(queue, "smallOut", 256)},
   bufSumOut{queue, "sumOut", 1},
+  bufCheckOut{queue, "checkOut", 3},
   buf1{queue, "buf1", N},
   buf2{queue, "buf2", N},
   buf3{queue, "buf3", N},
   args{args}
 {
   // dumpBinary(program.get(), "isa.bin");
+
+  // The bytes moved by one call, for the GB/s of the perf counters: the big buffers are N doubles, the words N ints.
+  u64 bigBytes = N * sizeof(double);
+  u64 intBytes = N * sizeof(int);
+  for (auto [kernel, bytes] : {pair{&carryFused, 2 * bigBytes}, {&carryFusedMul, 2 * bigBytes},
+                               {&carryFusedStats, 2 * bigBytes}, {&carryFusedMiddle, 2 * bigBytes},
+                               {&fftP, bigBytes + intBytes}, {&fftW, 2 * bigBytes},
+                               {&fftHin, 2 * bigBytes}, {&fftHout, 2 * bigBytes},
+                               {&fftMiddleIn, 2 * bigBytes}, {&fftMiddleOut, 2 * bigBytes},
+                               {&carryA, bigBytes + intBytes}, {&carryM, bigBytes + intBytes}, {&carryB, 2 * intBytes},
+                               {&transposeIn, 2 * intBytes}, {&transposeOut, 2 * intBytes},
+                               {&kernelMultiply, 3 * bigBytes}, {&kernelMultiplyDelta, 4 * bigBytes},
+                               {&tailFusedSquare, 2 * bigBytes}, {&tailSquareLow, 2 * bigBytes},
+                               {&tailFusedMul, 3 * bigBytes}, {&tailFusedMulLow, 3 * bigBytes},
+                               {&tailFusedMulDelta, 4 * bigBytes}, {&tailMulLowLow, 3 * bigBytes},
+                               {&compactWords, intBytes}, {&expandWords, intBytes}}) {
+    kernel->setBytes(bytes);
+  }
+
+  for (u32 i = 0; i < std::size(stageBusy); ++i) { bufStages.push_back(HostAccessBuffer<u32>::pinned(queue, "stage", compactCapacity(N))); }
   
-  carryFused.setFixedArgs(   2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
-  carryFusedMul.setFixedArgs(2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMulMax);
   fftP.setFixedArgs(2, bufTrigW);
   fftW.setFixedArgs(2, bufTrigW);
   fftHin.setFixedArgs(2, bufTrigH);
   fftHout.setFixedArgs(1, bufTrigH);
   fftMiddleIn.setFixedArgs(2, bufTrigM);
   fftMiddleOut.setFixedArgs(2, bufTrigM);
-    
-  carryA.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMax);
-  carryM.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMulMax);
-  carryB.setFixedArgs(1, bufCarry, bufBitsC);
+
 
   tailFusedMulDelta.setFixedArgs(4, bufTrigH, bufTrigH);
   tailFusedMulLow.setFixedArgs(3, bufTrigH, bufTrigH);
@@ -435,6 +662,11 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
 
   vector<float2> readTrigSH, readTrigBH, readTrigN;
   {
+    // Only the tables used by the TRIG_COMPUTE variant are built; the others are passed as a placeholder.
+    u32 trig = trigCompute(args, device, N);
+    if (!flagValue(args, "TRIG_COMPUTE")) { log("TRIG_COMPUTE=%u (cache %u KB)\n", trig, u32(getCacheSize(device) >> 10)); }
+    vector<pair<double, double>> none(1);
+
     HostAccessBuffer<float2>
       bufSH{queue, "readTrig", SMALL_H/4 + 1},
       bufBH{queue, "readTrigBH", BIG_H/8 + 1},
@@ -445,99 +677,146 @@ Gpu::Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
     readTrigBH = bufBH.read();
     readTrigN = bufN.read();
 
-    Kernel{program.get(), queue, device, 32, "writeGlobals"}(ConstBuffer{context, "dp1", makeTrig<double>(2 * SMALL_H)},
-                                                             ConstBuffer{context, "dp2", makeTrig<double>(BIG_H)},
-                                                             ConstBuffer{context, "dp3", makeTrig<double>(hN)},
-                                                             ConstBuffer{context, "dp4", makeTinyTrig<double>(W, hN)},
-
-                                                             ConstBuffer{context, "w2", weights.threadWeightsIF},
-                                                             ConstBuffer{context, "w3", weights.carryWeightsIF}
-                                                             );
+    writeGlobals(ConstBuffer{context, "dp1", makeTrig<double>(2 * SMALL_H)},
+                 ConstBuffer{context, "dp2", makeTrig<double>(BIG_H)},
+                 ConstBuffer{context, "dp3", trig == 0 ? makeTrig<double>(hN) : none},
+                 ConstBuffer{context, "dp4", trig == 1 ? makeTinyTrig<double>(W, hN) : none},
+
+                 ConstBuffer{context, "w2", weights.threadWeightsIF},
+                 ConstBuffer{context, "w3", weights.carryWeightsIF},
+                 ConstBuffer{context, "w4", weights.stepWeightsIF},
+                 ConstBuffer{context, "w5", weights.unitWeightsIF},
+                 E / N, N - E % N, 1u
+                 );
   }
 
+  cl_program p = program.get();
+  stepPlan.reset(new StepPlan{{p, fftP}, {p, fftMiddleIn}, {p, tailFusedSquare}, {p, fftMiddleOut}, {p, fftW},
+                              {p, carryA}, {p, carryM}, {p, carryB}, {p, carryFused}, {p, carryFusedMul},
+                              {p, carryFusedStats}, {p, carryFusedMiddle}, {}, {}});
+  stepPlan->fftP.setFixedArgs(0, buf2, bufData, bufTrigW);
+  stepPlan->tW.setFixedArgs(0, buf1, buf2, bufTrigM);
+  stepPlan->tailSquare.setFixedArgs(0, buf2, buf1, bufTrigH, bufTrigH);
+  stepPlan->tH.setFixedArgs(0, buf1, buf2, bufTrigM);
+  stepPlan->fftW.setFixedArgs(0, buf2, buf1, bufTrigW);
+  bindBits();
+  // The kernel is not in the program without the flag, or when MIDDLE is too large for it.
+  bool fusedMiddle = !useLongCarry && bool(carryFusedMiddle);
+  if (args.flags.count("FUSED_MIDDLE") && !fusedMiddle) { log("FUSED_MIDDLE not used with this FFT\n"); }
+  stepPlan->build(useLongCarry, fusedMiddle);
+
   finish();
   
   program.reset();
+
+  std::unique_lock lock{liveMutex};
+  ++liveGpus[device];
 }
 
-vector<Buffer<i32>> Gpu::makeBufVector(u32 size) {
-  vector<Buffer<i32>> r;
-  for (u32 i = 0; i < size; ++i) { r.emplace_back(queue, "vector", N); }
+// The arguments bufBits and bufBitsC, set again by retarget().
+void Gpu::bindBits() {
+  carryFused.setFixedArgs(   2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
+  carryFusedMul.setFixedArgs(2, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMulMax);
+  carryA.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMax);
+  carryM.setFixedArgs(2, bufCarry, bufBitsC, bufRoundoff, bufCarryMulMax);
+  carryB.setFixedArgs(1, bufCarry, bufBitsC);
+
+  stepPlan->carryA.setFixedArgs(0, bufData, buf2, bufCarry, bufBitsC, bufRoundoff, bufCarryMax);
+  stepPlan->carryM.setFixedArgs(0, bufData, buf2, bufCarry, bufBitsC, bufRoundoff, bufCarryMulMax);
+  stepPlan->carryB.setFixedArgs(0, bufData, bufCarry, bufBitsC);
+  stepPlan->carryFused.setFixedArgs(0, buf2, buf1, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
+  stepPlan->carryFusedMul.setFixedArgs(0, buf2, buf1, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMulMax);
+  stepPlan->carryFusedStats.setFixedArgs(0, buf2, buf1, bufCarry, bufReady, bufTrigW, bufBits, bufRoundoff, bufCarryMax);
+  stepPlan->carryFusedMiddle.setFixedArgs(0, buf1, buf2, bufCarry, bufReady, bufTrigW, bufTrigM, bufBits, bufRoundoff,
+                                          bufCarryMax);
+}
+
+vector<PooledBuffer<i32>> Gpu::makeBufVector(u32 size) {
+  vector<PooledBuffer<i32>> r;
+  try {
+    for (u32 i = 0; i < size; ++i) { r.push_back(pool.lease<i32>("vector", N)); }
+  } catch (const bad_alloc&) {
+    log("Only %u of %u buffers fit in GPU memory\n", u32(r.size()), size);
+  }
   return r;
 }
 
-static FFTConfig getFFTConfig(u32 E, string fftSpec) {
+// FFT sizes up to this (2.5M) are "small" for the purpose of launch overhead, see Gpu::make().
+static constexpr u32 SMALL_FFT_SIZE = 5 * 512 * 1024;
+
+static FFTConfig getFFTConfig(const Args& args, u32 E, string fftSpec) {
   if (fftSpec.empty()) {
     vector<FFTConfig> configs = FFTConfig::genConfigs();
-    for (FFTConfig c : configs) { if (c.maxExp() >= E) { return c; } }
+    map<string, u32> crossovers = Tune::crossovers(args);
+    for (FFTConfig c : configs) { if (Tune::maxExp(crossovers, c) >= E) { return c; } }
     log("No FFT for exponent %u\n", E);
     throw "No FFT for exponent";
   }
   return FFTConfig::fromSpec(fftSpec);
 }
 
+// The FFT that getFFTConfig() would pick after the given one, for a test whose roundoff is too high; "" if none.
+static string nextFFTSpec(const Args& args, u32 E, const string& spec) {
+  u32 size = FFTConfig::fromSpec(spec).fftSize();
+  map<string, u32> crossovers = Tune::crossovers(args);
+  for (FFTConfig c : FFTConfig::genConfigs()) {
+    if (c.fftSize() > size && Tune::maxExp(crossovers, c) >= E) { return c.spec(); }
+  }
+  return "";
+}
+
 vector<int> Gpu::readSmall(Buffer<int>& buf, u32 start) {
   readResidue(bufSmallOut, buf, start);
   return bufSmallOut.read(128);
 }
 
-Words Gpu::fold(vector<Buffer<int>>& bufs) {
-  assert(!bufs.empty());
-
-  for (int retry = 0; retry < 2; ++retry) {
-    {
-      Buffer<double> A{queue, "A", N};
-      Buffer<double> B{queue, "B", N};
-      {
-        Buffer<int>& last = bufs.back();
-        fftP(buf3, last);
-        tW(B, buf3);
-        fftHin(A, B);
-      }
+Words Gpu::product(const vector<Buffer<int>*>& ins) {
+  assert(!ins.empty());
+  if (ins.size() == 1) { return readAndCompress(*ins.front()); }
 
-      u32 n = bufs.size();
-      for (int i = n - 2; i >= 0; --i) {
-        Buffer<int>& buf = bufs[i];
-        fftP(buf3, buf);
-        tW(buf2, buf3);
-        tailFusedMulLow(A, buf2, A);
-        tH(buf3, A);
-        doCarry(A, buf3);
-        tW(buf3, A);
-        fftHin(A, buf3);
-
-        if (i == 0) {
-          tailSquare(buf3, B);
-          tH(B, buf3);
-          doCarry(buf3, B);
-          tW(B, buf3);
-        }
-    
-        tailFusedMulLow(buf3, B, A);
-        tH(B, buf3);
-    
-        if (i == 0) {
-          fftW(buf3, B);          
-          break;
-        } else {
-          doCarry(buf3, B);
-          tW(B, buf3);
-        }
-      }
+  // The partial products with their level in the tree, as the digits of a binary counter: level l is the product of
+  // 2^l inputs. Each input is transformed once to the position of fftHin(), where the products stay.
+  auto transform = [&](Buffer<int>& in) {
+    PooledBuffer<double> x = pool.lease<double>("product", N);
+    fftP(buf2, in);
+    tW(buf3, buf2);
+    fftHin(x, buf3);
+    return x;
+  };
+
+  // The last input is kept out of the counter, thus the last multiply always has two operands.
+  vector<pair<u32, PooledBuffer<double>>> stack;
+  for (auto it = ins.begin(), end = std::prev(ins.end()); it != end; ++it) {
+    PooledBuffer<double> x = transform(**it);
+    u32 level = 0;
+    for (; !stack.empty() && stack.back().first == level; ++level) {
+      multiplyLowLow(x, stack.back().second, buf3);
+      stack.pop_back();
     }
-
-    Buffer<int> C{queue, "C", N};
-    carryA(C, buf3);
-    carryB(C);
-    Words folded = readAndCompress(C);
-    if (!folded.empty()) { return folded; }
-    log("P1 fold() error ZERO, will retry\n");
+    stack.emplace_back(level, std::move(x));
   }
-  return {};
+  while (stack.size() > 1) {
+    PooledBuffer<double> top = std::move(stack.back().second);
+    stack.pop_back();
+    multiplyLowLow(stack.back().second, top, buf3);
+  }
+
+  // The last multiply goes to the words instead of back to the position of fftHin().
+  PooledBuffer<double> a = transform(*ins.back());
+  tailMulLowLow(a, stack.front().second);
+  tH(buf3, a);
+  fftW(buf2, buf3);
+  PooledBuffer<int> out = pool.lease<int>("product", N);
+  carryA(out, buf2);
+  carryB(out);
+  return readAndCompress(out);
 }
 
-unique_ptr<Gpu> Gpu::make(u32 E, const Args &args) {
-  FFTConfig config = getFFTConfig(E, args.fftSpec);
+unique_ptr<Gpu> Gpu::make(u32 E, const Args &argsIn, u32 fftE) {
+  FFTConfig config = getFFTConfig(argsIn, fftE ? fftE : E, argsIn.fftSpec.empty() ? argsIn.fftUpSpec : argsIn.fftSpec);
+  Args args = argsIn;
+  Tune::apply(args, E, config);
+
   u32 WIDTH        = config.width;
   u32 SMALL_HEIGHT = config.height;
   u32 MIDDLE       = config.middle;
@@ -561,32 +840,132 @@ unique_ptr<Gpu> Gpu::make(u32 E, const Args &args) {
 
   // log("Expected maximum carry32: %X0000\n", config.getMaxCarry32(N, E));
 
+  cl_device_id device = getDevice(args.device);
+
+  // The fixed buffers and two double buffers of temporaries. A giant FFT may not fit the default -maxAlloc of
+  // 3GB, which is then raised up to 90% of the GPU memory (split between the workers).
+  double GB = 1024.0 * 1024 * 1024;
+  u64 needBytes = fixedBytes(N, E, trigCompute(args, device, N) == 0) + 2 * u64(N) * sizeof(double);
+  if (needBytes > AllocTrac::availableBytes()) {
+    u64 deviceBytes = getTotalMem(device) / 10 * 9 / std::max(args.workers, 1u);
+    u64 limitBytes = args.maxAlloc ? AllocTrac::getMaxAlloc() : deviceBytes;
+    if (args.maxAlloc || AllocTrac::totalAllocBytes() + needBytes > deviceBytes) {
+      log("FFT %s needs %.2f GB of GPU memory, over the limit of %.2f GB%s\n", config.spec().c_str(), needBytes / GB,
+          limitBytes / GB, args.maxAlloc ? " (-maxAlloc)" : "");
+      throw "not enough GPU memory";
+    }
+    AllocTrac::setMaxAlloc(deviceBytes);
+    log("GPU memory budget raised to %.2f GB (the FFT needs %.2f GB)\n", deviceBytes / GB, needBytes / GB);
+  }
+
+  if (hasUnifiedMemory(device)) { log("unified memory: the host buffers are mapped, not copied\n"); }
+
   bool useLongCarry = (bitsPerWord < 10.5f) || (args.carry == Args::CARRY_LONG);
 
   if (useLongCarry) { log("using long carry kernels\n"); }
 
   bool timeKernels = args.timeKernels;
 
-  return make_unique<Gpu>(args, E, WIDTH, SMALL_HEIGHT * MIDDLE, SMALL_HEIGHT, nW, nH,
-                          getDevice(args.device), timeKernels, useLongCarry);
+  // With small FFTs the kernels are short, and the GPU idles while the host enqueues a whole block of iterations
+  // before the first flush. Flushing often lets the GPU start early on the already enqueued iterations.
+  u32 flushStep = (N <= SMALL_FFT_SIZE) ? 8 : 0;
+  if (flushStep) { log("small FFT: flush every %u iterations\n", flushStep); }
+
+  auto memLease = make_unique<MemLease>(args.masterDir, u32(args.device), leaseBudget(device), MemLease::GPU, needBytes);
+  auto gpu = make_unique<Gpu>(args, E, WIDTH, SMALL_HEIGHT * MIDDLE, SMALL_HEIGHT, nW, nH,
+                              device, timeKernels, useLongCarry, flushStep);
+  gpu->memLease = std::move(memLease);
+  gpu->fftSpec = config.spec();
+  if (args.selfTest) { gpu->selfTest(); }
+  return gpu;
+}
+
+void Gpu::selfTest() {
+  {
+    std::unique_lock lock{liveMutex};
+    if (liveGpus[device] > 1) {
+      log("self-test skipped: another Gpu of the process is on this device\n");
+      return;
+    }
+  }
+  SelfTest::check(*this, args, device, E, fftSpec);
+}
+
+bool Gpu::canRetarget(u32 newE, const Args& argsIn) const {
+  if (newE == E) { return true; }
+  FFTConfig config = getFFTConfig(argsIn, newE, argsIn.fftSpec);
+  Args newArgs = argsIn;
+  Tune::apply(newArgs, newE, config);
+  bool newLongCarry = (newE / float(N) < 10.5f) || (newArgs.carry == Args::CARRY_LONG);
+  return config.spec() == fftSpec && newArgs.flags == args.flags && newLongCarry == useLongCarry
+    && compactSize(newE) <= bufCompact.size && exponentDefines(N, newE, MIDDLE) == exponentDefines(N, E, MIDDLE);
+}
+
+void Gpu::retarget(u32 newE) {
+  finish();
+  for (auto& f : stageBusy) { if (f.valid()) { f.wait(); } }
+
+  if (newE != E) {
+    E = newE;
+    Weights weights = genWeights(E, WIDTH, N / 2 / WIDTH, nW);
+    bufBits = ConstBuffer{context, "bits", weights.bitsCF};
+    bufBitsC = ConstBuffer{context, "bitsC", weights.bitsC};
+    bindBits();
+
+    // The trig tables in the program globals are kept.
+    vector<pair<double, double>> none(1);
+    writeGlobals(ConstBuffer{context, "dp1", none}, ConstBuffer{context, "dp2", none},
+                 ConstBuffer{context, "dp3", none}, ConstBuffer{context, "dp4", none},
+                 ConstBuffer{context, "w2", weights.threadWeightsIF},
+                 ConstBuffer{context, "w3", weights.carryWeightsIF},
+                 ConstBuffer{context, "w4", weights.stepWeightsIF},
+                 ConstBuffer{context, "w5", weights.unitWeightsIF},
+                 E / N, N - E % N, 0u);
+  }
+
+  // The state of the previous task, reset for the same exponent too.
+  replay.reset();
+  nearEnd = nullptr;
+  preemptWanted = nullptr;
+  preempt = nullptr;
+  stepsSinceFlush = 0;
+  bufReady.zero();
+  bufRoundoff.zero();
+  bufCarryMax.zero();
+  bufCarryMulMax.zero();
+  finish();
+  log("Gpu re-targeted to %u\n", E);
+}
+
+namespace {
+
+// The same sum as computed on the GPU by sum64(). Sets allZero.
+u64 sumWords(const vector<u32>& data, bool& allZero) {
+  u64 sum = 0;
+  allZero = true;
+  for (auto it = data.begin(), end = data.end(); it < end; it += 2) {
+    u64 v = *it | (u64(*(it + 1)) << 32);
+    sum += v;
+    allZero &= !v;
+  }
+  return sum;
+}
+
 }
 
 vector<u32> Gpu::readAndCompress(ConstBuffer<int>& buf)  {
+  Perf::Span span{queue->perf, "read"};
   for (int nRetry = 0; nRetry < 3; ++nRetry) {
-    sum64(bufSumOut, u32(buf.size * sizeof(int)), buf);
+    compact(bufCompact, buf);
+    sum64(bufSumOut, u32(compactSize(E) * sizeof(u32)), bufCompact);
     
     vector<u64> expectedVect(1);
     bufSumOut.readAsync(expectedVect);
-    vector<int> data = readOut(buf);
+    vector<u32> data = bufCompact.read(compactSize(E));
     u64 expectedSum = expectedVect[0];
     
-    u64 sum = 0;
     bool allZero = true;
-    for (auto it = data.begin(), end = data.end(); it < end; it += 2) {
-      u64 v = u32(*it) | (u64(*(it + 1)) << 32);
-      sum += v;
-      allZero &= !v;
-    }
+    u64 sum = sumWords(data, allZero);
 
     if (sum != expectedSum || (allZero && nRetry == 0)) {
       log("GPU -> Host read #%d failed (check %x vs %x)\n", nRetry, unsigned(sum), unsigned(expectedSum));
@@ -595,13 +974,54 @@ vector<u32> Gpu::readAndCompress(ConstBuffer<int>& buf)  {
         log("Read ZERO\n");
         return {};
       } else {
-        return compactBits(std::move(data),  E);
+        data.resize((E - 1) / 32 + 1);
+        return data;
       }
     }
   }
   throw "Persistent read errors: GPU->Host";
 }
 
+shared_future<Words> Gpu::readAndCompressAsync(ConstBuffer<int>& buf) {
+  u32 i = stageIdx;
+  stageIdx = (stageIdx + 1) % bufStages.size();
+  if (stageBusy[i].valid()) { stageBusy[i].wait(); }
+  HostAccessBuffer<u32>& stage = bufStages[i];
+
+  // The staging buffer keeps the snapshot of "buf" on the GPU, for re-reading on a transfer error.
+  compact(stage, buf);
+  sum64(bufSumOut, u32(compactSize(E) * sizeof(u32)), stage);
+
+  auto expected = make_shared<vector<u64>>(1);
+  bufSumOut.readAsync(*expected);
+  auto data = make_shared<vector<u32>>();
+  auto done = make_shared<EventHolder>(stage.readAsyncEvent(*data, compactSize(E)));
+  queue->flush();
+
+  stageBusy[i] = async(launch::async, [&stage, expected, data, done, E = E, q = queue]() -> Words {
+    waitForEvent(done->get());
+    stage.endRead(*data);
+    Perf::Span span{q->perf, "compact"};
+    u64 expectedSum = (*expected)[0];
+    for (int nRetry = 0; nRetry < 3; ++nRetry) {
+      bool allZero = true;
+      u64 sum = sumWords(*data, allZero);
+      if (sum == expectedSum && (!allZero || nRetry > 0)) {
+        if (allZero) {
+          log("Read ZERO\n");
+          return {};
+        }
+        data->resize((E - 1) / 32 + 1);
+        return std::move(*data);
+      }
+      log("GPU -> Host read #%d failed (check %x vs %x)\n", nRetry, unsigned(sum), unsigned(expectedSum));
+      *data = stage.read(compactSize(E));
+    }
+    throw "Persistent read errors: GPU->Host";
+  }).share();
+  return stageBusy[i];
+}
+
 vector<u32> Gpu::readCheck() { return readAndCompress(bufCheck); }
 vector<u32> Gpu::readData() { return readAndCompress(bufData); }
 
@@ -681,6 +1101,9 @@ bool Gpu::doCheck(u32 blockSize, Buffer<double>& buf1, Buffer<double>& buf2, Buf
 }
 
 void Gpu::logTimeKernels() {
+  if (!args.perfFile.empty()) { queue->perf.write(args.perfFile, E, N); }
+  if (Trace::enabled()) { Trace::write(); }
+
   if (timeKernels) {
     Queue::Profile profile = queue->getProfile();
     queue->clearProfile();
@@ -722,7 +1145,17 @@ vector<int> Gpu::readOut(ConstBuffer<int> &buf) {
   return bufAux.read();
 }
 
-void Gpu::writeIn(Buffer<int>& buf, const vector<u32>& words) { writeIn(buf, expandBits(words, N, E)); }
+void Gpu::compact(Buffer<u32>& out, ConstBuffer<int>& in) {
+  compactSign(bufCompactSign, in);
+  compactCarry(bufCompactCarry, bufCompactSign);
+  compactWords(out, in, bufCompactCarry, E);
+}
+
+void Gpu::writeIn(Buffer<int>& buf, const vector<u32>& words) {
+  assert(words.size() == (E - 1) / 32 + 1);
+  bufCompact.write(words);
+  expandWords(buf, bufCompact, E);
+}
 
 void Gpu::writeIn(Buffer<int>& buf, const vector<i32>& words) {
   bufAux.write(words);
@@ -777,6 +1210,244 @@ Words Gpu::expExp2(const Words& A, u32 n) {
   return readData();
 }
 
+pair<Words, u32> Gpu::certify(const Args& args, const Words& A, u32 n) {
+  u32 blockSize = args.blockSize;
+  assert(blockSize > 0 && 10000 % blockSize == 0);
+  CheckPolicy checkPolicy{".", args.uid.empty() ? getLongInfo(device) : args.uid};
+  Signal signal;
+  u32 nErrors = 0;
+  u32 nSeqErrors = 0;
+
+  // The check is the product of the residues at the multiples of blockSize; with the base A kept in bufBase, the check
+  // C' = C * x(k + blockSize) of a block is verified as C^(2^blockSize) * A. The state of the last OK check is kept on
+  // the host, thus an error rolls back to it.
+  writeIn(bufBase, A);
+  Words data = A, check = A;
+  u32 k = 0;
+  u32 nFull = n / blockSize * blockSize;
+  IterationTimer timer{0};
+  writeData(data);
+  writeCheck(check);
+
+  while (k < nFull) {
+    u32 checkStep = checkPolicy.checkStep(blockSize, nErrors, 0);
+    u32 end = std::min(nFull, k + checkStep);
+    u32 i = k;
+    for (; i + blockSize < end; i += blockSize) {
+      modSqLoop(bufData, 0, blockSize);
+      mul(bufCheck, bufData);
+    }
+    modSqLoop(bufData, 0, blockSize);
+    bufAux << bufCheck;
+    modSqLoop(bufAux, 0, blockSize);
+    mul(bufAux, bufBase);
+    mul(bufCheck, bufData);
+    bool ok = equalNotZero(bufCheck, bufAux);
+    float secsPerIt = timer.reset(end);
+
+    if (ok) {
+      checkPolicy.ok(end - k);
+      k = end;
+      nSeqErrors = 0;
+      data = readData();
+      check = readCheck();
+      log("OK %9u / %u %016" PRIx64 " %4.0f us/it\n", k, n, res64(data), secsPerIt * 1'000'000);
+    } else {
+      checkPolicy.error();
+      ++nErrors;
+      log("EE %9u / %u, rollback to %u\n", end, n, k);
+      if (++nSeqErrors > 2) { throw "sequential errors"; }
+      writeData(data);
+      writeCheck(check);
+    }
+    if (signal.stopRequested()) {
+      log("Stopping, the certification starts over on the next run\n");
+      return {{}, nErrors};
+    }
+  }
+
+  // The last iterations, short of a block, are run twice.
+  if (n > nFull) {
+    while (true) {
+      writeData(data);
+      modSqLoop(bufData, 0, n - nFull);
+      Words first = readData();
+      writeData(data);
+      modSqLoop(bufData, 0, n - nFull);
+      Words second = readData();
+      if (first == second) {
+        data = std::move(first);
+        break;
+      }
+      ++nErrors;
+      log("EE %9u / %u, mismatch of the last %u iterations\n", n, n, n - nFull);
+      if (++nSeqErrors > 2) { throw "sequential errors"; }
+    }
+  }
+  return {data, nErrors};
+}
+
+void Gpu::productCheck() {
+  u32 nWords = (E - 1) / 32 + 1;
+  std::mt19937 rng{E};
+  vector<Words> words(3, Words(nWords));
+  vector<PooledBuffer<int>> bufs;
+  for (Words& w : words) {
+    for (u32& x : w) { x = rng(); }
+    if (E % 32) { w.back() &= (1u << (E % 32)) - 1; }
+    bufs.push_back(pool.lease<int>("productCheck", N));
+    writeIn(bufs.back(), w);
+  }
+
+  Ntt ntt{E};
+  Words expected = words[0];
+  for (u32 k = 2; k <= 3; ++k) {
+    expected = ntt.mul(expected, words[k - 1]);
+    vector<Buffer<int>*> ins;
+    for (u32 i = 0; i < k; ++i) { ins.push_back(&bufs[i]); }
+    Words prod = product(ins);
+    bool ok = prod == expected;
+    log("%s product check of %u residues: %016" PRIx64 " vs. %016" PRIx64 "\n",
+        ok ? "OK" : "EE", k, res64(prod), res64(expected));
+    if (!ok) { throw "product check failed"; }
+  }
+}
+
+void Gpu::nttCheck(u32 n) {
+  Words A = readData();
+  Timer timer;
+  u64 expected = res64(Ntt{E}.expExp2(A, n));
+  double secsHost = timer.reset();
+  u64 res = res64(expExp2(A, n));
+  bool ok = res == expected;
+  log("%s NTT check of %u squarings: %016" PRIx64 " vs. %016" PRIx64 " (host %.1fs, GPU %.1fs)\n",
+      ok ? "OK" : "EE", n, res, expected, secsHost, timer.at());
+  if (!ok) { throw "NTT check failed"; }
+}
+
+pair<double, RoundoffStats> Gpu::timeSquarings(u32 nIters, bool sample) {
+  const u32 blockSize = 400;
+  
+  writeData(makeWords(E, 3));
+
+  // The warm-up makes the value cover all the words, as the roundoff of the initial small values is not meaningful.
+  modSqLoop(bufData, 0, 1000);
+  finish();
+  readRoundoff(E);
+
+  Timer timer;
+  for (u32 k = 0; k < nIters; k += blockSize) {
+    u32 end = std::min(nIters, k + blockSize);
+    if (sample) {
+      // As in the PRP loop, the roundoff of one iteration per block, see -fftUp.
+      bool leadIn = true;
+      for (u32 i = k; i < end; ++i) {
+        bool leadOut = useLongCarry || (i == end - 1);
+        coreStep(bufData, bufData, leadIn, leadOut, false, !leadIn && !leadOut && i == k + 1);
+        leadIn = leadOut;
+      }
+    } else {
+      modSqLoop(bufData, k, end);
+    }
+    queue->finish();
+  }
+  double secsPerIt = timer.at() / nIters;
+  return {secsPerIt, readRoundoff(E)};
+}
+
+double Gpu::timeP2Muls(u32 nMuls) {
+  writeData(makeWords(E, 3));
+  modSqLoop(bufData, 0, 1000);
+
+  // The P2 inner step, as in pm1Stage2(): carry the accumulator, then multiply it by (giant - baby).
+  PooledBuffer<double> bufGiant = pool.lease<double>("P2time", N);
+  PooledBuffer<double> bufBaby = pool.lease<double>("P2time", N);
+  PooledBuffer<double> bufAcc = pool.lease<double>("P2time", N);
+  fftP(buf2, bufData);
+  tW(buf3, buf2);
+  fftHin(bufGiant, buf3);
+  bufBaby << bufGiant;
+  tailSquare(buf2, buf3);
+  tH(bufAcc, buf2);
+  finish();
+
+  Timer timer;
+  for (u32 i = 0; i < nMuls; ++i) {
+    doCarry(buf2, bufAcc);
+    tW(buf1, buf2);
+    tailMulDelta(buf2, buf1, bufGiant, bufBaby);
+    tH(bufAcc, buf2);
+  }
+  finish();
+  return timer.at() / nMuls;
+}
+
+vector<BenchTimes> Gpu::benchKernels(u32 nSamples, u32 batch) {
+  assert(timeKernels && nSamples && batch);
+
+  Words words((E - 1) / 32 + 1);
+  std::mt19937 rng{E};
+  for (u32& w : words) { w = rng(); }
+  if (E % 32) { words.back() &= (1u << (E % 32)) - 1; }
+  writeData(words);
+  // The warm-up also balances the words through the carry.
+  modSqLoop(bufData, 0, 100);
+
+  // The kernel inputs, as within an iteration: buf1 after tW(), buf2 after the tail, buf3 after tH().
+  PooledBuffer<double> bufA = pool.lease<double>("benchA", N);
+  PooledBuffer<double> bufB = pool.lease<double>("benchB", N);
+  PooledBuffer<int> bufC = pool.lease<int>("benchC", N);
+  fftP(buf2, bufData);
+  tW(buf1, buf2);
+  tailSquare(buf2, buf1);
+  tH(buf3, buf2);
+  fftW(bufB, buf3);
+  finish();
+  queue->clearProfile();
+
+  vector<pair<Kernel*, function<void()>>> kernels{
+    {&fftP, [&]() { fftP(bufA, bufData); }},
+    {&fftMiddleIn, [&]() { fftMiddleIn(bufA, buf2); }},
+    {&tailFusedSquare, [&]() { tailFusedSquare(bufA, buf1); }},
+    {&fftMiddleOut, [&]() { fftMiddleOut(bufA, buf2); }},
+    {&fftW, [&]() { fftW(bufA, buf3); }},
+    {&carryA, [&]() { carryA(bufC, bufB); }},
+    {&carryB, [&]() { carryB(bufC); }},
+    {&transposeOut, [&]() { transposeOut(bufAux, bufData); }},
+    {&transposeIn, [&]() { transposeIn(bufC, bufAux); }},
+  };
+  if (!useLongCarry) { kernels.push_back({&carryFused, [&]() { carryFused(bufA, buf3); }}); }
+
+  vector<BenchTimes> times;
+  for (auto& [kernel, run] : kernels) {
+    BenchTimes t{kernel->getName(), {}, kernel->getBytes()};
+    for (u32 i = 0; i < nSamples; ++i) {
+      for (u32 j = 0; j < batch; ++j) { run(); }
+      finish();
+      for (auto& [info, name] : queue->getProfile()) {
+        if (name == t.name) { t.secs.push_back(info.total / info.n); }
+      }
+      queue->clearProfile();
+    }
+    times.push_back(std::move(t));
+  }
+
+  u64 stepBytes = useLongCarry
+    ? fftW.getBytes() + carryA.getBytes() + carryB.getBytes() + fftP.getBytes()
+    : carryFused.getBytes();
+  stepBytes += fftMiddleIn.getBytes() + tailFusedSquare.getBytes() + fftMiddleOut.getBytes();
+  BenchTimes step{"coreStep", {}, stepBytes};
+  for (u32 i = 0; i < nSamples; ++i) {
+    Timer timer;
+    modSqLoop(bufData, 0, batch);
+    finish();
+    step.secs.push_back(timer.at() / batch);
+  }
+  queue->clearProfile();
+  times.push_back(std::move(step));
+  return times;
+}
+
 // A:= A^h * B
 void Gpu::expMul(Buffer<i32>& A, u64 h, Buffer<i32>& B) {
   exponentiate(A, h, buf1, buf2, buf3);
@@ -834,10 +1505,96 @@ namespace {
 bool testBit(u64 x, int bit) { return x & (u64(1) << bit); }
 }
 
+// Sliding window exponentiation, with windows of up to 3 bits: the odd powers base^3, base^5, base^7 are precomputed
+// in "low" position. For a 64-bit exponent this is about 20 multiplications instead of 32.
+// Returns false if there is no GPU memory for the powers.
+bool Gpu::exponentiateWindow(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp) {
+  vector<PooledBuffer<double>> pows; // base^2, base^3, base^5, base^7
+  try {
+    for (int i = 0; i < 4; ++i) { pows.push_back(pool.lease<double>("pow", N)); }
+  } catch (const bad_alloc&) {
+    return false;
+  }
+  auto odd = [&](u32 v) -> const Buffer<double>& { return v == 1 ? base : pows[v / 2]; };
+  
+  auto toLow = [&](Buffer<double>& low) {
+    doCarry(tmp, out);
+    tW(out, tmp);
+    fftHin(low, out);
+  };
+  
+  // "out" is in tW position on entry.
+  auto mulLow = [&](const Buffer<double>& low) {
+    tailFusedMulLow(tmp, out, low);
+    tH(out, tmp);
+  };
+
+  tailSquareLow(tmp, base);
+  tH(out, tmp);
+  toLow(pows[0]);
+  for (u32 v = 3; v <= 7; v += 2) {
+    mulLow(v == 3 ? base : pows[0]);
+    toLow(pows[v / 2]);
+  }
+
+  auto square = [&]() {
+    doCarry(tmp, out);
+    tW(out, tmp);
+    tailSquare(tmp, out);
+    tH(out, tmp);
+  };
+
+  auto mul = [&](const Buffer<double>& low) {
+    doCarry(tmp, out);
+    tW(out, tmp);
+    mulLow(low);
+  };
+
+  // The window [q, l] of up to 3 bits whose lowest bit l is set.
+  auto window = [exp](int q) {
+    int l = max(q - 2, 0);
+    while (!testBit(exp, l)) { ++l; }
+    return pair{l, u32(exp >> l) & ((1u << (q - l + 1)) - 1)};
+  };
+
+  int q = 63;
+  while (!testBit(exp, q)) { --q; }
+  auto [l, v] = window(q);
+  
+  if (v == 1) {
+    // a lone top bit is followed by a zero bit, and base^2 is that prefix.
+    assert(l > 0);
+    tailSquareLow(tmp, base);
+    tH(out, tmp);
+    q = l - 2;
+  } else {
+    tmp << odd(v - 2);
+    tailMulLowLow(tmp, pows[0]);
+    tH(out, tmp);
+    q = l - 1;
+  }
+
+  while (q >= 0) {
+    if (!testBit(exp, q)) {
+      square();
+      --q;
+    } else {
+      auto [l, v] = window(q);
+      for (int i = q; i >= l; --i) { square(); }
+      mul(odd(v));
+      q = l - 1;
+    }
+  }
+  return true;
+}
+
 // See "left-to-right binary exponentiation" on wikipedia
 void Gpu::exponentiateCore(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp) {
   assert(exp >= 2);
 
+  // The precomputation pays off only for longer exponents, such as the 64-bit hashes of the proofs.
+  if ((exp >> 16) && exponentiateWindow(out, base, exp, tmp)) { return; }
+
   tailSquareLow(tmp, base);
   tH(out, tmp);
   
@@ -873,7 +1630,22 @@ void Gpu::doCarry(Buffer<double>& out, Buffer<double>& in) {
   }
 }
 
-void Gpu::coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3) {
+void Gpu::coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3, bool sample) {
+  assert(leadOut || !useLongCarry);
+  assert(!sample || (!leadIn && !leadOut && !mul3));
+  if (&out == &bufData && &in == &bufData) {
+    stepPlan->run(leadIn, leadOut, mul3, sample);
+  } else {
+    coreStepUnplanned(out, in, leadIn, leadOut, mul3);
+  }
+
+  if (flushStep && ++stepsSinceFlush >= flushStep) {
+    queue->flush();
+    stepsSinceFlush = 0;
+  }
+}
+
+void Gpu::coreStepUnplanned(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3) {
   if (leadIn) {
     fftP(buf2, in);
     tW(buf1, buf2);    
@@ -894,6 +1666,27 @@ void Gpu::coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut,
   }
 }
 
+void Gpu::replayIters(u32 nIters) {
+  if (!replay || replay->nIters != nIters) {
+    replay.reset(new Replay{nIters, {}, {}});
+    const vector<Kernel*>& step = stepPlan->steps[StepPlan::index(false, false, false)];
+    for (u32 i = 0; i < nIters; ++i) { replay->launches.insert(replay->launches.end(), step.begin(), step.end()); }
+
+    // The command buffer launches are not profiled, thus not used with -time or -perf.
+    if (!queue->profiling()) {
+      if (CommandBufferHolder commands = makeCommandBuffer(device, queue->get())) {
+        bool ok = std::all_of(replay->launches.begin(), replay->launches.end(), [&](Kernel* k) { return k->record(commands.get()); });
+        if (ok && finalizeCommandBuffer(commands.get())) { replay->commands = std::move(commands); }
+      }
+    }
+    log("Replay of %u iterations %s\n", nIters, replay->commands ? "from a command buffer" : "from a launch list");
+  }
+
+  replay->run(*queue);
+  queue->flush();
+  stepsSinceFlush = 0;
+}
+
 u32 Gpu::modSqLoop(Buffer<int>& io, u32 from, u32 to) {
   assert(from <= to);
   bool leadIn = true;
@@ -917,11 +1710,16 @@ u32 Gpu::modSqLoopMul3(Buffer<int>& out, Buffer<int>& in, u32 from, u32 to) {
 }
 
 bool Gpu::equalNotZero(Buffer<int>& buf1, Buffer<int>& buf2) {
-  bufSmallOut.zero(1);
-  u32 sizeBytes = N * sizeof(int);
-  isNotZero(bufSmallOut, sizeBytes, buf1);
-  isEqual(bufSmallOut, sizeBytes, buf1, buf2);
-  return bufSmallOut.read(1)[0];
+  vector<u32> out;
+  equalNotZeroAsync(buf1, buf2, out);
+  finish();
+  return isEqualNotZero(out);
+}
+
+void Gpu::equalNotZeroAsync(Buffer<int>& buf1, Buffer<int>& buf2, vector<u32>& out) {
+  bufCheckOut.zero();
+  checkReduce(bufCheckOut, u32(N * sizeof(int)), buf1, buf2);
+  bufCheckOut.readAsync(out);
 }
   
 u64 Gpu::bufResidue(Buffer<int> &buf) {
@@ -958,11 +1756,10 @@ static string makeLogStr(const string& status, u32 k, u64 res, float secsPerIt,
   return buf;
 }
 
-static void doBigLog(u32 E, u32 k, u64 res, bool checkOK, float secsPerIt, float secsCheck, float secsSave, u32 nIters, u32 nErrors) {
-  char buf[64] = {0};
-  
+static void doBigLog(u32 E, u32 k, u64 res, bool checkOK, float secsPerIt, float secsCheck, float secsSave, u32 nIters, u32 nErrors,
+                     const string& powerStr) {
   log("%s%s%s\n", makeLogStr(checkOK ? "OK" : "EE", k, res, secsPerIt, secsCheck, secsSave, nIters).c_str(),
-      (nErrors ? " "s + to_string(nErrors) + " errors"s : ""s).c_str(), buf);
+      (nErrors ? " "s + to_string(nErrors) + " errors"s : ""s).c_str(), powerStr.c_str());
 }
 
 bool Gpu::equals9(const Words& a) {
@@ -971,45 +1768,36 @@ bool Gpu::equals9(const Words& a) {
   return true;
 }
 
-static u32 mod3(const std::vector<u32> &words) {
+// The residue x is modulo M = 2^E - 1: divides by 9 in a single pass, as (x + R*M) / 9 with the R in [0, 9) that makes
+// the division exact. R is added at the top, i.e. R*2^E = R*M + R, which does not change the floor of the quotient.
+void Gpu::doDiv9(u32 E, Words& words) {
+  u32 topBits = E % 32;
+  assert(topBits > 0 && topBits < 32);
+
+  // x mod 9, from 2^32 == 4 (mod 9) thus a period of 3 words.
+  u64 sum[3]{};
+  for (u32 i = 0, j = 0, n = words.size(); i < n; ++i, j = (j == 2) ? 0 : j + 1) { sum[j] += words[i]; }
+  u32 x = (sum[0] % 9 + 4 * (sum[1] % 9) + 7 * (sum[2] % 9)) % 9;
+
+  // M mod 9, from 2^6 == 1 (mod 9).
+  u32 m = (1u << (E % 6)) % 9 + 8;
   u32 r = 0;
-  // uses the fact that 2**32 % 3 == 1.
-  for (u32 w : words) { r += w % 3; }
-  return r % 3;
-}
+  while ((x + r * m) % 9) { ++r; }
+  assert(r < 9);
 
-static void doDiv3(u32 E, Words& words) {
-  u32 r = (3 - mod3(words)) % 3;
-  assert(r < 3);
-  int topBits = E % 32;
-  assert(topBits > 0 && topBits < 32);
   {
     u64 w = (u64(r) << topBits) + words.back();
-    words.back() = w / 3;
-    r = w % 3;
+    words.back() = w / 9;
+    r = w % 9;
   }
   for (auto it = words.rbegin() + 1, end = words.rend(); it != end; ++it) {
     u64 w = (u64(r) << 32) + *it;
-    *it = w / 3;
-    r = w % 3;
+    *it = w / 9;
+    r = w % 9;
   }
 }
 
-void Gpu::doDiv9(u32 E, Words& words) {
-  doDiv3(E, words);
-  doDiv3(E, words);
-}
-
 namespace {
-u32 checkStepForErrors(u32 argsCheckStep, u32 nErrors) {
-  if (argsCheckStep) { return argsCheckStep; }  
-  switch (nErrors) {
-    case 0:  return 200'000;
-    case 1:  return 100'000;
-    default: return  50'000;
-  }
-}
-
 template<typename To, typename From> To pun(From x) {
   static_assert(sizeof(To) == sizeof(From));
   union {
@@ -1022,27 +1810,27 @@ template<typename To, typename From> To pun(From x) {
 
 template<typename T> float asFloat(T x) { return pun<float>(x); }
 
+// The probability of a roundoff error in the E iterations of a test, with the per-iteration max roundoff of
+// the given mean and SD. See Gumbel distribution https://en.wikipedia.org/wiki/Gumbel_distribution
+double roundoffPErr(u32 E, double mean, double sdev) {
+  double gamma = 0.577215665; // Euler-Mascheroni
+  double z = (0.5 - mean) / sdev;
+  return -expm1(-exp(-z * (M_PI / sqrt(6))) * (E * exp(-gamma)));
+}
+
 }
 
-void Gpu::printRoundoff(u32 E) {
+RoundoffStats Gpu::readRoundoff(u32 E) {
   u32 roundN = bufRoundoff.read(1)[0];
   // fprintf(stderr, "roundN %u\n", roundN);
 
-  vector<u32> carry;
-  vector<u32> carryMul;
-  bufCarryMax.readAsync(carry, 4);
-  bufCarryMulMax.readAsync(carryMul, 4);
-  
   vector<u32> roundVect;
   bufRoundoff.readAsync(roundVect, roundN, 8);
-    
+
   vector<u32> zero{0, 0, 0, 0};
   bufRoundoff.write(zero);
-  bufCarryMax.write(zero);
-  bufCarryMulMax.write(zero);
 
-  if (!roundN) { return; }
-  if (roundN < 2000) { return; }
+  if (!roundN) { return {}; }
   
 #if DUMP_STATS
   {
@@ -1065,15 +1853,39 @@ void Gpu::printRoundoff(u32 E) {
   
   variance /= roundN;
   double sdev = sqrt(variance);
+  return {roundN, avg, sdev, m, roundoffPErr(E, avg, sdev)};
+}
+
+RoundoffStats RoundoffStats::merge(u32 E, const RoundoffStats& a, const RoundoffStats& b) {
+  if (!a.n || !b.n) { return a.n ? a : b; }
+  u32 n = a.n + b.n;
+  double mean = (a.n * a.mean + b.n * b.mean) / n;
+  double sq = (a.n * (a.sdev * a.sdev + a.mean * a.mean) + b.n * (b.sdev * b.sdev + b.mean * b.mean)) / n;
+  double sdev = sqrt(std::max(sq - mean * mean, 0.0));
+  return {n, mean, sdev, std::max(a.max, b.max), roundoffPErr(E, mean, sdev)};
+}
+
+u32 Gpu::readCarryMax() {
+  u32 carryMax = bufCarryMax.read(4)[2];
+  bufCarryMax.write(vector<u32>{0, 0, 0, 0});
+  return carryMax;
+}
+
+RoundoffStats Gpu::printRoundoff(u32 E) {
+  vector<u32> carry;
+  vector<u32> carryMul;
+  bufCarryMax.readAsync(carry, 4);
+  bufCarryMulMax.readAsync(carryMul, 4);
   
-  double gamma = 0.577215665; // Euler-Mascheroni
-  double z = (0.5 - avg) / sdev;
+  vector<u32> zero{0, 0, 0, 0};
+  bufCarryMax.write(zero);
+  bufCarryMulMax.write(zero);
 
-  // See Gumbel distribution https://en.wikipedia.org/wiki/Gumbel_distribution
-  double p = -expm1(-exp(-z * (M_PI / sqrt(6))) * (E * exp(-gamma))); 
+  RoundoffStats r = readRoundoff(E);
+  if (r.n < 2000) { return {}; }
   
   log("Roundoff: N=%u, mean %f, SD %f, CV %f, max %f, z %.1f (pErr %f%%)\n",
-      roundN, avg, sdev, sdev / avg, m, z, p * 100);
+      r.n, r.mean, r.sdev, r.sdev / r.mean, r.max, (0.5 - r.mean) / r.sdev, r.pErr * 100);
 
   // #if 0
   u32 carryN = carry[3];
@@ -1087,6 +1899,7 @@ void Gpu::printRoundoff(u32 E) {
   log("Carry: N=%u, max %x, avg %x; CarryM: N=%u, max %x, avg %x\n",
       carryN, carryMax, carryAvg, carryMulN, carryMulMax, carryMulAvg);
   // #endif
+  return r;
 }
 
 void Gpu::accumulate(Buffer<int>& acc, Buffer<double>& data, Buffer<double>& tmp1, Buffer<double>& tmp2) {
@@ -1125,15 +1938,15 @@ void Gpu::multiplyLowLow(Buffer<double>& io, const Buffer<double>& in, Buffer<do
 struct SquaringSet {  
   std::string name;
   u32 N;
-  Buffer<double> A, B, C;
+  PooledBuffer<double> A, B, C;
   Gpu& gpu;
 
   SquaringSet(Gpu& gpu, u32 N, string_view name)
     : name(name)
     , N(N)
-    , A{gpu.queue, this->name + ":A", N}
-    , B{gpu.queue, this->name + ":B", N}
-    , C{gpu.queue, this->name + ":C", N}
+    , A{gpu.pool, this->name + ":A", N}
+    , B{gpu.pool, this->name + ":B", N}
+    , C{gpu.pool, this->name + ":C", N}
     , gpu(gpu)
   {}
    
@@ -1186,24 +1999,28 @@ template<typename Future> bool wait(const Future& f) {
 
 // ----
 
-fs::path Gpu::saveProof(const Args& args, const ProofSet& proofSet) {
-  Memlock memlock{args.masterDir, u32(args.device)};
+pair<fs::path, ProofInfo> Gpu::saveProof(const Args& args, const ProofSet& proofSet) {
+  // The proof builder leases the "power" buffers of makeBufVector().
+  MemLease memLease{args.masterDir, u32(args.device), leaseBudget(device), MemLease::PHASE,
+                    u64(proofSet.power) * N * sizeof(i32)};
   
   for (int retry = 0; retry < 2; ++retry) {
     Proof proof = proofSet.computeProof(this);
     fs::path tmpFile = proof.file(args.proofToVerifyDir);
-    proof.save(tmpFile);
+    ProofInfo info = proof.save(tmpFile);
             
     fs::path proofFile = proof.file(args.proofResultDir);            
     bool doVerify = proofSet.power >= args.proofVerify;
     bool ok = !doVerify || Proof::load(tmpFile).verify(this);
     if (doVerify) { log("Proof '%s' verification %s\n", tmpFile.string().c_str(), ok ? "OK" : "FAILED"); }
+    // The proof buffers are released with the end of memLease.
+    pool.trim();
     if (ok) {
       error_code noThrow;
       fs::remove(proofFile, noThrow);
       fs::rename(tmpFile, proofFile);
       log("Proof '%s' generated\n", proofFile.string().c_str());
-      return proofFile;
+      return {proofFile, info};
     }
   }
   throw "bad proof generation";
@@ -1251,6 +2068,64 @@ vector<bool> takeTopBits(vector<bool>& v, u32 n) {
   return ret;
 }
 
+namespace {
+
+// E, B1, block-size, nBits
+constexpr const char* BITS_v1 = "OWL BITS 1 %u %u %u %u\n";
+
+// The P-1 tasks in memory at once are few (one per worker), thus so are the cached bits.
+constexpr u32 MAX_CACHED_BITS = 4;
+
+// The stage 1 exponent bits, computed once per (E, B1, blockSize) and cached in memory and in the exponent's directory,
+// thus a retry or a restart does not recompute them.
+vector<bool> powerSmoothCached(u32 E, u32 B1, u32 blockSize) {
+  static std::mutex mut;
+  static map<tuple<u32, u32, u32>, vector<bool>> cache;
+
+  std::unique_lock lock{mut};
+  auto key = make_tuple(E, B1, blockSize);
+  if (auto it = cache.find(key); it != cache.end()) { return it->second; }
+
+  fs::path path = fs::current_path() / to_string(E)
+    / (to_string(E) + "-" + to_string(B1) + "-" + to_string(blockSize) + ".bits");
+  vector<bool> bits;
+  if (File fi = File::openRead(path)) {
+    u32 fileE = 0, fileB1 = 0, fileBlockSize = 0, nBits = 0;
+    try {
+      if (sscanf(fi.readLine().c_str(), BITS_v1, &fileE, &fileB1, &fileBlockSize, &nBits) == 4
+          && fileE == E && fileB1 == B1 && fileBlockSize == blockSize) {
+        Words words = fi.readChecked<u32>((nBits - 1) / 32 + 1);
+        bits.resize(nBits);
+        for (u32 i = 0; i < nBits; ++i) { bits[i] = (words[i / 32] >> (i % 32)) & 1; }
+      }
+    } catch (const char*) {
+      bits.clear();
+    }
+  }
+
+  if (bits.empty()) {
+    bits = powerSmoothLE(E, B1, blockSize);
+    u32 nBits = bits.size();
+    Words words((nBits - 1) / 32 + 1);
+    for (u32 i = 0; i < nBits; ++i) { words[i / 32] |= u32(bits[i]) << (i % 32); }
+    fs::create_directories(path.parent_path());
+    {
+      File fo = File::openWrite(path + ".new");
+      fo.printf(BITS_v1, E, B1, blockSize, nBits);
+      fo.writeChecked(words);
+    }
+    fs::rename(path + ".new", path);
+  }
+  // The other exponents go first, as the retries are of the same exponent.
+  while (cache.size() >= MAX_CACHED_BITS) {
+    auto it = std::find_if(cache.begin(), cache.end(), [E](const auto& e) { return get<0>(e.first) != E; });
+    cache.erase(it == cache.end() ? cache.begin() : it);
+  }
+  return cache[key] = bits;
+}
+
+}
+
 void Gpu::pm1Block(vector<bool> bitsLE, bool update) {
   if (update) {
     modMul(bufCheck, bufCheck, bufData, buf1, buf2, buf3);
@@ -1303,7 +2178,7 @@ static void pm1Log(u32 B1, u32 k, u32 nBits, string strOK, u64 res64, float secs
   log("%5.2f%% %1s %016" PRIx64 " %4.0f%s\n", percent, strOK.c_str(), res64, us, err.c_str());
 }
 
-bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
+bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr, u32& usedB1) {
   enum RetCode { DONE=false, RETRY=true};
   const u32 blockSize = 200; // fixed for now
 
@@ -1319,13 +2194,14 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
 
   if (B1 != desiredB1) { log("using B1=%u (from savefile) vs. B1=%u\n", B1, desiredB1); }
   assert(B1);
+  usedB1 = B1;
 
   if (k == 0) {
     assert(data.empty());
     data = makeWords(E, 1);
   }
 
-  auto powerBits = powerSmoothLE(E, B1, blockSize);
+  auto powerBits = powerSmoothCached(E, B1, blockSize);
   const u32 nBits = powerBits.size();
 
   assert(nBits % blockSize == 0);
@@ -1346,6 +2222,11 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
   bool updateCheck = false;
   optional<P1State> pendingSave;
 
+  // The data is 3^s, with s the bits done so far, whose Jacobi symbol is (-1)^s. The symbol is computed in the
+  // background, and the data is saved once it matches.
+  future<bool> jacobiOK;
+  bool lastBit = false;
+
   u32 lastTimerK = k;
   // u32 newTimerK = timerK;
   u32 startK = k;
@@ -1355,6 +2236,9 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
 
   Timer timer;
 
+  // As in the PRP loop, the host stays -inflight blocks ahead of the GPU between the checks and logs.
+  const u32 inFlight = queue->profiling() ? 0 : args.inFlight;
+
   bool getOut = false;
   while (true) {
     if (powerBits.empty()) { getOut = true; }
@@ -1362,6 +2246,7 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
     if (!getOut) {
       auto bits = takeTopBits(powerBits, blockSize);
       sumLE = addLE(sumLE, bits);
+      lastBit = bits.front();
 
       pm1Block(bits, updateCheck); // here's GPU work
       updateCheck = true;
@@ -1380,7 +2265,11 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
       lastTimerK = k;
     }
 
-    if (pendingSave) {
+    if (pendingSave && (getOut || finished(jacobiOK))) {
+      if (!jacobiOK.get()) {
+        log("Jacobi check failed at %u\n", pendingSave->k);
+        return RETRY;
+      }
       bool isDone = pendingSave->k >= nBits;
       saver.saveP1(*pendingSave, isDone);
       pendingSave.reset();
@@ -1411,7 +2300,16 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
       checkSecs = checkTimer.at();
 
       if (maybeOK && *maybeOK) {
-        assert(!pendingSave);
+        // A previous save still waiting on its Jacobi symbol is waited for, and written as it is verified then.
+        if (pendingSave) {
+          if (!jacobiOK.get()) {
+            log("Jacobi check failed at %u\n", pendingSave->k);
+            return RETRY;
+          }
+          saver.saveP1(*pendingSave, pendingSave->k >= nBits);
+          pendingSave.reset();
+        }
+        jacobiOK = async(launch::async, [E = E, data, odd = lastBit]() { return jacobi(E, data) == (odd ? -1 : 1); });
         pendingSave = P1State{.B1=B1, .k=k, .data=data};
       }
 
@@ -1424,6 +2322,9 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
       if (doLog) {
         logRes = dataResidue(); // implies finish();
         checkSecs = 0;
+      } else if (inFlight) {
+        queue->mark();
+        queue->waitMarks(inFlight);
       } else {
         finish();
       }
@@ -1436,11 +2337,371 @@ bool Gpu::pm1Retry(const Args &args, const Task& task, u32 nErr) {
   if (!powerBits.empty()) { throw "stop requested"; }
 
   log("completed\n");
-  // auto factor = GCD(E, data, 1);
-  // log("factor \"%s\"\n", factor.c_str());
   return DONE;
 }
 
+u32 Gpu::maxBuffers() { return pool.available(bufSize); }
+
+optional<Words> Gpu::pm1Stage2(const Args& args, u32 B1, u32 B2, const shared_future<string>& gcdStage1) {
+  assert(B1 < B2);
+
+  // Besides the baby-steps we need the base, the "little" and "big" squaring sets, and the accumulator.
+  u32 nBuf = maxBuffers();
+  nBuf = (nBuf > 8) ? nBuf - 8 : 0;
+
+  // The baby-steps are leased from the memory shared on the device, waiting for at least the fewest that can run.
+  u64 minBytes = u64(Pm1Plan::minBufsFor(args.D ? args.D : Pm1Plan::Ds.front())) * bufSize;
+  MemLease memLease{args.masterDir, u32(args.device), leaseBudget(device), MemLease::PHASE,
+                    std::min(minBytes, u64(nBuf) * bufSize), u64(nBuf) * bufSize};
+  nBuf = std::min<u64>(nBuf, memLease.size() / bufSize);
+  u32 D = args.D ? args.D : Pm1Plan::pickD(nBuf, B1, B2);
+  if (!D || D > B1 || Pm1Plan::minBufsFor(D) > nBuf) {
+    log("P2 can't run with D=%u, B1=%u in %u buffers\n", D, B1, nBuf);
+    return nullopt;
+  }
+
+  Pm1Plan plan{D, nBuf, B1, B2, Pm1Plan::sieve(B1, B2)};
+  auto [startBlock, blocks] = plan.makePlan();
+  vector<u32> js = plan.jset();
+  u32 nJ = js.size();
+  u32 nBlocks = blocks.size();
+
+  Timer timer;
+  
+  PooledBuffer<double> bufBaseLow = pool.lease<double>("P2base", N);
+  fftP(buf2, bufData);
+  tW(buf3, buf2);
+  fftHin(bufBaseLow, buf3);
+
+  // Baby-steps x^(j^2), for odd j. The squares are stepped by differences: (j + 2)^2 - j^2 == 4j + 4.
+  vector<PooledBuffer<double>> babies;
+  babies.reserve(nJ);
+  {
+    SquaringSet little{*this, N, bufBaseLow, buf2, buf3, {1, 8, 8}, "little"};
+    for (u32 j = 1, i = 0; ; j += 2) {
+      if (j == js[i]) {
+        babies.push_back(pool.lease<double>("baby", N));
+        babies.back() << little.C;
+        if (++i == nJ) { break; }
+      }
+      little.step(buf2);
+    }
+  }
+
+  // Giant-steps x^((block * D)^2), stepped by differences too.
+  u64 D2 = u64(D) * D;
+  u64 b = startBlock;
+  SquaringSet big{*this, N, bufBaseLow, buf2, buf3, {D2 * b * b, D2 * (2 * b + 1), 2 * D2}, "big"};
+  finish();
+  log("P2 D=%u, %u buffers, setup %.1fs\n", D, nJ, timer.reset());
+
+  // The accumulator is kept in the position output by tH().
+  PooledBuffer<double> bufAcc = pool.lease<double>("P2acc", N);
+  bufCheck.set(1);
+  bool leadIn = true;
+  
+  Signal signal;
+  u32 nMuls = 0;
+  u32 logStep = max(1u, nBlocks / 20);
+  for (u32 i = 0; i < nBlocks; ++i) {
+    for (u32 k = 0; k < nJ; ++k) {
+      if (!blocks[i][k]) { continue; }
+      if (leadIn) {
+        fftP(buf2, bufCheck);
+        leadIn = false;
+      } else {
+        doCarry(buf2, bufAcc);
+      }
+      tW(buf1, buf2);
+      tailMulDelta(buf2, buf1, big.C, babies[k]);
+      tH(bufAcc, buf2);
+      ++nMuls;
+    }
+    if (i + 1 < nBlocks) { big.step(buf3); }
+    finish();
+    
+    if ((i + 1) % logStep == 0 || i + 1 == nBlocks) {
+      log("P2 %5.2f%% %u/%u blocks, %4.0f us/mul\n", (i + 1) * 100.0f / nBlocks, i + 1, nBlocks,
+          nMuls ? timer.reset() / nMuls * 1'000'000 : 0);
+      nMuls = 0;
+    }
+
+    if (finished(gcdStage1) && !gcdStage1.get().empty()) { return nullopt; }
+
+    if (signal.stopRequested()) {
+      log("P2 does not have savefiles, will restart from the end of the first stage\n");
+      throw "stop requested";
+    }
+  }
+
+  if (leadIn) { return Words{}; } // no prime in (B1, B2]
+
+  fftW(buf2, bufAcc);
+  carryA(bufCheck, buf2);
+  carryB(bufCheck);
+  Words acc = readCheck();
+  if (acc.empty()) { throw "P2 result ZERO"; }
+  return acc;
+}
+
+shared_future<PM1Result> Gpu::doPm1(const Args& args, const Task& task) {
+  u32 B1 = 0;
+  u32 nErr = 0;
+  while (pm1Retry(args, task, nErr++, B1)) {
+    if (nErr > 30) { throw "too many errors"; }
+  }
+
+  Words data = readData();
+  if (data.empty()) { throw "P1 read ZERO"; }
+
+  // The stage-1 GCD runs in the background, concurrently with the second stage.
+  shared_future<string> gcdStage1 = async(launch::async, [E = E, data = std::move(data)]() { return GCD(E, data, 1); }).share();
+
+  u32 B2 = u32(min(task.B2 ? task.B2 : args.B2 ? args.B2 : u64(B1) * args.B2_B1_ratio, Pm1Bounds::MAX_B2));
+  optional<Words> acc = (B2 > B1) ? pm1Stage2(args, B1, B2, gcdStage1) : nullopt;
+  // The second stage buffers are not reused.
+  pool.trim();
+
+  // The GCDs are waited for by the caller, which does not need the GPU anymore.
+  return async(launch::deferred, [E = E, B1, B2, gcdStage1, acc = std::move(acc)]() -> PM1Result {
+    if (string factor1 = gcdStage1.get(); !factor1.empty()) {
+      log("P1 factor %s\n", factor1.c_str());
+      return {factor1, B1, 0};
+    }
+
+    if (!acc) { return {"", B1, 0}; }
+
+    string factor2 = acc->empty() ? ""s : GCD(E, *acc, 0);
+    if (!factor2.empty()) { log("P2 factor %s\n", factor2.c_str()); }
+    return {factor2, B1, B2};
+  }).share();
+}
+
+// --- ECM ---
+
+// An ECM curve: its constants in the position of a multiplicand of mul(), the start point P and (A + 2) / 4 as
+// a24 / c24; and the points of the ladder, (x0 : z0) == k * P and (x1 : z1) == (k + 1) * P.
+struct EcmCurve {
+  u32 sigma;
+  PooledBuffer<double> xP, zP, a24, c24;
+  PooledBuffer<int> x0, z0, x1, z1;
+};
+
+struct EcmTemps {
+  PooledBuffer<int> s, d, u, v, t0, t1, e;
+};
+
+namespace {
+
+constexpr u32 ECM_MAX_CURVES = 16;
+
+// The ladder bits between the marks of the queue, between the savefiles, and between the logs.
+constexpr u32 ECM_BLOCK = 20;
+constexpr u32 ECM_SAVE_STEP = 20'000;
+constexpr u32 ECM_LOG_STEP = 5'000;
+
+}
+
+void Gpu::toLow(Buffer<double>& out, Buffer<int>& in) {
+  fftP(buf1, in);
+  tW(out, buf1);
+}
+
+// u = (xA - zA) * (xB + zB), v = (xA + zA) * (xB - zB); then xB = zP * (u + v)^2, zB = xP * (u - v)^2.
+void Gpu::ecmAdd(EcmCurve& c, Buffer<int>& xA, Buffer<int>& zA, Buffer<int>& xB, Buffer<int>& zB, EcmTemps& t) {
+  addSub(t.s, t.d, xA, zA);
+  addSub(t.t0, t.t1, xB, zB);
+  modMul(t.u, t.d, t.t0, buf1, buf2, buf3);
+  modMul(t.v, t.s, t.t1, buf1, buf2, buf3);
+  addSub(t.t0, t.t1, t.u, t.v);
+  square(t.t0);
+  square(t.t1);
+  mul(xB, t.t0, c.zP, buf1, buf2);
+  mul(zB, t.t1, c.xP, buf1, buf2);
+}
+
+// t1 = (x + z)^2, t0 = (x - z)^2, e = t1 - t0; then x = c24 * t0 * t1, z = (c24 * t0 + a24 * e) * e.
+void Gpu::ecmDouble(EcmCurve& c, Buffer<int>& x, Buffer<int>& z, EcmTemps& t) {
+  addSub(t.t1, t.t0, x, z);
+  square(t.t1);
+  square(t.t0);
+  mul(z, t.t0, c.c24, buf1, buf2);
+  modMul(x, z, t.t1, buf1, buf2, buf3);
+  addSub(t.u, t.e, t.t1, t.t0);
+  mul(t.t0, t.e, c.a24, buf1, buf2);
+  addSub(t.u, t.v, z, t.t0);
+  modMul(z, t.u, t.e, buf1, buf2, buf3);
+}
+
+u32 Gpu::ecmMaxCurves() {
+  // A curve takes 4 double and 4 int buffers, the equivalent of 6 double buffers; the temps 7 int buffers.
+  u32 nBuf = maxBuffers();
+  return (nBuf > 4) ? std::min((nBuf - 4) / 6, ECM_MAX_CURVES) : 0;
+}
+
+ECMResult Gpu::ecmStage1(const Args& args, u32 B1, u32 nCurves) {
+  assert(nCurves);
+  Saver saver{E, args.nSavefiles, args.startFrom, args.mprimeDir};
+
+  vector<u32> sigmas = saver.listECM();
+  std::sort(sigmas.begin(), sigmas.end());
+  if (sigmas.size() > nCurves) { sigmas.resize(nCurves); }
+  std::random_device rd;
+  while (sigmas.size() < nCurves) {
+    // Suyama's parametrization excludes sigma in {0, 1, 3, 5} (and their negatives).
+    u32 sigma = rd();
+    if (sigma > 5 && std::find(sigmas.begin(), sigmas.end(), sigma) == sigmas.end()) { sigmas.push_back(sigma); }
+  }
+
+  // The ladder goes from the most significant bit, which is the start (x0 : z0) == P, (x1 : z1) == 2 * P.
+  vector<bool> bits = powerSmoothBE(E, B1);
+  const u32 nBits = bits.size();
+
+  EcmTemps t{pool.lease<int>("ecm", N), pool.lease<int>("ecm", N), pool.lease<int>("ecm", N), pool.lease<int>("ecm", N),
+             pool.lease<int>("ecm", N), pool.lease<int>("ecm", N), pool.lease<int>("ecm", N)};
+  vector<EcmCurve> curves;
+  vector<u32> ks;
+  for (u32 sigma : sigmas) {
+    ECMState state = saver.loadECM(sigma);
+    if (state.B1 != B1) {
+      if (state.B1) { log("ECM sigma=%u: savefile B1=%u vs. B1=%u, starting again\n", sigma, state.B1, B1); }
+      state = {sigma, B1, 0};
+    }
+
+    auto [x, z, a24, c24] = suyamaCurve(E, sigma);
+    curves.push_back({sigma, pool.lease<double>("ecmP", N), pool.lease<double>("ecmP", N),
+                      pool.lease<double>("ecmA", N), pool.lease<double>("ecmA", N),
+                      pool.lease<int>("ecmX", N), pool.lease<int>("ecmX", N),
+                      pool.lease<int>("ecmX", N), pool.lease<int>("ecmX", N)});
+    EcmCurve& c = curves.back();
+    writeIn(c.x0, x);
+    writeIn(c.z0, z);
+    toLow(c.xP, c.x0);
+    toLow(c.zP, c.z0);
+    writeIn(c.x1, a24);
+    toLow(c.a24, c.x1);
+    writeIn(c.x1, c24);
+    toLow(c.c24, c.x1);
+
+    if (state.k) {
+      writeIn(c.x0, state.x0);
+      writeIn(c.z0, state.z0);
+      writeIn(c.x1, state.x1);
+      writeIn(c.z1, state.z1);
+    } else {
+      c.x1 << c.x0;
+      c.z1 << c.z0;
+      ecmDouble(c, c.x1, c.z1, t);
+      state.k = 1;
+    }
+    ks.push_back(state.k);
+  }
+  const u32 kStart = *std::min_element(ks.begin(), ks.end());
+  log("ECM B1=%u, %u curves at %u/%u bits\n", B1, nCurves, kStart, nBits);
+
+  auto save = [&]() {
+    for (u32 j = 0; j < curves.size(); ++j) {
+      EcmCurve& c = curves[j];
+      ECMState state{c.sigma, B1, ks[j], readAndCompress(c.x0), readAndCompress(c.z0), readAndCompress(c.x1),
+                     readAndCompress(c.z1)};
+      if (state.x0.empty() || state.z0.empty() || state.x1.empty() || state.z1.empty()) {
+        log("ECM sigma=%u: read failed, not saved\n", c.sigma);
+      } else {
+        saver.saveECM(state);
+      }
+    }
+  };
+
+  // The curves step in lockstep, thus the GPU queue is kept full of the work of all the curves.
+  const u32 inFlight = queue->profiling() ? 0 : args.inFlight;
+  Signal signal;
+  Timer timer;
+  u32 kLog = kStart;
+  for (u32 i = kStart; i < nBits; ++i) {
+    for (u32 j = 0; j < curves.size(); ++j) {
+      if (ks[j] != i) { continue; }
+      EcmCurve& c = curves[j];
+      // Bit 1: (x0, x1) := (x0 + x1, 2 * x1); bit 0: (x0, x1) := (2 * x0, x0 + x1).
+      if (bits[i]) {
+        ecmAdd(c, c.x1, c.z1, c.x0, c.z0, t);
+        ecmDouble(c, c.x1, c.z1, t);
+      } else {
+        ecmAdd(c, c.x0, c.z0, c.x1, c.z1, t);
+        ecmDouble(c, c.x0, c.z0, t);
+      }
+      ++ks[j];
+    }
+
+    u32 k = i + 1;
+    if (k % ECM_BLOCK == 0) {
+      if (inFlight) {
+        queue->mark();
+        queue->waitMarks(inFlight);
+      } else {
+        finish();
+      }
+    }
+
+    bool doStop = signal.stopRequested();
+    if (k % ECM_LOG_STEP == 0 || k == nBits) {
+      finish();
+      log("ECM %5.2f%% %u/%u bits, %u curves, %.0f us/bit\n", k * 100.0f / nBits, k, nBits, nCurves,
+          timer.reset() / (k - kLog) * 1'000'000);
+      kLog = k;
+    }
+    if (k < nBits && (doStop || k % ECM_SAVE_STEP == 0)) { save(); }
+    if (doStop && k < nBits) { throw "stop requested"; }
+  }
+
+  finish();
+  // A single GCD of the product of the z of the curves, and the GCDs of the curves only if it has a factor.
+  vector<Buffer<int>*> zs;
+  vector<EcmCurve*> live;
+  for (EcmCurve& c : curves) {
+    Words z = readAndCompress(c.z0);
+    if (z.empty()) { throw "ECM read ZERO"; }
+    if (std::all_of(z.begin(), z.end(), [](u32 w) { return w == 0; })) {
+      log("ECM sigma=%u: the point is zero\n", c.sigma);
+    } else {
+      zs.push_back(&c.z0);
+      live.push_back(&c);
+    }
+  }
+
+  bool any = !zs.empty();
+  if (zs.size() > 1) {
+    try {
+      Words prod = product(zs);
+      if (prod.empty()) { throw "ECM read ZERO"; }
+      any = !GCD(E, prod, 0).empty();
+    } catch (const bad_alloc&) {
+      log("ECM: no GPU memory for the product of the curves, one GCD per curve\n");
+    }
+  }
+
+  ECMResult result;
+  for (EcmCurve* c : any ? live : vector<EcmCurve*>{}) {
+    if (string factor = GCD(E, readAndCompress(c->z0), 0); !factor.empty()) {
+      log("ECM factor %s (sigma=%u)\n", factor.c_str(), c->sigma);
+      result = {factor, c->sigma};
+      break;
+    }
+  }
+  for (EcmCurve& c : curves) { saver.deleteECM(c.sigma); }
+  curves.clear();
+  pool.trim();
+  return result;
+}
+
+// How long before the end of the PRP loop nearEnd is called.
+static constexpr float NEAR_END_SECS = 120;
+static constexpr float PREEMPT_POLL_SECS = 1;
+
+// For -fftUp, the roundoff is sampled past the first iterations (whose small values have a low roundoff), and judged
+// with at least this many samples.
+static constexpr u32 ROUNDOFF_SKIP = 10000;
+static constexpr u32 ROUNDOFF_MIN_SAMPLES = 500;
+
 PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
   u32 E = task.exponent;
   u32 k = 0, blockSize = 0;
@@ -1457,9 +2718,55 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
 
   // Number of sequential errors (with no success in between). If this ever gets high enough, stop.
   int nSeqErrors = 0;
+
+  // The savefile is written in the background, overlapped with the following iterations.
+  future<void> pendingSave;
+
+  // The result of an enqueued check, read from the GPU after the following block of iterations.
+  vector<u32> checkResult;
+
+  CheckPolicy checkPolicy{".", args.uid.empty() ? getLongInfo(device) : args.uid};
+
+  bool nttChecked = !args.nttCheck;
+
+  Power watts{getPciAddress(device), args.powerCap};
+
+  // With -powerCap, the GPU is left idle (the queue drained) for the pause asked by the governor.
+  auto governPower = [&]() {
+    if (double pause = watts.pace()) {
+      finish();
+      std::this_thread::sleep_for(std::chrono::duration<double>(pause));
+    }
+  };
+
+  // The (data, check) of the last OK check, kept on the GPU: after an error the state is rolled back with device copies
+  // instead of reloaded from disk, which remains the fallback on sequential errors. The copies are taken when the check
+  // is enqueued ("snapNext"), and become the snapshot once the check is OK.
+  struct Snapshot {
+    PooledBuffer<int> data, check;
+    u32 k;
+    u64 res;
+  };
+  optional<Snapshot> snap, snapNext;
   
  reload:
-  {
+  if (pendingSave.valid()) { pendingSave.get(); }
+  snapNext.reset();
+  if (snap && nSeqErrors <= 1) {
+    bufData << snap->data;
+    bufCheck << snap->check;
+    if (u64 res = dataResidue(); res == snap->res) {
+      log("OK %9u rollback: %016" PRIx64 "\n", snap->k, res);
+      k = snap->k;
+    } else {
+      log("EE %9u rollback: %016" PRIx64 " vs. %016" PRIx64 "\n", snap->k, res, snap->res);
+      snap.reset();
+    }
+  } else {
+    snap.reset();
+  }
+
+  if (!snap) {
     PRPState loaded = saver.loadPRP(args.blockSize);    
     writeState(loaded.check, loaded.blockSize, buf1, buf2, buf3);
     
@@ -1467,6 +2774,11 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     if (res == loaded.res64) {
       log("OK %9u on-load: blockSize %d, %016" PRIx64 "\n", loaded.k, loaded.blockSize, res);
       // On the OK branch do not clear lastFailedRes64 -- we still want to compare it with the GEC check.
+      if (!nttChecked) {
+        nttChecked = true;
+        nttCheck(args.nttCheck);
+        goto reload;
+      }
     } else {
       log("EE %9u on-load: %016" PRIx64 " vs. %016" PRIx64 "\n", loaded.k, res, loaded.res64);
       if (lastFailedRes64 && res == *lastFailedRes64) {
@@ -1484,13 +2796,17 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
 
   assert(blockSize > 0 && 10000 % blockSize == 0);
   
-  u32 checkStep = checkStepForErrors(args.logStep, nErrors);
+  // With -log the check step is fixed.
+  u32 checkStep = args.logStep ? args.logStep : checkPolicy.checkStep(blockSize, nErrors, 0);
   assert(checkStep % 10000 == 0);
+  log("Check step %u\n", checkStep);
+  u32 lastCheckK = k;
 
   if (!startK) { startK = k; }
 
   if (power == u32(-1)) {
-    power = ProofSet::effectivePower(args.tmpDir, E, args.proofPow, startK);
+    u32 maxPower = ProofSet::powerForDisk(E, args.proofPow, args.proofDisk);
+    power = ProofSet::effectivePower(args.tmpDir, E, maxPower, startK);
     if (!power) {
       log("Proof disabled because of missing checkpoints\n");
     } else if (power != args.proofPow) {
@@ -1498,12 +2814,29 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     } else {
       log("Proof using power %u\n", power);
     }
+    if (power) {
+      log("Proof residues use %.2f GB of disk in '%s'\n",
+          ProofSet::diskUsage(E, power) / double(1u << 30), (args.tmpDir / to_string(E)).string().c_str());
+    }
   }
   
   ProofSet proofSet{args.tmpDir, E, power};
 
+  // The background save waits on the proof residues (below), thus it ends before proofSet, on a reload too.
+  struct SaveWait {
+    future<void>& f;
+    ~SaveWait() { if (f.valid()) { f.wait(); } }
+  } saveWait{pendingSave};
+
+  // The proof residue is read and saved in the background, while the iterations continue. A savefile past it is
+  // written only after it was saved OK, thus a reload after a failed read redoes it; and only once it is on disk,
+  // thus a restart does not miss it.
+  future<bool> pendingProof;
+  auto proofSaved = [&pendingProof]() { return !pendingProof.valid() || pendingProof.get(); };
+
   bool isPrime = false;
   IterationTimer iterationTimer{startK};
+  Timer preemptPoll;
 
   u64 finalRes64 = 0;
 
@@ -1519,15 +2852,97 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
 
   bool printStats = args.flags.count("STATS");
 
+  // With -fftUp, the roundoff of one iteration per block (of all of them with STATS) is judged at every check: when
+  // its pErr is above -fftUp, the test goes on from the savefile of the check with the next larger FFT (nextFFT).
+  bool fftUp = args.fftUp > 0 && args.fftSpec.empty() && !useLongCarry;
+  bool sampling = fftUp && !printStats;
+  RoundoffStats sampled;
+  u32 sampledCarry = 0;
+  string nextFFT;
+
   bool skipNextCheckUpdate = false;
 
   u32 persistK = proofSet.next(k);
   bool leadIn = true;
 
+  // The profiled kernel events are collected per finish() window, thus no blocks in flight while profiling.
+  const u32 inFlight = queue->profiling() ? 0 : args.inFlight;
+
+  struct PendingCheck {
+    u32 k;
+    u64 res;
+    Words check;
+    float secsPerIt;
+    float secsCheck;
+  };
+  optional<PendingCheck> pendingCheck;
+
+  // Completes the pending check, whose GPU work must be finished by now. Returns true if the check is OK.
+  auto endCheck = [&]() {
+    PendingCheck c = std::move(*pendingCheck);
+    pendingCheck.reset();
+    bool ok = !c.check.empty() && isEqualNotZero(checkResult);
+    if (!ok && !c.check.empty()) { log("check: %s, max word %u\n", checkResult[0] ? "mismatch" : "zero", checkResult[2]); }
+
+    if (ok && !proofSaved()) {
+      ++nErrors;
+      return false;
+    }
+
+    if (ok) {
+      nSeqErrors = 0;
+      lastFailedRes64.reset();
+      checkPolicy.ok(c.k - lastCheckK);
+      lastCheckK = c.k;
+
+      if (snapNext) {
+        snap.reset();
+        snap.emplace(std::move(*snapNext));
+        snapNext.reset();
+      }
+
+      Timer saveTimer;
+      if (c.k < kEnd) {
+        if (pendingSave.valid()) { pendingSave.get(); }
+        pendingSave = async(launch::async, [&saver, &proofSet, power, q = queue,
+                                            state = PRPState{c.k, blockSize, c.res, std::move(c.check), nErrors}]() {
+                                             if (power && !proofSet.persisted(state.k)) {
+                                               log("Savefile %u not written, before its proof residues\n", state.k);
+                                               return;
+                                             }
+                                             Perf::Span span{q->perf, "save"};
+                                             saver.savePRP(state);
+                                           });
+      }
+      doBigLog(E, c.k, c.res, ok, c.secsPerIt, c.secsCheck, saveTimer.at(), kEndEnd, nErrors, watts.report(c.k));
+    } else {
+      doBigLog(E, c.k, c.res, ok, c.secsPerIt, c.secsCheck, 0, kEndEnd, nErrors, watts.report(c.k));
+      ++nErrors;
+      checkPolicy.error();
+      if (++nSeqErrors > 2) {
+        log("%d sequential errors, will stop.\n", nSeqErrors);
+        throw "too many errors";
+      }
+      if (lastFailedRes64 && (c.res == *lastFailedRes64)) {
+        log("Consistent error %016" PRIx64 ", will stop.\n", c.res);
+        throw "consistent error";
+      }
+      lastFailedRes64 = c.res;
+    }
+    logTimeKernels();
+    return ok;
+  };
+
   assert(k % blockSize == 0);
   assert(checkStep % blockSize == 0);
 
   while (true) {
+    if (!nextFFT.empty() && !pendingCheck) {
+      if (pendingSave.valid()) { pendingSave.get(); }
+      log("Moving to the FFT %s from %u\n", nextFFT.c_str(), lastCheckK);
+      return {"", false, 0, nErrors, {}, {}, nextFFT};
+    }
+
     assert(k < kEndEnd);
     
     if (skipNextCheckUpdate) {
@@ -1543,24 +2958,40 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     ++k; // !! early inc
 
     bool doStop = false;
+    bool doPreempt = false;
 
     if (k % blockSize == 0) {
       doStop = signal.stopRequested() || (args.iters && k - startK >= args.iters);
+      if (!doStop && k < kEnd && preemptWanted && preemptPoll.at() >= PREEMPT_POLL_SECS) {
+        preemptPoll.reset();
+        doPreempt = preemptWanted();
+      }
     }
     
-    bool leadOut = doStop || (k % 10000 == 0) || (k % blockSize == 0 && k >= kEndEnd) || k == persistK || k == kEnd || useLongCarry;
+    // The host syncs with the GPU (residue, check, log) only at these; a proof point needs the leadOut (the words in
+    // bufData) but not the sync, as its capture is queued into a staging buffer and drained in the background.
+    bool syncPoint = doStop || doPreempt || (k % 10000 == 0) || (k % blockSize == 0 && k >= kEndEnd) || k == kEnd || useLongCarry;
+    bool leadOut = syncPoint || k == persistK;
 
-    coreStep(bufData, bufData, leadIn, leadOut, false);
+    bool sample = sampling && !leadIn && !leadOut && k % blockSize == 1 && k > ROUNDOFF_SKIP;
+    coreStep(bufData, bufData, leadIn, leadOut, false, sample);
     leadIn = leadOut;    
     
     if (k == persistK) {
-      Words data = readData();
-      if (data.empty()) {
-        log("Data error ZERO\n");
+      if (!proofSaved()) {
         ++nErrors;
         goto reload;
       }
-      proofSet.save(k, data);
+      pendingProof = async(launch::async, [&proofSet, k, q = queue, data = readAndCompressAsync(bufData)]() {
+                                            Words words = data.get();
+                                            Perf::Span span{q->perf, "proofSave"};
+                                            if (words.empty()) {
+                                              log("Data error ZERO\n");
+                                              return false;
+                                            }
+                                            proofSet.save(k, words);
+                                            return true;
+                                          });
       persistK = proofSet.next(k);
     }
 
@@ -1572,21 +3003,43 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
       log("%s %8d / %d, %s\n", isPrime ? "PP" : "CC", kEnd, E, hex(finalRes64).c_str());
     }
 
-    if (!leadOut) {
+    // The iterations of the block after its first, up to the one before its last, are replayed in one batch unless
+    // a proof residue or the end is within them.
+    if (!leadOut && k % blockSize == 1 && blockSize > 2) {
+      u32 end = k + blockSize - 2;
+      if (!(k < persistK && persistK <= end) && !(k < kEnd && kEnd <= end)) {
+        replayIters(blockSize - 2);
+        k = end;
+      }
+    }
+
+    if (!syncPoint) {
       if (k % blockSize == 0) {
-        finish();
+        // The pending check needs its result, else the host only waits for the oldest of the blocks in flight.
+        if (pendingCheck || !inFlight) {
+          finish();
+        } else {
+          queue->mark();
+          queue->waitMarks(inFlight);
+        }
         if (!args.noSpin) { spin(); }
+        if (pendingCheck && !endCheck()) { goto reload; }
+        governPower();
       }
       continue;
     }
 
     u64 res = dataResidue(); // implies finish()
+    if (k % blockSize == 0) { governPower(); }
+    if (pendingCheck && !endCheck()) { goto reload; }
+
     bool doCheck = !res || doStop || (k % checkStep == 0) || (k >= kEndEnd) || (k - startK == 2 * blockSize);
       
     if (k % 10000 == 0 && !doCheck) {
       float secsPerIt = iterationTimer.reset(k);
       // log("   %9u %6.2f%% %s %4.0f us/it\n", k, k / float(kEndEnd) * 100, hex(res).c_str(), secsPerIt * 1'000'000);
-      log("%9u %s %4.0f\n", k, hex(res).c_str(), secsPerIt * 1'000'000);
+      log("%9u %s %4.0f%s\n", k, hex(res).c_str(), secsPerIt * 1'000'000, watts.report(k).c_str());
+      if (nearEnd && (kEndEnd - k) * secsPerIt < NEAR_END_SECS) { std::exchange(nearEnd, nullptr)(); }
     }
       
     if (doStop) {
@@ -1595,55 +3048,108 @@ PRPResult Gpu::isPrimePRP(const Args &args, const Task& task) {
     }
             
     if (doCheck) {
-      if (printStats) { printRoundoff(E); }
+      RoundoffStats roundoff;
+      if (printStats) {
+        roundoff = printRoundoff(E);
+        double pErr = roundoff.pErr;
+        if (!args.logStep) {
+          u32 step = checkPolicy.checkStep(blockSize, nErrors, pErr);
+          if (step != checkStep) {
+            log("Check step %u (roundoff pErr %f%%)\n", step, pErr * 100);
+            checkStep = step;
+          }
+        }
+      } else if (sampling) {
+        roundoff = readRoundoff(E);
+        sampledCarry = std::max(sampledCarry, readCarryMax());
+      }
+
+      if (fftUp && k > ROUNDOFF_SKIP) {
+        sampled = RoundoffStats::merge(E, sampled, roundoff);
+        if (sampled.n >= ROUNDOFF_MIN_SAMPLES && sampled.pErr > args.fftUp) {
+          fftUp = sampling = false;
+          nextFFT = nextFFTSpec(args, E, fftSpec);
+          log("Roundoff too high for %s: N=%u, mean %f, SD %f, max %f (pErr %.2f%%), carry max %x%s\n", fftSpec.c_str(),
+              sampled.n, sampled.mean, sampled.sdev, sampled.max, sampled.pErr * 100, sampledCarry,
+              nextFFT.empty() ? ", no larger FFT" : "");
+        }
+      }
 
       float secsPerIt = iterationTimer.reset(k);
 
+      Perf::Span span{queue->perf, "check"};
       Words check = readCheck();
-      if (check.empty()) { log("Check read ZERO\n"); }
+      if (check.empty()) {
+        log("Check read ZERO\n");
+      } else {
+        snapNext.reset();
+        try {
+          snapNext.emplace(Snapshot{pool.lease<int>("snapData", N), pool.lease<int>("snapCheck", N), k, res});
+          snapNext->data << bufData;
+          snapNext->check << bufCheck;
+        } catch (const bad_alloc&) {
+          snapNext.reset();
+        }
 
-      bool ok = !check.empty() && this->doCheck(blockSize, buf1, buf2, buf3);
+        // The check is only enqueued here; its result is read after the next block of iterations.
+        modSqLoopMul3(bufAux, bufCheck, 0, blockSize);
+        modMul(bufCheck, bufCheck, bufData, buf1, buf2, buf3);
+        equalNotZeroAsync(bufCheck, bufAux, checkResult);
+        skipNextCheckUpdate = true;
+      }
 
       float secsCheck = iterationTimer.reset(k);
-        
-      if (ok) {
-        nSeqErrors = 0;
-        lastFailedRes64.reset();
-        skipNextCheckUpdate = true;
+      pendingCheck = PendingCheck{k, res, std::move(check), secsPerIt, secsCheck};
 
-        if (k < kEnd) { saver.savePRP(PRPState{k, blockSize, res, check, nErrors}); }
+      // The check result is needed right away at the end, on stop, or on a read error.
+      if (doStop || k >= kEndEnd || pendingCheck->check.empty()) {
+        finish();
+        bool ok = endCheck();
 
-        float secsSave = iterationTimer.reset(k);
-          
-        doBigLog(E, k, res, ok, secsPerIt, secsCheck, secsSave, kEndEnd, nErrors);
-          
-        if (k >= kEndEnd) {
-          fs::path proofFile = saveProof(args, proofSet);
-          return {"", isPrime, finalRes64, nErrors, proofFile.string()};          
-        }        
-      } else {
-        doBigLog(E, k, res, ok, secsPerIt, secsCheck, 0, kEndEnd, nErrors);
-        ++nErrors;
-        if (++nSeqErrors > 2) {
-          log("%d sequential errors, will stop.\n", nSeqErrors);
-          throw "too many errors";
+        if (ok && k >= kEndEnd) {
+          assert(!pendingProof.valid());
+          if (pendingSave.valid()) { pendingSave.get(); }
+          auto [proofFile, proofInfo] = saveProof(args, proofSet);
+          return {"", isPrime, finalRes64, nErrors, proofFile.string(), proofInfo};
         }
-        if (lastFailedRes64 && (res == *lastFailedRes64)) {
-          log("Consistent error %016" PRIx64 ", will stop.\n", res);
-          throw "consistent error";
+
+        if (doStop) {
+          queue->finish();
+          if (pendingSave.valid()) { pendingSave.get(); }
+          throw "stop requested";
         }
-        lastFailedRes64 = res;
-        if (!doStop) { goto reload; }
+
+        if (!ok) { goto reload; }
       }
         
-      logTimeKernels();
-        
-      if (doStop) {
-        queue->finish();
-        throw "stop requested";
+      iterationTimer.reset(k);
+    }
+
+    if (doPreempt) {
+      // A check enqueued at this same block is completed before, thus the state left is one of an OK check or
+      // of the iterations after it (with the check update done by the next iteration, as on any block boundary).
+      if (pendingCheck) {
+        finish();
+        if (!endCheck()) { goto reload; }
       }
-        
+      if (pendingProof.valid() && !proofSaved()) {
+        ++nErrors;
+        goto reload;
+      }
+      // The rollback copies and the free slabs are released, as the priority tasks may need the memory.
+      snap.reset();
+      snapNext.reset();
+      pool.trim();
+      log("Preempted at %u\n", k);
+      preempt();
+      if (u64 res2 = dataResidue(); res2 != res) {
+        log("EE %9u on-resume: %016" PRIx64 " vs. %016" PRIx64 "\n", k, res2, res);
+        ++nErrors;
+        goto reload;
+      }
+      log("OK %9u on-resume\n", k);
       iterationTimer.reset(k);
+      preemptPoll.reset();
     }
   }
 }
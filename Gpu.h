@@ -7,7 +7,9 @@
 #include "Queue.h"
 
 #include "common.h"
+#include "Args.h"
 #include "kernel.h"
+#include "Proof.h"
 
 #include <vector>
 #include <string>
@@ -15,16 +17,22 @@
 #include <variant>
 #include <atomic>
 #include <future>
+#include <optional>
 #include <filesystem>
+#include <functional>
 
 struct PRPResult;
 struct PRPState;
 struct Task;
 
-class Args;
 class Saver;
+struct StepPlan;
+struct Replay;
+struct EcmCurve;
+struct EcmTemps;
 class Signal;
 class ProofSet;
+class MemLease;
 
 using double2 = pair<double, double>;
 using float2 = pair<float, float>;
@@ -39,6 +47,37 @@ struct PRPResult {
   u64 res64 = 0;
   u32 nErrors = 0;
   fs::path proofPath{};
+  ProofInfo proofInfo{};
+  string nextFFT{}; // when set, the PRP stopped at its last savefile to go on with this larger FFT (see -fftUp).
+};
+
+struct PM1Result {
+  string factor;
+  u32 B1 = 0;
+  u32 B2 = 0; // zero if the second stage was not done.
+};
+
+struct ECMResult {
+  string factor;
+  u32 sigma = 0; // of the curve which found the factor.
+};
+
+struct RoundoffStats {
+  u32 n = 0;
+  double mean = 0;
+  double sdev = 0;
+  double max = 0;
+  double pErr = 0; // the estimated probability of a roundoff error (>= 0.5) in the whole test.
+
+  // The stats of both sets of samples of the exponent E.
+  static RoundoffStats merge(u32 E, const RoundoffStats& a, const RoundoffStats& b);
+};
+
+// The per-call times of a kernel (or of an iteration for "coreStep") over the -bench samples, and the bytes moved.
+struct BenchTimes {
+  string name;
+  vector<double> secs;
+  u64 bytes = 0;
 };
 
 struct Reload {
@@ -51,16 +90,31 @@ class Gpu {
 
   u32 hN, nW, nH, bufSize;
   u32 WIDTH;
+  u32 MIDDLE;
+  string fftSpec;
   bool useLongCarry;
   bool timeKernels;
 
+  // For small FFTs the queue is flushed every flushStep iterations (0 for never), see Gpu::make().
+  u32 flushStep;
+  u32 stepsSinceFlush = 0;
+
+  // The lease of the GPU memory of the Gpu from the device budget, taken by make(); declared before the buffers
+  // to be released after them.
+  unique_ptr<MemLease> memLease;
+
   cl_device_id device;
   Context context;
   Holder<cl_program> program;
   QueuePtr queue;
+
+  // The temporary N-sized buffers are leased from the pool.
+  BufferPool pool;
   
   Kernel carryFused;
   Kernel carryFusedMul;
+  Kernel carryFusedStats;
+  Kernel carryFusedMiddle; // only with -use FUSED_MIDDLE, see gpuowl.cl
   Kernel fftP;
   Kernel fftW;
   Kernel fftHin;
@@ -72,7 +126,6 @@ class Gpu {
   Kernel carryM;
   Kernel carryB;
   
-  Kernel transposeW, transposeH;
   Kernel transposeIn, transposeOut;
 
   Kernel kernelMultiply;
@@ -85,9 +138,15 @@ class Gpu {
   Kernel tailMulLowLow;
   
   Kernel readResidue;
-  Kernel isNotZero;
-  Kernel isEqual;
+  Kernel checkReduce;
   Kernel sum64;
+
+  Kernel compactSign;
+  Kernel compactCarry;
+  Kernel compactWords;
+  Kernel expandWords;
+  Kernel writeGlobals;
+  Kernel addSub;
   
   // Kernel testKernel;
 
@@ -105,10 +164,15 @@ class Gpu {
   Buffer<int> bufCheck;  // Buffers used with the error check.
   Buffer<int> bufBase;   // used in P-1 error check.
 
+  // The compact E-bit residue, padded to an even number of words; and the per-block state of the compaction.
+  HostAccessBuffer<u32> bufCompact;
+  Buffer<int> bufCompactSign;
+  Buffer<int> bufCompactCarry;
+
   // Carry buffers, used in carry and fusedCarry.
   Buffer<i64> bufCarry;  // Carry shuttle.
   
-  Buffer<int> bufReady;  // Per-group ready flag for stairway carry propagation.
+  Buffer<int> bufReady;  // Per-group ready flag for stairway carry propagation, then the CARRY_TICKET counter.
   HostAccessBuffer<u32> bufRoundoff;
   HostAccessBuffer<u32> bufCarryMax;
   HostAccessBuffer<u32> bufCarryMulMax;
@@ -116,11 +180,26 @@ class Gpu {
   // Small aux buffer used to read res64.
   HostAccessBuffer<int> bufSmallOut;
   HostAccessBuffer<u64> bufSumOut;
+  HostAccessBuffer<u32> bufCheckOut;
 
   // Auxilliary big buffers
   Buffer<double> buf1;
   Buffer<double> buf2;
   Buffer<double> buf3;
+
+  // Staging buffers in host memory for readAndCompressAsync(), used in turn. A staging buffer is reused only after
+  // the previous read from it is complete.
+  vector<HostAccessBuffer<u32>> bufStages;
+  shared_future<Words> stageBusy[2];
+  u32 stageIdx = 0;
+
+  // The kernels of coreStep() on bufData, with their arguments bound once.
+  unique_ptr<StepPlan> stepPlan;
+
+  void bindBits();
+
+  // The recorded batch of the plain iterations within a block, see replayIters().
+  unique_ptr<Replay> replay;
   
   vector<int> readSmall(Buffer<int>& buf, u32 start);
 
@@ -131,11 +210,25 @@ class Gpu {
   vector<int> readOut(ConstBuffer<int> &buf);
   void writeIn(Buffer<int>& buf, const vector<i32> &words);
 
-  void coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3);
+  // Compacts "in" into the E-bit residue on the GPU.
+  void compact(Buffer<u32>& out, ConstBuffer<int>& in);
+
+  // With "sample", a plain step on bufData collects its roundoff (see carryFusedStats) for readRoundoff().
+  void coreStep(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3, bool sample = false);
+  void coreStepUnplanned(Buffer<int>& out, Buffer<int>& in, bool leadIn, bool leadOut, bool mul3);
+
+  // Enqueues nIters plain iterations on bufData, i.e. coreStep(bufData, bufData, false, false, false).
+  void replayIters(u32 nIters);
   u32 modSqLoop(Buffer<int>& io, u32 from, u32 to);
   u32 modSqLoopMul3(Buffer<int>& out, Buffer<int>& in, u32 from, u32 to);
 
   bool equalNotZero(Buffer<int>& bufCheck, Buffer<int>& bufAux);
+
+  // One pass of checkReduce over both buffers; the result is available in "out" after the next finish().
+  void equalNotZeroAsync(Buffer<int>& bufCheck, Buffer<int>& bufAux, vector<u32>& out);
+
+  // The result of checkReduce: [0] bufCheck is not zero, [1] the buffers differ, [2] the max abs word of bufCheck.
+  static bool isEqualNotZero(const vector<u32>& out) { return out[0] && !out[1]; }
   u64 bufResidue(Buffer<int>& buf);
   
   vector<u32> writeBase(const vector<u32> &v);
@@ -144,6 +237,7 @@ class Gpu {
   void multiplyLowLow(Buffer<double>& io, const Buffer<double>& in, Buffer<double>& tmp);
 
   void exponentiateCore(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp);
+  bool exponentiateWindow(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp);
   
   void exponentiate(Buffer<int>& bufInOut, u64 exp, Buffer<double>& buf1, Buffer<double>& buf2, Buffer<double>& buf3);
   void exponentiate(Buffer<double>& out, const Buffer<double>& base, u64 exp, Buffer<double>& tmp1);
@@ -156,9 +250,14 @@ class Gpu {
   
 
   Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-      cl_device_id device, bool timeKernels, bool useLongCarry, struct Weights&& weights);
+      cl_device_id device, bool timeKernels, bool useLongCarry, u32 flushStep, struct Weights&& weights);
 
-  void printRoundoff(u32 E);
+  // Reads and resets the roundoff collected by the kernels (only with -use STATS).
+  RoundoffStats readRoundoff(u32 E);
+  // Reads and resets the max carry collected by the kernels (with -use STATS, or by carryFusedStats).
+  u32 readCarryMax();
+  // Logs and returns the roundoff and the carry stats, with -use STATS; returns empty stats if too few were collected.
+  RoundoffStats printRoundoff(u32 E);
 
   // does either carrryFused() or the expanded version depending on useLongCarry
   void doCarry(Buffer<double>& out, Buffer<double>& in);
@@ -170,14 +269,34 @@ class Gpu {
   // data := data * data;
   void square(Buffer<int>& data, Buffer<double>& tmp1, Buffer<double>& tmp2);
   
+  // The number of N-sized buffers that can still be allocated.
   u32 maxBuffers();
 
-  fs::path saveProof(const Args& args, const ProofSet& proofSet);
+  // P-1 second stage on the stage-1 result in bufData. Returns nullopt if stage 2 was not done.
+  // The stage 2 accumulator for the GCD, empty if there is no prime in (B1, B2]; nullopt if not done.
+  optional<Words> pm1Stage2(const Args& args, u32 B1, u32 B2, const shared_future<string>& gcdStage1);
+
+  pair<fs::path, ProofInfo> saveProof(const Args& args, const ProofSet& proofSet);
   
 public:
-  const Args& args;
-
-  Words fold(vector<Buffer<int>>& bufs);
+  // A copy, as Gpu::make() may add the tuned -use flags.
+  const Args args;
+
+  // Called once by the PRP loop when the end of the test is estimated within a couple of minutes, e.g. to build the
+  // Gpu of the next task (see Lookahead).
+  std::function<void()> nearEnd;
+
+  // Polled by the PRP loop at a block boundary (at most once a second); when true, the PRP stops at the block end,
+  // with its state left in the buffers of this Gpu, and calls preempt(), e.g. to run the priority tasks on a Gpu of
+  // their own. The PRP then goes on from where it stopped, without a savefile reload nor a check. Only the rollback
+  // copies and the free pool slabs are released before: the fixed buffers and the MemLease of this Gpu stay, thus the
+  // Gpu of a priority task is built beside them, within what is left of the memory budget.
+  std::function<bool()> preemptWanted;
+  std::function<void()> preempt;
+
+  // The product of the residues, reduced as a balanced tree over operands left transformed (see multiplyLowLow),
+  // thus K residues cost K forward transforms and K - 1 multiplies. Empty on a read error.
+  Words product(const vector<Buffer<int>*>& ins);
   
   void mul(Buffer<int>& out, Buffer<int>& inA, Buffer<int>& inB);
   void mul(Buffer<int>& io, Buffer<int>& inB);
@@ -190,14 +309,34 @@ public:
   void accumulate(Buffer<int>& acc, Buffer<double>& data, Buffer<double>& tmp1, Buffer<double>& tmp2);
 
   
-  static unique_ptr<Gpu> make(u32 E, const Args &args);
+  // The FFT is the one of fftE if not 0, e.g. larger than the FFT of E for the headroom of ECM.
+  static unique_ptr<Gpu> make(u32 E, const Args &args, u32 fftE = 0);
+
+  // The exponent to pick the FFT of an ECM Gpu for: the sums ahead of the ECM multiplications are not carried, and
+  // the words of a product grow by up to two bits.
+  static u32 ecmFFTExponent(u32 E) { return E + E / 8; }
+
+  // Whether the Gpu (program, trig tables and buffers) can be re-targeted to the exponent: the same FFT and tuned flags,
+  // and the same exponent-dependent defines of the program. Then retarget() only sets the bits and the weights, and
+  // resets the state left by the previous task (also for the same exponent).
+  bool canRetarget(u32 E, const Args& args) const;
+  void retarget(u32 E);
+
+  // The self-test of the FFT, see SelfTest; overwrites the data. Skipped while another Gpu of the process is alive on
+  // the same device (-workers, a preempted PRP), as the timing and the recorded baseline would not be of the FFT alone.
+  void selfTest();
+  ~Gpu();
   static void doDiv9(u32 E, Words& words);
   static bool equals9(const Words& words);
   
   Gpu(const Args& args, u32 E, u32 W, u32 BIG_H, u32 SMALL_H, u32 nW, u32 nH,
-      cl_device_id device, bool timeKernels, bool useLongCarry);
+      cl_device_id device, bool timeKernels, bool useLongCarry, u32 flushStep);
 
   vector<u32> readAndCompress(ConstBuffer<int>& buf);
+
+  // Like readAndCompress(), but does not wait for the transfer: the iterations can continue on the GPU while the
+  // read is checksummed and compacted on a worker thread.
+  shared_future<Words> readAndCompressAsync(ConstBuffer<int>& buf);
   void writeIn(Buffer<int>& buf, const vector<u32> &words);
   void writeData(const vector<u32> &v) { writeIn(bufData, v); }
   void writeCheck(const vector<u32> &v) { writeIn(bufCheck, v); }
@@ -217,20 +356,42 @@ public:
   void pm1Block(vector<bool> bits, bool update);
   bool pm1Check(vector<bool> sumBits, u32 blockSize);
 
-  void doPm1(const Args& args, const Task& task) {
-    u32 nErr = 0;
-    while (pm1Retry(args, task, nErr++)) {
-      if (nErr > 30) { throw "too many errors"; }
-    }
-  }
+  // The differential addition and the doubling of the Montgomery ladder of the ECM curve, in projective (X : Z).
+  // (xB : zB) := (xA : zA) + (xB : zB), where the difference of the points is the start point of the curve.
+  void ecmAdd(EcmCurve& c, Buffer<int>& xA, Buffer<int>& zA, Buffer<int>& xB, Buffer<int>& zB, EcmTemps& t);
+  // (x : z) := 2 * (x : z)
+  void ecmDouble(EcmCurve& c, Buffer<int>& x, Buffer<int>& z, EcmTemps& t);
+  // out := the residue in the position of a multiplicand of mul().
+  void toLow(Buffer<double>& out, Buffer<int>& in);
 
-  // return true to be invoked again (for retry)
-  bool pm1Retry(const Args& args, const Task& task, u32 nErr);
+  // The result is the GCDs, computed (on the CPU) by get().
+  shared_future<PM1Result> doPm1(const Args& args, const Task& task);
+
+  // return true to be invoked again (for retry). Sets B1 to the bound used.
+  bool pm1Retry(const Args& args, const Task& task, u32 nErr, u32& B1);
 
   // std::variant<string, vector<u32>> factorPM1(u32 E, const Args& args, u32 B1, u32 B2);
+
+  // The most ECM curves that fit in the GPU memory at once.
+  u32 ecmMaxCurves();
+
+  // ECM stage 1 to B1 on nCurves curves, run in lockstep along the Montgomery ladder of the power-smooth of B1. The
+  // curves of a savefile are resumed first, and the others get random sigmas. The GCDs are done at the end.
+  ECMResult ecmStage1(const Args& args, u32 B1, u32 nCurves);
   
   u32 getFFTSize() { return N; }
 
+  // Used by the tuner: returns the seconds per iteration over nIters squarings, and the roundoff stats (with STATS, or
+  // sampled once per block).
+  pair<double, RoundoffStats> timeSquarings(u32 nIters, bool sample = false);
+
+  // Used by the P-1 bounds planner: returns the seconds per P2 multiplication over nMuls.
+  double timeP2Muls(u32 nMuls);
+
+  // Used by -bench, with -time: times the kernels of an iteration each in isolation, and a whole coreStep(), on random
+  // data. Every sample is the average over "batch" calls.
+  vector<BenchTimes> benchKernels(u32 nSamples, u32 batch);
+
   // return A^h * B
   Words expMul(const Words& A, u64 h, const Words& B);
 
@@ -242,5 +403,16 @@ public:
   
   // return A^(2^n)
   Words expExp2(const Words& A, u32 n);
-  vector<Buffer<i32>> makeBufVector(u32 size);
+
+  // The CERT work: A^(2^n) with the Gerbicz check of the PRP, with A instead of 3 as the base; and the check errors.
+  // On a stop request the residue is empty.
+  pair<Words, u32> certify(const Args& args, const Words& A, u32 n);
+
+  // Cross-checks n squarings of the current data on the GPU against the NTT engine on the host (-nttCheck).
+  void nttCheck(u32 n);
+
+  // Cross-checks product() of 2 and of 3 random residues against the NTT engine on the host; throws on a mismatch.
+  void productCheck();
+  // Allocates up to "size" buffers, as many as fit in the GPU memory.
+  vector<PooledBuffer<i32>> makeBufVector(u32 size);
 };
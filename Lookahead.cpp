@@ -0,0 +1,69 @@
+// Copyright (C) Mihai Preda.
+
+#include "Lookahead.h"
+#include "AllocTrac.h"
+#include "Gpu.h"
+#include "Worktodo.h"
+
+extern thread_local string globalCpuName;
+
+Lookahead::Lookahead(const Args& args) : args{args} {}
+
+Lookahead::~Lookahead() = default;
+
+void Lookahead::start(const Gpu* current) {
+  if (gpu.valid()) { return; }
+  next = Worktodo::peekTask();
+  if (!next || next->kind == Task::VERIFY || next->kind == Task::ECM) { return; }
+  if (current && current->canRetarget(next->exponent, args)) {
+    log("the Gpu will be re-used by the next task %u\n", next->exponent);
+    return;
+  }
+
+  log("building the Gpu of the next task %u\n", next->exponent);
+  gpu = std::async(std::launch::async,
+                   [args = args, E = next->exponent, budget = AllocTrac::threadBudget(), cpuName = globalCpuName]() {
+                     globalCpuName = cpuName;
+                     AllocTrac::useBudget(budget);
+                     LogContext context{to_string(E)};
+                     // The self-test is run when the Gpu is taken, not beside the running task.
+                     Args aheadArgs = args;
+                     aheadArgs.selfTest = false;
+                     return Gpu::make(E, aheadArgs);
+                   });
+}
+
+std::unique_ptr<Gpu> Lookahead::take(const Task& task) {
+  if (gpu.valid()) {
+    bool isNext = next->line == task.line && next->exponent == task.exponent;
+    try {
+      std::unique_ptr<Gpu> ret = gpu.get();
+      if (isNext) {
+        kept.reset();
+        if (args.selfTest) { ret->selfTest(); }
+        return ret;
+      }
+      log("the next task changed, the Gpu of %u is not used\n", next->exponent);
+    } catch (const char* mes) {
+      log("the Gpu of the next task failed: %s\n", mes);
+    } catch (const std::exception& e) {
+      log("the Gpu of the next task failed: %s\n", e.what());
+    }
+  }
+
+  if (reuses(task)) {
+    kept->retarget(task.exponent);
+    return std::move(kept);
+  }
+  // Its memory is released before a new Gpu is made.
+  kept.reset();
+  return {};
+}
+
+void Lookahead::release() { kept.reset(); }
+
+void Lookahead::keep(std::unique_ptr<Gpu> gpu) { kept = std::move(gpu); }
+
+bool Lookahead::reuses(const Task& task) const {
+  return kept && (task.kind == Task::PRP || task.kind == Task::PM1) && kept->canRetarget(task.exponent, args);
+}
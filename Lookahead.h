@@ -0,0 +1,44 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "Args.h"
+#include "Task.h"
+#include "common.h"
+
+#include <future>
+#include <memory>
+#include <optional>
+
+class Gpu;
+
+// Builds the Gpu of the next task of worktodo.txt on a background thread, near the end of the current task: program,
+// weights, trig tables and buffers, from the memory budget of the worker. The next task then starts without the setup.
+// A next task of the same FFT instead re-uses the Gpu of the task that ended, re-targeted to its exponent.
+class Lookahead {
+  const Args args;
+  std::optional<Task> next;
+  std::future<std::unique_ptr<Gpu>> gpu;
+  std::unique_ptr<Gpu> kept;
+
+public:
+  explicit Lookahead(const Args& args);
+  ~Lookahead();
+
+  // Starts building the Gpu of the next unclaimed task, if any and not started already, and if the current Gpu
+  // can't be re-targeted to it.
+  void start(const Gpu* current = nullptr);
+
+  // The Gpu of the task, built for it or re-targeted from the kept one; or null.
+  std::unique_ptr<Gpu> take(const Task& task);
+
+  // Releases the kept Gpu, for a task that makes a Gpu of its own (ECM, VERIFY). The Gpu being built for the next
+  // task, if any, is left to it.
+  void release();
+
+  // Keeps the Gpu of the task that ended, for re-use by the next task.
+  void keep(std::unique_ptr<Gpu> gpu);
+
+  // Whether the task would re-use the kept Gpu.
+  bool reuses(const Task& task) const;
+};
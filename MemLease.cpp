@@ -0,0 +1,235 @@
+// Copyright Mihai Preda.
+
+#include "MemLease.h"
+#include "File.h"
+#include "common.h"
+#include "Signal.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#if !defined(_WIN32) && !defined(__WIN32__)
+#include <unistd.h>
+#endif
+#if defined(F_OFD_SETLKW)
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+namespace {
+
+constexpr u64 UNIT = u64(16) << 20;
+
+// How often a waiting lease checks for a stop request, as SIGINT may be taken by another thread.
+constexpr u32 STOP_CHECK_MS = 1000;
+
+double toGB(u64 bytes) { return bytes / (1024.0 * 1024 * 1024); }
+
+// The units leased by this process, per device.
+std::mutex heldMut;
+std::map<u32, u32> heldUnits;
+
+#if defined(F_OFD_SETLKW)
+
+// The open file description locks (unlike the process locks) conflict between the threads of a process too.
+struct flock lockRange(short type, u32 start, u32 n) {
+  struct flock fl{};
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = start;
+  fl.l_len = n;
+  return fl;
+}
+
+// The first window of n free units, going up from the bottom or down from the top of the budget; -1 if none.
+i64 findFree(int fd, u32 total, u32 n, bool fromTop) {
+  if (n > total) { return -1; }
+  i64 start = fromTop ? total - n : 0;
+  while (start >= 0 && start + n <= total) {
+    struct flock fl = lockRange(F_WRLCK, start, n);
+    if (fcntl(fd, F_OFD_GETLK, &fl) < 0) { return -1; }
+    if (fl.l_type == F_UNLCK) { return start; }
+    // Skip past the conflicting lease.
+    if (fromTop) {
+      start = i64(fl.l_start) - n;
+    } else {
+      if (fl.l_len == 0) { return -1; }
+      start = fl.l_start + fl.l_len;
+    }
+  }
+  return -1;
+}
+
+bool tryLock(int fd, u32 start, u32 n) {
+  struct flock fl = lockRange(F_WRLCK, start, n);
+  return fcntl(fd, F_OFD_SETLK, &fl) == 0;
+}
+
+// Blocks until a lease ends anywhere in the budget: the end of a lease closes its descriptor of the lease file (also
+// when its process dies), which inotify reports as IN_CLOSE_WRITE. A lock wait would end only with the leases of one
+// window, while any window that frees up will do.
+class CloseWatch {
+  int fd = -1;
+
+public:
+  explicit CloseWatch(const fs::path& path) : fd{inotify_init1(IN_CLOEXEC)} {
+    if (fd >= 0 && inotify_add_watch(fd, path.string().c_str(), IN_CLOSE_WRITE) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  ~CloseWatch() { if (fd >= 0) { close(fd); } }
+
+  // Returns false on a stop request. Without inotify, only waits between the checks for a stop request.
+  bool wait(Signal& signal) {
+    while (!signal.stopRequested()) {
+      if (fd < 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(STOP_CHECK_MS));
+        return true;
+      }
+      struct pollfd p{fd, POLLIN, 0};
+      if (poll(&p, 1, STOP_CHECK_MS) > 0) {
+        char buf[4096];
+        [[maybe_unused]] ssize_t n = read(fd, buf, sizeof(buf));
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+#else
+
+error_code& noThrow() {
+  static error_code dummy;
+  return dummy;
+}
+
+#endif
+
+}
+
+#if defined(F_OFD_SETLKW)
+
+MemLease::MemLease(const fs::path& dir, u32 device, u64 budget, Kind kind, u64 minBytes, u64 maxBytes)
+  : path{dir / ("memlease-"s + to_string(device))}, device{device} {
+  assert(minBytes <= maxBytes);
+  u32 total = budget / UNIT;
+  u32 minUnits = (minBytes + UNIT - 1) / UNIT;
+  u32 maxUnits = std::min<u64>((maxBytes + UNIT - 1) / UNIT, total);
+  bool fromTop = kind == GPU;
+  if (!maxUnits) { return; }
+
+  fd = open(path.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    log("Can't open the memory lease file '%s', not leased\n", path.string().c_str());
+    bytes = maxBytes;
+    return;
+  }
+
+  u32 n = 0;
+  bool logged = false;
+  Signal signal;
+  std::optional<CloseWatch> watch;
+  while (true) {
+    // The largest free window, by bisection as any smaller window fits too.
+    u32 lo = std::max(minUnits, 1u);
+    n = maxUnits;
+    i64 pos = findFree(fd, total, n, fromTop);
+    for (u32 hi = (pos < 0) ? n : lo; lo < hi;) {
+      u32 mid = (lo + hi) / 2;
+      if (i64 p = findFree(fd, total, mid, fromTop); p >= 0) {
+        n = mid;
+        pos = p;
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (pos >= 0) {
+      if (tryLock(fd, pos, n)) { break; }
+      continue; // Taken by another lease since, look again.
+    }
+
+    u32 held = 0;
+    {
+      std::unique_lock lock{heldMut};
+      held = heldUnits[device];
+    }
+    if (!minUnits || held + minUnits > total) {
+      if (minUnits) {
+        log("GPU memory lease of %.2f GB does not fit the budget of %.2f GB beside this process, not leased\n",
+            toGB(minBytes), toGB(budget));
+      }
+      close(fd);
+      fd = -1;
+      bytes = minUnits ? maxBytes : 0;
+      return;
+    }
+
+    // The watch starts before the search is done once more, thus a lease that ends in between is not missed.
+    if (!watch) {
+      watch.emplace(path);
+      continue;
+    }
+
+    if (!logged) {
+      log("Waiting for %.2f GB of GPU memory (%s)\n", toGB(u64(minUnits) * UNIT), path.string().c_str());
+      logged = true;
+    }
+    if (!watch->wait(signal)) {
+      close(fd);
+      fd = -1;
+      throw "stop requested";
+    }
+  }
+
+  nUnits = n;
+  bytes = std::min(maxBytes, u64(n) * UNIT);
+  std::unique_lock lock{heldMut};
+  heldUnits[device] += nUnits;
+}
+
+void MemLease::release() {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+    std::unique_lock lock{heldMut};
+    heldUnits[device] -= nUnits;
+  }
+}
+
+#else
+
+// Without open file description locks (e.g. Windows), a lease is for the whole device: a directory, whose creation is
+// atomic, which is left behind by a process that dies.
+MemLease::MemLease(const fs::path& dir, u32 device, u64 budget, Kind kind, u64 minBytes, u64 maxBytes)
+  : path{dir / ("memlock-"s + to_string(device))}, device{device}, bytes{maxBytes} {
+  if (kind == GPU) { return; }
+  if (!fs::create_directory(path, noThrow())) {
+    log("Waiting for memory lock '%s'\n", path.string().c_str());
+    Signal signal;
+    do {
+      std::this_thread::sleep_for(std::chrono::seconds(5));
+      if (signal.stopRequested()) { throw "stop requested"; }
+    } while (!fs::create_directory(path, noThrow()));
+  }
+  fd = 0;
+}
+
+void MemLease::release() {
+  if (fd >= 0) {
+    fs::remove(path, noThrow());
+    fd = -1;
+  }
+}
+
+#endif
+
+MemLease::~MemLease() { release(); }
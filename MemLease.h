@@ -0,0 +1,41 @@
+// Copyright Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// A lease of GPU memory from the budget of a device, shared by the processes (and the worker threads) of the host.
+// The broker is a lock file per device in the -masterDir, where a lease is a lock on the byte range of its units of
+// memory: the lock is released when the lease ends, and by the OS when the holding process dies. A lease that does not
+// fit blocks until a lease ends (see CloseWatch), then looks again for a free window.
+class MemLease {
+public:
+  // The leases of a Gpu for its lifetime are packed from the top of the budget, those of the memory-heavy phases
+  // (proof, P-1 stage 2) from the bottom. Thus a phase waits on the end of other phases, not of the running Gpus.
+  enum Kind {GPU, PHASE};
+
+  // Leases as much as is free between minBytes and maxBytes of the budget, waiting for at least minBytes.
+  // A lease that does not fit beside the leases of this same process is not waited for (it would wait on itself).
+  MemLease(const fs::path& dir, u32 device, u64 budget, Kind kind, u64 minBytes, u64 maxBytes);
+  MemLease(const fs::path& dir, u32 device, u64 budget, Kind kind, u64 bytes)
+    : MemLease{dir, device, budget, kind, bytes, bytes} {}
+  ~MemLease();
+
+  MemLease(const MemLease&) = delete;
+  void operator=(const MemLease&) = delete;
+
+  // The leased bytes, which may be less than maxBytes.
+  u64 size() const { return bytes; }
+
+private:
+  fs::path path;
+  u32 device;
+  int fd = -1;
+  u32 nUnits = 0;
+  u64 bytes = 0;
+
+  void release();
+};
@@ -0,0 +1,175 @@
+// Copyright (C) Mihai Preda.
+
+#include "Ntt.h"
+
+#include <cassert>
+
+namespace {
+
+using u128 = unsigned __int128;
+
+constexpr u64 P = 0xffff'ffff'0000'0001ull;  // 2^64 - 2^32 + 1
+constexpr u64 EPSILON = 0xffff'ffffull;      // 2^64 mod P
+
+u64 add(u64 a, u64 b) {
+  u64 s = a + b;
+  if (s < a) { s += EPSILON; } // wrapped 2^64
+  return s >= P ? s - P : s;
+}
+
+u64 sub(u64 a, u64 b) { return a >= b ? a - b : a + (P - b); }
+
+// Using 2^64 == 2^32 - 1 and 2^96 == -1 (mod P).
+u64 reduce(u128 x) {
+  u64 lo = u64(x);
+  u64 hi = u64(x >> 64);
+  u64 hiHi = hi >> 32;
+  u64 hiLo = hi & EPSILON;
+
+  u64 t = lo - hiHi;
+  if (lo < hiHi) { t -= EPSILON; } // borrowed 2^64
+  u64 r = t + hiLo * EPSILON;
+  if (r < t) { r += EPSILON; }
+  return r >= P ? r - P : r;
+}
+
+u64 mul(u64 a, u64 b) { return reduce(u128(a) * b); }
+
+u64 pow(u64 x, u64 e) {
+  u64 r = 1;
+  for (; e; e >>= 1, x = mul(x, x)) {
+    if (e & 1) { r = mul(r, x); }
+  }
+  return r;
+}
+
+// 7 generates the multiplicative group of P.
+constexpr u64 GENERATOR = 7;
+
+// The "n" bits of "words" starting at bit "start", as "nWords" words.
+Words bitsAt(const Words& words, u32 start, u32 n, u32 nWords) {
+  Words out(nWords);
+  for (u32 i = 0; i < nWords; ++i) {
+    u32 bit = start + i * 32;
+    u32 w = bit / 32, shift = bit % 32;
+    u64 v = (w < words.size() ? words[w] : 0) | (u64(w + 1 < words.size() ? words[w + 1] : 0) << 32);
+    out[i] = u32(v >> shift);
+  }
+  if (n % 32) { out.back() &= (1u << (n % 32)) - 1; }
+  return out;
+}
+
+}
+
+Ntt::Ntt(u32 E) : E{E}, nDigits{(E - 1) / 16 + 1}, size{1} {
+  while (size < 2 * nDigits) { size *= 2; }
+  assert(u64(nDigits) << 32 < P); // the convolution outputs must not wrap
+
+  // The twiddles of the radix-2 stages, for each stage half-size m: w_m^j, j < m.
+  u64 w = pow(GENERATOR, (P - 1) / size);
+  u64 iw = pow(w, P - 2);
+  roots.resize(size);
+  invRoots.resize(size);
+  for (u32 m = 1; m < size; m *= 2) {
+    u64 step = pow(w, size / (2 * m));
+    u64 iStep = pow(iw, size / (2 * m));
+    u64 r = 1, ir = 1;
+    for (u32 j = 0; j < m; ++j) {
+      roots[m + j] = r;
+      invRoots[m + j] = ir;
+      r = ::mul(r, step);
+      ir = ::mul(ir, iStep);
+    }
+  }
+}
+
+// In-place iterative radix-2 transform (bit-reversed input order).
+void Ntt::transform(vector<u64>& a, const vector<u64>& w) {
+  for (u32 i = 1, j = 0; i < size; ++i) {
+    u32 bit = size >> 1;
+    for (; j & bit; bit >>= 1) { j ^= bit; }
+    j ^= bit;
+    if (i < j) { std::swap(a[i], a[j]); }
+  }
+
+  for (u32 m = 1; m < size; m *= 2) {
+    for (u32 i = 0; i < size; i += 2 * m) {
+      for (u32 j = 0; j < m; ++j) {
+        u64 u = a[i + j];
+        u64 v = ::mul(a[i + j + m], w[m + j]);
+        a[i + j] = add(u, v);
+        a[i + j + m] = sub(u, v);
+      }
+    }
+  }
+}
+
+vector<u64> Ntt::forward(const Words& A) {
+  assert(A.size() == (E - 1) / 32 + 1);
+  vector<u64> a(size);
+  for (u32 i = 0; i < nDigits; ++i) { a[i] = (A[i / 2] >> (16 * (i % 2))) & 0xffff; }
+  transform(a, roots);
+  return a;
+}
+
+Words Ntt::square(const Words& A) {
+  vector<u64> a = forward(A);
+  for (u64& x : a) { x = ::mul(x, x); }
+  return inverse(a);
+}
+
+Words Ntt::mul(const Words& A, const Words& B) {
+  vector<u64> a = forward(A);
+  vector<u64> b = forward(B);
+  for (u32 i = 0; i < size; ++i) { a[i] = ::mul(a[i], b[i]); }
+  return inverse(a);
+}
+
+Words Ntt::inverse(vector<u64>& a) {
+  u32 nWords = (E - 1) / 32 + 1;
+  transform(a, invRoots);
+
+  // The product (< 2^(2E)) as words of 32 bits, after the carry propagation.
+  u64 invSize = pow(size, P - 2);
+  Words prod(2 * nWords + 1);
+  u128 carry = 0;
+  for (u32 i = 0; i < 2 * prod.size(); ++i) {
+    u128 v = carry + (i < size ? ::mul(a[i], invSize) : 0);
+    u32 digit = u32(v & 0xffff);
+    carry = v >> 16;
+    prod[i / 2] |= digit << (16 * (i % 2));
+  }
+  assert(carry == 0);
+
+  // Fold mod 2^E - 1: low E bits + high bits, with the end-around carry.
+  Words low = bitsAt(prod, 0, E, nWords);
+  Words high = bitsAt(prod, E, E, nWords);
+  u64 c = 0;
+  for (u32 i = 0; i < nWords; ++i) {
+    c += u64(low[i]) + high[i];
+    low[i] = u32(c);
+    c >>= 32;
+  }
+  u32 topBits = E % 32 ? E % 32 : 32;
+  u64 over = (u64(c) << (32 - topBits)) | (topBits < 32 ? low.back() >> topBits : 0);
+  if (topBits < 32) { low.back() &= (1u << topBits) - 1; }
+  for (u32 i = 0; over && i < nWords; ++i) {
+    over += low[i];
+    low[i] = u32(over);
+    over >>= 32;
+  }
+
+  // 2^E - 1 is 0.
+  bool allOnes = true;
+  for (u32 i = 0; i < nWords; ++i) {
+    u32 mask = (i == nWords - 1 && topBits < 32) ? (1u << topBits) - 1 : ~0u;
+    allOnes &= low[i] == mask;
+  }
+  if (allOnes) { std::fill(low.begin(), low.end(), 0); }
+  return low;
+}
+
+Words Ntt::expExp2(Words A, u32 n) {
+  for (u32 i = 0; i < n; ++i) { A = square(A); }
+  return A;
+}
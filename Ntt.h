@@ -0,0 +1,31 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+// An independent check engine, on the host: squarings modulo 2^E - 1 through a number-theoretic transform over the
+// prime 2^64 - 2^32 + 1. The integer arithmetic is exact (no roundoff), thus it can cross-check the FP64 FFT of the GPU.
+// It is slow (a plain zero-padded convolution of 16-bit digits), meant for a few iterations (-nttCheck).
+class Ntt {
+public:
+  explicit Ntt(u32 E);
+
+  // A^(2^n) mod 2^E - 1, with 2^E - 1 normalized to 0.
+  Words expExp2(Words A, u32 n);
+
+  Words square(const Words& A);
+  Words mul(const Words& A, const Words& B);
+
+private:
+  u32 E;
+  u32 nDigits; // 16-bit digits of a residue.
+  u32 size;    // the transform size, a power of two >= 2 * nDigits.
+  vector<u64> roots, invRoots;
+
+  void transform(vector<u64>& a, const vector<u64>& w);
+
+  // The digits of A, transformed; and back from the pointwise product to the residue.
+  vector<u64> forward(const Words& A);
+  Words inverse(vector<u64>& a);
+};
@@ -0,0 +1,69 @@
+// Copyright (C) Mihai Preda.
+
+#include "Perf.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+
+namespace {
+
+string counterJson(const string& name, const Perf::Counter& c, bool withBytes) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "\"%s\": {\"calls\": %" PRIu64 ", \"secs\": %.6f, \"us\": %.2f",
+           name.c_str(), c.n, c.total, c.n ? c.total * 1e6 / c.n : 0.0);
+  string s = buf;
+  if (withBytes) {
+    snprintf(buf, sizeof(buf), ", \"GBps\": %.2f", c.total > 0 ? c.bytes / c.total * 1e-9 : 0.0);
+    s += buf;
+  }
+  return s + "}";
+}
+
+string mapJson(const map<string, Perf::Counter>& counters, bool withBytes) {
+  string s;
+  for (const auto& [name, c] : counters) { s += (s.empty() ? "\n    " : ",\n    ") + counterJson(name, c, withBytes); }
+  return "{" + s + "\n  }";
+}
+
+}
+
+void Perf::kernel(const string& name, double secs, u64 bytes) {
+  std::unique_lock lock{mut};
+  kernels[name].add(secs, bytes);
+}
+
+void Perf::span(const string& name, double secs) {
+  std::unique_lock lock{mut};
+  spans[name].add(secs, 0);
+}
+
+void Perf::window(double waitSecs, double wallSecs, double busySecs) {
+  std::unique_lock lock{mut};
+  wait.add(waitSecs, 0);
+  sampledWall += wallSecs;
+  sampledBusy += busySecs;
+}
+
+string Perf::json(u32 E, u32 fftSize) const {
+  std::unique_lock lock{mut};
+  // The GPU is idle while the host enqueues, checks or waits on a transfer; estimated over the sampled windows.
+  double idle = sampledWall > 0 ? std::max(0.0, 1 - sampledBusy / sampledWall) : 0;
+  char buf[256];
+  snprintf(buf, sizeof(buf), "{\n  \"time\": %" PRIu64 ",\n  \"E\": %u,\n  \"fftSize\": %u,\n  \"gpuIdle\": %.4f,\n  ",
+           u64(std::time(nullptr)), E, fftSize, idle);
+  return buf + counterJson("finish", wait, false)
+    + ",\n  \"kernels\": " + mapJson(kernels, true)
+    + ",\n  \"spans\": " + mapJson(spans, false) + "\n}\n";
+}
+
+void Perf::write(const fs::path& path, u32 E, u32 fftSize) const {
+  fs::path tmp = path + ".new";
+  {
+    File fo = File::openWrite(tmp);
+    fo.write(json(E, fftSize));
+  }
+  fs::rename(tmp, path);
+}
@@ -0,0 +1,67 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include "timeutil.h"
+#include "Trace.h"
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Performance counters: the kernel times and the bytes moved (from the profiling events of the queue), the host-side
+// spans (check, save, read, ...) and the time the host waits in finish(). With -perf <file> these are exported as JSON,
+// see tools/monitor.py.
+class Perf {
+public:
+  struct Counter {
+    double total{};
+    u64 n{};
+    u64 bytes{};
+
+    void add(double secs, u64 deltaBytes) {
+      total += secs;
+      ++n;
+      bytes += deltaBytes;
+    }
+  };
+
+  // Measures a host-side span, from construction to destruction.
+  class Span {
+    Perf& perf;
+    const char* name;
+    Timer timer;
+
+  public:
+    Span(Perf& perf, const char* name) : perf{perf}, name{name} {}
+    ~Span() {
+      double secs = timer.at();
+      perf.span(name, secs);
+      if (Trace::enabled()) { Trace::span(name, secs); }
+    }
+  };
+
+  void kernel(const string& name, double secs, u64 bytes);
+  void span(const string& name, double secs);
+
+  // A finish() which waited "waitSecs". If the window since the previous finish() was sampled, the GPU was busy
+  // "busySecs" of its "wallSecs".
+  void window(double waitSecs, double wallSecs = 0, double busySecs = 0);
+
+  string json(u32 E, u32 fftSize) const;
+
+  // Writes the JSON through a temporary file, thus a reader never sees a partial file.
+  void write(const fs::path& path, u32 E, u32 fftSize) const;
+
+private:
+  mutable std::mutex mut;
+  std::map<string, Counter> kernels;
+  std::map<string, Counter> spans;
+  Counter wait;
+  double sampledWall{};
+  double sampledBusy{};
+};
@@ -0,0 +1,137 @@
+// Copyright (C) Mihai Preda.
+
+#include "Pm1Bounds.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace {
+
+constexpr double RHO_STEP = 1.0 / 256;
+constexpr double RHO_END = 32;
+
+// Dickman's rho: 1 on [0, 1], then x * rho'(x) == -rho(x - 1). Tabulated once by the trapezoidal rule, where rho(x - 1)
+// is a point of the table as 1 is a multiple of the step.
+const vector<double>& rhoTable() {
+  static const vector<double> table = []() {
+    const u32 n = RHO_END / RHO_STEP;
+    const u32 one = 1 / RHO_STEP;
+    vector<double> t(n + 1, 1.0);
+    for (u32 i = one; i < n; ++i) {
+      double x0 = i * RHO_STEP;
+      double x1 = x0 + RHO_STEP;
+      t[i + 1] = t[i] - RHO_STEP / 2 * (t[i - one] / x0 + t[i + 1 - one] / x1);
+    }
+    return t;
+  }();
+  return table;
+}
+
+// rho(x) == F(1/x), the probability that a number is x-th root smooth.
+double rho(double x) {
+  if (x <= 1) { return 1; }
+  const vector<double>& table = rhoTable();
+  double pos = x / RHO_STEP;
+  u32 i = pos;
+  if (i + 1 >= table.size()) { return 0; }
+  double f = pos - i;
+  return table[i] * (1 - f) + table[i + 1] * f;
+}
+
+// Integrates f from a to b by the midpoint rule.
+template<u32 STEPS = 31, typename Fun>
+double integral(double a, double b, Fun f) {
+  if (b <= a) { return 0; }
+  double step = (b - a) / STEPS;
+  double sum = 0;
+  for (u32 i = 0; i < STEPS; ++i) { sum += f(a + step * (i + 0.5)); }
+  return sum * step;
+}
+
+// Approximation of the number of primes <= n; the correction "-1.06" was determined experimentally.
+double primepi(double n) { return (n > 0) ? n / (log(n) - 1.06) : 0; }
+
+double nPrimesBetween(double B1, double B2) { return (B2 <= B1) ? 0 : (primepi(B2) - primepi(B1)); }
+
+// The usual trial-factoring depth of GIMPS exponents: 2^76 at 100M, two bits more for every doubling.
+u32 usualFactored(u32 E) { return std::max(60.0, std::round(76 + 2 * log2(E / 100e6))); }
+
+// The P2 multiplications per prime in (B1, B2], with the prime pairing of Pm1Plan.
+constexpr double MULS_PER_PRIME = 0.6;
+
+// The P1 iterations per unit of B1, the bits of the power-smooth of B1: B1 / ln(2).
+constexpr double ITERS_PER_B1 = 1.442;
+
+}
+
+// See "Some Integer Factorization Algorithms using Elliptic Curves", R. P. Brent, page 3, and "Speeding up Integer
+// Multiplication and Factorization", A. Kruppa, chapter 5.3.3.
+std::pair<double, double> Pm1Bounds::probability(u32 E, u32 factoredUpTo, double B1, double B2) {
+  assert(B2 >= B1);
+  // The factors of a Mersenne number are 2*k*p + 1, thus the smoothness is that of the "k" part.
+  const double takeAwayBits = log2(E) + 1;
+
+  // The factors are considered up to BIT_END bits, in slices of SLICE_WIDTH bits.
+  constexpr double BIT_END = 200;
+  constexpr double SLICE_WIDTH = 0.125;
+  const double SLICE_MIDDLE = log2(1 + exp2(SLICE_WIDTH)) - 1;
+
+  const double bitsB1 = log2(B1);
+  const double beta = log2(B2) / bitsB1;
+
+  // The sums of independent events: sum += p - sum * p.
+  double sum1 = 0;
+  double sum12 = 0;
+  for (double bitPos = factoredUpTo + SLICE_MIDDLE; bitPos < BIT_END; bitPos += SLICE_WIDTH) {
+    double alpha = (bitPos - takeAwayBits) / bitsB1;
+    double sliceProb = SLICE_WIDTH / bitPos;
+    double p1 = rho(alpha) * sliceProb;
+    // A factor found by the second stage is not B1-smooth, thus p1 and p2 are disjoint.
+    double p2 = integral(1, beta, [alpha](double x) { return rho(alpha - x) / x; }) * sliceProb;
+    sum1 += fma(p1, -sum1, p1);
+    sum12 += fma(p1 + p2, -sum12, p1 + p2);
+  }
+  return {sum1, sum12 - sum1};
+}
+
+Pm1Bounds Pm1Bounds::plan(u32 E, u32 factoredUpTo, const Costs& costs, u32 fixedB1, u32 fixedB2) {
+  if (!factoredUpTo) { factoredUpTo = usualFactored(E); }
+  const double prpSecs = double(E) * costs.secsPerSquaring;
+
+  vector<double> b1s;
+  if (fixedB1) {
+    b1s.push_back(fixedB1);
+  } else {
+    // The first stage alone costs less than the PRP.
+    for (double b1 = 50'000; b1 * ITERS_PER_B1 < E && b1 <= 100'000'000; b1 *= 1.2) { b1s.push_back(std::round(b1)); }
+  }
+
+  Pm1Bounds best;
+  double bestGain = -1e30;
+  for (double b1 : b1s) {
+    vector<double> b2s;
+    if (fixedB2) {
+      b2s.push_back(fixedB2);
+    } else {
+      for (double ratio : {5, 10, 15, 20, 30, 40, 50, 70, 100, 150, 200, 300, 500, 1000}) {
+        if (b1 * ratio <= MAX_B2) { b2s.push_back(b1 * ratio); }
+      }
+    }
+
+    for (double b2 : b2s) {
+      if (b2 < b1) { continue; }
+      auto [p1, p2] = probability(E, factoredUpTo, b1, b2);
+      // The second stage is cut short by a factor of the first stage.
+      double secs1 = b1 * ITERS_PER_B1 * costs.secsPerSquaring;
+      double secs2 = nPrimesBetween(b1, b2) * MULS_PER_PRIME * costs.secsPerMul;
+      double secs = secs1 + (1 - p1) * secs2;
+      double saved = (p1 + p2) * prpSecs;
+      if (saved - secs > bestGain) {
+        bestGain = saved - secs;
+        best = {u32(b1), u32(b2), p1, p2, secs, saved};
+      }
+    }
+  }
+  return best;
+}
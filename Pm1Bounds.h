@@ -0,0 +1,35 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <utility>
+
+// The P-1 bounds which maximize the expected GPU time saved by a P-1 task: the PRP time of the exponent times the
+// probability of a factor, less the expected time of the two stages. The costs are those measured on the Gpu, and the
+// probability is from Dickman's rho function for the trial-factoring depth of the exponent, as in pm1/pm1.cpp.
+// Maximizing the saving per exponent maximizes the exponents cleared per GPU-hour.
+struct Pm1Bounds {
+  // Keep (block * D)^2 in the P2 giant-steps within u64.
+  static constexpr u64 MAX_B2 = 4'000'000'000;
+
+  // The costs measured on the Gpu, in seconds.
+  struct Costs {
+    double secsPerSquaring; // a P1 (or PRP) iteration.
+    double secsPerMul;      // a P2 multiplication.
+  };
+
+  u32 B1 = 0;
+  u32 B2 = 0;
+  double p1 = 0;        // the probability of a factor found by the first stage,
+  double p2 = 0;        // and by the second stage.
+  double secs = 0;      // the expected time of the P-1.
+  double savedSecs = 0; // the expected PRP time saved.
+
+  // Plans the bounds which are not fixed (0). A factoredUpTo of 0 stands for the usual depth of the exponent.
+  static Pm1Bounds plan(u32 E, u32 factoredUpTo, const Costs& costs, u32 fixedB1 = 0, u32 fixedB2 = 0);
+
+  // The probabilities of a factor found by the first stage, and by the second stage.
+  static std::pair<double, double> probability(u32 E, u32 factoredUpTo, double B1, double B2);
+};
@@ -0,0 +1,98 @@
+// Copyright (C) Mihai Preda.
+
+#include "Pm1Plan.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+const vector<u32> Pm1Plan::Ds{210, 330, 420, 462, 660, 770, 924, 1540, 2310};
+
+vector<bool> Pm1Plan::sieve(u32 B1, u32 B2) {
+  assert(B1 < B2);
+  vector<bool> bits(size_t(B2) + 1, true);
+  bits[0] = bits[1] = false;
+  for (u32 p = 2; u64(p) * p <= B2; ++p) {
+    if (bits[p]) {
+      for (u64 i = u64(p) * p; i <= B2; i += p) { bits[i] = false; }
+    }
+  }
+  // Only the primes above B1 are of interest to the second stage.
+  std::fill(bits.begin(), bits.begin() + B1 + 1, false);
+  return bits;
+}
+
+u32 Pm1Plan::minBufsFor(u32 D) {
+  u32 n = 0;
+  for (u32 j = 1; j < D / 2; j += 2) { n += (std::gcd(j, D) == 1); }
+  return n;
+}
+
+u32 Pm1Plan::pickD(u32 nBuf, u32 B1, u32 B2) {
+  assert(B1 < B2);
+  u32 bestD = 0;
+  double bestCost = 0;
+  for (u32 D : Ds) {
+    if (D > B1 || minBufsFor(D) > nBuf) { continue; }
+
+    // The baby-steps setup costs about D/2 multiplications, and every giant-step costs two.
+    // The number of multiplications for the primes is about the same for all D, thus not part of the choice.
+    double cost = D / 2 + 2.0 * (B2 - B1) / D;
+    if (!bestD || cost < bestCost) {
+      bestD = D;
+      bestCost = cost;
+    }
+  }
+  return bestD;
+}
+
+Pm1Plan::Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2, vector<bool>&& primeBits)
+  : D{D}, nBuf{nBuf}, B1{B1}, B2{B2}, primeBits{std::move(primeBits)} {
+  assert(std::find(Ds.begin(), Ds.end(), D) != Ds.end());
+  assert(D <= B1 && B1 < B2);
+  assert(this->primeBits.size() > B2);
+}
+
+vector<u32> Pm1Plan::jset() const {
+  vector<u32> js;
+  for (u32 j = 1; j < D / 2; j += 2) {
+    if (std::gcd(j, D) == 1) { js.push_back(j); }
+  }
+  assert(js.size() <= MAX_J);
+  return js;
+}
+
+std::pair<u32, vector<Pm1Plan::BitBlock>> Pm1Plan::makePlan() {
+  vector<u32> js = jset();
+  assert(js.size() <= nBuf);
+
+  vector<int> jIndex(D / 2, -1);
+  for (u32 i = 0; i < js.size(); ++i) { jIndex[js[i]] = i; }
+
+  // The block of the prime p is the nearest multiple of D: (p + D/2) / D.
+  u32 startBlock = (u64(B1) + 1 + D / 2) / D;
+  u32 endBlock   = (u64(B2) + D / 2) / D;
+  assert(startBlock >= 1 && startBlock <= endBlock);
+
+  vector<BitBlock> blocks(endBlock - startBlock + 1);
+  u32 nPrimes = 0;
+  u32 nMuls = 0;
+  for (u32 p = B1 + 1; p <= B2 && p > B1; ++p) {
+    if (!primeBits[p]) { continue; }
+    ++nPrimes;
+    u32 block = (u64(p) + D / 2) / D;
+    u64 center = u64(block) * D;
+    u32 j = (p > center) ? p - center : center - p;
+    assert(j < D / 2 && jIndex[j] >= 0);
+    BitBlock& bits = blocks[block - startBlock];
+    if (!bits[jIndex[j]]) {
+      bits[jIndex[j]] = true;
+      ++nMuls;
+    }
+  }
+
+  u32 nPairs = nPrimes - nMuls;
+  log("P2 D=%u: %u primes in (%u, %u], %u blocks, %u muls, %u pairs (%.1f%%)\n",
+      D, nPrimes, B1, B2, u32(blocks.size()), nMuls, nPairs, nPrimes ? 200.0f * nPairs / nPrimes : 0.0f);
+  return {startBlock, blocks};
+}
@@ -0,0 +1,50 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <bitset>
+#include <utility>
+#include <vector>
+
+// P-1 second stage plan, "baby-step giant-step" with prime pairing.
+// Every prime p in (B1, B2] is written as p == block * D +/- j, with j odd, coprime to D, and j < D/2.
+// For x the stage-1 result, a single multiplication by (x^((block * D)^2) - x^(j^2)) covers both primes
+// (block * D - j) and (block * D + j), because (block * D)^2 - j^2 == (block * D - j) * (block * D + j).
+class Pm1Plan {
+public:
+  // The number of "j" values for the largest D (2310) is 240.
+  static constexpr u32 MAX_J = 240;
+
+  // A set of selected "j" values (i.e. baby-steps) for one block.
+  using BitBlock = std::bitset<MAX_J>;
+
+  // The supported values of D, in increasing order.
+  static const vector<u32> Ds;
+
+  // Returns a bitmap indexed by value up to B2, with the primes in (B1, B2] set.
+  static vector<bool> sieve(u32 B1, u32 B2);
+
+  // Number of baby-step buffers needed for D, which is the number of "j" values: eulerPhi(D)/2.
+  static u32 minBufsFor(u32 D);
+
+  // Returns the D with the lowest estimated cost which fits in nBuf buffers, or 0 if none fits.
+  static u32 pickD(u32 nBuf, u32 B1, u32 B2);
+
+  const u32 D;
+  const u32 nBuf;
+  const u32 B1;
+  const u32 B2;
+
+  Pm1Plan(u32 D, u32 nBuf, u32 B1, u32 B2, vector<bool>&& primeBits);
+
+  // The "j" values in increasing order. The bit i of a BitBlock refers to jset()[i].
+  vector<u32> jset() const;
+
+  // Returns the first block, and for each block starting with it the set of selected "j" values.
+  std::pair<u32, vector<BitBlock>> makePlan();
+
+private:
+  vector<bool> primeBits;
+};
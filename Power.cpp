@@ -0,0 +1,82 @@
+// Copyright (C) Mihai Preda.
+
+#include "Power.h"
+#include "File.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+
+// The hwmon power file of the PCI device: the average power if there is one, otherwise the instant power (in microwatts).
+fs::path findPowerFile(const string& pciAddress) {
+  if (pciAddress.empty()) { return {}; }
+  std::error_code ec;
+  for (const auto& entry : fs::directory_iterator(fs::path{"/sys/bus/pci/devices"} / pciAddress / "hwmon", ec)) {
+    for (const char* name : {"power1_average", "power1_input"}) {
+      if (fs::exists(entry.path() / name, ec)) { return entry.path() / name; }
+    }
+  }
+  return {};
+}
+
+// The step of the pause fraction, per block over or under the cap.
+constexpr double PAUSE_STEP = 0.02;
+constexpr double MAX_PAUSE_FRACTION = 0.8;
+
+}
+
+Power::Power(const string& pciAddress, u32 capWatts) : powerFile{findPowerFile(pciAddress)}, capWatts{capWatts} {
+  if (capWatts && !valid()) {
+    log("-powerCap %uW: no power reading for the device, not governed\n", capWatts);
+  } else if (valid()) {
+    lastWatts = avgWatts = read();
+    if (capWatts) { log("power cap %uW, now %.0fW\n", capWatts, lastWatts); }
+  }
+}
+
+double Power::read() const {
+  File fi = File::openRead(powerFile);
+  string line = fi ? fi.readLine() : "";
+  return line.empty() ? 0 : std::strtod(line.c_str(), nullptr) * 1e-6;
+}
+
+double Power::pace() {
+  if (!valid()) { return 0; }
+
+  double secs = timer.reset();
+  double watts = read();
+  joules += (lastWatts + watts) / 2 * secs;
+  reportSecs += secs;
+  lastWatts = watts;
+  avgWatts = 0.8 * avgWatts + 0.2 * watts;
+
+  if (!capWatts) { return 0; }
+
+  // The fraction of time paused moves in small steps towards the cap, as the power while paused is not zero.
+  if (avgWatts > capWatts) {
+    pauseFraction = std::min(MAX_PAUSE_FRACTION, pauseFraction + PAUSE_STEP);
+  } else if (avgWatts < 0.95 * capWatts) {
+    pauseFraction = std::max(0.0, pauseFraction - PAUSE_STEP);
+  }
+  double busySecs = std::max(0.0, secs - pauseSecs);
+  pauseSecs = busySecs * pauseFraction / (1 - pauseFraction);
+  return pauseSecs;
+}
+
+string Power::report(u32 k) {
+  bool first = !reported || k <= reportK;
+  reported = true;
+  if (!valid() || first || reportSecs <= 0) {
+    joules = 0;
+    reportSecs = 0;
+    reportK = k;
+    return "";
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %.0fW %.2fJ/it", joules / reportSecs, joules / (k - reportK));
+  joules = 0;
+  reportSecs = 0;
+  reportK = k;
+  return buf;
+}
@@ -0,0 +1,43 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include "timeutil.h"
+
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+// The board power of the GPU, and the power-cap governor of the PRP loop (-powerCap).
+// The power is read from the hwmon of the PCI device of the GPU (amdgpu on Linux), found by its PCI address (see
+// getPciAddress) as the OpenCL device index does not follow the DRM card numbering; without it there is no power
+// reading, and no governing.
+class Power {
+public:
+  Power(const string& pciAddress, u32 capWatts);
+
+  bool valid() const { return !powerFile.empty(); }
+
+  // Samples the power at a block boundary, integrating the energy. Returns the seconds to pause the GPU (idle) to keep
+  // its average power under the cap, 0 without a cap.
+  double pace();
+
+  // The power and the energy per iteration since the previous report, e.g. " 231W 0.62J/it"; empty if not valid.
+  string report(u32 k);
+
+private:
+  fs::path powerFile;
+  u32 capWatts;
+  Timer timer;
+  double lastWatts{};
+  double avgWatts{};
+  double joules{};
+  double reportSecs{};
+  u32 reportK{};
+  bool reported{};
+  double pauseFraction{};
+  double pauseSecs{};
+
+  double read() const;
+};
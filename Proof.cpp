@@ -5,6 +5,9 @@
 #include "Sha3Hash.h"
 #include "MD5.h"
 #include "Gpu.h"
+#include "FFTConfig.h"
+#include "Args.h"
+#include "log.h"
 
 #include <vector>
 #include <string>
@@ -12,6 +15,8 @@
 #include <filesystem>
 #include <cinttypes>
 #include <climits>
+#include <cstring>
+#include <future>
 
 #if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
 #error Byte order must be Little Endian
@@ -37,8 +42,7 @@ string fileHash(const fs::path& filePath) {
   return std::move(h).finish();
 }
 
-ProofInfo getInfo(const fs::path& proofFile) {
-  string hash = proof::fileHash(proofFile);
+ProofInfo getHeader(const fs::path& proofFile) {
   File fi = File::openReadThrow(proofFile);
   u32 E = 0, power = 0;
   char c = 0;
@@ -46,7 +50,13 @@ ProofInfo getInfo(const fs::path& proofFile) {
     log("Proof file '%s' has invalid header\n", proofFile.string().c_str());
     throw "Invalid proof header";
   }
-  return {power, E, hash};
+  return {power, E, ""};
+}
+
+ProofInfo getInfo(const fs::path& proofFile) {
+  ProofInfo info = getHeader(proofFile);
+  info.md5 = proof::fileHash(proofFile);
+  return info;
 }
 
 }
@@ -59,12 +69,22 @@ fs::path Proof::file(const fs::path& proofDir) const {
   return proofDir / (strE + '-' + to_string(power) + ".proof");  
 }
 
-void Proof::save(const fs::path& proofFile) const {
+ProofInfo Proof::save(const fs::path& proofFile) const {
+  // The MD5 of the file is computed as it is written, to not read the file back.
+  MD5 h;
   File fo = File::openWrite(proofFile);
+  auto put = [&fo, &h](const void* data, u32 size) {
+               fo.write(data, size);
+               h.update(data, size);
+             };
+  
   u32 power = middles.size();
-  fo.printf(HEADER_v2, power, E, '\n');
-  fo.write(B.data(), (E-1)/8+1);
-  for (const Words& w : middles) { fo.write(w.data(), (E-1)/8+1); }
+  char header[256];
+  snprintf(header, sizeof(header), HEADER_v2, power, E, '\n');
+  put(header, strlen(header));
+  put(B.data(), (E-1)/8+1);
+  for (const Words& w : middles) { put(w.data(), (E-1)/8+1); }
+  return {power, E, std::move(h).finish()};
 }
 
 Proof Proof::load(const fs::path& path) {
@@ -96,13 +116,18 @@ bool Proof::verify(Gpu *gpu) const {
   Words A{makeWords(E, 3)};
   Words B{this->B};
   
-  auto hash = proof::hashWords(E, B);
+  // The hashes do not depend on the GPU results, thus are computed ahead on background threads.
+  vector<shared_future<array<u64, 4>>> hashes;
+  shared_future<array<u64, 4>> hash = async(launch::async, [this]() { return proof::hashWords(E, this->B); }).share();
+  for (u32 i = 0; i < power; ++i) {
+    hash = async(launch::async, [this, i, hash]() { return proof::hashWords(E, hash.get(), middles[i]); }).share();
+    hashes.push_back(hash);
+  }
 
   u32 span = E;
   for (u32 i = 0; i < power; ++i, span = (span + 1) / 2) {
     const Words& M = middles[i];
-    hash = proof::hashWords(E, hash, M);
-    u64 h = hash[0];    
+    u64 h = hashes[i].get()[0];
     A = gpu->expMul(A, h, M);
     
     if (span % 2) {
@@ -126,16 +151,60 @@ bool Proof::verify(Gpu *gpu) const {
   return ok;
 }
 
+void Proof::verifyDir(const Args& args, const fs::path& dir) {
+  // (FFT size, exponent, file)
+  vector<tuple<u32, u32, fs::path>> proofs;
+  vector<FFTConfig> configs = FFTConfig::genConfigs();
+  for (const auto& entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() != ".proof") { continue; }
+    try {
+      u32 E = proof::getHeader(entry.path()).exp;
+      auto it = find_if(configs.begin(), configs.end(), [E](const FFTConfig& c) { return c.maxExp() >= E; });
+      proofs.push_back({it == configs.end() ? 0 : it->fftSize(), E, entry.path()});
+    } catch (const char* mes) {
+      log("proof '%s' skipped: %s\n", entry.path().string().c_str(), mes);
+    } catch (const std::exception& e) {
+      log("proof '%s' skipped: %s\n", entry.path().string().c_str(), e.what());
+    }
+  }
+  std::sort(proofs.begin(), proofs.end());
+  log("Verifying %u proofs from '%s'\n", u32(proofs.size()), dir.string().c_str());
+
+  u32 nOK = 0;
+  vector<fs::path> failed;
+  unique_ptr<Gpu> gpu;
+  u32 gpuE = 0;
+  for (const auto& [fftSize, E, path] : proofs) {
+    LogContext context{to_string(E)};
+    bool ok = false;
+    try {
+      // One Gpu for all the proofs of the same exponent (e.g. a test and its double-check).
+      if (!gpu || gpuE != E) {
+        gpu.reset();
+        gpu = Gpu::make(E, args);
+        gpuE = E;
+      }
+      ok = Proof::load(path).verify(gpu.get());
+    } catch (const char* mes) {
+      log("proof '%s' : %s\n", path.string().c_str(), mes);
+    } catch (const std::exception& e) {
+      log("proof '%s' : %s\n", path.string().c_str(), e.what());
+    }
+    log("proof '%s' %s\n", path.string().c_str(), ok ? "verified" : "failed");
+    if (ok) { ++nOK; } else { failed.push_back(path); }
+  }
+  
+  log("Verified %u proofs: %u OK, %u failed\n", u32(proofs.size()), nOK, u32(failed.size()));
+  for (const fs::path& path : failed) { log("failed: %s\n", path.string().c_str()); }
+}
+
 // ---- ProofSet ----
 
 ProofSet::ProofSet(const fs::path& tmpDir, u32 E, u32 power)
-  : E{E}, power{power}, exponentDir(tmpDir / to_string(E)) {
+  : E{E}, power{power}, exponentDir(tmpDir / to_string(E)), cache{E, power, exponentDir} {
   
   assert(E & 1); // E is supposed to be prime
   assert(power > 0);
-    
-  fs::create_directory(exponentDir);
-  fs::create_directory(proofPath);
 
   vector<u32> spans;
   for (u32 span = (E + 1) / 2; spans.size() < power; span = (span + 1) / 2) { spans.push_back(span); }
@@ -170,10 +239,20 @@ u32 ProofSet::effectivePower(const fs::path& tmpDir, u32 E, u32 power, u32 curre
   assert(false);
 }
     
+u32 ProofSet::powerForDisk(u32 E, u32 power, u64 diskBudget) {
+  u32 p = power;
+  while (diskBudget && p > 1 && diskUsage(E, p) > diskBudget) { --p; }
+  if (diskBudget && diskUsage(E, p) > diskBudget) {
+    log("Proof power %u for %u needs %.2f GB of disk, above the -proofDisk %.2f GB\n",
+        p, E, diskUsage(E, p) / double(1u << 30), diskBudget / double(1u << 30));
+  }
+  return p;
+}
+
 bool ProofSet::isValidTo(u32 limitK) const {
   for (u32 k : points) {
     if (k > limitK) { break; }
-    try { load(k); } catch (...) { return false; }
+    if (!cache.has(k)) { return false; }
   }
   return true;
 }
@@ -196,6 +275,16 @@ Words ProofSet::load(u32 k) const {
 }
 
 Proof ProofSet::computeProof(Gpu *gpu) const {
+  // The residues in their order of use, to read them from disk in the background one ahead of their use.
+  vector<u32> order;
+  for (u32 p = 0; p < power; ++p) {
+    u32 s = (1u << (power - p - 1));
+    for (u32 i = 0; i < (1u << p); ++i) { order.push_back(points[s * (i * 2 + 1) - 1]); }
+  }
+  auto prefetch = [this](u32 k) { return async(launch::async, [this, k]() { return load(k); }); };
+  u32 nextPos = 0;
+  future<Words> nextWords = prefetch(order[nextPos++]);
+  
   Words B = load(E);
   Words A = makeWords(E, 3);
 
@@ -204,28 +293,65 @@ Proof ProofSet::computeProof(Gpu *gpu) const {
 
   auto hash = proof::hashWords(E, B);
 
-  vector<Buffer<i32>> bufVect = gpu->makeBufVector(power);
+  // The middle of a level is read back and hashed while the next level starts on the GPU; its hash is needed only
+  // from the second residue of the next level on.
+  future<void> pendingMiddle;
+  auto endLevel = [&pendingMiddle]() { if (pendingMiddle.valid()) { pendingMiddle.get(); } };
+  
+  // The stack of the products. When GPU memory is short the bottom of the stack, which is the least used, is spilled
+  // to host memory: slot j is hostVect[j] for j < nHost, and on the GPU bufVect[j - nHost] otherwise.
+  vector<PooledBuffer<i32>> bufVect = gpu->makeBufVector(power);
+  u32 nHost = power - bufVect.size();
+  if (nHost) { log("proof: %u of %u buffers in host memory for lack of GPU memory\n", nHost, power); }
+  vector<Words> hostVect(nHost);
+
+  auto push = [&](u32 j, const Words& w) {
+    if (j < nHost) {
+      hostVect[j] = w;
+    } else {
+      gpu->writeIn(bufVect[j - nHost], w);
+    }
+  };
 
+  // slot a := slot a ^ h * slot b, with a < b.
+  auto combine = [&](u32 a, u64 h, u32 b) {
+    if (a >= nHost) {
+      gpu->expMul(bufVect[a - nHost], h, bufVect[b - nHost]);
+    } else {
+      hostVect[a] = gpu->expMul(hostVect[a], h, (b < nHost) ? hostVect[b] : gpu->readAndCompress(bufVect[b - nHost]));
+    }
+  };
+  
   for (u32 p = 0; p < power; ++p) {
-    auto bufIt = bufVect.begin();
-    assert(p == hashes.size());
+    u32 top = 0;
     u32 s = (1u << (power - p - 1));
     for (u32 i = 0; i < (1u << p); ++i) {
-      Words w = load(points[s * (i * 2 + 1) - 1]);
-      gpu->writeIn(*bufIt++, w);
+      Words w = nextWords.get();
+      assert(order[nextPos - 1] == points[s * (i * 2 + 1) - 1]);
+      if (nextPos < order.size()) { nextWords = prefetch(order[nextPos++]); }
+      
+      push(top++, w);
+      if (i == 1) {
+        endLevel();
+        assert(p == hashes.size());
+      }
       for (u32 k = 0; i & (1u << k); ++k) {
         assert(k <= p - 1);
-        --bufIt;
-        u64 h = hashes[p - 1 - k];
-        gpu->expMul(*(bufIt - 1), h, *bufIt);
+        --top;
+        combine(top - 1, hashes[p - 1 - k], top);
       }
     }
-    assert(bufIt == bufVect.begin() + 1);
-    middles.push_back(gpu->readAndCompress(bufVect.front()));
-    hash = proof::hashWords(E, hash, middles.back());
-    hashes.push_back(hash[0]);
-
-    log("proof level %u : M %016" PRIx64 ", h %016" PRIx64 "\n", p, res64(middles.back()), hashes.back()); 
+    assert(top == 1);
+    endLevel();
+    shared_future<Words> middle = nHost ? async(launch::deferred, [w = hostVect[0]]() { return w; }).share()
+      : gpu->readAndCompressAsync(bufVect.front());
+    pendingMiddle = async(launch::async, [&, p, middle]() {
+                                           middles.push_back(middle.get());
+                                           hash = proof::hashWords(E, hash, middles.back());
+                                           hashes.push_back(hash[0]);
+                                           log("proof level %u : M %016" PRIx64 ", h %016" PRIx64 "\n", p, res64(middles.back()), hashes.back());
+                                         });
   }
+  endLevel();
   return Proof{E, std::move(B), std::move(middles)};
 }
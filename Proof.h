@@ -9,6 +9,7 @@
 namespace fs = std::filesystem;
 
 class Gpu;
+class Args;
 
 struct ProofInfo {
   u32 power;
@@ -24,6 +25,9 @@ array<u64, 4> hashWords(u32 E, array<u64, 4> prefix, const Words& words);
 
 string fileHash(const fs::path& filePath);
 
+// The power and exponent from the header, without the hash.
+ProofInfo getHeader(const fs::path& proofFile);
+
 ProofInfo getInfo(const fs::path& proofFile);
 
 }
@@ -45,11 +49,15 @@ public:
 
   static Proof load(const fs::path& path);
   
-  void save(const fs::path& proofResultDir) const;
+  // Returns the info of the saved file, including its MD5.
+  ProofInfo save(const fs::path& proofFile) const;
 
   fs::path file(const fs::path& proofDir) const;
   
   bool verify(Gpu *gpu) const;
+
+  // Verifies all the proofs in the folder, in the order of their FFT size.
+  static void verifyDir(const Args& args, const fs::path& dir);
 };
 
 class ProofSet {
@@ -59,8 +67,7 @@ public:
   
 private:  
   fs::path exponentDir;
-  fs::path proofPath{exponentDir / "proof"};
-  ProofCache cache{E, proofPath};
+  ProofCache cache;
 
   vector<u32> points;  
   
@@ -71,6 +78,12 @@ private:
 public:
   
   static u32 effectivePower(const fs::path& tmpDir, u32 E, u32 power, u32 currentK);
+
+  // The disk space used by the proof residues.
+  static u64 diskUsage(u32 E, u32 power) { return ProofCache::fileSize(E, power); }
+
+  // The largest power up to "power" whose residues fit in diskBudget bytes (0 for no limit). At least 1.
+  static u32 powerForDisk(u32 E, u32 power, u64 diskBudget);
   
   ProofSet(const fs::path& tmpDir, u32 E, u32 power);
     
@@ -79,6 +92,9 @@ public:
   void save(u32 k, const Words& words);
 
   Words load(u32 k) const;
+
+  // Waits until the residues up to k are on disk (see ProofCache). False if they could not be written.
+  bool persisted(u32 k) { return cache.persisted(k); }
         
   Proof computeProof(Gpu *gpu) const;
 };
@@ -2,36 +2,227 @@
 
 #include "ProofCache.h"
 #include "File.h"
+#include "Trace.h"
 
-bool ProofCache::write(u32 k, const Words& words) {
+#include <chrono>
+
+namespace {
+
+struct Header {
+  u32 magic;
+  u32 E;
+  u32 nWords;
+  u32 maxSlots;
+};
+
+constexpr u32 MAGIC = 0x31465250; // "PRF1"
+
+}
+
+ProofCache::ProofCache(u32 E, u32 power, const fs::path& exponentDir)
+  : E{E},
+    nWords{E / 32 + 1},
+    path{exponentDir / "proof.bin"},
+    legacyDir{exponentDir / "proof"},
+    index(MAX_SLOTS) {
+  assert(power > 0 && (1u << power) <= MAX_SLOTS);
+  if (!readIndex()) { create(); }
+  reserve(1u << power);
+}
+
+u64 ProofCache::indexOffset(u32 slot) { return sizeof(Header) + u64(slot) * sizeof(Slot); }
+
+u64 ProofCache::dataOffset(u32 E, u32 slot) { return indexOffset(MAX_SLOTS) + u64(slot) * (E / 32 + 1) * sizeof(u32); }
+
+bool ProofCache::readIndex() {
+  File f = File::openRead(path);
+  if (!f) { return false; }
   try {
-    File f = File::openWrite(proofPath / to_string(k));
-    f.write(words);
-    f.write<u32>({crc32(words)});
-  } catch (fs::filesystem_error& e) {
+    Header h = f.read<Header>(1)[0];
+    if (h.magic != MAGIC || h.E != E || h.nWords != nWords || h.maxSlots != MAX_SLOTS) {
+      log("Invalid proof residues file '%s', recreating\n", f.name.c_str());
+      return false;
+    }
+    index = f.read<Slot>(MAX_SLOTS);
+  } catch (const std::ios_base::failure& e) {
+    log("Can't read proof index '%s', recreating\n", f.name.c_str());
     return false;
   }
+  return true;
+}
+
+void ProofCache::create() {
+  index.assign(MAX_SLOTS, Slot{});
+  fs::create_directories(path.parent_path());
+  File f = File::openWrite(path);
+  f.write(Header{MAGIC, E, nWords, MAX_SLOTS});
+  f.write(index);
+}
+
+void ProofCache::reserve(u32 nSlots) {
+  u64 size = dataOffset(nSlots);
+  std::error_code noThrow;
+  if (fs::file_size(path, noThrow) < size) {
+    fs::resize_file(path, size, noThrow);
+    if (noThrow) { log("Can't preallocate '%s': %s\n", path.string().c_str(), noThrow.message().c_str()); }
+  }
+}
+
+ProofCache::~ProofCache() {
+  {
+    std::unique_lock lock{mut};
+    stop = true;
+  }
+  cond.notify_all();
+  if (writer.joinable()) { writer.join(); }
+}
+
+int ProofCache::slotOf(u32 k, Slot* entry) const {
+  std::unique_lock lock{mut};
+  for (u32 i = 0; i < MAX_SLOTS && index[i].k; ++i) {
+    if (index[i].k == k) {
+      if (entry) { *entry = index[i]; }
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool ProofCache::has(u32 k) const {
+  {
+    std::unique_lock lock{mut};
+    if (staged.count(k)) { return true; }
+  }
+  // The index entry is written before the residue leaves the staging.
+  return slotOf(k) >= 0 || fs::exists(legacyDir / to_string(k));
+}
+
+void ProofCache::save(u32 k, const Words& words) {
+  assert(k && words.size() == nWords);
+  std::unique_lock lock{mut};
+  if (!writer.joinable()) { writer = std::thread{[this]() { writeLoop(); }}; }
+  // While the disk is failing the residues are kept in RAM, however many.
+  cond.wait(lock, [this]() { return staged.size() < MAX_STAGED || failing; });
+  staged[k] = words;
+  cond.notify_all();
+}
 
-  assert(words == read(k));
+Words ProofCache::load(u32 k) const {
+  {
+    std::unique_lock lock{mut};
+    if (auto it = staged.find(k); it != staged.end()) { return it->second; }
+  }
+  return read(k);
+}
+
+bool ProofCache::persisted(u32 k) {
+  std::unique_lock lock{mut};
+  auto done = [this, k]() { return staged.empty() || staged.begin()->first > k; };
+  cond.wait(lock, [this, &done]() { return failing || done(); });
+  return done();
+}
+
+bool ProofCache::write(u32 k, const Words& words) {
+  assert(k && words.size() == nWords);
+  int slot = slotOf(k);
+  if (slot < 0) {
+    std::unique_lock lock{mut};
+    slot = 0;
+    while (slot < int(MAX_SLOTS) && index[slot].k) { ++slot; }
+    if (slot == int(MAX_SLOTS)) {
+      log("No free slot for the proof residue %u in '%s'\n", k, path.string().c_str());
+      return false;
+    }
+  }
+
+  Slot entry{k, crc32(words)};
+  try {
+    {
+      File f = File::openReadWrite(path);
+      f.seek(dataOffset(slot));
+      f.write(words);
+    }
+    // The index entry only after the residue is on disk.
+    File f = File::openReadWrite(path);
+    f.seek(indexOffset(slot));
+    f.write(entry);
+  } catch (const fs::filesystem_error& e) {
+    return false;
+  } catch (const std::ios_base::failure& e) {
+    log("%s\n", e.what());
+    return false;
+  }
+  std::unique_lock lock{mut};
+  index[slot] = entry;
   return true;
 }
 
+bool ProofCache::writeVerified(u32 k, const Words& words) {
+  if (!write(k, words)) { return false; }
+  try {
+    if (read(k) == words) { return true; }
+    log("Proof residue %u read back different from '%s'\n", k, path.string().c_str());
+  } catch (const fs::filesystem_error& e) {
+  } catch (const std::ios_base::failure& e) {
+    log("%s\n", e.what());
+  }
+  return false;
+}
+
 Words ProofCache::read(u32 k) const {
-  File f = File::openReadThrow(proofPath / to_string(k));
-  vector<u32> words = f.read<u32>(E / 32 + 2);
-  u32 checksum = words.back();
-  words.pop_back();
-  if (checksum != crc32(words)) {
-    log("checksum %x (expected %x) in '%s'\n", crc32(words), checksum, f.name.c_str());
+  Slot entry{};
+  int slot = slotOf(k, &entry);
+  if (slot < 0) {
+    File f = File::openReadThrow(legacyDir / to_string(k));
+    vector<u32> words = f.read<u32>(nWords + 1);
+    u32 checksum = words.back();
+    words.pop_back();
+    if (checksum != crc32(words)) {
+      log("checksum %x (expected %x) in '%s'\n", crc32(words), checksum, f.name.c_str());
+      throw fs::filesystem_error{"checksum mismatch", {}};
+    }
+    return words;
+  }
+  
+  File f = File::openReadThrow(path);
+  f.seek(dataOffset(slot));
+  vector<u32> words = f.read<u32>(nWords);
+  if (entry.crc != crc32(words)) {
+    log("checksum %x (expected %x) of residue %u in '%s'\n", crc32(words), entry.crc, k, f.name.c_str());
     throw fs::filesystem_error{"checksum mismatch", {}};
   }
   return words;
 }
 
+void ProofCache::writeLoop() {
+  std::unique_lock lock{mut};
+  while (true) {
+    cond.wait(lock, [this]() { return stop || !staged.empty(); });
+    if (staged.empty()) { break; }
+    auto [k, words] = *staged.begin();
+    lock.unlock();
+    bool ok = false;
+    {
+      Trace::Span span{"proofWrite"};
+      ok = writeVerified(k, words);
+    }
+    lock.lock();
+    if (ok) {
+      staged.erase(k);
+      failing = false;
+      cond.notify_all();
+      continue;
+    }
 
-void ProofCache::flush() {
-  for (auto it = pending.cbegin(), end = pending.cend(); it != end && write(it->first, it->second); it = pending.erase(it));
-  if (!pending.empty()) {
-    log("Could not write %u residues under '%s' -- hurry make space!\n", u32(pending.size()), proofPath.string().c_str());
+    if (!failing || stop) {
+      log("Could not write %u residues to '%s' -- hurry make space!\n", u32(staged.size()), path.string().c_str());
+    }
+    failing = true;
+    cond.notify_all();
+    if (stop) {
+      staged.clear();
+      break;
+    }
+    cond.wait_for(lock, std::chrono::seconds(RETRY_SECS), [this]() { return stop; });
   }
 }
@@ -4,37 +4,84 @@
 
 #include "common.h"
 
-#include <unordered_map>
+#include <condition_variable>
 #include <filesystem>
+#include <map>
+#include <mutex>
+#include <thread>
 
 namespace fs = std::filesystem;
 
+// The proof residues of one exponent, in a single preallocated file "proof.bin" with a fixed layout:
+// a header, an index of (k, CRC) for up to MAX_SLOTS residues, followed by the residues in slots of fixed size.
+// The index entry of a residue is written after the residue itself, so an index entry implies a complete residue,
+// and the presence of the residues is known from the index alone.
+// A save only stages the residue in RAM, from where a background thread writes it to the file and reads it back to
+// verify its CRC; thus a slow disk does not stall the PRP at the proof points. Up to MAX_STAGED residues are staged,
+// a save beyond that waits for the disk. A residue that can't be written (e.g. the disk is full) stays staged and is
+// retried every RETRY_SECS.
 class ProofCache {
+public:
+  // Enough for proof power 10.
+  static constexpr u32 MAX_SLOTS = 1024;
+  static constexpr u32 MAX_STAGED = 8;
+  static constexpr u32 RETRY_SECS = 10;
+
+private:
+  struct Slot {
+    u32 k;
+    u32 crc;
+  };
+  
   const u32 E;
-  std::unordered_map<u32, Words> pending;
-  fs::path proofPath;
+  const u32 nWords;
+  fs::path path;
+  fs::path legacyDir; // the older layout with one file per residue, read-only.
+  vector<Slot> index;
+
+  // The staged residues, and the state of the writer thread; the index is written under "mut" too.
+  std::map<u32, Words> staged;
+  mutable std::mutex mut;
+  std::condition_variable cond;
+  bool failing = false;
+  bool stop = false;
+  std::thread writer;
+
+  static u64 indexOffset(u32 slot);
+  static u64 dataOffset(u32 E, u32 slot);
+  u64 dataOffset(u32 slot) const { return dataOffset(E, slot); }
+  
+  bool readIndex();
+  void create();
+  void reserve(u32 nSlots);
+  
+  // The slot of k, or -1; with "entry", a copy of its index entry, taken under the lock.
+  int slotOf(u32 k, Slot* entry = nullptr) const;
   
   bool write(u32 k, const Words& words);
 
+  bool writeVerified(u32 k, const Words& words);
+
   Words read(u32 k) const;
 
-  void flush();
+  void writeLoop();
   
 public:
-  ProofCache(u32 E, const fs::path& proofPath) : E{E}, proofPath{proofPath} {}
-  
-  ~ProofCache() { flush(); }
+  ProofCache(u32 E, u32 power, const fs::path& exponentDir);
+
+  // The size of the file for the given power.
+  static u64 fileSize(u32 E, u32 power) { return dataOffset(E, 1u << power); }
   
-  void save(u32 k, const Words& words) {
-    if (pending.empty() && write(k, words)) { return; }    
-    pending[k] = words;
-    flush();
-  }
-
-  Words load(u32 k) const {
-    auto it = pending.find(k);
-    return (it == pending.end()) ? read(k) : it->second;
-  }
-
-  void clear() { pending.clear(); }
+  // Writes out the staged residues.
+  ~ProofCache();
+
+  void save(u32 k, const Words& words);
+
+  Words load(u32 k) const;
+
+  // Without reading the residue.
+  bool has(u32 k) const;
+
+  // Waits until the residues up to k are in the file. False if a residue could not be written.
+  bool persisted(u32 k);
 };
@@ -3,11 +3,19 @@
 #pragma once
 
 #include "Buffer.h"
+#include "Perf.h"
+#include "Trace.h"
+#include "timeutil.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <unistd.h>
 
@@ -34,48 +42,201 @@ using QueuePtr = std::shared_ptr<class Queue>;
 class Queue : public QueueHolder {
   using TimeMap = std::map<std::string, TimeInfo>;
   TimeMap timeMap;
-  std::vector<std::pair<Event, TimeMap::iterator>> events;
-  bool profile{};
+
+  struct Pending {
+    Event event;
+    TimeMap::iterator it;
+    u64 bytes;
+  };
+  std::vector<Pending> events;
+
+  // The kernels are profiled in one out of sampleStep windows between finish() calls (0 for never).
+  u32 sampleStep{};
+  u32 nWindow{};
+  u32 nRun{};
+  Timer windowTimer;
   bool cudaYield{};
 
+  bool sampling() const { return sampleStep && nWindow % sampleStep == 0; }
+
+  // With -yield: the average time from a finish() to the completion of the work enqueued after it.
+  double expectedSecs = 0;
+
+  // The markers at the ends of the blocks enqueued since finish(), oldest first.
+  std::deque<Event> marks;
+  Timer markTimer;
+
+  // With -trace, the timeline of the kernels of this queue.
+  std::unique_ptr<Trace::Track> track;
+
+  // With -yield: the average time between the completions of two marked blocks.
+  double expectedBlockSecs = 0;
+
+  // The host spins (with yield) only for this long before the expected completion.
+  static constexpr double SPIN_SECS = 0.0002;
+
+  static void average(double& avg, double secs) { avg = avg ? 0.8 * avg + 0.2 * secs : secs; }
+
+  // Waits for the event without keeping a CPU core busy: sleeps until woken by the completion callback, or until
+  // shortly before the expected completion in "remainSecs", then spins with yield() for a short while to cut the
+  // wake-up latency.
+  static void waitYield(Event& last, double remainSecs) {
+    struct Done {
+      std::mutex mut;
+      std::condition_variable cond;
+      bool done = false;
+    };
+    auto done = std::make_shared<Done>();
+    auto signal = [done]() {
+      std::unique_lock lock{done->mut};
+      done->done = true;
+      done->cond.notify_all();
+    };
+    bool hasCallback = setCompletionCallback(last.get(), signal);
+    auto isDone = [&done]() { return done->done; };
+
+    if (hasCallback) {
+      double sleepSecs = remainSecs - SPIN_SECS;
+      if (sleepSecs > 0) {
+        std::unique_lock lock{done->mut};
+        done->cond.wait_for(lock, std::chrono::duration<double>(sleepSecs), isDone);
+      }
+    }
+
+    Timer spinTimer;
+    while (!last.isComplete()) {
+      if (spinTimer.at() < 2 * SPIN_SECS) {
+        std::this_thread::yield();
+      } else if (hasCallback) {
+        std::unique_lock lock{done->mut};
+        done->cond.wait(lock, isDone);
+        break;
+      } else {
+#if defined(__CYGWIN__)
+        sleep(1);
+#else
+        usleep(100);
+#endif
+      }
+    }
+  }
+
 public:
-  Queue(cl_queue q, bool profile, bool cudaYield) : QueueHolder{q}, profile{profile}, cudaYield{cudaYield} {}  
-  static QueuePtr make(const Context& context, bool profile, bool cudaYield) { return make_shared<Queue>(makeQueue(context.deviceId(), context.get(), profile), profile, cudaYield); }
+  Perf perf;
+
+  bool profiling() const { return sampleStep; }
+
+  Queue(cl_queue q, u32 sampleStep, bool cudaYield, cl_device_id device)
+    : QueueHolder{q}, sampleStep{sampleStep}, cudaYield{cudaYield}
+    , track{Trace::enabled() ? std::make_unique<Trace::Track>(device, getShortInfo(device) + ' ' + getPciAddress(device))
+            : nullptr} {}
+  static QueuePtr make(const Context& context, u32 sampleStep, bool cudaYield) {
+    return make_shared<Queue>(makeQueue(context.deviceId(), context.get(), sampleStep != 0), sampleStep, cudaYield,
+                              context.deviceId());
+  }
   
-  void run(cl_kernel kernel, size_t groupSize, size_t workSize, const string &name) {
+  void run(cl_kernel kernel, size_t groupSize, size_t workSize, const string &name, u64 bytes = 0) {
+    bool profile = sampling();
+    ++nRun;
     Event event{::run(get(), kernel, groupSize, workSize, name, profile || cudaYield)};
     auto it = profile ? timeMap.insert({name, TimeInfo{}}).first : timeMap.end();
     if (profile) {
-      events.emplace_back(std::move(event), it);
+      events.push_back({std::move(event), it, bytes});
     } else if (cudaYield) {
       if (events.empty()) {
-        events.emplace_back(std::move(event), it);
+        events.push_back({std::move(event), it, bytes});
       } else {
-        events.front() = std::make_pair(std::move(event), it);
+        events.front() = {std::move(event), it, bytes};
       }
     }
   }
 
-  bool allEventsCompleted() { return events.empty() || events.back().first.isComplete(); }
+  // Enqueues a recorded command buffer. Not profiled. Returns false if the driver rejected it, with nothing enqueued.
+  bool run(cl_command_buffer_khr buf) {
+    assert(!profiling());
+    EventHolder event;
+    if (!enqueueCommandBuffer(get(), buf, cudaYield ? &event : nullptr)) { return false; }
+    ++nRun;
+    if (cudaYield) {
+      if (events.empty()) {
+        events.push_back({Event{std::move(event)}, timeMap.end(), 0});
+      } else {
+        events.back() = {Event{std::move(event)}, timeMap.end(), 0};
+      }
+    }
+    return true;
+  }
+
+  // Marks the end of a block of work, and submits it to the GPU.
+  void mark() {
+    if (marks.empty()) { markTimer.reset(); }
+    marks.push_back(Event{enqueueMarker(get())});
+    flush();
+  }
+
+  // Waits until at most "depth" of the marked blocks are not completed, thus the host keeps that many blocks ahead
+  // of the GPU instead of draining the queue with finish().
+  void waitMarks(u32 depth) {
+    while (marks.size() > depth) {
+      Event& oldest = marks.front();
+      if (cudaYield) {
+        waitYield(oldest, expectedBlockSecs - markTimer.at());
+        average(expectedBlockSecs, markTimer.at());
+      } else {
+        waitForEvent(oldest.get());
+      }
+      markTimer.reset();
+      marks.pop_front();
+    }
+  }
+
+  bool allEventsCompleted() { return events.empty() || events.back().event.isComplete(); }
 
   void flush() { ::flush(get()); }
   
   void finish() {
-    if (cudaYield) {
+    Timer waitTimer;
+    if (cudaYield && !events.empty()) {
       flush();
-      while (!allEventsCompleted()) {
-#if defined(__CYGWIN__)
-	sleep(1);
-#else
-	usleep(500);
-#endif
-      }
+      waitYield(events.back().event, expectedSecs - windowTimer.at());
+      average(expectedSecs, windowTimer.at());
     }
     
     ::finish(get());
-    
-    if (profile) { for (auto& [event, it] : events) { it->second.add(event.secs()); } }
+    double waitSecs = waitTimer.at();
+    bool trace = bool(track);
+    i64 finishNs = trace ? Trace::hostNanos() : 0;
+    if (trace) { Trace::span("finish", waitSecs); }
+    marks.clear();
+
+    if (!nRun) {
+      events.clear();
+      return;
+    }
+
+    if (sampling()) {
+      double busy = 0;
+      u64 lastEnd = 0;
+      for (auto& [event, it, bytes] : events) {
+        double secs = event.secs();
+        busy += secs;
+        it->second.add(secs);
+        perf.kernel(it->first, secs, bytes);
+        if (trace) {
+          auto [start, end] = getEventTimes(event.get());
+          track->kernel(it->first, start, end);
+          lastEnd = std::max(lastEnd, end);
+        }
+      }
+      if (trace && lastEnd) { track->sync(lastEnd, finishNs); }
+      perf.window(waitSecs, windowTimer.at(), busy);
+    } else {
+      perf.window(waitSecs);
+    }
     events.clear();
+    nRun = 0;
+    ++nWindow;
+    windowTimer.reset();
   }
 
   using Profile = std::vector<std::pair<TimeInfo, std::string>>;
@@ -6,11 +6,13 @@
 #include "Args.h"
 #include "common.h"
 
+#include <algorithm>
 #include <filesystem>
 #include <functional>
 #include <ios>
 #include <cassert>
 #include <cinttypes>
+#include <set>
 #include <string>
 
 namespace fs = std::filesystem;
@@ -49,8 +51,70 @@ vector<u32> Saver::listIterations(const string& prefix, const string& ext) {
   return ret;
 }
 
+// The directory is scanned only when the index is missing or stale, i.e. the directory changed after the index
+// (e.g. a savefile copied in by hand) or a listed savefile is gone.
 vector<u32> Saver::listIterations() {
-  return listIterations(to_string(E) + '-', ".prp");
+  if (!fs::exists(base)) { fs::create_directory(base); }
+  if (auto ks = readIndex()) { return *ks; }
+  vector<u32> ks = listIterations(to_string(E) + '-', ".prp");
+  std::sort(ks.begin(), ks.end());
+  writeIndex(ks);
+  return ks;
+}
+
+std::optional<vector<u32>> Saver::readIndex() {
+  fs::path path = pathIndex();
+  error_code ec;
+  if (!fs::exists(path) || fs::last_write_time(base, ec) > fs::last_write_time(path, ec)) { return {}; }
+
+  File fi = File::openRead(path);
+  if (!fi) { return {}; }
+  std::set<u32> ks;
+  u32 nLines = 0;
+  try {
+    while (auto line = fi.maybeReadLine()) {
+      char op = 0;
+      u32 k = 0;
+      if (sscanf(line->c_str(), "%c%u", &op, &k) != 2 || (op != '+' && op != '-')) {
+        log("In file '%s': bad line '%s'\n", fi.name.c_str(), line->c_str());
+        return {};
+      }
+      if (op == '+') {
+        ks.insert(k);
+      } else {
+        ks.erase(k);
+      }
+      ++nLines;
+    }
+  } catch (const char*) {
+    // A partial last line, from an interrupted append.
+    return {};
+  }
+
+  for (u32 k : ks) {
+    if (!fs::exists(pathPRP(k))) { return {}; }
+  }
+  indexLines = nLines;
+  return vector<u32>{ks.begin(), ks.end()};
+}
+
+void Saver::writeIndex(const vector<u32>& ks) {
+  fs::path path = pathIndex();
+  {
+    File fo = File::openWrite(path + ".new");
+    for (u32 k : ks) { fo.printf("+%u\n", k); }
+  }
+  fs::rename(path + ".new", path);
+  // Newer than the directory, which the rename just changed.
+  fs::last_write_time(path, fs::file_time_type::clock::now(), noThrow());
+  indexLines = ks.size();
+}
+
+void Saver::appendIndex(char op, u32 k) {
+  File::append(pathIndex(), string(1, op) + to_string(k) + '\n');
+  if (++indexLines > 4 * nKeep) {
+    if (auto ks = readIndex()) { writeIndex(*ks); }
+  }
 }
 
 void Saver::cleanup(u32 E, const Args& args) {
@@ -111,6 +175,7 @@ void Saver::deleteBadSavefiles(u32 kBad, u32 currentK) {
 void Saver::del(u32 k) {
   // log("Note: deleting savefile %u\n", k);
   fs::remove(pathPRP(k), noThrow()); 
+  appendIndex('-', k);
 }
 
 void Saver::savedPRP(u32 k) {
@@ -174,16 +239,19 @@ void Saver::savePRP(const PRPState& state) {
   assert(state.check.size() == nWords(E));
   u32 k = state.k;
   
+  // Written through a temporary file, thus a savefile is never partial.
   fs::path path = pathPRP(k);
   {
-    File fo = File::openWrite(path);
+    File fo = File::openWrite(path + ".new");
 
     if (fo.printf(PRP_v12, E, k, state.blockSize, state.res64, state.nErrors, crc32(state.check)) <= 0) {
       throw(ios_base::failure("can't write header"));
     }    
     fo.write(state.check);
   }
+  fs::rename(path + ".new", path);
   loadPRPAux(k);
+  appendIndex('+', k);
   savedPRP(k);
 }
 
@@ -290,6 +358,43 @@ void Saver::saveP1(const P1State& state, bool isDone) {
   cycle(pathP1());
 }
 
+// --- ECM ---
+
+ECMState Saver::loadECM(u32 sigma) {
+  File fi = File::openRead(pathECM(sigma));
+  if (!fi) { return {sigma}; }
+  string header = fi.readLine();
+  u32 fileE, fileSigma, fileB1, fileK;
+  if (sscanf(header.c_str(), ECM_v1, &fileE, &fileSigma, &fileB1, &fileK) != 4 || fileE != E || fileSigma != sigma) {
+    log("In file '%s': bad header '%s'\n", fi.name.c_str(), header.c_str());
+    throw "bad savefile";
+  }
+  ECMState state{sigma, fileB1, fileK};
+  for (Words* w : {&state.x0, &state.z0, &state.x1, &state.z1}) { *w = fi.readChecked<u32>(nWords(E)); }
+  return state;
+}
+
+void Saver::saveECM(const ECMState& state) {
+  fs::path name = pathECM(state.sigma);
+  {
+    File fo = File::openWrite(name + ".new");
+    if (fo.printf(ECM_v1, E, state.sigma, state.B1, state.k) <= 0) {
+      throw(ios_base::failure("can't write header"));
+    }
+    for (const Words* w : {&state.x0, &state.z0, &state.x1, &state.z1}) {
+      assert(w->size() == nWords(E));
+      fo.writeChecked(*w);
+    }
+  }
+  cycle(name);
+}
+
+void Saver::deleteECM(u32 sigma) {
+  fs::path name = pathECM(sigma);
+  fs::remove(name, noThrow());
+  fs::remove(name + ".bak", noThrow());
+}
+
 void Saver::cycle(const fs::path& name) {
   fs::remove(name + ".bak");
   fs::rename(name, name + ".bak", noThrow());
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string>
 #include <cinttypes>
+#include <optional>
 #include <queue>
 
 class Args;
@@ -26,6 +27,15 @@ struct P1State {
   Words data;
 };
 
+// An ECM curve in stage 1: the Montgomery ladder at the bit k of the power-smooth of B1, as the points (x0 : z0), and
+// (x1 : z1) which is just ahead by the start point.
+struct ECMState {
+  u32 sigma;
+  u32 B1;
+  u32 k;
+  Words x0, z0, x1, z1;
+};
+
 class Saver {
   // E, k, block-size, res64, nErrors
   static constexpr const char *PRP_v10 = "OWL PRP 10 %u %u %u %016" SCNx64 " %u\n";
@@ -39,6 +49,8 @@ class Saver {
 
   static constexpr const char *P1_v3 = "OWL P1 3 E=%u B1=%u k=%u\n";
 
+  static constexpr const char *ECM_v1 = "OWL ECM 1 E=%u sigma=%u B1=%u k=%u\n";
+
   // ----
 
   u32 lastK = 0;
@@ -66,13 +78,23 @@ class Saver {
   }
 
   fs::path pathPRP(u32 k) const { return path(str9(k), ".prp"); }
+
+  // The index of the PRP savefiles: an append-only log of "+<k>" (written) and "-<k>" (deleted) lines.
+  fs::path pathIndex() const { return base / "prp.idx"; }
   fs::path pathP1() const       { return base / to_string(E) + ".p1"; }
+  fs::path pathECM(u32 sigma) const { return path(sigma, ".ecm"); }
 
   void savedPRP(u32 k);
 
   PRPState loadPRPAux(u32 k);
   vector<u32> listIterations(const string& prefix, const string& ext);
   vector<u32> listIterations();
+
+  // Lines in the index; it is rewritten compact when the log grows well beyond the savefiles kept.
+  u32 indexLines = 0;
+  std::optional<vector<u32>> readIndex();
+  void writeIndex(const vector<u32>& ks);
+  void appendIndex(char op, u32 k);
   void scan(u32 upToK = u32(-1));
   
   const u32 E;
@@ -94,6 +116,12 @@ public:
   void saveP1(const P1State& state, bool isDone);
   void saveP1Prime95(const P1State& state);
 
+  // The sigmas of the ECM curves with a savefile, i.e. in progress.
+  vector<u32> listECM() { return listIterations(to_string(E) + '-', ".ecm"); }
+  ECMState loadECM(u32 sigma);
+  void saveECM(const ECMState& state);
+  void deleteECM(u32 sigma);
+
   // Will delete all PRP & P-1 savefiles at iteration kBad up to currentK as bad.
   void deleteBadSavefiles(u32 kBad, u32 currentK);
 };
@@ -0,0 +1,95 @@
+// Copyright (C) Mihai Preda.
+
+#include "SelfTest.h"
+#include "Args.h"
+#include "File.h"
+#include "Gpu.h"
+
+#include <cmath>
+#include <mutex>
+#include <optional>
+#include <sstream>
+
+namespace {
+
+constexpr u32 TIME_ITERS = 20'000;
+constexpr u32 NTT_ITERS = 10;
+
+// A regression is warned of above these ratios to the previous driver.
+constexpr double MAX_SLOWDOWN = 1.05;
+constexpr double MAX_ROUNDOFF = 1.10;
+
+// The roundoff grows by about 4x per bit per word; it is compared only between close exponents.
+constexpr double MAX_BPW_DELTA = 0.2;
+
+// The workers of a process share the file.
+std::mutex fileMutex;
+
+struct Entry {
+  string fft;
+  double bpw{};
+  double usPerIt{};
+  double roundoff{}; // the mean of the sampled roundoff, 0 if not sampled.
+  string device;
+  string driver;
+};
+
+// One line per test: "<fft> <bpw> <us/it> <roundoff> <device>; <driver>"
+std::optional<Entry> parse(const string& line) {
+  Entry e;
+  std::istringstream iss{rstripNewline(line)};
+  string rest;
+  if (!(iss >> e.fft >> e.bpw >> e.usPerIt >> e.roundoff && std::getline(iss >> std::ws, rest))) { return {}; }
+  auto pos = rest.rfind("; ");
+  if (pos == string::npos) { return {}; }
+  e.device = rest.substr(0, pos);
+  e.driver = rest.substr(pos + 2);
+  return e;
+}
+
+}
+
+void SelfTest::check(Gpu& gpu, const Args& args, cl_device_id device, u32 E, const string& fft) {
+  string deviceName = args.uid.empty() ? getLongInfo(device) : args.uid;
+  string driver = getDriverVersion(device);
+  string key = fft;
+  for (const string& flag : args.flags) { key += ',' + flag; }
+
+  std::optional<Entry> previous;
+  {
+    std::unique_lock lock{fileMutex};
+    for (const string& line : File::openRead(FILE_NAME)) {
+      if (auto e = parse(line); e && e->fft == key && e->device == deviceName) {
+        if (e->driver == driver) { return; }
+        previous = e;
+      }
+    }
+  }
+
+  log("self-test of FFT %s on driver %s\n", key.c_str(), driver.c_str());
+  auto [secsPerIt, roundoff] = gpu.timeSquarings(TIME_ITERS, true);
+  gpu.nttCheck(NTT_ITERS);
+  gpu.productCheck();
+
+  Entry e{key, double(E) / gpu.getFFTSize(), secsPerIt * 1e6, roundoff.n ? roundoff.mean : 0, deviceName, driver};
+  log("self-test: %.1f us/it, roundoff %.4f (%u samples)\n", e.usPerIt, e.roundoff, roundoff.n);
+
+  if (previous) {
+    if (e.usPerIt > previous->usPerIt * MAX_SLOWDOWN) {
+      log("self-test: FFT %s is %.0f%% slower than with the driver %s (%.1f us/it)\n", key.c_str(),
+          (e.usPerIt / previous->usPerIt - 1) * 100, previous->driver.c_str(), previous->usPerIt);
+    }
+    double dBpw = e.bpw - previous->bpw;
+    if (e.roundoff && previous->roundoff && std::abs(dBpw) < MAX_BPW_DELTA) {
+      double ratio = e.roundoff / (previous->roundoff * std::pow(4, dBpw));
+      if (ratio > MAX_ROUNDOFF) {
+        log("self-test: FFT %s has a %.0f%% higher roundoff than with the driver %s\n", key.c_str(),
+            (ratio - 1) * 100, previous->driver.c_str());
+      }
+    }
+  }
+
+  std::unique_lock lock{fileMutex};
+  File::append(FILE_NAME, e.fft + ' ' + std::to_string(e.bpw) + ' ' + std::to_string(e.usPerIt) + ' '
+               + std::to_string(e.roundoff) + ' ' + e.device + "; " + e.driver + '\n');
+}
@@ -0,0 +1,27 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include "clwrap.h"
+
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+class Args;
+class Gpu;
+
+// A quick self-test of an FFT on its first use per (device, driver): the time per iteration and the roundoff of a
+// fixed number of squarings, and a cross-check of a few squarings and of Gpu::product() against the exact NTT engine
+// of the host. The results are kept per device in FILE_NAME, and compared with the last recorded for the same FFT under
+// an earlier driver: a slow-down or a higher roundoff is warned of, and a failed cross-check throws. Off with
+// -noselftest.
+class SelfTest {
+public:
+  static constexpr const char* FILE_NAME = "selftest.txt";
+
+  // Runs on the data of "gpu", which is overwritten, unless already recorded for this driver.
+  static void check(Gpu& gpu, const Args& args, cl_device_id device, u32 E, const string& fft);
+};
@@ -3,12 +3,13 @@
 #pragma once
 
 class Signal {
-  bool isOwner;
+  bool isOwner = false;
   
 public:
   Signal();
   ~Signal();
   
-  unsigned stopRequested();
+  // Whether a SIGINT came, also while no Signal was alive.
+  static unsigned stopRequested();
   void release();
 };
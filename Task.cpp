@@ -2,7 +2,10 @@
 
 #include "Task.h"
 
+#include "Background.h"
 #include "Gpu.h"
+#include "Lookahead.h"
+#include "Pm1Bounds.h"
 #include "Args.h"
 #include "File.h"
 #include "GmpUtil.h"
@@ -10,15 +13,45 @@
 #include "Saver.h"
 #include "version.h"
 #include "Proof.h"
+#include "FFTConfig.h"
 #include "log.h"
 
 #include <cstdio>
 #include <cmath>
 #include <thread>
 #include <cassert>
+#include <mutex>
+
+extern thread_local string globalCpuName;
 
 namespace {
 
+// With -B1 auto, the bounds not set by the task are planned from the speed of the Gpu.
+void planPm1(Task& task, Gpu& gpu) {
+  Pm1Bounds::Costs costs{gpu.timeSquarings(2000).first, gpu.timeP2Muls(200)};
+  Pm1Bounds bounds = Pm1Bounds::plan(task.exponent, task.howFarFactored, costs, task.B1, task.B2);
+  log("P-1 bounds B1=%u B2=%u (%.0f / %.0f us): %.2f%% + %.2f%% for %.2fh, saves %.2fh of PRP\n",
+      bounds.B1, bounds.B2, costs.secsPerSquaring * 1e6, costs.secsPerMul * 1e6, bounds.p1 * 100, bounds.p2 * 100,
+      bounds.secs / 3600, bounds.savedSecs / 3600);
+  task.B1 = bounds.B1;
+  task.B2 = bounds.B2;
+}
+
+// The FFT that -fftUp moved a PRP to, kept in the directory of the exponent (beside its savefiles) for a restart.
+fs::path fftUpPath(u32 E) { return fs::current_path() / to_string(E) / (to_string(E) + ".fft"); }
+
+string readFFTUp(u32 E) {
+  File fi = File::openRead(fftUpPath(E));
+  return fi ? rstripNewline(fi.readLine()) : "";
+}
+
+void writeFFTUp(u32 E, const string& spec) {
+  fs::path path = fftUpPath(E);
+  fs::create_directories(path.parent_path());
+  File::openWrite(path + ".new").write(spec + '\n');
+  fs::rename(path + ".new", path);
+}
+
 string json(const vector<string>& v) {
   bool isFirst = true;
   string s = "{";
@@ -69,6 +102,10 @@ void writeResult(u32 E, const char *workType, const string &status, const std::s
   fields += tailFields(AID, args);
   string s = json(std::move(fields));
   log("%s\n", s.c_str());
+
+  // The results file is shared by the workers of -devices.
+  static std::mutex resultsMutex;
+  std::unique_lock lock(resultsMutex);
   File::append(args.resultsFile, s + '\n');
 }
 
@@ -81,7 +118,8 @@ string Task::kindStr() const {
 }
 */
 
-void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath) const {
+void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath,
+                          const ProofInfo& info) const {
   vector<string> fields{json("res64", Hex{res64}),
                         json("residue-type", 1),
                         json("errors", vector<string>{json("gerbicz", nErrors)}),
@@ -90,7 +128,6 @@ void Task::writeResultPRP(const Args &args, bool isPrime, u64 res64, u32 fftSize
 
   // "proof":{"version":1, "power":6, "hashsize":64, "md5":"0123456789ABCDEF"}, 
   if (!proofPath.empty()) {
-    ProofInfo info = proof::getInfo(proofPath);
     fields.push_back(json("proof", vector<string>{
             json("version", 1),
             json("power", info.power),
@@ -116,36 +153,190 @@ void Task::writeResultPM1(const Args& args, const string& factor, u32 fftSize) c
               });
 }
 
-void Task::execute(const Args& args) {
+void Task::writeResultECM(const Args& args, const string& factor, u32 sigma, u32 nCurves, u32 fftSize) const {
+  assert(B1);
+  bool hasFactor = !factor.empty();
+  writeResult(exponent, "ECM", hasFactor ? "F" : "NF", AID, args,
+              {json("B1", B1),
+               json("curves", nCurves),
+               json("fft-length", fftSize),
+               hasFactor ? json("sigma", sigma) : "",
+               factor.empty() ? "" : (json("factors") + ':' + "[\""s + factor + "\"]")
+              });
+}
+
+// The fields of the CERT result of mprime: the SHA3-256 of the residue (its bytes, as in the proof file).
+void Task::writeResultCERT(const Args& args, const Words& res, u32 fftSize, u32 nErrors) const {
+  string hash;
+  for (u64 w : proof::hashWords(exponent, res)) {
+    for (u32 i = 0; i < 8; ++i) {
+      char buf[4];
+      snprintf(buf, sizeof(buf), "%02x", u32(w >> (8 * i)) & 0xff);
+      hash += buf;
+    }
+  }
+  writeResult(exponent, "Cert", "C", AID, args,
+              {json("sha3-hash", hash),
+               json("squarings", squarings),
+               json("shift-count", 0u),
+               json("errors", vector<string>{json("gerbicz", nErrors)}),
+               json("fft-length", fftSize)
+              });
+}
+
+bool Task::execute(const Args& args, Background& background, Lookahead* lookahead) {
   LogContext pushContext(std::to_string(exponent));
   
   if (kind == VERIFY) {
+    // Releases the Gpu kept from the previous task before the Gpu of the proof is made.
+    if (lookahead) { lookahead->release(); }
     Proof proof = Proof::load(verifyPath);
     auto gpu = Gpu::make(proof.E, args);
     bool ok = proof.verify(gpu.get());
     log("proof '%s' %s\n", verifyPath.c_str(), ok ? "verified" : "failed");
-    return;
+    return true;
   }
 
-  assert(kind == PRP || kind == PM1);
+  if (kind == ECM) {
+    // Releases the Gpu kept from the previous task, as the FFT of ECM is larger.
+    if (lookahead) { lookahead->release(); }
+    LogContext ecm{"ECM"};
+    auto gpu = Gpu::make(exponent, args, Gpu::ecmFFTExponent(exponent));
+    u32 fftSize = gpu->getFFTSize();
+
+    // The curves are run in batches which fit the GPU memory; the worktodo line keeps the count of curves left.
+    Task task = *this;
+    while (true) {
+      u32 n = std::min(task.curves, gpu->ecmMaxCurves());
+      if (!n) {
+        log("no ECM curve fits in the GPU memory\n");
+        throw "not enough GPU memory";
+      }
+      ECMResult result = gpu->ecmStage1(args, B1, n);
+      writeResultECM(args, result.factor, result.sigma, n, fftSize);
+      task.curves -= n;
+      if (!result.factor.empty() || !task.curves) {
+        Worktodo::deleteTask(task);
+        if (!result.factor.empty()) { Worktodo::deletePRP(exponent); }
+        return true;
+      }
+      task.line = Worktodo::replaceECM(task);
+    }
+  }
+
+  assert(kind == PRP || kind == PM1 || kind == CERT);
 
-  auto gpu = Gpu::make(exponent, args);
+  // A PRP that -fftUp moved to a larger FFT goes on with it after a restart too.
+  Args taskArgs = args;
+  if (kind == PRP && args.fftSpec.empty()) { taskArgs.fftUpSpec = readFFTUp(exponent); }
+
+  unique_ptr<Gpu> gpu = lookahead ? lookahead->take(*this) : nullptr;
+  if (gpu && !taskArgs.fftUpSpec.empty() && gpu->getFFTSize() != FFTConfig::fromSpec(taskArgs.fftUpSpec).fftSize()) {
+    gpu.reset();
+  }
+  if (!gpu) { gpu = Gpu::make(exponent, taskArgs); }
+  if (lookahead) { gpu->nearEnd = [lookahead, current = gpu.get()]() { lookahead->start(current); }; }
   auto fftSize = gpu->getFFTSize();
 
+  if (kind == CERT) {
+    LogContext cert{"CERT"};
+    Words A = File::openReadThrow(certPath()).readBytesLE((exponent - 1) / 8 + 1);
+    log("%u squarings of %016" PRIx64 "\n", squarings, res64(A));
+    auto [res, nErrors] = gpu->certify(args, A, squarings);
+    if (res.empty()) { return true; } // stopped, without a result
+    writeResultCERT(args, res, fftSize, nErrors);
+    Worktodo::deleteTask(*this);
+    std::error_code noThrow;
+    fs::remove(certPath(), noThrow);
+    if (lookahead) { lookahead->keep(std::move(gpu)); }
+    return true;
+  }
+
   if (kind == PRP) {
-    auto [factor, isPrime, res64, nErrors, proofPath] = gpu->isPrimePRP(args, *this);
+    auto hook = [&](Gpu& g) {
+      // The priority tasks run on a Gpu of their own, while this one keeps the state of the preempted PRP.
+      if (!priority) {
+        g.preemptWanted = []() { return Worktodo::hasPriority(); };
+        g.preempt = [&args, &background]() {
+          while (auto task = Worktodo::getPriorityTask()) {
+            // A failed priority task must not end the PRP kept here. Its line stays claimed, thus it is skipped
+            // until the restart instead of retried at every poll.
+            try {
+              if (task->execute(args, background)) { Worktodo::releaseTask(*task); }
+            } catch (const char* mes) {
+              log("priority task '%s' failed: %s\n", rstripNewline(task->line).c_str(), mes);
+            } catch (const std::exception& e) {
+              log("priority task '%s' failed: %s\n", rstripNewline(task->line).c_str(), e.what());
+            }
+          }
+        };
+      }
+    };
+    hook(*gpu);
+    PRPResult result = gpu->isPrimePRP(taskArgs, *this);
+
+    // A test whose roundoff got too high goes on from its last savefile with the larger FFT, see -fftUp.
+    Args upArgs = taskArgs;
+    while (!result.nextFFT.empty()) {
+      upArgs.fftUpSpec = result.nextFFT;
+      writeFFTUp(exponent, result.nextFFT);
+      gpu.reset();
+      gpu = Gpu::make(exponent, upArgs);
+      if (lookahead) { gpu->nearEnd = [lookahead, current = gpu.get()]() { lookahead->start(current); }; }
+      hook(*gpu);
+      fftSize = gpu->getFFTSize();
+      result = gpu->isPrimePRP(upArgs, *this);
+    }
+
+    auto [factor, isPrime, res64, nErrors, proofPath, proofInfo, nextFFT] = result;
     if (factor.empty()) {
-      writeResultPRP(args, isPrime, res64, fftSize, nErrors, proofPath);
+      writeResultPRP(args, isPrime, res64, fftSize, nErrors, proofPath, proofInfo);
     }
 
     Worktodo::deleteTask(*this);
+    std::error_code noThrow;
+    fs::remove(fftUpPath(exponent), noThrow);
     if (!isPrime) { Saver::cleanup(exponent, args); }
+    if (lookahead) { lookahead->keep(std::move(gpu)); }
+    return true;
   } else { // P-1
     LogContext p1{"P1"};
-    assert(!line.empty());  // We want to pass the same line to mprime following first-stage
-    gpu->doPm1(args, *this);
-    File::openAppend(args.mprimeDir/"worktodo.add").write(line);
-    Worktodo::deleteTask(*this);
+    // The planned bounds go into the line, thus a restart goes on with them instead of planning again.
+    if (!B1 && !args.B1) {
+      planPm1(*this, *gpu);
+      if (!line.empty()) { line = Worktodo::replaceBounds(*this); }
+    }
+    shared_future<PM1Result> pending = gpu->doPm1(args, *this);
+
+    // The GCDs are left to the background, as the GPU can start on the next task. The task stays claimed until its
+    // result is written.
+    background.run([task = *this, args, fftSize, pending, cpuName = globalCpuName]() mutable {
+      globalCpuName = cpuName;
+      LogContext pushContext(std::to_string(task.exponent));
+      LogContext p1{"P1"};
+      try {
+        PM1Result result = pending.get();
+        task.B1 = result.B1;
+        task.B2 = result.B2;
+        if (!result.factor.empty() || task.B2) {
+          task.writeResultPM1(args, result.factor, fftSize);
+        } else {
+          // The second stage was not done on the GPU, thus pass the same line to mprime.
+          assert(!task.line.empty());
+          File::openAppend(args.mprimeDir/"worktodo.add").write(task.line);
+        }
+        // The queued PRP of a factored exponent is not needed anymore. It is deleted while this task is still claimed,
+        // as until then it is not handed to a worker (see Worktodo::getTask).
+        if (!result.factor.empty()) { Worktodo::deletePRP(task.exponent); }
+        Worktodo::deleteTask(task);
+      } catch (const char* mes) {
+        log("GCD failed: %s\n", mes);
+        Worktodo::releaseTask(task);
+      } catch (const std::exception& e) {
+        log("GCD failed: %s\n", e.what());
+        Worktodo::releaseTask(task);
+      }
+    });
     /*
     {
       char buf[256];
@@ -155,5 +346,7 @@ void Task::execute(const Args& args) {
       fo.write(""s + buf);
     }
     */
+    if (lookahead) { lookahead->keep(std::move(gpu)); }
+    return false;
   }
 }
@@ -12,9 +12,11 @@
 class Args;
 class Result;
 class Background;
+class Lookahead;
+struct ProofInfo;
 
 struct Task {
-  enum Kind {PRP, VERIFY, PM1};
+  enum Kind {PRP, VERIFY, PM1, ECM, CERT};
 
   Kind kind;
   u32 exponent;
@@ -24,13 +26,25 @@ struct Task {
   u32 B1 = 0;
   u32 B2 = 0;
   u32 howFarFactored = 0;
+  u32 curves = 0; // For ECM, the curves left to run.
+  u32 squarings = 0; // For CERT.
 
   string verifyPath; // For Verify
+
+  bool priority = false; // From priority.txt rather than worktodo.txt.
+
+  // The start value of a CERT, placed there by the user: the little-endian bytes of the residue.
+  fs::path certPath() const { return fs::path{"cert"} / (AID + ".cert"); }
     
-  void execute(const Args& args);
+  // Returns false if the end of the task (the P-1 GCDs and result) was left to a background job, which then releases
+  // the task. With a lookahead, the Gpu may be already built, and the one of the next task is built near the end.
+  bool execute(const Args& args, Background& background, Lookahead* lookahead = nullptr);
 
-  void writeResultPRP(const Args&, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath) const;
+  void writeResultPRP(const Args&, bool isPrime, u64 res64, u32 fftSize, u32 nErrors, const fs::path& proofPath,
+                      const ProofInfo& proofInfo) const;
   void writeResultPM1(const Args&, const std::string& factor, u32 fftSize) const;
+  void writeResultECM(const Args&, const std::string& factor, u32 sigma, u32 nCurves, u32 fftSize) const;
+  void writeResultCERT(const Args&, const Words& res, u32 fftSize, u32 nErrors) const;
 
   // string kindStr() const;
   
@@ -0,0 +1,133 @@
+// Copyright (C) Mihai Preda.
+
+#include "Trace.h"
+#include "File.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+#include <mutex>
+
+std::atomic<bool> Trace::on{};
+
+namespace {
+
+// About a minute of iterations at the PRP wavefront, with a few kernels per iteration.
+constexpr u32 SIZE = 1 << 18;
+
+// The process of the host threads; the devices follow.
+constexpr u32 HOST_PID = 0;
+
+struct Event {
+  string name;
+  i64 startNs;
+  i64 durNs;
+  u32 pid;
+  u32 tid;
+};
+
+std::mutex mut;
+fs::path traceFile;
+std::vector<Event> ring;
+u64 nEvents = 0;
+
+const auto origin = std::chrono::steady_clock::now();
+
+// The process of each device, with its name and count of tracks.
+struct Device {
+  u32 pid;
+  string name;
+  u32 nTracks = 0;
+};
+std::map<cl_device_id, Device> devices;
+
+std::atomic<u32> nThreads{};
+
+u32 threadId() {
+  thread_local u32 id = ++nThreads;
+  return id;
+}
+
+void put(Event&& e) {
+  if (ring.size() < SIZE) {
+    ring.push_back(std::move(e));
+  } else {
+    ring[nEvents % SIZE] = std::move(e);
+  }
+  ++nEvents;
+}
+
+string jsonEvent(const Event& e) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+           e.name.c_str(), e.pid, e.tid, e.startNs * 1e-3, e.durNs * 1e-3);
+  return buf;
+}
+
+string jsonName(const char* what, u32 pid, u32 tid, const string& name) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+           what, pid, tid, name.c_str());
+  return buf;
+}
+
+}
+
+i64 Trace::hostNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void Trace::enable(const fs::path& file) {
+  std::unique_lock lock{mut};
+  traceFile = file;
+  ring.reserve(SIZE);
+  on = true;
+}
+
+Trace::Track::Track(cl_device_id device, const string& deviceName) {
+  std::unique_lock lock{mut};
+  auto it = devices.find(device);
+  if (it == devices.end()) { it = devices.insert({device, {u32(devices.size()) + 1, deviceName}}).first; }
+  pid = it->second.pid;
+  tid = ++it->second.nTracks;
+}
+
+void Trace::Track::sync(u64 endNs, i64 finishNs) {
+  offset = std::min(offset, finishNs - i64(endNs));
+  std::unique_lock lock{mut};
+  for (const Kernel& k : unsynced) { put({k.name, i64(k.startNs) + offset, i64(k.endNs - k.startNs), pid, tid}); }
+  unsynced.clear();
+}
+
+void Trace::span(const char* name, double secs) {
+  i64 now = hostNanos();
+  i64 durNs = secs * 1e9;
+  u32 tid = threadId();
+  std::unique_lock lock{mut};
+  put({name, now - durNs, durNs, HOST_PID, tid});
+}
+
+void Trace::write() {
+  string s = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n" + jsonName("process_name", HOST_PID, 0, "host");
+  fs::path tmp;
+  {
+    std::unique_lock lock{mut};
+    if (!on) { return; }
+    tmp = traceFile + ".new";
+    for (const auto& [device, d] : devices) {
+      s += ",\n" + jsonName("process_name", d.pid, 0, d.name);
+      for (u32 tid = 1; tid <= d.nTracks; ++tid) {
+        s += ",\n" + jsonName("thread_name", d.pid, tid, "queue " + to_string(tid));
+      }
+    }
+    u32 n = ring.size();
+    for (u32 i = 0; i < n; ++i) { s += ",\n" + jsonEvent(ring[(nEvents + i) % n]); }
+  }
+  s += "\n]}\n";
+  {
+    File fo = File::openWrite(tmp);
+    fo.write(s);
+  }
+  fs::rename(tmp, traceFile);
+}
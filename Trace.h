@@ -0,0 +1,74 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+#include "timeutil.h"
+#include "tinycl.h"
+
+#include <atomic>
+#include <filesystem>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// With -trace <file>, the timeline of the GPU kernels (from the profiling events of the queue) and of the host spans
+// (check, read, save, proof writes, the waits in finish()). The latest events are kept in a bounded ring, and written
+// in the Chrome "Trace Event Format", which loads in ui.perfetto.dev or chrome://tracing: the gaps of the GPU track
+// show where the GPU waits on the host. Process-wide, as the spans come from several threads; each device is a process
+// of the trace, with a track per queue (-workers, or a Gpu built ahead), and the host threads are one more.
+class Trace {
+  static std::atomic<bool> on;
+
+public:
+  static void enable(const fs::path& file);
+  static bool enabled() { return on; }
+
+  // The host clock of the timeline, in nanoseconds from the start of the process.
+  static i64 hostNanos();
+
+  // The kernels of one queue, on a track of their own. The device clock is placed on the host timeline by an offset
+  // kept per track, as the devices of a process have clocks of their own.
+  class Track {
+    u32 pid;
+    u32 tid;
+
+    // The host time minus the device time; the smallest seen is the closest, as the host sees an end late.
+    i64 offset = std::numeric_limits<i64>::max();
+
+    struct Kernel {
+      string name;
+      u64 startNs;
+      u64 endNs;
+    };
+    // The kernels wait for the offset, known only at the end of their window.
+    std::vector<Kernel> unsynced;
+
+  public:
+    explicit Track(cl_device_id device, const string& deviceName);
+
+    // A kernel, from the profiling start and end of its event, in nanoseconds of the device clock.
+    void kernel(const string& name, u64 startNs, u64 endNs) { unsynced.push_back({name, startNs, endNs}); }
+
+    // After a finish() which returned at the host time finishNs, with the end of its last kernel: the device clock
+    // endNs corresponds to at most finishNs, which places the kernels on the host timeline.
+    void sync(u64 endNs, i64 finishNs);
+  };
+
+  // A span of the calling thread which ends now.
+  static void span(const char* name, double secs);
+
+  // Writes the ring, through a temporary file thus a reader never sees a partial file.
+  static void write();
+
+  class Span {
+    const char* name;
+    Timer timer;
+
+  public:
+    explicit Span(const char* name) : name{name} {}
+    ~Span() { if (on) { span(name, timer.at()); } }
+  };
+};
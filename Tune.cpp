@@ -0,0 +1,323 @@
+// Copyright (C) Mihai Preda.
+
+#include "Tune.h"
+#include "Args.h"
+#include "Gpu.h"
+#include "FFTConfig.h"
+#include "File.h"
+#include "clwrap.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <sstream>
+
+namespace {
+
+// Alternative values of the tunables listed at the top of gpuowl.cl. The groups are searched one after another,
+// keeping the best value found so far for the previous groups. The carry width is not among them: it is chosen
+// per exponent (see exponentDefines in Gpu.cpp), and a tuned CARRY32 would conflict with the CARRY64 of a larger
+// exponent of the same FFT.
+const vector<vector<string>> FLAG_GROUPS{
+  {"TRIG_COMPUTE=0", "TRIG_COMPUTE=1"},
+  {"OUT_SIZEX=4", "OUT_SIZEX=8", "OUT_SIZEX=32"},
+  {"OUT_SPACING=1", "OUT_SPACING=2", "OUT_SPACING=4"},
+  {"IN_SIZEX=4", "IN_SIZEX=8", "IN_SIZEX=32"},
+  {"UNROLL_WIDTH", "NO_UNROLL_WIDTH"},
+  {"OLD_FFT5", "NEWEST_FFT5"},
+  {"OLD_FFT9"},
+  {"SUBGROUP_SHUFFLE"},
+  {"CARRY_TICKET"},
+  {"FUSED_MIDDLE"},
+};
+
+constexpr u32 TUNE_ITERS = 5000;
+
+// A flag is kept only if it is faster by at least 1%, to not choose on timing noise.
+constexpr double MIN_GAIN = 0.99;
+
+// The limits for the roundoff of the chosen variant.
+constexpr double MAX_ROUNDOFF = 0.42;
+constexpr double MAX_PERR = 0.01;
+
+// The crossover measurement: the squarings per exponent, the exponents around the formula limit (as fractions of it),
+// and the target probability of a roundoff error over a whole test.
+constexpr u32 CROSSOVER_ITERS = 20000;
+const vector<double> CROSSOVER_STEPS{0.97, 0.99, 1.01, 1.03, 1.05};
+constexpr double CROSSOVER_PERR = 0.002;
+
+struct Entry {
+  string fftSize;
+  string spec;
+  string flags;
+  string device;
+};
+
+string deviceKey(const Args& args) { return getLongInfo(getDevice(args.device)); }
+
+string join(const vector<string>& flags) {
+  string s;
+  for (const string& flag : flags) { s += (s.empty() ? "" : ",") + flag; }
+  return s.empty() ? "-" : s;
+}
+
+vector<string> split(const string& flags) {
+  if (flags == "-") { return {}; }
+  string ss = flags;
+  std::replace(ss.begin(), ss.end(), ',', ' ');
+  std::istringstream iss{ss};
+  return {std::istream_iterator<std::string>{iss}, std::istream_iterator<std::string>{}};
+}
+
+// The tune file has one line per entry: "<FFT size> <width:middle:height> <flags or -> <device>"
+vector<Entry> readEntries(const fs::path& fileName) {
+  vector<Entry> entries;
+  for (const string& line : File::openRead(fileName)) {
+    Entry e;
+    std::istringstream iss{rstripNewline(line)};
+    if (iss >> e.fftSize >> e.spec >> e.flags && std::getline(iss >> std::ws, e.device)) { entries.push_back(e); }
+  }
+  return entries;
+}
+
+void writeEntries(const fs::path& fileName, const vector<Entry>& entries) {
+  fs::path tmp = fileName + ".new";
+  {
+    File fo = File::openWrite(tmp);
+    for (const Entry& e : entries) {
+      fo.printf("%s %s %s %s\n", e.fftSize.c_str(), e.spec.c_str(), e.flags.c_str(), e.device.c_str());
+    }
+  }
+  fs::rename(tmp, fileName);
+}
+
+optional<pair<double, RoundoffStats>> measure(Args args, u32 E, const FFTConfig& config, const vector<string>& flags) {
+  args.fftSpec = config.spec();
+  args.flags = {flags.begin(), flags.end()};
+  try {
+    return Gpu::make(E, args)->timeSquarings(TUNE_ITERS);
+  } catch (const char* mes) {
+    log("%s %s : failed \"%s\"\n", config.spec().c_str(), join(flags).c_str(), mes);
+  } catch (const std::exception& e) {
+    log("%s %s : failed %s\n", config.spec().c_str(), join(flags).c_str(), e.what());
+  }
+  return {};
+}
+
+double timeIt(const Args& args, u32 E, const FFTConfig& config, const vector<string>& flags) {
+  auto r = measure(args, E, config, flags);
+  if (!r) { return INFINITY; }
+  log("%s %s : %.1f us/it\n", config.spec().c_str(), join(flags).c_str(), r->first * 1e6);
+  return r->first;
+}
+
+bool roundoffOK(const Args& args, u32 E, const FFTConfig& config, vector<string> flags) {
+  flags.push_back("STATS");
+  auto r = measure(args, E, config, flags);
+  if (!r) { return false; }
+  const RoundoffStats& s = r->second;
+  log("%s %s : roundoff N=%u, mean %f, max %f, pErr %f%%\n",
+      config.spec().c_str(), join(flags).c_str(), s.n, s.mean, s.max, s.pErr * 100);
+  return s.n && s.max < MAX_ROUNDOFF && s.pErr < MAX_PERR;
+}
+
+// The crossover file has one line per entry: "<width:middle:height> <max exponent> <device>"
+map<string, u32> readCrossovers(const fs::path& fileName, const string& device) {
+  map<string, u32> crossovers;
+  for (const string& line : File::openRead(fileName)) {
+    std::istringstream iss{rstripNewline(line)};
+    string spec, dev;
+    u32 maxExp = 0;
+    if (iss >> spec >> maxExp && std::getline(iss >> std::ws, dev) && dev == device) { crossovers[spec] = maxExp; }
+  }
+  return crossovers;
+}
+
+// Returns the exponent where the fit of log(pErr) as a linear function of the exponent reaches CROSSOVER_PERR.
+// The result is not extrapolated above the largest measured exponent.
+u32 fitCrossover(const vector<pair<u32, double>>& points) {
+  double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+  u32 maxE = 0;
+  for (auto [E, pErr] : points) {
+    maxE = max(maxE, E);
+    if (pErr <= 0) { continue; }
+    double x = E, y = log(pErr);
+    n += 1;
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  if (n < 2) { return 0; }
+  double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+  if (!(slope > 0)) { return 0; }
+  double intercept = (sy - slope * sx) / n;
+  double E = (log(CROSSOVER_PERR) - intercept) / slope;
+  return E > 0 ? u32(min(E, double(maxE))) : 0;
+}
+
+}
+
+u32 Tune::maxExp(const map<string, u32>& crossovers, const FFTConfig& config) {
+  auto it = crossovers.find(config.spec());
+  return it == crossovers.end() ? config.maxExp() : it->second;
+}
+
+map<string, u32> Tune::crossovers(const Args& args) {
+  return args.crossoverFile.empty() ? map<string, u32>{} : readCrossovers(args.crossoverFile, deviceKey(args));
+}
+
+void Tune::crossover(const Args& argsIn, const string& spec) {
+  vector<FFTConfig> configs = FFTConfig::fromSpecList(spec);
+  if (configs.empty() || argsIn.crossoverFile.empty()) {
+    log("-crossover '%s' selects no FFT, or no -crossoverFile\n", spec.c_str());
+    throw "-crossover";
+  }
+
+  string device = deviceKey(argsIn);
+  Args args = argsIn;
+  args.flags.insert("STATS");
+
+  for (const FFTConfig& c : configs) {
+    args.fftSpec = c.spec();
+    vector<pair<u32, double>> points;
+    for (double step : CROSSOVER_STEPS) {
+      u32 E = u32(c.maxExp() * step) | 1;
+      if (E > c.fftSize() * 20) { continue; }
+      try {
+        RoundoffStats r = Gpu::make(E, args)->timeSquarings(CROSSOVER_ITERS).second;
+        log("%s %u (%.3f bpw) : roundoff N=%u, mean %f, max %f, pErr %f%%\n",
+            c.spec().c_str(), E, E / double(c.fftSize()), r.n, r.mean, r.max, r.pErr * 100);
+        if (r.n) { points.push_back({E, r.pErr}); }
+      } catch (const char* mes) {
+        log("%s %u : failed \"%s\"\n", c.spec().c_str(), E, mes);
+      } catch (const std::exception& e) {
+        log("%s %u : failed %s\n", c.spec().c_str(), E, e.what());
+      }
+    }
+
+    u32 maxExp = fitCrossover(points);
+    if (!maxExp) {
+      log("%s : no crossover fit, not saved\n", c.spec().c_str());
+      continue;
+    }
+    log("%s : crossover %u (%.3f bpw), formula %u (%+.2f%%)\n", c.spec().c_str(), maxExp, maxExp / double(c.fftSize()),
+        c.maxExp(), (maxExp / double(c.maxExp()) - 1) * 100);
+
+    vector<string> lines;
+    for (const string& line : File::openRead(args.crossoverFile)) {
+      std::istringstream iss{rstripNewline(line)};
+      string lineSpec, dev;
+      u32 unused = 0;
+      if (!(iss >> lineSpec >> unused && std::getline(iss >> std::ws, dev)) || lineSpec != c.spec() || dev != device) {
+        lines.push_back(rstripNewline(line));
+      }
+    }
+    lines.push_back(c.spec() + " " + to_string(maxExp) + " " + device);
+
+    fs::path tmp = args.crossoverFile + ".new";
+    {
+      File fo = File::openWrite(tmp);
+      for (const string& line : lines) { fo.printf("%s\n", line.c_str()); }
+    }
+    fs::rename(tmp, args.crossoverFile);
+  }
+}
+
+void Tune::tune(const Args& args, u32 E) {
+  vector<FFTConfig> candidates;
+  if (!args.fftSpec.empty()) {
+    candidates.push_back(FFTConfig::fromSpec(args.fftSpec));
+  } else {
+    u32 fftSize = 0;
+    map<string, u32> limits = crossovers(args);
+    for (const FFTConfig& c : FFTConfig::genConfigs()) {
+      if (maxExp(limits, c) < E || (fftSize && c.fftSize() != fftSize)) { continue; }
+      fftSize = c.fftSize();
+      candidates.push_back(c);
+    }
+  }
+
+  if (candidates.empty()) {
+    log("No FFT for exponent %u\n", E);
+    throw "No FFT for exponent";
+  }
+
+  string device = deviceKey(args);
+  u32 fftSize = candidates.front().fftSize();
+  log("Tuning %u (FFT %s) on '%s', %u FFT variants\n", E, numberK(fftSize).c_str(), device.c_str(), u32(candidates.size()));
+
+  FFTConfig best = candidates.front();
+  double bestTime = INFINITY;
+  for (const FFTConfig& c : candidates) {
+    if (double t = timeIt(args, E, c, {}); t < bestTime) {
+      best = c;
+      bestTime = t;
+    }
+  }
+
+  if (bestTime == INFINITY) {
+    log("Tuning %u: no usable FFT variant\n", E);
+    throw "tune failed";
+  }
+
+  vector<string> bestFlags;
+  for (const vector<string>& group : FLAG_GROUPS) {
+    string chosen;
+    for (const string& flag : group) {
+      vector<string> flags = bestFlags;
+      flags.push_back(flag);
+      if (double t = timeIt(args, E, best, flags); t < bestTime * MIN_GAIN) {
+        chosen = flag;
+        bestTime = t;
+      }
+    }
+    if (!chosen.empty()) { bestFlags.push_back(chosen); }
+  }
+
+  if (!roundoffOK(args, E, best, bestFlags)) {
+    if (bestFlags.empty() || !roundoffOK(args, E, best, {})) {
+      log("Tuning %u: roundoff too high for %s, not saved\n", E, best.spec().c_str());
+      return;
+    }
+    bestFlags.clear();
+  }
+
+  log("Tuned FFT %s: %s %s, %.1f us/it\n", numberK(fftSize).c_str(), best.spec().c_str(), join(bestFlags).c_str(), bestTime * 1e6);
+
+  string size = numberK(fftSize);
+  vector<Entry> entries;
+  for (const Entry& e : readEntries(args.tuneFile)) {
+    if (e.device != device || e.fftSize != size) { entries.push_back(e); }
+  }
+  entries.push_back({size, best.spec(), join(bestFlags), device});
+  writeEntries(args.tuneFile, entries);
+}
+
+void Tune::apply(Args& args, u32 E, FFTConfig& config) {
+  if (!args.fftSpec.empty() || args.tuneFile.empty()) { return; }
+
+  string device = deviceKey(args);
+  string size = numberK(config.fftSize());
+  for (const Entry& e : readEntries(args.tuneFile)) {
+    if (e.device != device || e.fftSize != size) { continue; }
+
+    FFTConfig tuned = FFTConfig::fromSpec(e.spec);
+    if (tuned.fftSize() != config.fftSize() || maxExp(crossovers(args), tuned) < E) { return; }
+    config = tuned;
+
+    if (args.flags.empty()) {
+      vector<string> flags = split(e.flags);
+      // Tune files written before the carry width left FLAG_GROUPS may still have it.
+      flags.erase(std::remove_if(flags.begin(), flags.end(), [](const string& f) { return f == "CARRY32" || f == "CARRY64"; }),
+                  flags.end());
+      args.flags.insert(flags.begin(), flags.end());
+      log("Using tuned %s %s\n", e.spec.c_str(), e.flags.c_str());
+    } else {
+      log("Using tuned %s (the tuned flags %s are not used because of -use)\n", e.spec.c_str(), e.flags.c_str());
+    }
+    return;
+  }
+}
@@ -0,0 +1,33 @@
+// Copyright (C) Mihai Preda.
+
+#pragma once
+
+#include "common.h"
+
+#include <map>
+
+class Args;
+struct FFTConfig;
+
+// The tuner times, for the FFT size of an exponent, the FFT variants (width:middle:height) and the -use flags
+// of the tunables at the top of gpuowl.cl. The fastest choice with a safe roundoff is stored per device and FFT size
+// in the tune file (-tuneFile), which is then used by Gpu::make().
+class Tune {
+public:
+  // Runs the tuning for the FFT size of the exponent E, and updates the tune file.
+  static void tune(const Args& args, u32 E);
+
+  // Sets the tuned FFT variant, and adds the tuned -use flags, if there is a usable tune entry for the device and the
+  // FFT size of "config". Does nothing if the FFT was explicitly specified with -fft.
+  static void apply(Args& args, u32 E, FFTConfig& config);
+
+  // Measures the roundoff (-use STATS) of each FFT variant at exponents around its formula limit FFTConfig::maxExp(),
+  // and stores in the crossover file (-crossoverFile) the exponent where the fitted pErr reaches the target.
+  static void crossover(const Args& args, const string& spec);
+
+  // The measured crossovers of the device, indexed by the FFT spec.
+  static std::map<string, u32> crossovers(const Args& args);
+
+  // The largest exponent for the FFT variant: the measured crossover if there is one, otherwise the formula.
+  static u32 maxExp(const std::map<string, u32>& crossovers, const FFTConfig& config);
+};
@@ -9,12 +9,97 @@
 #include "Saver.h"
 
 #include <cassert>
+#include <chrono>
+#include <filesystem>
+#include <map>
 #include <string>
 #include <optional>
+#include <random>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <thread>
 
 namespace {
 
-std::optional<Task> parse(const std::string& line) {
+// With -devices the workers share worktodo.txt. The mutex serializes the access to it, and a task being executed
+// by one worker is "claimed" (by its line) so that it is not picked up by another one.
+std::mutex worktodoMutex;
+std::set<string> claimed;
+
+// Notified when a claimed task is deleted or released, for a getTask() which waits for a P-1 (see goodTasks).
+std::condition_variable unclaimed;
+
+error_code& noThrow() {
+  static error_code dummy;
+  return dummy;
+}
+
+// Serializes the workers of all the hosts on the shared -pool worktodo.txt. As with MemLease on Windows, the lock is a
+// directory, whose creation is atomic on network filesystems too. A lock older than STALE_SECS was left by a worker that died.
+class PoolLock {
+  static constexpr int STALE_SECS = 120;
+
+  // How long the holder waits, after taking the lock, before it checks that the lock is still its own: two workers
+  // that both found the lock stale may remove it one after the other, and the second removal takes the lock of the
+  // first that re-created it.
+  static constexpr int SETTLE_MS = 100;
+
+  fs::path path;
+  string token;
+
+  bool isStale() {
+    error_code ec;
+    auto t = fs::last_write_time(path, ec);
+    return !ec && fs::file_time_type::clock::now() - t > std::chrono::seconds(STALE_SECS);
+  }
+
+  fs::path ownerPath() const { return path / "owner"; }
+
+  bool isOwned() {
+    try {
+      File fi = File::openRead(ownerPath());
+      return fi && fi.readLine() == token;
+    } catch (const char*) {
+      return false; // the owner file of another holder, being written
+    }
+  }
+
+  void remove() {
+    fs::remove(ownerPath(), noThrow());
+    fs::remove(path, noThrow());
+  }
+
+public:
+  explicit PoolLock(const fs::path& dir) : path{dir / "worktodo.lock"} {
+    std::random_device rd;
+    token = to_string(getpid()) + '-' + hex((u64(rd()) << 32) | rd()) + '\n';
+
+    bool logged = false;
+    while (true) {
+      if (fs::create_directory(path, noThrow())) {
+        File::openWrite(ownerPath()).write(token);
+        std::this_thread::sleep_for(std::chrono::milliseconds(SETTLE_MS));
+        if (isOwned()) { return; }
+        continue;
+      }
+      if (isStale()) {
+        log("Removing stale lock '%s'\n", path.string().c_str());
+        remove();
+        continue;
+      }
+      if (!logged) {
+        log("Waiting for lock '%s'\n", path.string().c_str());
+        logged = true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+  }
+
+  ~PoolLock() { if (isOwned()) { remove(); } }
+};
+
+std::optional<Task> parseAux(const std::string& line) {
   u32 exp = 0;
   int pos = 0;
   u32 B1 = 0;
@@ -32,7 +117,28 @@ std::optional<Task> parse(const std::string& line) {
   if(sscanf(tail.c_str(), "%11[a-zA-Z]=%n", kindStr, &pos) == 1) {
     string kind = kindStr;
     tail = tail.substr(pos);
-    if (kind == "PRP" || kind == "PRPDC" || kind == "Pfactor" || kind == "PFactor") {
+    if (kind == "ECM2") {
+      // ECM2=AID,1,2,exponent,-1,B1,B2,curves; only the first stage is done, to B1.
+      char AIDStr[64] = {0};
+      u32 curves = 0;
+      if (sscanf(tail.c_str(), "%32[0-9a-zA-Z/],1,2,%u,-1,%u,%u,%u", AIDStr, &exp, &B1, &B2, &curves) == 5
+          && B1 && curves) {
+        string AID = AIDStr;
+        if (AID == "N/A" || AID == "0") { AID = ""; }
+        Task task{Task::ECM, exp, AID, line, B1, B2};
+        task.curves = curves;
+        return task;
+      }
+    } else if (kind == "Cert") {
+      // Cert=AID,1,2,exponent,-1,squarings; the start value is in the file of Task::certPath().
+      char AIDStr[64] = {0};
+      u32 squarings = 0;
+      if (sscanf(tail.c_str(), "%32[0-9a-fA-F],1,2,%u,-1,%u", AIDStr, &exp, &squarings) == 3 && squarings) {
+        Task task{Task::CERT, exp, AIDStr, line};
+        task.squarings = squarings;
+        return task;
+      }
+    } else if (kind == "PRP" || kind == "PRPDC" || kind == "Pfactor" || kind == "PFactor") {
       if (tail.find('"') != string::npos) {
         log("GpuOwl does not support PRP-CF!\n");
       } else {
@@ -53,61 +159,217 @@ std::optional<Task> parse(const std::string& line) {
   return std::nullopt;
 }
 
-bool deleteLine(const fs::path& fileName, const std::string& targetLine) {
-  assert(!targetLine.empty());
-  bool lineDeleted = false;
+// The parsed lines, thus each line is parsed (and logged if ignored) only once, not on every getTask().
+// The lines seen, parsed; dropped past MAX_PARSED, as the lines of a long-running pool come and go.
+constexpr u32 MAX_PARSED = 4096;
+
+std::optional<Task> parse(const std::string& line) {
+  static std::map<string, optional<Task>> parsed;
+  if (parsed.size() >= MAX_PARSED) { parsed.clear(); }
+  auto it = parsed.find(line);
+  if (it == parsed.end()) { it = parsed.emplace(line, parseAux(line)).first; }
+  return it->second;
+}
+
+// Deletes the target lines (one occurrence each) in a single rewrite of the file.
+bool deleteLines(const fs::path& fileName, std::multiset<string> targets) {
+  assert(!targets.empty());
+  u32 nTargets = targets.size();
   {
     auto fo{File::openWrite(fileName + ".new")};
     for (const string& line : File::openReadThrow(fileName)) {
       // log("line '%s'\n", line.c_str());
-      if (!lineDeleted && line == targetLine) {
-        lineDeleted = true;
+      if (auto it = targets.find(line); it != targets.end()) {
+        targets.erase(it);
       } else {
         fo.write(line);
       }
     }
   }
 
-  if (!lineDeleted) {
-    log("'%s': could not find the line '%s' to delete\n", fileName.string().c_str(), targetLine.c_str());
-    return false;
+  for (const string& line : targets) {
+    log("'%s': could not find the line '%s' to delete\n", fileName.string().c_str(), line.c_str());
   }
+  if (targets.size() == nTargets) { return false; }
   Saver::cycle(fileName);
-  return true;
+  return targets.empty();
+}
+
+bool deleteLine(const fs::path& fileName, const std::string& targetLine) {
+  assert(!targetLine.empty());
+  return deleteLines(fileName, {targetLine});
 }
 
-std::optional<Task> firstGoodTask(const fs::path& fileName) {
+// The exponents of the claimed P-1 tasks, whose GCD may still be running in the background.
+std::set<u32> claimedPM1() {
+  std::set<u32> exponents;
+  for (const string& line : claimed) {
+    if (optional<Task> task = parse(line); task && task->kind == Task::PM1) { exponents.insert(task->exponent); }
+  }
+  return exponents;
+}
+
+// Up to "n" tasks of the file which are not claimed. A CERT waits for its start value file.
+// With "deferPRP", a PRP waits for the P-1 of its exponent, as a factor found by the P-1 GCD deletes it; "deferred"
+// is then set.
+vector<Task> goodTasks(const fs::path& fileName, u32 n, bool deferPRP = true, bool* deferred = nullptr) {
+  std::set<u32> pm1 = deferPRP ? claimedPM1() : std::set<u32>{};
+  vector<Task> tasks;
   for (const string& line : File::openRead(fileName)) {
-    if (optional<Task> maybeTask = parse(line)) { return maybeTask; }
+    if (tasks.size() >= n) { break; }
+    if (claimed.count(line)) { continue; }
+    if (optional<Task> maybeTask = parse(line)) {
+      if (maybeTask->kind == Task::CERT && !fs::exists(maybeTask->certPath())) { continue; }
+      if (maybeTask->kind == Task::PRP && pm1.count(maybeTask->exponent)) {
+        if (deferred) { *deferred = true; }
+        continue;
+      }
+      tasks.push_back(*maybeTask);
+    }
+  }
+  return tasks;
+}
+
+// How far down the file a preferred task is looked for, thus the order of the file is mostly kept.
+constexpr u32 PREFER_WINDOW = 16;
+
+std::optional<Task> firstGoodTask(const fs::path& fileName, const std::function<bool(const Task&)>& prefer = {},
+                                  bool* deferred = nullptr) {
+  vector<Task> tasks = goodTasks(fileName, prefer ? PREFER_WINDOW : 1, true, deferred);
+  if (tasks.empty()) { return nullopt; }
+  if (prefer) {
+    for (const Task& task : tasks) { if (prefer(task)) { return task; } }
+  }
+  return tasks.front();
+}
+
+// The tasks of priority.txt (same format as worktodo.txt) go before those of worktodo.txt, and preempt a running PRP.
+const char* const PRIORITY_TXT = "priority.txt";
+
+const char* fileOf(const Task& task) { return task.priority ? PRIORITY_TXT : "worktodo.txt"; }
+
+std::optional<Task> claimPriority() {
+  optional<Task> task = firstGoodTask(PRIORITY_TXT);
+  if (task) {
+    task->priority = true;
+    claimed.insert(task->line);
   }
-  return nullopt;
+  return task;
+}
+
+// Replaces the line of the claimed task, which stays claimed by the new line.
+string replaceLine(const Task& task, const string& newLine) {
+  fs::path fileName = fileOf(task);
+  std::unique_lock lock(worktodoMutex);
+  {
+    auto fo{File::openWrite(fileName + ".new")};
+    bool done = false;
+    for (const string& line : File::openReadThrow(fileName)) {
+      fo.write((!done && line == task.line) ? newLine : line);
+      done = done || line == task.line;
+    }
+  }
+  Saver::cycle(fileName);
+  claimed.erase(task.line);
+  claimed.insert(newLine);
+  return newLine;
 }
 
 }
 
-std::optional<Task> Worktodo::getTask(Args &args) {
+std::optional<Task> Worktodo::getTask(Args &args, const std::function<bool(const Task&)>& prefer) {
   string worktodoTxt = "worktodo.txt";
+  std::unique_lock lock(worktodoMutex);
+
+  if (optional<Task> task = claimPriority()) { return task; }
   
  again:
+  bool deferred = false;
   // Try to get a task from the local worktodo.txt
-  if (optional<Task> task = firstGoodTask(worktodoTxt)) {    
+  if (optional<Task> task = firstGoodTask(worktodoTxt, prefer, &deferred)) {
+    claimed.insert(task->line);
     return task;
   }
   
+  // A batch of -poolBatch tasks is moved from the pool to the local worktodo.txt, under the pool lock.
   if (!args.masterDir.empty()) {
     fs::path globalWorktodo = args.masterDir / worktodoTxt;
-    if (optional<Task> task = firstGoodTask(globalWorktodo)) {
-      File::append(worktodoTxt, task->line);
-      deleteLine(globalWorktodo, task->line);
+    PoolLock poolLock{args.masterDir};
+    if (vector<Task> tasks = goodTasks(globalWorktodo, args.poolBatch); !tasks.empty()) {
+      std::multiset<string> lines;
+      for (const Task& task : tasks) {
+        File::append(worktodoTxt, task.line);
+        lines.insert(task.line);
+      }
+      deleteLines(globalWorktodo, lines);
       goto again;
     }
   }
+
+  // Only a PRP waiting for its P-1 is left: wait for the P-1 GCD, which may delete it.
+  if (deferred) {
+    unclaimed.wait(lock);
+    goto again;
+  }
   
   return std::nullopt;
 }
 
+bool Worktodo::hasPriority() {
+  std::unique_lock lock(worktodoMutex);
+  return !goodTasks(PRIORITY_TXT, 1).empty();
+}
+
+std::optional<Task> Worktodo::getPriorityTask() {
+  std::unique_lock lock(worktodoMutex);
+  return claimPriority();
+}
+
+std::optional<Task> Worktodo::peekTask() {
+  std::unique_lock lock(worktodoMutex);
+  return firstGoodTask("worktodo.txt");
+}
+
 bool Worktodo::deleteTask(const Task &task) {
   // Some tasks don't originate in worktodo.txt and thus don't need deleting.
   if (task.line.empty()) { return true; }
-  return deleteLine("worktodo.txt", task.line);
+  std::unique_lock lock(worktodoMutex);
+  claimed.erase(task.line);
+  unclaimed.notify_all();
+  return deleteLine(fileOf(task), task.line);
+}
+
+void Worktodo::releaseTask(const Task& task) {
+  std::unique_lock lock(worktodoMutex);
+  claimed.erase(task.line);
+  unclaimed.notify_all();
+}
+
+string Worktodo::replaceECM(const Task& task) {
+  assert(task.kind == Task::ECM && !task.line.empty());
+  char buf[256];
+  snprintf(buf, sizeof(buf), "ECM2=%s,1,2,%u,-1,%u,%u,%u\n",
+           task.AID.empty() ? "N/A" : task.AID.c_str(), task.exponent, task.B1, task.B2, task.curves);
+  return replaceLine(task, buf);
+}
+
+string Worktodo::replaceBounds(const Task& task) {
+  assert(task.kind == Task::PM1 && !task.line.empty());
+  // The "B1=..;" or "B2=..;" prefix of the line, if any, is replaced.
+  string tail = task.line;
+  if (tail.rfind("B1=", 0) == 0 || tail.rfind("B2=", 0) == 0) {
+    if (auto pos = tail.find(';'); pos != string::npos) { tail = tail.substr(pos + 1); }
+  }
+  return replaceLine(task, "B1="s + to_string(task.B1) + ",B2=" + to_string(task.B2) + ";" + tail);
+}
+
+void Worktodo::deletePRP(u32 exponent) {
+  std::unique_lock lock(worktodoMutex);
+  std::multiset<string> lines;
+  for (const Task& task : goodTasks("worktodo.txt", u32(-1), false)) {
+    if (task.kind == Task::PRP && task.exponent == exponent) { lines.insert(task.line); }
+  }
+  if (!lines.empty() && deleteLines("worktodo.txt", lines)) {
+    log("Deleted %u PRP task(s) of the factored %u\n", u32(lines.size()), exponent);
+  }
 }
@@ -6,12 +6,35 @@
 #include "Args.h"
 #include "Task.h"
 #include "common.h"
+#include <functional>
 #include <optional>
 
 class Worktodo {
 public:
-  static std::optional<Task> getTask(Args &args);
+  // With "prefer", the first of the next few unclaimed tasks that satisfies it, else the first unclaimed task.
+  // The PRP of an exponent whose P-1 is claimed (running, or its GCD pending) is not returned until the P-1 is done,
+  // and when only such PRPs are left getTask() waits for the P-1.
+  static std::optional<Task> getTask(Args &args, const std::function<bool(const Task&)>& prefer = {});
+
+  // Whether priority.txt has an unclaimed task, which then preempts the running PRP (see Gpu::preempt).
+  static bool hasPriority();
+  static std::optional<Task> getPriorityTask();
+
+  // The task that getTask() would return next from the local worktodo.txt, without claiming it.
+  static std::optional<Task> peekTask();
   static bool deleteTask(const Task &task);
+
+  // Allow the task to be returned again by getTask(), if it was not deleted.
+  static void releaseTask(const Task& task);
+
+  // Writes the count of curves left of the claimed ECM task into its line, and returns the new line.
+  static string replaceECM(const Task& task);
+
+  // Writes the bounds of the claimed P-1 task into its line (as the "B1=..,B2=..;" prefix), and returns the new line.
+  static string replaceBounds(const Task& task);
+
+  // Deletes the PRP tasks of a factored exponent, except those claimed by a worker.
+  static void deletePRP(u32 exponent);
   
   static Task makePRP(Args &args, u32 exponent) {
     Task task{Task::PRP, exponent};
@@ -12,6 +12,8 @@
 #include <memory>
 #include <vector>
 #include <array>
+#include <map>
+#include <mutex>
 
 using namespace std;
 
@@ -108,11 +110,31 @@ u64 getFreeMem(cl_device_id id) {
   }
 }
 
+u64 getCacheSize(cl_device_id id) {
+  try {
+    u64 cacheSize = 0;
+    GET_INFO(id, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, cacheSize);
+    return cacheSize;
+  } catch (const gpu_error& err) {
+    return 0;
+  }
+}
+
+bool hasUnifiedMemory(cl_device_id id) {
+  try {
+    cl_bool unified = 0;
+    GET_INFO(id, CL_DEVICE_HOST_UNIFIED_MEMORY, unified);
+    return unified;
+  } catch (const gpu_error& err) {
+    return false;
+  }
+}
+
 u64 getTotalMem(cl_device_id id) {
   try {
     u64 totSize = 0; 
     GET_INFO(id, CL_DEVICE_GLOBAL_MEM_SIZE, totSize);
-    return totSize * 1024; // KB to Bytes.    
+    return totSize;
   } catch (const gpu_error& err) {
     return u64(64) * 1024 * 1024 * 1024; // return huge size (64G) when free-info not available
   }
@@ -165,9 +187,48 @@ static string getFreq(cl_device_id device) {
 }
 */
 
+string getPciAddress(cl_device_id id) {
+  u32 domain = 0, bus = 0, device = 0, function = 0;
+  try {
+    cl_device_pci_bus_info_khr info;
+    GET_INFO(id, CL_DEVICE_PCI_BUS_INFO_KHR, info);
+    domain = info.pci_domain;
+    bus = info.pci_bus;
+    device = info.pci_device;
+    function = info.pci_function;
+  } catch (const gpu_error&) {
+    try {
+      cl_device_topology_amd top;
+      GET_INFO(id, CL_DEVICE_TOPOLOGY_AMD, top);
+      bus = (unsigned char) top.pcie.bus;
+      device = top.pcie.device;
+      function = top.pcie.function;
+    } catch (const gpu_error&) {
+      try {
+        u32 slot = 0;
+        GET_INFO(id, CL_DEVICE_PCI_BUS_ID_NV, bus);
+        GET_INFO(id, CL_DEVICE_PCI_SLOT_ID_NV, slot);
+        device = slot >> 3;
+        function = slot & 7;
+      } catch (const gpu_error&) {
+        return "";
+      }
+    }
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%04x:%02x:%02x.%x", domain, bus, device, function);
+  return buf;
+}
+
 string getShortInfo(cl_device_id device) { return getHwName(device); }
 string getLongInfo(cl_device_id device) { return getShortInfo(device) + "-" + getBoardName(device); }
 
+string getDriverVersion(cl_device_id id) {
+  char version[256] = {0};
+  GET_INFO(id, CL_DRIVER_VERSION, version);
+  return version;
+}
+
 cl_device_id getDevice(u32 argsDeviceId) {
   auto devices = getAllDeviceIDs();
   if (devices.empty()) {
@@ -196,6 +257,106 @@ void release(cl_queue queue)     { CHECK1(clReleaseCommandQueue(queue)); }
 void release(cl_kernel k)        { CHECK1(clReleaseKernel(k)); }
 void release(cl_event event)     { CHECK1(clReleaseEvent(event)); }
 
+namespace {
+
+// The entry points of cl_khr_command_buffer, which are resolved at runtime per platform.
+using cl_sync_point_khr = unsigned;
+using CreateCommandBufferFn = cl_command_buffer_khr (*)(unsigned, const cl_queue*, const u64*, int*);
+using CommandNDRangeKernelFn = int (*)(cl_command_buffer_khr, cl_queue, const u64*, cl_kernel, unsigned,
+                                       const size_t*, const size_t*, const size_t*,
+                                       unsigned, const cl_sync_point_khr*, cl_sync_point_khr*, void*);
+using FinalizeCommandBufferFn = int (*)(cl_command_buffer_khr);
+using EnqueueCommandBufferFn = int (*)(unsigned, cl_queue*, cl_command_buffer_khr, unsigned, const cl_event*, cl_event*);
+using ReleaseCommandBufferFn = int (*)(cl_command_buffer_khr);
+
+struct CommandBufferFns {
+  CreateCommandBufferFn create{};
+  CommandNDRangeKernelFn ndRange{};
+  FinalizeCommandBufferFn finalize{};
+  EnqueueCommandBufferFn enqueue{};
+  ReleaseCommandBufferFn release{};
+  bool ok() const { return create && ndRange && finalize && enqueue && release; }
+};
+
+// A single platform is used by a process.
+CommandBufferFns cbFns;
+
+// The sync point of the last recorded command, per command buffer.
+std::map<cl_command_buffer_khr, cl_sync_point_khr> lastSyncPoint;
+std::mutex cbMutex;
+
+bool loadCommandBufferFns(cl_device_id device) {
+  std::unique_lock lock{cbMutex};
+  if (cbFns.ok()) { return true; }
+
+  size_t size = 0;
+  if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, nullptr, &size) != CL_SUCCESS) { return false; }
+  vector<char> extensions(size + 1);
+  if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, extensions.data(), nullptr) != CL_SUCCESS) { return false; }
+  if ((" "s + extensions.data() + " ").find(" cl_khr_command_buffer ") == string::npos) { return false; }
+
+  cl_platform_id platform{};
+  if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr) != CL_SUCCESS) { return false; }
+  auto get = [platform](const char* name) { return clGetExtensionFunctionAddressForPlatform(platform, name); };
+  cbFns = {
+    reinterpret_cast<CreateCommandBufferFn>(get("clCreateCommandBufferKHR")),
+    reinterpret_cast<CommandNDRangeKernelFn>(get("clCommandNDRangeKernelKHR")),
+    reinterpret_cast<FinalizeCommandBufferFn>(get("clFinalizeCommandBufferKHR")),
+    reinterpret_cast<EnqueueCommandBufferFn>(get("clEnqueueCommandBufferKHR")),
+    reinterpret_cast<ReleaseCommandBufferFn>(get("clReleaseCommandBufferKHR")),
+  };
+  return cbFns.ok();
+}
+
+}
+
+void release(cl_command_buffer_khr buf) {
+  {
+    std::unique_lock lock{cbMutex};
+    lastSyncPoint.erase(buf);
+  }
+  CHECK1(cbFns.release(buf));
+}
+
+CommandBufferHolder makeCommandBuffer(cl_device_id device, cl_queue queue) {
+  if (!loadCommandBufferFns(device)) { return {}; }
+
+  // The buffer is enqueued again while the previous enqueue is pending, see -inflight. Since 0.9.5 this is always
+  // allowed, and the capability is gone; before, it must be asked for.
+  u64 caps = 0;
+  bool simultaneous = clGetDeviceInfo(device, CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR, sizeof(caps), &caps, nullptr)
+    == CL_SUCCESS && (caps & CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR);
+  u64 properties[] = {CL_COMMAND_BUFFER_FLAGS_KHR, CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR, 0};
+
+  int err = 0;
+  cl_command_buffer_khr buf = cbFns.create(1, &queue, simultaneous ? properties : nullptr, &err);
+  return CommandBufferHolder{err == CL_SUCCESS ? buf : nullptr};
+}
+
+bool recordKernel(cl_command_buffer_khr buf, cl_kernel kernel, size_t groupSize, size_t workSize) {
+  std::unique_lock lock{cbMutex};
+  auto it = lastSyncPoint.find(buf);
+  cl_sync_point_khr syncPoint{};
+  bool ok = cbFns.ndRange(buf, nullptr, nullptr, kernel, 1, nullptr, &workSize, &groupSize,
+                          it == lastSyncPoint.end() ? 0 : 1, it == lastSyncPoint.end() ? nullptr : &it->second,
+                          &syncPoint, nullptr) == CL_SUCCESS;
+  if (ok) { lastSyncPoint[buf] = syncPoint; }
+  return ok;
+}
+
+bool finalizeCommandBuffer(cl_command_buffer_khr buf) { return cbFns.finalize(buf) == CL_SUCCESS; }
+
+bool enqueueCommandBuffer(cl_queue queue, cl_command_buffer_khr buf, EventHolder* outEvent) {
+  cl_event event{};
+  int err = cbFns.enqueue(1, &queue, buf, 0, nullptr, outEvent ? &event : nullptr);
+  if (err != CL_SUCCESS) {
+    log("enqueue of the command buffer: error %d (%s)\n", err, errMes(err).c_str());
+    return false;
+  }
+  if (outEvent) { *outEvent = EventHolder{event}; }
+  return true;
+}
+
 string getBinary(cl_program program) {
   size_t size;
   CHECK1(clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL));
@@ -331,6 +492,44 @@ void read(cl_queue queue, bool blocking, cl_mem buf, size_t size, void *data, si
   CHECK1(clEnqueueReadBuffer(queue, buf, blocking, start, size, data, 0, NULL, NULL));
 }
 
+EventHolder readWithEvent(cl_queue queue, cl_mem buf, size_t size, void *data, size_t start) {
+  cl_event event{};
+  CHECK1(clEnqueueReadBuffer(queue, buf, false, start, size, data, 0, NULL, &event));
+  return EventHolder{event};
+}
+
+void *mapBuf(cl_queue queue, cl_mem buf, bool forWrite, size_t size, cl_event *outEvent) {
+  int err = 0;
+  void *ptr = clEnqueueMapBuffer(queue, buf, !outEvent, forWrite ? CL_MAP_WRITE_INVALIDATE_REGION : CL_MAP_READ, 0, size,
+                                 0, NULL, outEvent, &err);
+  CHECK1(err);
+  return ptr;
+}
+
+void unmapBuf(cl_queue queue, cl_mem buf, void *ptr) { CHECK1(clEnqueueUnmapMemObject(queue, buf, ptr, 0, NULL, NULL)); }
+
+void waitForEvent(cl_event event) { CHECK1(clWaitForEvents(1, &event)); }
+
+EventHolder enqueueMarker(cl_queue queue) {
+  cl_event event{};
+  CHECK1(clEnqueueMarkerWithWaitList(queue, 0, NULL, &event));
+  return EventHolder{event};
+}
+
+bool setCompletionCallback(cl_event event, std::function<void()> fn) {
+  auto* f = new std::function<void()>(std::move(fn));
+  auto callback = [](cl_event, int, void* data) {
+    auto* f = static_cast<std::function<void()>*>(data);
+    (*f)();
+    delete f;
+  };
+  if (clSetEventCallback(event, CL_COMPLETE, callback, f) != CL_SUCCESS) {
+    delete f;
+    return false;
+  }
+  return true;
+}
+
 void write(cl_queue queue, bool blocking, cl_mem buf, size_t size, const void *data, size_t start) {
   CHECK1(clEnqueueWriteBuffer(queue, buf, blocking, start, size, data, 0, NULL, NULL));
 }
@@ -371,11 +570,16 @@ u32 getEventInfo(cl_event event) {
 }
 
 u64 getEventNanos(cl_event event) {  
+  auto [start, end] = getEventTimes(event);
+  return end - start;
+}
+
+std::pair<u64, u64> getEventTimes(cl_event event) {
   u64 start = 0;
   u64 end = 0;
   CHECK1(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, 0));
   CHECK1(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, 0));
-  return end - start;
+  return {start, end};
 }
 
 cl_context getQueueContext(cl_command_queue q) {
@@ -10,6 +10,7 @@
 #include <cassert>
 #include <memory>
 #include <any>
+#include <functional>
 
 using cl_queue = cl_command_queue;
 
@@ -20,6 +21,7 @@ void release(cl_mem buf);
 void release(cl_program program);
 void release(cl_queue queue);
 void release(cl_event event);
+void release(cl_command_buffer_khr buf);
 
 template<typename T>
 struct Deleter {
@@ -34,6 +36,7 @@ template<> struct default_delete<cl_mem> : public Deleter<cl_mem> {};
 template<> struct default_delete<cl_program> : public Deleter<cl_program> {};
 template<> struct default_delete<cl_queue> : public Deleter<cl_queue> {};
 template<> struct default_delete<cl_event> : public Deleter<cl_event> {};
+template<> struct default_delete<cl_command_buffer_khr> : public Deleter<cl_command_buffer_khr> {};
 }
 
 template<typename T> using Holder = std::unique_ptr<T, Deleter<T> >;
@@ -41,6 +44,7 @@ template<typename T> using Holder = std::unique_ptr<T, Deleter<T> >;
 using QueueHolder = std::unique_ptr<cl_queue>;
 using KernelHolder = std::unique_ptr<cl_kernel>;
 using EventHolder = std::unique_ptr<cl_event>;
+using CommandBufferHolder = std::unique_ptr<cl_command_buffer_khr>;
 
 class Context;
 
@@ -54,10 +58,23 @@ void check(int err, const char *file, int line, const char *func, string_view me
 vector<cl_device_id> getAllDeviceIDs();
 string getShortInfo(cl_device_id device);
 string getLongInfo(cl_device_id device);
+string getDriverVersion(cl_device_id device);
+
+// The PCI address "domain:bus:device.function" of the device, as in /sys/bus/pci/devices; empty if not known.
+string getPciAddress(cl_device_id device);
 
 // Get GPU free memory in bytes.
 u64 getFreeMem(cl_device_id id);
 bool hasFreeMemInfo(cl_device_id id);
+
+// The GPU global memory size in bytes.
+u64 getTotalMem(cl_device_id id);
+
+// The global memory cache (L2) size in bytes, 0 if not known.
+u64 getCacheSize(cl_device_id id);
+
+// True on APUs and integrated GPUs, where the device memory is the host memory.
+bool hasUnifiedMemory(cl_device_id id);
 bool isAmdGpu(cl_device_id id);
 
 cl_context createContext(cl_device_id id);
@@ -89,6 +106,29 @@ EventHolder run(cl_queue queue, cl_kernel kernel, size_t groupSize, size_t workS
 void read(cl_queue queue, bool blocking, cl_mem buf, size_t size, void *data, size_t start = 0);
 void write(cl_queue queue, bool blocking, cl_mem buf, size_t size, const void *data, size_t start = 0);
 
+// Non-blocking read; "data" is filled when the returned event completes.
+EventHolder readWithEvent(cl_queue queue, cl_mem buf, size_t size, void *data, size_t start = 0);
+void waitForEvent(cl_event event);
+
+// Maps "size" bytes of the buffer for reading, or for writing the whole region. With "outEvent" the map is non-blocking
+// and the pointer is valid once the event completes. The mapping is released with unmapBuf().
+void *mapBuf(cl_queue queue, cl_mem buf, bool forWrite, size_t size, cl_event *outEvent = nullptr);
+void unmapBuf(cl_queue queue, cl_mem buf, void *ptr);
+
+// A marker, complete when all the commands enqueued before it are complete.
+EventHolder enqueueMarker(cl_queue queue);
+
+// Calls "fn", on a thread of the OpenCL runtime, when the event is complete. Returns false if not supported.
+bool setCompletionCallback(cl_event event, std::function<void()> fn);
+
+// cl_khr_command_buffer. makeCommandBuffer() returns null if the device does not support it; the kernels are recorded
+// with their arguments at the time of recording, each after the previous one. enqueueCommandBuffer() returns false,
+// with nothing enqueued, if the driver rejects it.
+CommandBufferHolder makeCommandBuffer(cl_device_id device, cl_queue queue);
+bool recordKernel(cl_command_buffer_khr buf, cl_kernel kernel, size_t groupSize, size_t workSize);
+bool finalizeCommandBuffer(cl_command_buffer_khr buf);
+bool enqueueCommandBuffer(cl_queue queue, cl_command_buffer_khr buf, EventHolder* event);
+
 void copyBuf(cl_queue queue, const cl_mem src, cl_mem dst, size_t size);
 
 void fillBuf(cl_queue q, cl_mem buf, void *pat, size_t patSize, size_t size = 0, size_t start = 0);
@@ -98,6 +138,9 @@ std::string getKernelArgName(cl_kernel k, int pos);
 
 cl_device_id getDevice(u32 argsDevId);
 u64 getEventNanos(cl_event event);
+// The profiling start and end of the event, in nanoseconds of the device clock.
+std::pair<u64, u64> getEventTimes(cl_event event);
 u32 getEventInfo(cl_event event);
 
 cl_context getQueueContext(cl_command_queue q);
+cl_device_id getQueueDevice(cl_command_queue q);
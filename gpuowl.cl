@@ -21,8 +21,18 @@ OLD_FFT9
 CARRY32 <AMD default for PRP when appropriate>
 CARRY64 <nVidia default>, <AMD default for PM1 when appropriate>
 
-TRIG_COMPUTE=<n> (default 2), can be used to balance between compute and memory for trigonometrics. TRIG_COMPUTE=0 does more memory access, TRIG_COMPUTE=2 does more compute,
-and TRIG_COMPUTE=1 is in between.
+SUBGROUP_SHUFFLE: do the shufl() exchanges of the width and height FFTs with sub-group shuffles instead of LDS, when the
+workgroup is a single sub-group (e.g. the 64-wide FFTs on a wave64 GPU) and cl_khr_subgroup_shuffle is supported.
+
+CARRY_TICKET: in carryFused, each group takes its line from a counter in dispatch order instead of its group id. The group it
+waits for is then always already running, which helps GPUs that dispatch the groups out of order.
+
+FUSED_MIDDLE: do fftMiddleOut, carryFused and fftMiddleIn of a plain squaring in one kernel, carryFusedMiddle, which keeps
+MIDDLE lines per group in registers. Only built for MIDDLE * NW <= 32, otherwise the separate kernels are used.
+
+TRIG_COMPUTE=<n> can be used to balance between compute and memory for trigonometrics. TRIG_COMPUTE=0 does more memory access, TRIG_COMPUTE=2 does more compute,
+and TRIG_COMPUTE=1 is in between. When not set, the host picks 0 if its N-byte table fits in 1/8 of the device cache, else 2,
+or 1 on a GPU with a FP64 rate below 1/8 of FP32.
 
 DEBUG      enable asserts. Slow, but allows to verify that all asserts hold.
 STATS      enable stats about roundoff distribution and carry magnitude
@@ -39,10 +49,10 @@ HAS_ASM : set if we believe __asm() can be used
  */
 
 /* List of code-specific macros. These are set by the C++ host code or derived
-EXP        the exponent
 WIDTH
 SMALL_HEIGHT
 MIDDLE
+LARGE_WORDS set if the words may have 19 bits or more (EXP / NWORDS >= 19)
 
 -- Derived from above:
 BIG_HEIGHT = SMALL_HEIGHT * MIDDLE
@@ -74,6 +84,11 @@ G_H        "group height"
 #pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
 // #pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
 
+#if SUBGROUP_SHUFFLE && defined(cl_khr_subgroup_shuffle)
+#pragma OPENCL EXTENSION cl_khr_subgroup_shuffle : enable
+#define HAS_SUBGROUP_SHUFFLE 1
+#endif
+
 #if DEBUG
 #define assert(condition) if (!(condition)) { printf("assert(%s) failed at line %d\n", STR(condition), __LINE__ - 1); }
 // __builtin_trap();
@@ -107,6 +122,12 @@ G_H        "group height"
 #endif
 #endif
 
+// STATS is also used as a value, see carryPair().
+#if !STATS
+#undef STATS
+#define STATS 0
+#endif
+
 // The ROCm optimizer does a very, very poor job of keeping register usage to a minimum.  This negatively impacts occupancy
 // which can make a big performance difference.  To counteract this, we can prevent some loops from being unrolled.
 // For AMD GPUs we do not unroll fft_WIDTH loops. For nVidia GPUs, we unroll everything.
@@ -114,8 +135,8 @@ G_H        "group height"
 #define UNROLL_WIDTH 1
 #endif
 
-// Expected defines: EXP the exponent.
-// WIDTH, SMALL_HEIGHT, MIDDLE.
+// Expected defines: WIDTH, SMALL_HEIGHT, MIDDLE.
+// The exponent is not a define; the values derived from it are set by writeGlobals().
 
 #define BIG_HEIGHT (SMALL_HEIGHT * MIDDLE)
 #define ND (WIDTH * BIG_HEIGHT)
@@ -299,10 +320,13 @@ OVERLOAD TT mul(TT a, TT b) { return U2(mad1(RE(a), RE(b), - IM(a) * IM(b)), mad
 
 bool test(u32 bits, u32 pos) { return (bits >> pos) & 1; }
 
-#define STEP (NWORDS - (EXP % NWORDS))
+// Set by writeGlobals(): BITLEN == EXP / NWORDS, STEP == NWORDS - (EXP % NWORDS).
+u32 BITLEN;
+u32 STEP;
+
 // bool isBigWord(u32 extra) { return extra < NWORDS - STEP; }
 
-u32 bitlen(bool b) { return EXP / NWORDS + b; }
+u32 bitlen(bool b) { return BITLEN + b; }
 
 
 // complex add * 2
@@ -452,7 +476,7 @@ Word OVERLOAD carryStep(i64 x, i32 *outCarry, bool isBigWord) {
 
 // If nBits could be 20 or more we must be careful.  doubleToLong generated x as 13 bits of trash and 51-bit signed value.
 // If we right shift 20 bits we will shift some of the trash into outCarry.  First we must remove the trash bits.
-#if EXP / NWORDS >= 19
+#if LARGE_WORDS
   *outCarry = as_int2(x << 13).y >> (nBits - 19);
 #else
   *outCarry = xtract32(x, nBits);
@@ -485,13 +509,12 @@ u32 bound(i64 carry) { return min(abs(carry), 0xfffffffful); }
 typedef TT T2;
 
 //{{ carries
-Word2 OVERLOAD carryPair(T2 u, iCARRY *outCarry, bool b1, bool b2, iCARRY inCarry, u32* carryMax) {
+// With "stats" (a constant: STATS, or 1 in the sampling carryFusedStats) the carry magnitude goes into carryMax.
+Word2 OVERLOAD carryPair(T2 u, iCARRY *outCarry, bool b1, bool b2, iCARRY inCarry, u32* carryMax, bool stats) {
   iCARRY midCarry;
   Word a = carryStep(doubleToLong(u.x, (iCARRY) 0) + inCarry, &midCarry, b1);
   Word b = carryStep(doubleToLong(u.y, (iCARRY) 0) + midCarry, outCarry, b2);
-#if STATS
-  *carryMax = max(*carryMax, max(bound(midCarry), bound(*outCarry)));
-#endif
+  if (stats) { *carryMax = max(*carryMax, max(bound(midCarry), bound(*outCarry))); }
   return (Word2) (a, b);
 }
 
@@ -507,13 +530,11 @@ Word2 OVERLOAD carryFinal(Word2 u, iCARRY inCarry, bool b1) {
 //== carries CARRY=32
 //== carries CARRY=64
 
-Word2 OVERLOAD carryPairMul(T2 u, i64 *outCarry, bool b1, bool b2, i64 inCarry, u32* carryMax) {
+Word2 OVERLOAD carryPairMul(T2 u, i64 *outCarry, bool b1, bool b2, i64 inCarry, u32* carryMax, bool stats) {
   i64 midCarry;
   Word a = carryStep(3 * doubleToLong(u.x, (i64) 0) + inCarry, &midCarry, b1);
   Word b = carryStep(3 * doubleToLong(u.y, (i64) 0) + midCarry, outCarry, b2);
-#if STATS
-  *carryMax = max(*carryMax, max(bound(midCarry), bound(*outCarry)));
-#endif
+  if (stats) { *carryMax = max(*carryMax, max(bound(midCarry), bound(*outCarry))); }
   return (Word2) (a, b);
 }
 
@@ -655,7 +676,77 @@ void fft6(T2 *u) {
 #include "fft14.cl"
 #include "fft15.cl"
 
+// 4x4: the fft4 of the 4 columns, the twiddles, the fft4 of the 4 rows, then a transpose to the natural order.
+void fft16(T2 *u) {
+  const double C1 = 0.92387953251128675613;	// cos(tau/16)
+  const double S1 = 0.38268343236508977173;	// sin(tau/16)
+
+  for (i32 i = 0; i < 4; ++i) {
+    T2 v[4] = {u[i], u[i + 4], u[i + 8], u[i + 12]};
+    fft4(v);
+    for (i32 k = 0; k < 4; ++k) { u[i + 4 * k] = v[k]; }
+  }
+
+  u[5]  = mul(u[5], U2(C1, -S1));
+  u[6]  = mul_t8(u[6]);
+  u[7]  = mul(u[7], U2(S1, -C1));
+  u[9]  = mul_t8(u[9]);
+  u[10] = mul_t4(u[10]);
+  u[11] = mul_3t8(u[11]);
+  u[13] = mul(u[13], U2(S1, -C1));
+  u[14] = mul_3t8(u[14]);
+  u[15] = mul(u[15], U2(-C1, S1));
+
+  for (i32 i = 0; i < 4; ++i) { fft4(u + 4 * i); }
+
+  SWAP(u[1], u[4]);
+  SWAP(u[2], u[8]);
+  SWAP(u[3], u[12]);
+  SWAP(u[6], u[9]);
+  SWAP(u[7], u[13]);
+  SWAP(u[11], u[14]);
+}
+
+#if HAS_SUBGROUP_SHUFFLE
+T2 shuffleXor(T2 a, u32 mask) { return U2(sub_group_shuffle_xor(a.x, mask), sub_group_shuffle_xor(a.y, mask)); }
+T2 shuffleLane(T2 a, u32 lane) { return U2(sub_group_shuffle(a.x, lane), sub_group_shuffle(a.y, lane)); }
+
+// The permutation of shufl() done within one sub-group. With WG = 2^w, n = 2^a, f = 2^s: first each register bit c is
+// swapped with the lane bit w-a+c, then the lane bits [s, w) are rotated right by a. Requires s + a <= w.
+void shuflSubgroup(u32 WG, T2 *u, u32 n, u32 f) {
+  u32 me = get_local_id(0);
+  u32 w = ctz(WG);
+  u32 a = ctz(n);
+  u32 s = ctz(f);
+
+  for (u32 c = 0; c < a; ++c) {
+    u32 laneBit = 1u << (w - a + c);
+    bool high = me & laneBit;
+    for (u32 r = 0; r < n; ++r) {
+      if (r & (1u << c)) { continue; }
+      u32 r1 = r | (1u << c);
+      T2 recv = shuffleXor(high ? u[r] : u[r1], laneBit);
+      if (high) { u[r] = recv; } else { u[r1] = recv; }
+    }
+  }
+
+  u32 len = w - s;
+  if (len > a) {
+    u32 field = me >> s;
+    u32 src = (me & (f - 1)) | ((((field >> a) | (field << (len - a))) & ((1u << len) - 1)) << s);
+    for (u32 i = 0; i < n; ++i) { u[i] = shuffleLane(u[i], src); }
+  }
+}
+#endif
+
 void shufl(u32 WG, local T2 *lds2, T2 *u, u32 n, u32 f) {
+#if HAS_SUBGROUP_SHUFFLE
+  if (get_num_sub_groups() == 1 && ctz(f) + ctz(n) <= ctz(WG)) {
+    shuflSubgroup(WG, u, n, f);
+    return;
+  }
+#endif
+
   u32 me = get_local_id(0);
   local T* lds = (local T*) lds2;
 
@@ -793,7 +884,7 @@ void readDelta(u32 WG, u32 N, T2 *u, const global T2 *a, const global T2 *b, u32
 // c) the difference between S0 and C0 represented as a double vs infinite precision is minimized.
 // Note that condition (a) requires different multipliers for different MIDDLE values.
 
-#if MIDDLE <= 4 || MIDDLE == 6 || MIDDLE == 8 || MIDDLE == 12
+#if MIDDLE <= 4 || MIDDLE == 6 || MIDDLE == 8 || MIDDLE == 12 || MIDDLE == 16
 
 #define SIN_COEFS {0.013255665205020225,-3.8819803226819742e-07,3.4105654433606424e-12,-1.4268560139781677e-17,3.4821751757020666e-23,-5.5620764489252689e-29,6.2011635226098908e-35, 237}
 #define COS_COEFS {-8.7856330013791936e-05,1.2864557872487131e-09,-7.5348856128299892e-15,2.3642407019488875e-20,-4.6158547847666762e-26,6.1440808274170587e-32,-5.8714657758002626e-38, 237}
@@ -903,6 +994,13 @@ global double2 TRIG_W[WIDTH / 2 + 1];
 TT THREAD_WEIGHTS[G_W];
 TT CARRY_WEIGHTS[BIG_HEIGHT / CARRY_LEN];
 
+// The weight step between the two words of a pair (x: inverse, y: forward), and the weights of the lines in a carry group.
+TT WEIGHT_STEPS;
+TT UNIT_WEIGHTS[CARRY_LEN];
+
+#define IWEIGHT_STEP (WEIGHT_STEPS.x)
+#define WEIGHT_STEP  (WEIGHT_STEPS.y)
+
 double2 tableTrig(u32 k, u32 n, u32 kBound, global double2* trigTable) {
   assert(n % 8 == 0);
   assert(k < kBound);       // kBound actually bounds k
@@ -973,20 +1071,32 @@ float fastCosSP(u32 k, u32 tau) {
 
 KERNEL(64) writeGlobals(global double2* trig2ShDP, global double2* trigBhDP, global double2* trigNDP,
                         global double2* trigW,
-                        global double2* threadWeights, global double2* carryWeights
+                        global double2* threadWeights, global double2* carryWeights,
+                        global double2* stepWeights, global double2* unitWeights,
+                        u32 bitlen, u32 step, u32 withTrig
                         ) {
-  for (u32 k = get_global_id(0); k < 2 * SMALL_HEIGHT/8 + 1; k += get_global_size(0)) { TRIG_2SH[k] = trig2ShDP[k]; }
-  for (u32 k = get_global_id(0); k < BIG_HEIGHT/8 + 1; k += get_global_size(0)) { TRIG_BH[k] = trigBhDP[k]; }
+  // The trig tables depend only on the FFT, and are not written again when the exponent changes.
+  if (withTrig) {
+    for (u32 k = get_global_id(0); k < 2 * SMALL_HEIGHT/8 + 1; k += get_global_size(0)) { TRIG_2SH[k] = trig2ShDP[k]; }
+    for (u32 k = get_global_id(0); k < BIG_HEIGHT/8 + 1; k += get_global_size(0)) { TRIG_BH[k] = trigBhDP[k]; }
 
 #if TRIG_COMPUTE == 0
-  for (u32 k = get_global_id(0); k < ND/8 + 1; k += get_global_size(0)) { TRIG_N[k] = trigNDP[k]; }
+    for (u32 k = get_global_id(0); k < ND/8 + 1; k += get_global_size(0)) { TRIG_N[k] = trigNDP[k]; }
 #elif TRIG_COMPUTE == 1
-  for (u32 k = get_global_id(0); k <= WIDTH/2; k += get_global_size(0)) { TRIG_W[k] = trigW[k]; }
+    for (u32 k = get_global_id(0); k <= WIDTH/2; k += get_global_size(0)) { TRIG_W[k] = trigW[k]; }
 #endif
+  }
 
   // Weights
   for (u32 k = get_global_id(0); k < G_W; k += get_global_size(0)) { THREAD_WEIGHTS[k] = threadWeights[k]; }
   for (u32 k = get_global_id(0); k < BIG_HEIGHT / CARRY_LEN; k += get_global_size(0)) { CARRY_WEIGHTS[k] = carryWeights[k]; }  
+  for (u32 k = get_global_id(0); k < CARRY_LEN; k += get_global_size(0)) { UNIT_WEIGHTS[k] = unitWeights[k]; }
+
+  if (get_global_id(0) == 0) {
+    WEIGHT_STEPS = stepWeights[0];
+    BITLEN = bitlen;
+    STEP = step;
+  }
 }
 
 double2 slowTrig_2SH(u32 k, u32 kBound) { return tableTrig(k, 2 * SMALL_HEIGHT, kBound, TRIG_2SH); }
@@ -1094,23 +1204,25 @@ KERNEL(256) sum64(global ulong* out, u32 sizeBytes, global ulong* in) {
   if (get_local_id(0) == 0) { atom_add(&out[0], sum); }
 }
 
-// outEqual must be "true" on entry.
-KERNEL(256) isEqual(P(bool) outEqual, u32 sizeBytes, global i64 *in1, global i64 *in2) {
+// The check reduction, in one pass over both buffers: out[0] is set if in1 is not zero, out[1] if in1 and in2 differ,
+// and out[2] is the max abs word of in1. "out" must be zero on entry.
+KERNEL(256) checkReduce(global u32* out, u32 sizeBytes, global i64 *in1, global i64 *in2) {
+  bool notZero = false;
+  bool notEqual = false;
+  u32 maxAbs = 0;
   for (i32 p = get_global_id(0); p < sizeBytes / sizeof(i64); p += get_global_size(0)) {
-    if (in1[p] != in2[p]) {
-      *outEqual = false;
-      return;
-    }
+    i64 a = in1[p];
+    notZero |= (a != 0);
+    notEqual |= (a != in2[p]);
+    maxAbs = max(maxAbs, max(abs((i32) a), abs((i32) (a >> 32))));
   }
-}
-
-// outNotZero must be "false" on entry.
-KERNEL(256) isNotZero(P(bool) outNotZero, u32 sizeBytes, global i64 *in) {
-  for (i32 p = get_global_id(0); p < sizeBytes / sizeof(i64); p += get_global_size(0)) {
-    if (in[p] != 0) {
-      *outNotZero = true;
-      return;
-    }
+  notZero = work_group_any(notZero);
+  notEqual = work_group_any(notEqual);
+  maxAbs = work_group_reduce_max(maxAbs);
+  if (get_local_id(0) == 0) {
+    if (notZero) { out[0] = 1; }
+    if (notEqual) { out[1] = 1; }
+    atomic_max(&out[2], maxAbs);
   }
 }
 
@@ -1245,15 +1357,9 @@ T iweightStep(u32 i) {
   return TWO_TO_MINUS_NTH[i * STEP % NW * (8 / NW)];
 }
 
-T fweightUnitStep(u32 i) {
-  T FWEIGHTS_[] = FWEIGHTS;
-  return FWEIGHTS_[i];
-}
+T fweightUnitStep(u32 i) { return UNIT_WEIGHTS[i].y; }
 
-T iweightUnitStep(u32 i) {
-  T IWEIGHTS_[] = IWEIGHTS;
-  return IWEIGHTS_[i];
-}
+T iweightUnitStep(u32 i) { return UNIT_WEIGHTS[i].x; }
 
 // fftPremul: weight words with IBDWT weights followed by FFT-width.
 KERNEL(G_W) fftP(P(T2) out, CP(Word2) in, Trig smallTrig) {
@@ -1315,6 +1421,8 @@ void fft_MIDDLE(T2 *u) {
   fft14(u);
 #elif MIDDLE == 15
   fft15(u);
+#elif MIDDLE == 16
+  fft16(u);
 #else
 #error UNRECOGNIZED MIDDLE
 #endif
@@ -1660,9 +1768,9 @@ KERNEL(G_W) NAME(P(Word2) out, CP(T2) in, P(CarryABM) carryOut, CP(u32) bits, P(
 #endif
     
 #if DO_MUL3
-    out[p] = carryPairMul(x, &carry, test(b, 2 * i), test(b, 2 * i + 1), carry, &carryMax);
+    out[p] = carryPairMul(x, &carry, test(b, 2 * i), test(b, 2 * i + 1), carry, &carryMax, STATS);
 #else
-    out[p] = carryPair(x, &carry, test(b, 2 * i), test(b, 2 * i + 1), carry, &carryMax);
+    out[p] = carryPair(x, &carry, test(b, 2 * i), test(b, 2 * i + 1), carry, &carryMax, STATS);
 #endif
   }
   carryOut[G_W * g + me] = carry;
@@ -1707,15 +1815,28 @@ KERNEL(G_W) carryB(P(Word2) io, CP(CarryABM) carryIn, CP(u32) bits) {
 
 // The "carryFused" is equivalent to the sequence: fftW, carryA, carryB, fftPremul.
 // It uses "stairway" carry data forwarding from one group to the next.
+// The last entry of "ready" is the line counter of CARRY_TICKET.
 // See tools/expand.py for the meaning of '//{{', '//}}', '//==' -- a form of macro expansion
 //{{ CARRY_FUSED
 KERNEL(G_W) NAME(P(T2) out, CP(T2) in, P(i64) carryShuttle, P(u32) ready, Trig smallTrig,
                  CP(u32) bits, P(u32) roundOut, P(u32) carryStats) {
   local T2 lds[WIDTH / 2];
   
-  u32 gr = get_group_id(0);
   u32 me = get_local_id(0);
 
+#if CARRY_TICKET
+  // The line is the order in which the groups start, see CARRY_TICKET. The last group resets the counter for the next run.
+  local u32 ticket;
+  if (me == 0) {
+    ticket = atomic_fetch_add((atomic_uint *) &ready[BIG_HEIGHT], 1);
+    if (ticket == BIG_HEIGHT) { atomic_store((atomic_uint *) &ready[BIG_HEIGHT], 0); }
+  }
+  work_group_barrier(CLK_LOCAL_MEM_FENCE);
+  u32 gr = ticket;
+#else
+  u32 gr = get_group_id(0);
+#endif
+
   u32 H = BIG_HEIGHT;
   u32 line = gr % H;
 
@@ -1766,9 +1887,9 @@ KERNEL(G_W) NAME(P(T2) out, CP(T2) in, P(i64) carryShuttle, P(u32) ready, Trig s
   // Generate our output carries
   for (i32 i = 0; i < NW; ++i) {
 #if CF_MUL    
-    wu[i] = carryPairMul(u[i], &carry[i], test(b, 2 * i), test(b, 2 * i + 1), 0, &carryMax);
+    wu[i] = carryPairMul(u[i], &carry[i], test(b, 2 * i), test(b, 2 * i + 1), 0, &carryMax, STATS);
 #else
-    wu[i] = carryPair(u[i], &carry[i], test(b, 2 * i), test(b, 2 * i + 1), 0, &carryMax);
+    wu[i] = carryPair(u[i], &carry[i], test(b, 2 * i), test(b, 2 * i + 1), 0, &carryMax, STATS);
 #endif
   }
 
@@ -1841,6 +1962,171 @@ KERNEL(G_W) NAME(P(T2) out, CP(T2) in, P(i64) carryShuttle, P(u32) ready, Trig s
 
 //== CARRY_FUSED NAME=carryFused,    CF_MUL=0
 //== CARRY_FUSED NAME=carryFusedMul, CF_MUL=1
+// With the roundoff and the carry max collected as with STATS, run once per PRP block to sample them at a low cost.
+//== CARRY_FUSED NAME=carryFusedStats, CF_MUL=0, STATS=1
+
+// The weights of "line" for thread "me", as in carryFused: the inverse weight in x, the forward weight in y.
+T2 lineWeights(u32 line, u32 me) {
+  T2 weights = fancyMul(CARRY_WEIGHTS[line / CARRY_LEN], THREAD_WEIGHTS[me]);
+  return fancyMul(U2(optionalDouble(weights.x), optionalHalve(weights.y)),
+                  U2(iweightUnitStep(line % CARRY_LEN), fweightUnitStep(line % CARRY_LEN)));
+}
+
+// The fused middle pass keeps the MIDDLE lines of a group in registers; with more than 32 words per thread it is not
+// built, and the host falls back to the separate passes.
+#if FUSED_MIDDLE && MIDDLE * NW > 32
+#undef FUSED_MIDDLE
+#endif
+
+#if FUSED_MIDDLE
+// The sequence fftMiddleOut, carryFused, fftMiddleIn in one kernel: two passes over the data per squaring (with
+// tailFusedSquare) instead of four. Group g does the lines g + i * SMALL_HEIGHT, which the middle FFTs mix at the same
+// position: thread "me" holds the positions me + j * G_W of all its MIDDLE lines.
+// The carries go from line to line as in carryFused, thus from group g - 1 to group g. The extra group SMALL_HEIGHT
+// redoes the lines of group 0 with the carries of group SMALL_HEIGHT - 1: of its line i - 1 for line i, and the rotated
+// carries of the last line for line 0.
+// The accesses of a group are strided by BIG_HEIGHT, but the groups run in order and the next groups hit the same
+// cache lines.
+KERNEL(G_W) carryFusedMiddle(P(T2) out, CP(T2) in, P(i64) carryShuttle, P(u32) ready, Trig smallTrig, Trig middleTrig,
+                             CP(u32) bits, P(u32) roundOut, P(u32) carryStats) {
+  local T2 lds[WIDTH / 2];
+
+  u32 me = get_local_id(0);
+
+#if CARRY_TICKET
+  local u32 ticket;
+  if (me == 0) {
+    ticket = atomic_fetch_add((atomic_uint *) &ready[BIG_HEIGHT], 1);
+    if (ticket == SMALL_HEIGHT) { atomic_store((atomic_uint *) &ready[BIG_HEIGHT], 0); }
+  }
+  work_group_barrier(CLK_LOCAL_MEM_FENCE);
+  u32 gr = ticket;
+#else
+  u32 gr = get_group_id(0);
+#endif
+
+  u32 g = gr % SMALL_HEIGHT;
+
+  // u[j][i] is the position me + j * G_W of the line g + i * SMALL_HEIGHT.
+  T2 u[NW][MIDDLE];
+  for (i32 j = 0; j < NW; ++j) {
+    for (i32 i = 0; i < MIDDLE; ++i) { u[j][i] = in[(me + j * G_W) * BIG_HEIGHT + g + i * SMALL_HEIGHT]; }
+  }
+
+  ENABLE_MUL2();
+
+  // As fftMiddleOut.
+  double factor = 1.0 / (4 * 4 * NWORDS);
+  for (i32 j = 0; j < NW; ++j) {
+    middleMul(u[j], g, middleTrig);
+    fft_MIDDLE(u[j]);
+    middleMul2(u[j], me + j * G_W, g, factor);
+  }
+
+  P(CFcarry) carryShuttlePtr = (P(CFcarry)) carryShuttle;
+  Word2 wu[MIDDLE][NW];
+  u32 b[MIDDLE];
+  T2 weights[MIDDLE];
+
+  float roundMax = 0;
+  u32 carryMax = 0;
+
+  for (i32 i = 0; i < MIDDLE; ++i) {
+    u32 line = g + i * SMALL_HEIGHT;
+
+    T2 v[NW];
+    for (i32 j = 0; j < NW; ++j) { v[j] = u[j][i]; }
+    if (i) { bar(); }
+    fft_WIDTH(lds, v, smallTrig);
+
+#define GPW (16 / NW)
+    b[i] = bits[(G_W * line + me) / GPW] >> (me % GPW * (2 * NW));
+#undef GPW
+    weights[i] = lineWeights(line, me);
+
+    T invBase = optionalDouble(weights[i].x);
+    CFcarry carry[NW];
+    for (u32 j = 0; j < NW; ++j) {
+      T invWeight1 = j == 0 ? invBase : optionalDouble(fancyMul(invBase, iweightStep(j)));
+      T invWeight2 = optionalDouble(fancyMul(invWeight1, IWEIGHT_STEP));
+
+#if STATS
+      roundMax = max(roundMax, roundoff(conjugate(v[j]), U2(invWeight1, invWeight2)));
+#endif
+
+      wu[i][j] = carryPair(conjugate(v[j]) * U2(invWeight1, invWeight2), &carry[j],
+                           test(b[i], 2 * j), test(b[i], 2 * j + 1), 0, &carryMax, STATS);
+    }
+
+    if (gr < SMALL_HEIGHT) {
+      for (i32 j = 0; j < NW; ++j) { carryShuttlePtr[line * WIDTH + me * NW + j] = carry[j]; }
+    }
+  }
+
+  // Signal that this group is done writing its carries
+  if (gr < SMALL_HEIGHT) {
+    work_group_barrier(CLK_GLOBAL_MEM_FENCE, memory_scope_device);
+    if (me == 0) { atomic_store((atomic_uint *) &ready[gr], 1); }
+  }
+
+#if STATS
+  updateStats(roundMax, carryMax, roundOut, carryStats);
+#endif
+
+  if (gr == 0) { return; }
+
+  // Wait until the previous group is ready with their carries
+  if (me == 0) {
+    while(!atomic_load((atomic_uint *) &ready[gr - 1]));
+  }
+  work_group_barrier(CLK_GLOBAL_MEM_FENCE, memory_scope_device);
+
+  for (i32 i = 0; i < MIDDLE; ++i) {
+    u32 line = g + i * SMALL_HEIGHT;
+
+    CFcarry carry[NW + 1];
+    if (line) {
+      for (i32 j = 0; j < NW; ++j) { carry[j] = carryShuttlePtr[(line - 1) * WIDTH + me * NW + j]; }
+    } else {
+      for (i32 j = 0; j < NW; ++j) {
+        carry[j] = carryShuttlePtr[(BIG_HEIGHT - 1) * WIDTH + (me + G_W - 1) % G_W * NW + j];
+      }
+      if (me == 0) {
+        carry[NW] = carry[NW-1];
+        for (i32 j = NW-1; j; --j) { carry[j] = carry[j-1]; }
+        carry[0] = carry[NW];
+      }
+    }
+
+    T base = optionalHalve(weights[i].y);
+    T2 v[NW];
+    for (u32 j = 0; j < NW; ++j) {
+      Word2 w = carryFinal(wu[i][j], carry[j], test(b[i], 2 * j));
+      T weight1 = j == 0 ? base : optionalHalve(fancyMul(base, fweightStep(j)));
+      T weight2 = optionalHalve(fancyMul(weight1, WEIGHT_STEP));
+      v[j] = U2(w.x, w.y) * U2(weight1, weight2);
+    }
+
+    bar();
+    fft_WIDTH(lds, v, smallTrig);
+    for (i32 j = 0; j < NW; ++j) { u[j][i] = v[j]; }
+  }
+
+  // Clear carry ready flag for next iteration
+  if (me == 0) { ready[gr - 1] = 0; }
+
+  // As fftMiddleIn, written in the layout of fftMiddleIn after its middleShuffle.
+  u32 SIZEY = IN_WG / IN_SIZEX;
+  out += g / SIZEY * (MIDDLE * IN_WG) + g % SIZEY;
+  for (i32 j = 0; j < NW; ++j) {
+    u32 x = me + j * G_W;
+    middleMul2(u[j], x, g, 1);
+    fft_MIDDLE(u[j]);
+    middleMul(u[j], g, middleTrig);
+    for (i32 i = 0; i < MIDDLE; ++i) { out[x / IN_SIZEX * (BIG_HEIGHT * IN_SIZEX) + x % IN_SIZEX * SIZEY + i * IN_WG] = u[j][i]; }
+  }
+}
+#endif
 
 // from transposed to sequential.
 KERNEL(64) transposeOut(P(Word2) out, CP(Word2) in) {
@@ -1854,6 +2140,127 @@ KERNEL(64) transposeIn(P(Word2) out, CP(Word2) in) {
   transposeWords(BIG_HEIGHT, WIDTH, lds, in, out);
 }
 
+// Conversion between the balanced words and the compact E-bit residue (the counterparts of compactBits() and
+// expandBits() in state.cpp). Only the compact words are transferred to and from the host.
+// The balanced words are read and written in place in the transposed layout of the FFT (see readResidue), thus
+// without a transposeIn / transposeOut pass: the strided accesses of a group hit about WIDTH cache lines, which the
+// following groups re-use.
+// The balanced words are made non-negative with a borrow from below: a word gets a borrow iff the nearest non-zero
+// word below it, circularly because 2^E == 1, is negative. The borrow is resolved in blocks of COMPACT_BLOCK words.
+
+// Must match COMPACT_BLOCK in Gpu.cpp.
+#define COMPACT_BLOCK 256
+#define NBLOCKS (NWORDS / COMPACT_BLOCK)
+
+u32 wordPos(u32 E, u32 k) { return (k * (u64) E + (NWORDS - 1)) / NWORDS; }
+
+// The position in the transposed layout of the sequential word k, and its inverse.
+u32 wordToMem(u32 k) { u32 s = k / 2; return 2 * (s % BIG_HEIGHT * WIDTH + s / BIG_HEIGHT) + k % 2; }
+u32 memToWord(u32 m) { u32 t = m / 2; return 2 * (t % WIDTH * BIG_HEIGHT + t / WIDTH) + m % 2; }
+
+// The sign of the topmost non-zero word of each block.
+KERNEL(64) compactSign(P(i32) outSign, CP(i32) in) {
+  u32 block = get_global_id(0);
+  if (block >= NBLOCKS) { return; }
+  i32 sign = 0;
+  for (u32 p = (block + 1) * COMPACT_BLOCK; p > block * COMPACT_BLOCK && !sign; --p) {
+    i32 w = in[wordToMem(p - 1)];
+    sign = (w > 0) ? 1 : (w < 0) ? -1 : 0;
+  }
+  outSign[block] = sign;
+}
+
+// The borrow (0 or -1) into the first word of each block. A single group, every thread handles a range of blocks.
+KERNEL(256) compactCarry(P(i32) outCarry, CP(i32) sign) {
+  local i32 lds[256];
+  u32 me = get_local_id(0);
+  u32 chunk = (NBLOCKS + 255) / 256;
+  u32 begin = min(me * chunk, (u32) NBLOCKS);
+  u32 end = min(begin + chunk, (u32) NBLOCKS);
+
+  i32 top = 0;
+  for (u32 b = end; b > begin && !top; --b) { top = sign[b - 1]; }
+  lds[me] = top;
+  bar();
+
+  // The nearest non-zero below, wrapping around through the top to our own range.
+  i32 s = 0;
+  for (u32 i = 1; i <= 256 && !s; ++i) { s = lds[(me + 256 - i) % 256]; }
+
+  for (u32 b = begin; b < end; ++b) {
+    outCarry[b] = (s < 0) ? -1 : 0;
+    if (sign[b]) { s = sign[b]; }
+  }
+}
+
+u32 compactWord(CP(i32) in, CP(i32) blockCarry, u32 E, u32 j) {
+  u32 bit = j * 32;
+  u32 p = bit * (u64) NWORDS / E; // the word containing "bit"
+  
+  i32 carry = blockCarry[p / COMPACT_BLOCK];
+  for (u32 q = p; q > p / COMPACT_BLOCK * COMPACT_BLOCK; --q) {
+    i32 w = in[wordToMem(q - 1)];
+    if (w) {
+      carry = (w < 0) ? -1 : 0;
+      break;
+    }
+  }
+
+  u32 out = 0;
+  for (u32 pos = wordPos(E, p); p < NWORDS && pos < bit + 32; ++p) {
+    u32 nextPos = wordPos(E, p + 1);
+    i32 w = in[wordToMem(p)] + carry;
+    carry = (w < 0) ? -1 : 0;
+    u32 u = (w < 0) ? w + (1 << (nextPos - pos)) : w;
+    out |= (pos >= bit) ? (u << (pos - bit)) : (u >> (bit - pos));
+    pos = nextPos;
+  }
+  return out;
+}
+
+// The output is padded with a zero word to an even size, for sum64().
+KERNEL(64) compactWords(P(u32) out, CP(i32) in, CP(i32) blockCarry, u32 E) {
+  u32 nOut = (E - 1) / 32 + 1;
+  u32 j = get_global_id(0);
+  if (j < nOut) {
+    out[j] = compactWord(in, blockCarry, E, j);
+  } else if (j < (nOut + 1) / 2 * 2) {
+    out[j] = 0;
+  }
+}
+
+// The bits of word k, as signed. The top word is partial: its bits end at E, and the read stops at the last u32 of
+// the residue, (E - 1) / 32, whatever the padding of the buffer.
+i32 compactRead(CP(u32) in, u32 E, u32 k) {
+  u32 pos = wordPos(E, k);
+  u32 end = (k == NWORDS - 1) ? E : wordPos(E, k + 1);
+  u32 nBits = end - pos;
+  u32 last = (E - 1) / 32;
+  u32 lo = in[pos / 32];
+  u32 hi = (pos / 32 < last) ? in[pos / 32 + 1] : 0;
+  u32 u = (u32) ((((u64) hi << 32) | lo) >> (pos % 32));
+  return ((i32) (u << (32 - nBits))) >> (32 - nBits);
+}
+
+// The balanced words from the compact residue. A negative word borrows from the word above; the borrow of the top
+// word wraps around into word 0 (as 2^E == 1), as in compactWord.
+KERNEL(64) expandWords(P(i32) out, CP(u32) in, u32 E) {
+  u32 m = get_global_id(0);
+  if (m >= NWORDS) { return; }
+  u32 k = memToWord(m);
+  u32 below = (k == 0) ? NWORDS - 1 : k - 1;
+  out[m] = compactRead(in, E, k) + (compactRead(in, E, below) < 0);
+}
+
+// The word-wise sum and difference of two residues, not carried: the words grow by one bit (see the ECM FFT headroom).
+KERNEL(256) addSub(P(Word2) outSum, P(Word2) outDiff, CP(Word2) a, CP(Word2) b) {
+  u32 k = get_global_id(0);
+  Word2 x = a[k];
+  Word2 y = b[k];
+  outSum[k] = x + y;
+  outDiff[k] = x - y;
+}
+
 // For use in tailFused below
 
 void reverse(u32 WG, local T2 *lds, T2 *u, bool bump) {
@@ -1998,7 +2405,11 @@ void pairMul(u32 N, T2 *u, T2 *v, T2 *p, T2 *q, T2 base_squared, bool special) {
 }
 
 //{{ MULTIPLY
+#if MULTIPLY_DELTA
+KERNEL(SMALL_HEIGHT / 2) NAME(P(T2) io, CP(T2) inA, CP(T2) inB) {
+#else
 KERNEL(SMALL_HEIGHT / 2) NAME(P(T2) io, CP(T2) in) {
+#endif
   u32 W = SMALL_HEIGHT;
   u32 H = ND / W;
 
@@ -9,6 +9,7 @@
 
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 class Kernel {
   KernelHolder kernel;
@@ -16,6 +17,11 @@ class Kernel {
   QueuePtr queue;
   size_t workSize;
   string name;
+  u64 bytes{}; // the bytes moved by a call, for the perf counters.
+
+  // The ids of the buffers last set as arguments. The per-iteration kernels are invoked again and again with the same
+  // buffers, and skipping the redundant clSetKernelArg() calls cuts the host time per launch.
+  std::vector<u64> bufIds;
 
 public:
   Kernel(cl_program program, QueuePtr queue, cl_device_id device, u32 nWorkGroups, const std::string &name) :
@@ -37,6 +43,16 @@ public:
   }
 
   
+  // A new instance of "proto", with its own arguments (not set).
+  Kernel(cl_program program, const Kernel& proto) :
+    kernel(makeKernel(program, proto.name.c_str())),
+    groupSize(proto.groupSize),
+    queue(proto.queue),
+    workSize(proto.workSize),
+    name(proto.name),
+    bytes(proto.bytes)
+  {}
+
   template<typename... Args> void setFixedArgs(int pos, const Args &...tail) { setArgs(pos, tail...); }
   
   template<typename... Args> void operator()(const Args &...args) {
@@ -44,12 +60,32 @@ public:
     run();
   }
 
+  // Runs with the arguments set before.
+  void operator()() { run(); }
+
+  // Records a run, with the arguments set before, into a command buffer.
+  bool record(cl_command_buffer_khr buf) { return kernel && recordKernel(buf, kernel.get(), groupSize, workSize); }
+
   string getName() { return name; }
 
+  // Whether the program has the kernel, e.g. one built only under a -use flag.
+  explicit operator bool() const { return bool(kernel); }
+
+  void setBytes(u64 b) { bytes = b; }
+  u64 getBytes() const { return bytes; }
+
 private:
-  template<typename T> void setArgs(int pos, const ConstBuffer<T>& buf) { setArgs(pos, buf.get()); }
-  template<typename T> void setArgs(int pos, const Buffer<T>& buf) { setArgs(pos, buf.get()); }
-  template<typename T> void setArgs(int pos, const HostAccessBuffer<T>& buf) { setArgs(pos, buf.get()); }
+  // The id is unique per allocation, unlike the cl_mem which may be reused after a buffer is released.
+  void setBufArg(int pos, cl_mem buf, u64 id) {
+    if (pos < int(bufIds.size()) && bufIds[pos] == id) { return; }
+    if (pos >= int(bufIds.size())) { bufIds.resize(pos + 1); }
+    bufIds[pos] = id;
+    ::setArg(kernel.get(), pos, buf);
+  }
+  
+  template<typename T> void setArgs(int pos, const ConstBuffer<T>& buf) { setBufArg(pos, buf.get(), buf.id); }
+  template<typename T> void setArgs(int pos, const Buffer<T>& buf) { setBufArg(pos, buf.get(), buf.id); }
+  template<typename T> void setArgs(int pos, const HostAccessBuffer<T>& buf) { setBufArg(pos, buf.get(), buf.id); }
   template<typename T> void setArgs(int pos, const T &arg) { ::setArg(kernel.get(), pos, arg); }
   
   template<typename T, typename... Args> void setArgs(int pos, const T &arg, const Args &...tail) {
@@ -59,7 +95,7 @@ private:
   
   void run() {
     if (kernel) {
-      queue->run(kernel.get(), groupSize, workSize, name);
+      queue->run(kernel.get(), groupSize, workSize, name, bytes);
     } else {
       throw std::runtime_error("OpenCL kernel "s + name + " not found");
     }
@@ -1,20 +1,172 @@
 #include "log.h"
 #include "File.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <mutex>
+#include <thread>
 
 vector<File> logFiles;
-string globalCpuName;
-string context;
+std::mutex logFilesMut;
 
-void initLog() { logFiles.emplace_back(stdout, "stdout"); }
+// Per thread, as with -devices every worker thread logs with its own name and context.
+thread_local string globalCpuName;
+thread_local string context;
+
+namespace {
+
+// The log lines go through a bounded ring, written to the files by one flusher thread: a log() only formats into a
+// free slot, and never waits on a file. When the ring is full a log() waits at most FULL_WAIT_MS for the flusher, then
+// drops the line; the flusher reports the count of dropped lines.
+// The ring is Vyukov's bounded MPMC queue, with a single consumer: a slot is free for position "pos" when its sequence
+// is "pos", and holds the line of "pos" when its sequence is "pos + 1".
+// Set once the ring is destroyed (at exit); a later log() goes to stderr.
+std::atomic<bool> ringGone{};
+
+// SIZE lines of LINE_SIZE bytes (1 MB) hold a burst of log lines for much longer than the flusher takes to drain it.
+class LogRing {
+  static constexpr u32 SIZE = 512;
+  static constexpr u32 LINE_SIZE = 2048;
+  static constexpr u32 FULL_WAIT_MS = 100;
+
+  struct Slot {
+    std::atomic<u64> seq;
+    char text[LINE_SIZE];
+  };
+
+  Slot slots[SIZE];
+  std::atomic<u64> head{};
+  u64 tail{};
+  std::atomic<u32> nDropped{};
+
+  std::mutex mut;
+  std::condition_variable cond;
+  bool stop{};
+  std::thread flusher;
+
+  bool drain() {
+    std::unique_lock lock{logFilesMut};
+    bool any = false;
+    while (true) {
+      Slot& slot = slots[tail % SIZE];
+      if (slot.seq.load(std::memory_order_acquire) != tail + 1) { break; }
+      for (auto& f : logFiles) { fprintf(f.get(), f.get() == stdout ? "\r%s" : "%s", slot.text); }
+      slot.seq.store(tail + SIZE, std::memory_order_release);
+      ++tail;
+      any = true;
+    }
+    if (u32 n = nDropped.exchange(0)) {
+      for (auto& f : logFiles) { fprintf(f.get(), "(%u log lines dropped)\n", n); }
+      any = true;
+    }
+    if (any) { for (auto& f : logFiles) { fflush(f.get()); } }
+    return any;
+  }
+
+  void run() {
+    std::unique_lock lock{mut};
+    while (true) {
+      lock.unlock();
+      bool any = drain();
+      lock.lock();
+      if (stop && !any) { break; }
+      // The timeout covers a line published between the drain and the wait.
+      if (!any) { cond.wait_for(lock, std::chrono::milliseconds(50)); }
+    }
+  }
+
+public:
+  LogRing() {
+    for (u32 i = 0; i < SIZE; ++i) { slots[i].seq.store(i, std::memory_order_relaxed); }
+    flusher = std::thread{[this]() { run(); }};
+  }
+
+  ~LogRing() {
+    {
+      std::unique_lock lock{mut};
+      stop = true;
+    }
+    cond.notify_one();
+    flusher.join();
+    ringGone = true;
+  }
+
+  // Returns a slot to fill with a line (of at most LINE_SIZE bytes) and publish(), or null if the ring is full.
+  char* claim(u64& pos) {
+    pos = head.load(std::memory_order_relaxed);
+    u32 nWait = 0;
+    while (true) {
+      Slot& slot = slots[pos % SIZE];
+      i64 diff = i64(slot.seq.load(std::memory_order_acquire)) - i64(pos);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { return slot.text; }
+      } else if (diff < 0) {
+        if (nWait++ >= FULL_WAIT_MS) {
+          ++nDropped;
+          return nullptr;
+        }
+        cond.notify_one();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        pos = head.load(std::memory_order_relaxed);
+      } else {
+        pos = head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void publish(u64 pos) {
+    slots[pos % SIZE].seq.store(pos + 1, std::memory_order_release);
+    cond.notify_one();
+  }
+
+  static constexpr u32 lineSize() { return LINE_SIZE; }
+};
+
+LogRing& logRing() {
+  static LogRing ring;
+  return ring;
+}
+
+// The time part of the prefix, formatted again only when the second changes.
+const char* shortTime() {
+  thread_local time_t cachedSecs = -1;
+  thread_local char cached[32];
+  time_t t = time(NULL);
+  if (t != cachedSecs) {
+    cachedSecs = t;
+    tm local;
+    localtime_r(&t, &local);
+    strftime(cached, sizeof(cached), "%Y%m%d %H:%M:%S", &local);
+  }
+  return cached;
+}
+
+// The prefix of a log line: the time, the cpu name and the context.
+int formatPrefix(char* text, u32 size) {
+  int n = snprintf(text, size, "%s %s%s%s ", shortTime(), globalCpuName.c_str(), globalCpuName.empty() ? "" : " ",
+                   context.c_str());
+  return std::min(std::max(n, 0), int(size) - 1);
+}
+
+}
+
+void initLog() {
+  {
+    std::unique_lock lock{logFilesMut};
+    logFiles.emplace_back(stdout, "stdout");
+  }
+  logRing();
+}
 
 void initLog(const char *logName) {
   auto fo = File::openAppend(logName);
 #if defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE)
     setlinebuf(fo.get());
 #endif
+  std::unique_lock lock{logFilesMut};
   logFiles.push_back(std::move(fo));
 }
 
@@ -22,24 +174,34 @@ string longTimeStr()  { return timeStr("%Y-%m-%d %H:%M:%S %Z"); }
 string shortTimeStr() { return timeStr("%Y%m%d %H:%M:%S"); }
 
 void log(const char *fmt, ...) {
-  static std::mutex logMutex;
-  
-  char buf[2 * 1024];
+  if (ringGone) {
+    char prefix[256];
+    formatPrefix(prefix, sizeof(prefix));
+    fputs(prefix, stderr);
+    va_list va;
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+    return;
+  }
+
+  LogRing& ring = logRing();
+  u64 pos = 0;
+  char* text = ring.claim(pos);
+  if (!text) { return; }
+
+  u32 size = LogRing::lineSize();
+  int n = formatPrefix(text, size);
 
   va_list va;
   va_start(va, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, va);
+  int len = vsnprintf(text + n, size - n, fmt, va);
   va_end(va);
-  
-  string prefix = shortTimeStr() + " "s + (globalCpuName.empty() ? "" : globalCpuName + " "s) + context;
-
-  std::unique_lock lock(logMutex);
-  for (auto &f : logFiles) {
-    fprintf(f.get(), f.get() == stdout ? "\r%s %s" : "%s %s", prefix.c_str(), buf);
-#if !(defined(_DEFAULT_SOURCE) || defined(_BSD_SOURCE))
-    fflush(f.get());
-#endif
-  }
+
+  // A truncated line is marked, and still ends the line.
+  if (len >= int(size - n)) { strcpy(text + size - 5, "...\n"); }
+
+  ring.publish(pos);
 }
 
 LogContext::LogContext(const string& s) : part{s} {
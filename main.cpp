@@ -1,19 +1,28 @@
 // GpuOwl Mersenne primality tester; Copyright Mihai Preda.
 
+#include "Affinity.h"
 #include "Args.h"
 #include "Task.h"
 #include "Worktodo.h"
+#include "Tune.h"
+#include "Bench.h"
+#include "Proof.h"
 #include "common.h"
 #include "File.h"
 #include "version.h"
 #include "AllocTrac.h"
+#include "Background.h"
+#include "Lookahead.h"
 #include "typeName.h"
 #include "log.h"
+#include "Signal.h"
+#include "Trace.h"
 
 #include <cstdio>
 #include <filesystem>
+#include <thread>
 
-extern string globalCpuName;
+extern thread_local string globalCpuName;
 
 namespace fs = std::filesystem;
 
@@ -34,12 +43,71 @@ static void readConfig(Args& args, const fs::path& path, bool doLog) {
   }
 }
 
+static void runTasks(Args& args, Background& background) {
+  if (args.affinity) { pinToDevice(getDevice(args.device)); }
+  Lookahead lookahead{args};
+  auto reuses = [&lookahead](const Task& task) { return lookahead.reuses(task); };
+  while (auto task = Worktodo::getTask(args, args.groupFFT ? reuses : std::function<bool(const Task&)>{})) {
+    if (task->execute(args, background, &lookahead)) { Worktodo::releaseTask(*task); }
+    // A task that stopped on SIGINT without throwing (e.g. CERT) ends the worker too.
+    if (Signal::stopRequested()) { break; }
+  }
+}
+
+static void worker(Args args, u32 device, u32 slot, Background& background) {
+  args.device = device;
+  if (!args.cpu.empty()) { args.cpu += "-" + std::to_string(device); }
+  
+  try {
+    args.setDefaults();
+    // The perf file of the worker is named by its cpu name, or by the device index without one.
+    string name = args.cpu.empty() ? std::to_string(device) : args.cpu;
+    if (args.workers > 1) {
+      args.cpu += "." + std::to_string(slot);
+      name += "." + std::to_string(slot);
+    }
+    if (!args.perfFile.empty()) {
+      args.perfFile.replace_filename(args.perfFile.stem().string() + "-" + name + args.perfFile.extension().string());
+    }
+    if (!args.cpu.empty()) { globalCpuName = args.cpu; }
+
+    // The workers of a device share its memory.
+    if (args.maxAlloc || args.workers > 1) {
+      AllocTrac::setMaxAlloc((args.maxAlloc ? args.maxAlloc : AllocTrac::getMaxAlloc()) / args.workers);
+    }
+    runTasks(args, background);
+  } catch (const char *mes) {
+    log("Worker exiting because \"%s\"\n", mes);
+  } catch (const std::exception& e) {
+    log("Worker exception %s: %s\n", typeName(e), e.what());
+  } catch (...) {
+    log("Worker unexpected exception\n");
+  }
+}
+
+// Worker threads (-workers per device), all taking tasks from the shared worktodo.txt. The workers on the same device
+// have their own Gpu and queue, and the device interleaves their kernels.
+static void runWorkers(const Args& args, Background& background) {
+  // Installed for the lifetime of the workers, thus not released when a worker's task ends.
+  Signal signal;
+
+  vector<u32> devices = args.devices.empty() ? vector<u32>{u32(args.device)} : args.devices;
+  vector<std::thread> workers;
+  for (u32 device : devices) {
+    for (u32 slot = 0; slot < args.workers; ++slot) { workers.emplace_back(worker, args, device, slot, std::ref(background)); }
+  }
+  for (std::thread& t : workers) { t.join(); }
+}
+
 int main(int argc, char **argv) {
   initLog();
   log("GpuOwl VERSION %s\n", VERSION);
 
   int exitCode = 0;
 
+  // The host jobs of all the workers, e.g. the P-1 GCDs.
+  Background background;
+
   try {
     string mainLine = Args::mergeArgs(argc, argv);
     {
@@ -65,17 +133,35 @@ int main(int argc, char **argv) {
       log("config: %s\n", mainLine.c_str());
       args.parse(mainLine);
     }
-    args.setDefaults();
-    if (!args.cpu.empty()) { globalCpuName = args.cpu; }
+    bool multiWorker = !args.devices.empty() || args.workers > 1;
+    // These time many FFTs on purpose.
+    if (args.tuneExp || !args.crossoverSpec.empty() || !args.benchSpec.empty()) { args.selfTest = false; }
+    if (!args.traceFile.empty()) { Trace::enable(args.traceFile); }
+    
+    // With -devices or -workers the defaults are set per worker.
+    if (!multiWorker) {
+      args.setDefaults();
+      if (!args.cpu.empty()) { globalCpuName = args.cpu; }
     
-    if (args.maxAlloc) { AllocTrac::setMaxAlloc(args.maxAlloc); }
+      if (args.maxAlloc) { AllocTrac::setMaxAlloc(args.maxAlloc); }
+    }
     
-    if (args.prpExp) {
-      Worktodo::makePRP(args, args.prpExp).execute(args);
+    if (multiWorker) {
+      runWorkers(args, background);
+    } else if (args.tuneExp) {
+      Tune::tune(args, args.tuneExp);
+    } else if (!args.crossoverSpec.empty()) {
+      Tune::crossover(args, args.crossoverSpec);
+    } else if (!args.benchSpec.empty()) {
+      Bench::bench(args, args.benchSpec);
+    } else if (args.prpExp) {
+      Worktodo::makePRP(args, args.prpExp).execute(args, background);
+    } else if (!args.verifyDir.empty()) {
+      Proof::verifyDir(args, args.verifyDir);
     } else if (!args.verifyPath.empty()) {
-      Worktodo::makeVerify(args, args.verifyPath).execute(args);
+      Worktodo::makeVerify(args, args.verifyPath).execute(args, background);
     } else {
-      while (auto task = Worktodo::getTask(args)) { task->execute(args); }
+      runTasks(args, background);
     }
   } catch (const char *mes) {
     log("Exiting because \"%s\"\n", mes);
@@ -85,7 +171,7 @@ int main(int argc, char **argv) {
     log("Unexpected exception\n");
   }
 
-  // background.wait();
+  background.wait();
   // if (factorFoundForExp) { Worktodo::deletePRP(factorFoundForExp); }
   log("Bye\n");
   return exitCode; // not used yet.
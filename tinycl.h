@@ -16,6 +16,7 @@ typedef struct _cl_program *        cl_program;
 typedef struct _cl_kernel *         cl_kernel;
 typedef struct _cl_event *          cl_event;
 typedef struct _cl_sampler *        cl_sampler;
+typedef struct _cl_command_buffer_khr * cl_command_buffer_khr;
 
 typedef unsigned cl_bool;
 typedef unsigned cl_program_build_info;
@@ -29,6 +30,7 @@ typedef unsigned cl_event_info;
 typedef unsigned cl_command_queue_info;
 
 typedef u64 cl_mem_flags;
+typedef u64 cl_map_flags;
 typedef u64 cl_svm_mem_flags;
 typedef u64 cl_device_type;
 typedef u64 cl_queue_properties;
@@ -66,6 +68,9 @@ int clEnqueueCopyBuffer(cl_command_queue, cl_mem, cl_mem, size_t, size_t, size_t
                         unsigned numEvent, const cl_event *waitEvents, cl_event *outEvent);
 int clEnqueueFillBuffer(cl_command_queue, cl_mem, const void *, size_t patternSize, size_t offset, size_t size,
                         unsigned numEvent, const cl_event *waitEvents, cl_event *outEvent);
+void *clEnqueueMapBuffer(cl_command_queue, cl_mem, cl_bool, cl_map_flags, size_t offset, size_t size,
+                         unsigned numEvent, const cl_event *waitEvents, cl_event *outEvent, int *err);
+int clEnqueueUnmapMemObject(cl_command_queue, cl_mem, void *, unsigned numEvent, const cl_event *waitEvents, cl_event *outEvent);
   
 int clFlush(cl_command_queue);
 int clFinish(cl_command_queue);
@@ -73,6 +78,8 @@ int clSetKernelArg(cl_kernel, unsigned, size_t, const void *);
 
 int clReleaseEvent(cl_event);
 int clWaitForEvents(unsigned numEvents, const cl_event *);
+int clEnqueueMarkerWithWaitList(cl_command_queue, unsigned, const cl_event *, cl_event *);
+int clSetEventCallback(cl_event, int, void (*)(cl_event, int, void *), void *);
 
 int clGetKernelInfo(cl_kernel, cl_kernel_info, size_t, void *, size_t *);
 int clGetKernelArgInfo(cl_kernel, unsigned, cl_kernel_arg_info, size_t, void *, size_t *);
@@ -85,6 +92,8 @@ void* clSVMAlloc(cl_context, cl_svm_mem_flags, size_t, unsigned alignment);
 void clSVMFree(cl_context, void*);
 
 int clSetKernelArgSVMPointer(cl_kernel, unsigned, const void *);
+
+void* clGetExtensionFunctionAddressForPlatform(cl_platform_id, const char *);
   
 }
 
@@ -94,12 +103,16 @@ int clSetKernelArgSVMPointer(cl_kernel, unsigned, const void *);
 #define CL_PLATFORM_VERSION     0x0901
 #define CL_DEVICE_MAX_COMPUTE_UNITS 0x1002
 #define CL_DEVICE_MAX_CLOCK_FREQUENCY 0x100C
+#define CL_DEVICE_GLOBAL_MEM_CACHE_SIZE  0x101E
 #define CL_DEVICE_GLOBAL_MEM_SIZE        0x101F
 #define CL_DEVICE_ERROR_CORRECTION_SUPPORT 0x1024
 #define CL_DEVICE_NAME          0x102B
 #define CL_DEVICE_VERSION       0x102F
 #define CL_DRIVER_VERSION       0x102D
 #define CL_DEVICE_BUILT_IN_KERNELS 0x103F
+#define CL_DEVICE_EXTENSIONS    0x1030
+#define CL_DEVICE_HOST_UNIFIED_MEMORY 0x1035
+#define CL_DEVICE_PLATFORM      0x1031
 
 #define CL_PROGRAM_BINARY_SIZES 0x1165
 #define CL_PROGRAM_BINARIES     0x1166
@@ -120,6 +133,9 @@ int clSetKernelArgSVMPointer(cl_kernel, unsigned, const void *);
 #define CL_MEM_SVM_FINE_GRAIN_BUFFER (1 << 10)
 #define CL_MEM_SVM_ATOMICS           (1 << 11)
 
+#define CL_MAP_READ                  (1 << 0)
+#define CL_MAP_WRITE_INVALIDATE_REGION (1 << 2)
+
 #define CL_QUEUE_PROFILING_ENABLE    (1 << 1)
 #define CL_QUEUE_PROPERTIES       0x1093
 
@@ -192,6 +208,26 @@ int clSetKernelArgSVMPointer(cl_kernel, unsigned, const void *);
 #define CL_DEVICE_BOARD_NAME_AMD  0x4038
 #define CL_DEVICE_GLOBAL_FREE_MEMORY_AMD 0x4039
 
+// NVIDIA
+#define CL_DEVICE_PCI_BUS_ID_NV   0x4008
+#define CL_DEVICE_PCI_SLOT_ID_NV  0x4009
+
+// cl_khr_pci_bus_info
+#define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+
+typedef struct {
+  u32 pci_domain;
+  u32 pci_bus;
+  u32 pci_device;
+  u32 pci_function;
+} cl_device_pci_bus_info_khr;
+
+// cl_khr_command_buffer, the provisional revisions before 0.9.5 which have the simultaneous use flag.
+#define CL_DEVICE_COMMAND_BUFFER_CAPABILITIES_KHR 0x12A9
+#define CL_COMMAND_BUFFER_CAPABILITY_SIMULTANEOUS_USE_KHR (1 << 2)
+#define CL_COMMAND_BUFFER_FLAGS_KHR 0x1293
+#define CL_COMMAND_BUFFER_SIMULTANEOUS_USE_KHR (1 << 0)
+
 // Error codes
 #define CL_MEM_OBJECT_ALLOCATION_FAILURE -4
 #define CL_OUT_OF_RESOURCES -5
@@ -1,5 +1,6 @@
 #!/usr/bin/python3
 
+import json
 import os
 import re
 import sys
@@ -90,14 +91,35 @@ def printInfo(devices, readSlow):
         print(('%(card)d %(pciId)s %(uid)s %(voltage)dmV %(sclk)4d %(mclk)4d %(memUsedGB)5.2fGB    %(memBusy)2d%%    %(power)3dW %(fan)4d %(temps)s %(pcie_speed)-21s %(pcieErr)3d' + (' %(pcie_bw)s' if readSlow else ''))
               % dict(gpu.__dict__, card=d, temps=temps))
     
+# The JSON written by gpuowl -perf <file>: the kernels with the most time, the host spans and the GPU idle fraction.
+def printPerf(path, top=8):
+    try:
+        with open(path) as f:
+            perf = json.load(f)
+    except (FileNotFoundError, json.JSONDecodeError):
+        return
+    age = int(time.time()) - perf['time']
+    print(f"{path}: {perf['E']} FFT {perf['fftSize'] // 1024}K, {age}s ago, GPU idle {perf['gpuIdle'] * 100:.1f}%, "
+          f"finish wait {perf['finish']['secs']:.1f}s")
+    kernels = sorted(perf['kernels'].items(), key=lambda kv: -kv[1]['secs'])
+    total = sum(k['secs'] for _, k in kernels) or 1
+    for name, k in kernels[:top]:
+        print(f"  {name:<18} {k['secs'] / total * 100:5.1f}% {k['us']:8.1f} us/call {k['GBps']:7.1f} GB/s")
+    for name, s in perf['spans'].items():
+        print(f"  {name:<18} {s['calls']:6d} x {s['us'] / 1000:8.2f} ms")
+
 devices = deviceList()
 
+perfFiles = [a for a in sys.argv[1:] if a.endswith('.json')]
+
 readSlow = len(sys.argv) >= 2 and sys.argv[1] == '-s'
 
 sleep = int(sys.argv[2]) if len(sys.argv) >= 3 and sys.argv[1] == '-t' else None
 
 printInfo(devices, readSlow)
+for p in perfFiles: printPerf(p)
 while sleep:
     time.sleep(sleep)
     print('\n', datetime.now())
     printInfo(devices, readSlow)
+    for p in perfFiles: printPerf(p)
@@ -4,6 +4,7 @@
 # Inspired by mlucas-primenet.py , part of Mlucas by Ernst W. Mayer.
 
 import argparse
+import json
 import time
 import urllib
 import requests
@@ -56,6 +57,19 @@ def sendOne(line):
         else:
             return False
 
+# The md5 of the proof files, from the "proof" of the PRP result lines, by file name.
+def proofHashes(resultsName):
+    hashes = {}
+    for line in loadLines(resultsName):
+        try:
+            result = json.loads(line)
+        except ValueError:
+            continue
+        proof = result.get('proof') if isinstance(result, dict) else None
+        if proof and 'md5' in proof and 'power' in proof:
+            hashes[f"{result['exponent']}-{proof['power']}.proof"] = proof['md5']
+    return hashes
+
 def appendLine(fileName, line):
     with open(fileName, 'a') as fo: print(line, file = fo, end = '\n')
     
@@ -89,6 +103,8 @@ parser.add_argument('-p', dest='password', help="Primenet password")
 parser.add_argument('-t', dest='timeout',  type=int, default=1800, help="Seconds to sleep between updates")
 parser.add_argument('--dirs', metavar='DIR', nargs='+', help="GpuOwl directories to scan", default=".")
 parser.add_argument('--tasks', dest='nTasks', type=int, default=None, help='Number of tasks to fetch ahead')
+parser.add_argument('--delete-uploaded', dest='deleteUploaded', action='store_true',
+                    help="Delete the proof files once uploaded, instead of moving them to 'uploaded/'")
 
 choices=list(workTypes.keys())
 parser.add_argument('-w', dest='work', choices=choices, help="GIMPS work type", default="PRP")
@@ -141,12 +157,16 @@ def handle(folder):
         os.mkdir(folder + 'uploaded')
     except FileExistsError:
         pass
-    
+
+    hashes = proofHashes(resultsName)
     for entry in os.listdir(folder + 'proof'):
         if entry.endswith('.proof'):
             fileName = folder + 'proof/' + entry
-            if upload.uploadProof(user, fileName):
-                os.rename(fileName, folder + 'uploaded/' + entry)
+            if upload.uploadProof(user, fileName, fileHash=hashes.get(entry)):
+                if options.deleteUploaded:
+                    os.remove(fileName)
+                else:
+                    os.rename(fileName, folder + 'uploaded/' + entry)
 
 while True:
     for folder in dirs:
@@ -2,15 +2,18 @@
 
 import requests
 import hashlib
+import os
 import sys
 import time
 
-def fileBytes(name):
-    with open(name, mode='rb') as f:
-        return f.read()
+CHUNK_SIZE = 5 * 1024 * 1024
 
-def md5(data):
-    return hashlib.md5(data).digest().hex()
+def fileMD5(name):
+    h = hashlib.md5()
+    with open(name, mode='rb') as f:
+        for block in iter(lambda: f.read(CHUNK_SIZE), b''):
+            h.update(block)
+    return h.hexdigest()
 
 def headerLines(fileName):
     readLine = lambda f: f.readline().decode().strip()
@@ -29,57 +32,60 @@ def getNeedRegion(need):
     return firstNeed[0], firstNeed[1] + 1
 
 def uploadChunk(session, baseUrl, pos, chunk):
-    url = f'{baseUrl}&DataOffset={pos}&DataSize={len(chunk)}&DataMD5={md5(chunk)}'
-    response = session.post(url, files={'Data': (None, chunk)}, allow_redirects=False, timeout=900)
-    # headers={'Content-Type:': 'multipart/form-data'}
-    return response
-    print(response.json())
-    if response.status_code == 200:
-        return True
-
-    print(url)
-    print(response)
-    # print(response.json())
-    return False
+    url = f'{baseUrl}&DataOffset={pos}&DataSize={len(chunk)}&DataMD5={hashlib.md5(chunk).hexdigest()}'
+    return session.post(url, files={'Data': (None, chunk)}, allow_redirects=False, timeout=900)
 
-def upload(userId, exponent, data, verbose):
-    fileSize = len(data)
-    fileHash = md5(data)
+# The file is read chunk by chunk, as the server asks for it ("need"). After a network error the server is asked again
+# where to go on from, thus an interrupted upload resumes instead of starting over.
+def upload(userId, exponent, fileName, fileHash, verbose, retries=5):
+    fileSize = os.path.getsize(fileName)
     url = f'http://mersenne.org/proof_upload/?UserID={userId}&Exponent={exponent}&FileSize={fileSize}&FileMD5={fileHash}'
     verbose and print(url)
 
-    while True:
-        json = requests.get(url, timeout=20).json()
-        if 'error_status' in json or 'URLToUse' not in json or 'need' not in json:
-            print(json)
-            return json['error_status'] == 409 and json['error_description'] == 'Proof already uploaded'
-
-        origUrl = json['URLToUse']
-        verbose and print(origUrl)
-        baseUrl = 'http' + origUrl[5:] if origUrl.startswith('https:') else origUrl
-        if baseUrl != origUrl:
-            verbose and print(f'Re-written to: {baseUrl}')
-
-        baseUrl = f'{baseUrl}&FileMD5={fileHash}'
-        pos, end = getNeedRegion(json['need'])
-        verbose and print(pos, end)
-
-        with requests.session() as session:
-            while pos < end:
-                size = min(end - pos, 5*1024*1024)
-                time1 = time.time()
-                response = uploadChunk(session, baseUrl, pos, data[pos:pos+size])
-                if response.status_code != 200:
-                    print(response)                
+    nFails = 0
+    with open(fileName, mode='rb') as f:
+        while True:
+            try:
+                json = requests.get(url, timeout=20).json()
+                if 'error_status' in json or 'URLToUse' not in json or 'need' not in json:
+                    print(json)
+                    return json.get('error_status') == 409 and json.get('error_description') == 'Proof already uploaded'
+
+                origUrl = json['URLToUse']
+                verbose and print(origUrl)
+                baseUrl = 'http' + origUrl[5:] if origUrl.startswith('https:') else origUrl
+                if baseUrl != origUrl:
+                    verbose and print(f'Re-written to: {baseUrl}')
+
+                baseUrl = f'{baseUrl}&FileMD5={fileHash}'
+                pos, end = getNeedRegion(json['need'])
+                verbose and print(pos, end)
+
+                with requests.session() as session:
+                    while pos < end:
+                        size = min(end - pos, CHUNK_SIZE)
+                        f.seek(pos)
+                        chunk = f.read(size)
+                        time1 = time.time()
+                        response = uploadChunk(session, baseUrl, pos, chunk)
+                        if response.status_code != 200:
+                            print(response)
+                            return False
+                        pos += size
+                        nFails = 0
+                        time2 = time.time()
+                        print(f'\r{int(pos/fileSize*100+0.5)}%\t{int(size/(time2 - time1)/1024+0.5)} KB/s    ', end='', flush=True)
+                        if 'FileUploaded' in response.json():
+                            print('')
+                            verbose and print('Upload complete')
+                            assert(pos >= end)
+                            return True
+            except requests.exceptions.RequestException as e:
+                nFails += 1
+                print(f'\n{e}')
+                if nFails > retries:
                     return False
-                pos += size
-                time2 = time.time()
-                print(f'\r{int(pos/fileSize*100+0.5)}%\t{int(size/(time2 - time1)/1024+0.5)} KB/s    ', end='', flush=True)
-                if 'FileUploaded' in response.json():
-                    print('')
-                    verbose and print('Upload complete')
-                    assert(pos >= end)
-                    return True
+                time.sleep(min(60 * nFails, 600))
 
 def getTask(userId):
     url = f'http://mersenne.org/oneAssignment/&UserID={userId}&workpref=150'
@@ -88,11 +94,20 @@ def getTask(userId):
     print(r)
     print(r.json())
 
-def uploadProof(userId, fileName, verbose=False):
+# The md5 of the file, when known (from the "proof" of the result line), saves reading it once more. The proof file may
+# have been made again since its result line, thus when the upload fails the md5 of the file itself is tried.
+def uploadProof(userId, fileName, verbose=False, fileHash=None):
     exponent = headerExponent(fileName)
     print(f'Uploading M{exponent} from "{fileName}"')
-    data = fileBytes(fileName)
-    return upload(userId, exponent, data, verbose)
+    if fileHash:
+        if upload(userId, exponent, fileName, fileHash, verbose):
+            return True
+        actualHash = fileMD5(fileName)
+        if actualHash == fileHash:
+            return False
+        print(f'The md5 of "{fileName}" is not the one of its result line, retrying')
+        fileHash = actualHash
+    return upload(userId, exponent, fileName, fileHash or fileMD5(fileName), verbose)
     
 if __name__ == '__main__':
     if len(sys.argv) < 3: